@@ -33,10 +33,16 @@
 
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 328247 $")
 
+#include <math.h>
+
 #include "asterisk/module.h"
 #include "asterisk/channel.h"
 #include "asterisk/pbx.h"
 #include "asterisk/indications.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/lock.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
 
 /*** DOCUMENTATION
 	<application name="Milliwatt" language="en_US">
@@ -64,50 +70,170 @@ static const char app[] = "Milliwatt";
 
 static const char digital_milliwatt[] = {0x1e,0x0b,0x0b,0x1e,0x9e,0x8b,0x8b,0x9e} ;
 
+/*! Most samples the generator is ever asked for at once */
+#define MILLIWATT_MAXSAMPLES 640
+/*! 1004Hz repeats every 2000 samples at 8kHz */
+#define MILLIWATT_TONE_FREQ 1004
+#define MILLIWATT_TONE_RATE 8000
+#define MILLIWATT_TONE_PERIOD 2000
+#define MILLIWATT_TONE_VOLUME 23255
+
+enum milliwatt_kind {
+	/*! The digital milliwatt sequence, the 'o' option */
+	MILLIWATT_DIGITAL,
+	/*! A 1004Hz sine */
+	MILLIWATT_1004HZ,
+	MILLIWATT_KINDS,
+};
+
+/*!
+ * \brief A tone, computed once and shared by every channel playing it.
+ *
+ * One period of the tone is followed by enough of its beginning that
+ * any frame can be taken straight out of the buffer, whatever the
+ * phase it starts at.  Channels only keep a reference and their own
+ * phase, so nothing is synthesized or copied per channel.
+ */
+struct milliwatt_tone {
+	enum ast_format_id format;
+	/*! Bytes per sample */
+	int width;
+	/*! Samples in one period */
+	int period;
+	unsigned char data[0];
+};
+
+static const enum ast_format_id tone_formats[] = { AST_FORMAT_ULAW, AST_FORMAT_ALAW, AST_FORMAT_SLINEAR };
+
+/*! Tones by kind and format, built the first time they are needed */
+static struct milliwatt_tone *tones[MILLIWATT_KINDS][ARRAY_LEN(tone_formats)];
+AST_MUTEX_DEFINE_STATIC(tones_lock);
+
+static struct milliwatt_tone *milliwatt_tone_build(enum milliwatt_kind kind, enum ast_format_id format)
+{
+	struct milliwatt_tone *tone;
+	int period = kind == MILLIWATT_DIGITAL ? ARRAY_LEN(digital_milliwatt) : MILLIWATT_TONE_PERIOD;
+	int width = format == AST_FORMAT_SLINEAR ? sizeof(short) : 1;
+	int i;
+
+	if (!(tone = ao2_alloc(sizeof(*tone) + (period + MILLIWATT_MAXSAMPLES) * width, NULL))) {
+		return NULL;
+	}
+	tone->format = format;
+	tone->width = width;
+	tone->period = period;
+
+	for (i = 0; i < period + MILLIWATT_MAXSAMPLES; i++) {
+		short sample;
+
+		if (kind == MILLIWATT_DIGITAL) {
+			/* Only ever played as mu-law, see old_milliwatt_exec() */
+			tone->data[i] = digital_milliwatt[i % period];
+			continue;
+		}
+		sample = MILLIWATT_TONE_VOLUME * sin(2.0 * M_PI * MILLIWATT_TONE_FREQ * (i % period) / MILLIWATT_TONE_RATE);
+		switch (format) {
+		case AST_FORMAT_ULAW:
+			tone->data[i] = AST_LIN2MU(sample);
+			break;
+		case AST_FORMAT_ALAW:
+			tone->data[i] = AST_LIN2A(sample);
+			break;
+		default:
+			((short *) tone->data)[i] = sample;
+			break;
+		}
+	}
+
+	return tone;
+}
+
+/*! \brief Get a reference to a shared tone */
+static struct milliwatt_tone *milliwatt_tone_get(enum milliwatt_kind kind, enum ast_format_id format)
+{
+	struct milliwatt_tone *tone;
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(tone_formats) - 1 && tone_formats[i] != format; i++);
+
+	ast_mutex_lock(&tones_lock);
+	if (!tones[kind][i]) {
+		tones[kind][i] = milliwatt_tone_build(kind, tone_formats[i]);
+	}
+	if ((tone = tones[kind][i])) {
+		ao2_ref(tone, +1);
+	}
+	ast_mutex_unlock(&tones_lock);
+
+	return tone;
+}
+
+/*! \brief What a channel playing a tone keeps */
+struct milliwatt_state {
+	struct milliwatt_tone *tone;
+	/*! Where in the tone's period the next frame starts */
+	int phase;
+};
+
 static void *milliwatt_alloc(struct ast_channel *chan, void *params)
 {
-	return ast_calloc(1, sizeof(int));
+	struct milliwatt_state *state;
+
+	if (!(state = ast_calloc(1, sizeof(*state)))) {
+		return NULL;
+	}
+	state->tone = params;
+	ao2_ref(state->tone, +1);
+	return state;
 }
 
 static void milliwatt_release(struct ast_channel *chan, void *data)
 {
-	ast_free(data);
+	struct milliwatt_state *state = data;
+
+	ao2_ref(state->tone, -1);
+	ast_free(state);
 	return;
 }
 
 static int milliwatt_generate(struct ast_channel *chan, void *data, int len, int samples)
 {
-	unsigned char buf[AST_FRIENDLY_OFFSET + 640];
-	const int maxsamples = ARRAY_LEN(buf);
-	int i, *indexp = (int *) data;
+	struct milliwatt_state *state = data;
+	struct milliwatt_tone *tone = state->tone;
+	unsigned char buf[MILLIWATT_MAXSAMPLES * sizeof(short)];
 	struct ast_frame wf = {
 		.frametype = AST_FRAME_VOICE,
-		.offset = AST_FRIENDLY_OFFSET,
+		/* No room in front of the shared data: a channel driver that wants
+		 * to put a header there has to make its own copy first. */
+		.offset = 0,
 		.src = __FUNCTION__,
 	};
-	ast_format_set(&wf.subclass.format, AST_FORMAT_ULAW, 0);
-	wf.data.ptr = buf + AST_FRIENDLY_OFFSET;
+	ast_format_set(&wf.subclass.format, tone->format, 0);
 
 	/* Instead of len, use samples, because channel.c generator_force
 	* generate(chan, tmp, 0, 160) ignores len. In any case, len is
 	* a multiple of samples, given by number of samples times bytes per
 	* sample. In the case of ulaw, len = samples. for signed linear
 	* len = 2 * samples */
-	if (samples > maxsamples) {
-		ast_log(LOG_WARNING, "Only doing %d samples (%d requested)\n", maxsamples, samples);
-		samples = maxsamples;
+	if (samples > MILLIWATT_MAXSAMPLES) {
+		ast_log(LOG_WARNING, "Only doing %d samples (%d requested)\n", MILLIWATT_MAXSAMPLES, samples);
+		samples = MILLIWATT_MAXSAMPLES;
 	}
 
-	len = samples * sizeof (buf[0]);
+	len = samples * tone->width;
 	wf.datalen = len;
 	wf.samples = samples;
+	wf.data.ptr = tone->data + state->phase * tone->width;
 
-	/* create a buffer containing the digital milliwatt pattern */
-	for (i = 0; i < len; i++) {
-		buf[AST_FRIENDLY_OFFSET + i] = digital_milliwatt[(*indexp)++];
-		*indexp &= 7;
+	/* Audiohooks and framehooks may change the frame in place, and signed
+	 * linear may get byte swapped on its way out. */
+	if (chan->audiohooks || chan->framehooks || tone->format == AST_FORMAT_SLINEAR) {
+		memcpy(buf, wf.data.ptr, len);
+		wf.data.ptr = buf;
 	}
 
+	state->phase = (state->phase + samples) % tone->period;
+
 	if (ast_write(chan,&wf) < 0) {
 		ast_log(LOG_WARNING,"Failed to write frame to '%s': %s\n",chan->name,strerror(errno));
 		return -1;
@@ -122,16 +248,46 @@ static struct ast_generator milliwattgen = {
 	generate: milliwatt_generate,
 };
 
+/*! \brief Start playing a shared tone on a channel, in a format it can take without translation if possible */
+static int milliwatt_start(struct ast_channel *chan, enum milliwatt_kind kind)
+{
+	struct milliwatt_tone *tone;
+	struct ast_format tmpfmt;
+	enum ast_format_id format = AST_FORMAT_ULAW;
+	int res;
+
+	if (kind != MILLIWATT_DIGITAL) {
+		if (ast_format_cap_iscompatible(chan->nativeformats, ast_format_set(&tmpfmt, AST_FORMAT_ULAW, 0))) {
+			format = AST_FORMAT_ULAW;
+		} else if (ast_format_cap_iscompatible(chan->nativeformats, ast_format_set(&tmpfmt, AST_FORMAT_ALAW, 0))) {
+			format = AST_FORMAT_ALAW;
+		} else {
+			format = AST_FORMAT_SLINEAR;
+		}
+	}
+	if (ast_set_write_format_by_id(chan, format)) {
+		ast_log(LOG_WARNING, "Unable to set write format on '%s'\n", chan->name);
+		return -1;
+	}
+	if (!(tone = milliwatt_tone_get(kind, format))) {
+		return -1;
+	}
+
+	res = ast_activate_generator(chan, &milliwattgen, tone);
+	ao2_ref(tone, -1);
+
+	return res;
+}
+
 static int old_milliwatt_exec(struct ast_channel *chan)
 {
-	ast_set_write_format_by_id(chan, AST_FORMAT_ULAW);
 	ast_set_read_format_by_id(chan, AST_FORMAT_ULAW);
 
 	if (chan->_state != AST_STATE_UP) {
 		ast_answer(chan);
 	}
 
-	if (ast_activate_generator(chan,&milliwattgen,"milliwatt") < 0) {
+	if (milliwatt_start(chan, MILLIWATT_DIGITAL) < 0) {
 		ast_log(LOG_WARNING,"Failed to activate generator on '%s'\n",chan->name);
 		return -1;
 	}
@@ -153,18 +309,35 @@ static int milliwatt_exec(struct ast_channel *chan, const char *data)
 		return old_milliwatt_exec(chan);
 	}
 
-	res = ast_playtones_start(chan, 23255, "1004/1000", 0);
+	res = milliwatt_start(chan, MILLIWATT_1004HZ);
 
 	while (!res) {
 		res = ast_safe_sleep(chan, 10000);
 	}
 
+	ast_deactivate_generator(chan);
+
 	return res;
 }
 
 static int unload_module(void)
 {
-	return ast_unregister_application(app);
+	int res = ast_unregister_application(app);
+	int i, j;
+
+	/* Channels still playing keep their own references */
+	ast_mutex_lock(&tones_lock);
+	for (i = 0; i < MILLIWATT_KINDS; i++) {
+		for (j = 0; j < ARRAY_LEN(tone_formats); j++) {
+			if (tones[i][j]) {
+				ao2_ref(tones[i][j], -1);
+				tones[i][j] = NULL;
+			}
+		}
+	}
+	ast_mutex_unlock(&tones_lock);
+
+	return res;
 }
 
 static int load_module(void)
@@ -99,9 +99,18 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 352651 $")
 #include <sys/mman.h>
 #include <time.h>
 #include <dirent.h>
-#if defined(__FreeBSD__) || defined(__OpenBSD__)
-#include <sys/wait.h>
+#include <glob.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <sys/vfs.h>
 #endif
+#include <sys/wait.h>
 
 #include "asterisk/logger.h"
 #include "asterisk/lock.h"
@@ -459,7 +468,8 @@ static AST_LIST_HEAD_STATIC(vmstates, vmstate);
 #define MINPASSWORD 0 /*!< Default minimum mailbox password length */
 
 #define BASELINELEN 72
-#define BASEMAXINLINE 256
+/*! Lines of attachment read and encoded at a time */
+#define BASELINES 64
 #ifdef IMAP_STORAGE
 #define ENDL "\r\n"
 #else
@@ -628,14 +638,6 @@ and vm-Old are spelled plural, to make them sound more as folder name than an ad
 
 */
 
-struct baseio {
-	int iocp;
-	int iolen;
-	int linelength;
-	int ateof;
-	unsigned char iobuf[BASEMAXINLINE];
-};
-
 /*! Structure for linked list of users 
  * Use ast_vm_user_destroy() to free one of these structures. */
 struct ast_vm_user {
@@ -980,6 +982,420 @@ static int inprocess_count(const char *context, const char *mailbox, int delta)
 
 #if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
 static int __has_voicemail(const char *context, const char *mailbox, const char *folder, int shortcircuit);
+
+/*!
+ * \brief In-memory index of one mailbox folder on the file system.
+ *
+ * Counting messages used to mean reading the whole folder directory on
+ * every MWI poll, SUBSCRIBE and login.  The index remembers which
+ * msgNNNN.txt files exist; one is kept per folder, so INBOX, Old and
+ * Urgent give the new/old/urgent split.  It is updated directly by the
+ * changes made here and, where possible, by inotify.  Folders that are
+ * not watched are revalidated against the directory mtime instead.
+ */
+struct vm_folder_index {
+	/*! inotify watch descriptor, or -1 if the folder is not watched */
+	int wd;
+	/*! Set while count and map reflect the folder */
+	unsigned int valid:1;
+	/*! Set if the folder is on a network file system, so never watched */
+	unsigned int remote:1;
+	/*! Number of messages in the folder */
+	int count;
+	/*! Directory mtime at the last scan */
+	time_t mtime;
+	/*! Length of map, in bytes */
+	int maplen;
+	/*! One bit per message number present */
+	unsigned char *map;
+	char path[0];
+};
+
+enum vm_folder_index_mode {
+	/*! Always read the folder */
+	VM_FOLDER_INDEX_OFF,
+	/*! Use inotify where available and local, the directory mtime otherwise */
+	VM_FOLDER_INDEX_ON,
+	/*! Always check the directory mtime, for spools shared between hosts */
+	VM_FOLDER_INDEX_STAT,
+};
+
+static enum vm_folder_index_mode vm_folder_index_mode = VM_FOLDER_INDEX_ON;
+
+/*! Folder indexes, by path */
+static struct ao2_container *vm_folder_indexes;
+
+#ifdef HAVE_INOTIFY
+/*! Watched folder indexes, by watch descriptor */
+static struct ao2_container *vm_folder_watches;
+static int vm_inotify_fd = -1;
+static pthread_t vm_inotify_thread = AST_PTHREADT_NULL;
+static unsigned char vm_inotify_run;
+
+#define VM_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*!
+ * \brief Tell whether a folder is on a network or cluster file system.
+ *
+ * inotify only reports the changes made through this host's kernel, so a
+ * spool shared with other hosts over NFS, CIFS and the like would leave a
+ * watched index stale without ever being told.  Such folders are checked
+ * by their mtime instead, as with folderindex=stat.
+ */
+static int vm_folder_is_remote(const char *path)
+{
+	static const unsigned long remote_magic[] = {
+		0x6969,		/* NFS */
+		0xff534d42,	/* CIFS */
+		0xfe534d42,	/* SMB2 */
+		0x517b,		/* SMB */
+		0x564c,		/* NCP */
+		0x5346414f,	/* AFS */
+		0x6b414653,	/* kAFS */
+		0x00c36400,	/* Ceph */
+		0x65735546,	/* FUSE: sshfs, GlusterFS, ... */
+		0x01161970,	/* GFS2 */
+		0x7461636f,	/* OCFS2 */
+		0x47504653,	/* GPFS */
+		0x0bd00bd0,	/* Lustre */
+	};
+	struct statfs sfs;
+	int x;
+
+	if (statfs(path, &sfs)) {
+		return 0;
+	}
+	for (x = 0; x < ARRAY_LEN(remote_magic); x++) {
+		if ((unsigned long) (unsigned int) sfs.f_type == remote_magic[x]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+static int vm_folder_index_hash_fn(const void *obj, const int flags)
+{
+	const struct vm_folder_index *idx = obj;
+	return ast_str_hash(idx->path);
+}
+
+static int vm_folder_index_cmp_fn(void *obj, void *arg, int flags)
+{
+	struct vm_folder_index *idx = obj, *idx2 = arg;
+	return !strcmp(idx->path, idx2->path) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+#ifdef HAVE_INOTIFY
+static int vm_folder_watch_hash_fn(const void *obj, const int flags)
+{
+	const struct vm_folder_index *idx = obj;
+	return idx->wd;
+}
+
+static int vm_folder_watch_cmp_fn(void *obj, void *arg, int flags)
+{
+	struct vm_folder_index *idx = obj, *idx2 = arg;
+	return idx->wd == idx2->wd ? CMP_MATCH | CMP_STOP : 0;
+}
+#endif
+
+static void vm_folder_index_destructor(void *obj)
+{
+	struct vm_folder_index *idx = obj;
+	ast_free(idx->map);
+}
+
+/*!
+ * \brief Get the message number of a msgNNNN.txt file name.
+ * \return the message number, or -1 if this is not a message descriptor.
+ */
+static int vm_index_msgnum(const char *name)
+{
+	int msgnum;
+	char extension[4];
+
+	if (strlen(name) != 11 || sscanf(name, "msg%30d.%3s", &msgnum, extension) != 2 || strcmp(extension, "txt")) {
+		return -1;
+	}
+	return msgnum < MAXMSGLIMIT ? msgnum : -1;
+}
+
+/*! \brief Test whether a message number is present. \note The index must be locked. */
+static int vm_index_test(struct vm_folder_index *idx, int msgnum)
+{
+	return msgnum / 8 < idx->maplen && (idx->map[msgnum / 8] & (1 << (msgnum % 8)));
+}
+
+/*! \brief Mark a message number present or absent. \note The index must be locked. */
+static void vm_index_set(struct vm_folder_index *idx, int msgnum, int present)
+{
+	unsigned char bit = 1 << (msgnum % 8);
+	int byte = msgnum / 8;
+
+	if (msgnum < 0 || msgnum >= MAXMSGLIMIT) {
+		return;
+	}
+	if (byte >= idx->maplen) {
+		unsigned char *map;
+		int len = MIN(MAX(byte + 1, idx->maplen * 2), MAXMSGLIMIT / 8 + 1);
+
+		if (!present) {
+			return;
+		}
+		if (!(map = ast_realloc(idx->map, len))) {
+			idx->valid = 0;
+			return;
+		}
+		memset(map + idx->maplen, 0, len - idx->maplen);
+		idx->map = map;
+		idx->maplen = len;
+	}
+	if (present && !(idx->map[byte] & bit)) {
+		idx->map[byte] |= bit;
+		idx->count++;
+	} else if (!present && (idx->map[byte] & bit)) {
+		idx->map[byte] &= ~bit;
+		idx->count--;
+	}
+}
+
+/*!
+ * \brief Rebuild an index by reading its folder.
+ * \note The index must be locked.
+ * \return zero on success, -1 if the folder could not be read.
+ */
+static int vm_index_scan(struct vm_folder_index *idx)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	int msgnum;
+
+	idx->valid = 0;
+	idx->count = 0;
+	if (idx->map) {
+		memset(idx->map, 0, idx->maplen);
+	}
+
+	if (stat(idx->path, &st) || !(dir = opendir(idx->path))) {
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		if ((msgnum = vm_index_msgnum(de->d_name)) >= 0) {
+			vm_index_set(idx, msgnum, 1);
+		}
+	}
+	closedir(dir);
+
+	/* A change made in the same second as the scan would not move the
+	 * mtime, so an unwatched folder is only trusted once it is older. */
+	idx->mtime = st.st_mtime;
+	idx->valid = (idx->wd > -1 && vm_folder_index_mode == VM_FOLDER_INDEX_ON) || st.st_mtime < time(NULL);
+	return 0;
+}
+
+/*!
+ * \brief Find the index of a folder, creating or refreshing it if needed.
+ * \param path the folder, as built by make_dir()
+ * \return a reference to the locked index, to be given back with
+ *  vm_index_release(), or NULL if the folder should be read directly.
+ */
+static struct vm_folder_index *vm_index_get(const char *path)
+{
+	struct vm_folder_index *idx, *tmp;
+	struct stat st;
+
+	if (vm_folder_index_mode == VM_FOLDER_INDEX_OFF || !vm_folder_indexes) {
+		return NULL;
+	}
+
+	tmp = alloca(sizeof(*tmp) + strlen(path) + 1);
+	strcpy(tmp->path, path); /* SAFE */
+
+	ao2_lock(vm_folder_indexes);
+	if (!(idx = ao2_find(vm_folder_indexes, tmp, OBJ_POINTER))) {
+		if (!(idx = ao2_alloc(sizeof(*idx) + strlen(path) + 1, vm_folder_index_destructor))) {
+			ao2_unlock(vm_folder_indexes);
+			return NULL;
+		}
+		idx->wd = -1;
+		strcpy(idx->path, path); /* SAFE */
+		ao2_link(vm_folder_indexes, idx);
+	}
+	ao2_unlock(vm_folder_indexes);
+
+	ao2_lock(idx);
+	if (idx->valid && (idx->wd < 0 || vm_folder_index_mode == VM_FOLDER_INDEX_STAT)) {
+		if (stat(path, &st) || st.st_mtime != idx->mtime) {
+			idx->valid = 0;
+		}
+	}
+	if (!idx->valid) {
+#ifdef HAVE_INOTIFY
+		/* Watch before reading, so no change can slip in between */
+		if (idx->wd < 0 && !idx->remote && vm_inotify_fd > -1 && vm_folder_index_mode == VM_FOLDER_INDEX_ON) {
+			if (vm_folder_is_remote(path)) {
+				idx->remote = 1;
+				ast_debug(1, "%s is on a network file system, checking it by mtime\n", path);
+			} else if ((idx->wd = inotify_add_watch(vm_inotify_fd, path, VM_INOTIFY_MASK)) > -1) {
+				ao2_link(vm_folder_watches, idx);
+			}
+		}
+#endif
+		if (vm_index_scan(idx)) {
+			ao2_unlock(idx);
+			ao2_ref(idx, -1);
+			return NULL;
+		}
+	}
+	return idx;
+}
+
+static void vm_index_release(struct vm_folder_index *idx)
+{
+	ao2_unlock(idx);
+	ao2_ref(idx, -1);
+}
+
+/*!
+ * \brief Record a message we created or removed in the index of its folder.
+ * \param file the path of the message, without extension.
+ * \param present non-zero if the message now exists.
+ */
+static void vm_index_note(const char *file, int present)
+{
+	struct vm_folder_index *idx, *tmp;
+	const char *name;
+	int msgnum;
+
+	if (!vm_folder_indexes || !(name = strrchr(file, '/')) || sscanf(name, "/msg%30d", &msgnum) != 1) {
+		return;
+	}
+
+	tmp = alloca(sizeof(*tmp) + (name - file) + 1);
+	ast_copy_string(tmp->path, file, (name - file) + 1);
+	if ((idx = ao2_find(vm_folder_indexes, tmp, OBJ_POINTER))) {
+		ao2_lock(idx);
+		if (idx->valid) {
+			vm_index_set(idx, msgnum, present);
+		}
+		ao2_unlock(idx);
+		ao2_ref(idx, -1);
+	}
+}
+
+#ifdef HAVE_INOTIFY
+static int vm_index_invalidate_cb(void *obj, void *arg, int flags)
+{
+	struct vm_folder_index *idx = obj;
+
+	ao2_lock(idx);
+	idx->valid = 0;
+	ao2_unlock(idx);
+	return 0;
+}
+
+static void vm_inotify_handle(const struct inotify_event *ev)
+{
+	struct vm_folder_index *idx, tmp = { .wd = ev->wd, };
+	int msgnum;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* Events were lost; every folder is read again on next use */
+		ast_log(AST_LOG_NOTICE, "Voicemail folder watch queue overflowed, rescanning folders\n");
+		ao2_callback(vm_folder_indexes, OBJ_NODATA, vm_index_invalidate_cb, NULL);
+		return;
+	}
+
+	if (!(idx = ao2_find(vm_folder_watches, &tmp, OBJ_POINTER))) {
+		return;
+	}
+	ao2_lock(idx);
+	if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		idx->valid = 0;
+		if (ev->mask & IN_IGNORED) {
+			ao2_unlink(vm_folder_watches, idx);
+			idx->wd = -1;
+		}
+	} else if (idx->valid && ev->len && (msgnum = vm_index_msgnum(ev->name)) > -1) {
+		vm_index_set(idx, msgnum, ev->mask & (IN_CREATE | IN_MOVED_TO));
+	}
+	ao2_unlock(idx);
+	ao2_ref(idx, -1);
+}
+
+static void *vm_inotify_monitor(void *data)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = vm_inotify_fd, .events = POLLIN, };
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *ptr;
+
+	while (vm_inotify_run) {
+		if (ast_poll(&pfd, 1, 1000) < 1) {
+			continue;
+		}
+		if ((len = read(vm_inotify_fd, buf, sizeof(buf))) < 1) {
+			continue;
+		}
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) ptr;
+			vm_inotify_handle(ev);
+		}
+	}
+	return NULL;
+}
+#endif
+
+static int vm_folder_index_init(void)
+{
+	if (!(vm_folder_indexes = ao2_container_alloc(1021, vm_folder_index_hash_fn, vm_folder_index_cmp_fn))) {
+		return -1;
+	}
+#ifdef HAVE_INOTIFY
+	if (!(vm_folder_watches = ao2_container_alloc(1021, vm_folder_watch_hash_fn, vm_folder_watch_cmp_fn))) {
+		return -1;
+	}
+	if ((vm_inotify_fd = inotify_init()) < 0) {
+		ast_log(AST_LOG_WARNING, "Unable to watch voicemail folders: %s.  Folders will be checked by mtime.\n", strerror(errno));
+		return 0;
+	}
+	vm_inotify_run = 1;
+	if (ast_pthread_create(&vm_inotify_thread, NULL, vm_inotify_monitor, NULL)) {
+		vm_inotify_run = 0;
+		close(vm_inotify_fd);
+		vm_inotify_fd = -1;
+	}
+#endif
+	return 0;
+}
+
+static void vm_folder_index_destroy(void)
+{
+#ifdef HAVE_INOTIFY
+	if (vm_inotify_thread != AST_PTHREADT_NULL) {
+		vm_inotify_run = 0;
+		pthread_join(vm_inotify_thread, NULL);
+		vm_inotify_thread = AST_PTHREADT_NULL;
+	}
+	if (vm_inotify_fd > -1) {
+		close(vm_inotify_fd);
+		vm_inotify_fd = -1;
+	}
+	if (vm_folder_watches) {
+		ao2_ref(vm_folder_watches, -1);
+		vm_folder_watches = NULL;
+	}
+#endif
+	if (vm_folder_indexes) {
+		ao2_ref(vm_folder_indexes, -1);
+		vm_folder_indexes = NULL;
+	}
+}
+#else
+#define vm_index_note(file, present)
 #endif
 
 /*!
@@ -3969,6 +4385,13 @@ static int count_messages(struct ast_vm_user *vmu, char *dir)
 	int vmcount = 0;
 	DIR *vmdir = NULL;
 	struct dirent *vment = NULL;
+	struct vm_folder_index *idx;
+
+	if ((idx = vm_index_get(dir))) {
+		vmcount = idx->count;
+		vm_index_release(idx);
+		return vmcount;
+	}
 
 	if (vm_lock_path(dir))
 		return ERROR_LOCK_PATH;
@@ -4003,7 +4426,10 @@ static void rename_file(char *sfn, char *dfn)
 	if (ast_check_realtime("voicemail_data")) {
 		ast_update_realtime("voicemail_data", "filename", sfn, "filename", dfn, SENTINEL);
 	}
-	rename(stxt, dtxt);
+	if (!rename(stxt, dtxt)) {
+		vm_index_note(sfn, 0);
+		vm_index_note(dfn, 1);
+	}
 }
 
 /*! 
@@ -4026,6 +4452,20 @@ static int last_message_index(struct ast_vm_user *vmu, char *dir)
 	int msgdirint;
 	char extension[4];
 	int stopcount = 0;
+	struct vm_folder_index *idx;
+
+	if ((idx = vm_index_get(dir))) {
+		stopcount = idx->count;
+		for (x = 0; x < vmu->maxmsg; x++) {
+			if (vm_index_test(idx, x)) {
+				stopcount--;
+			} else if (!stopcount) {
+				break;
+			}
+		}
+		vm_index_release(idx);
+		return x - 1;
+	}
 
 	/* Reading the entire directory into a file map scales better than
 	 * doing a stat repeatedly on a predicted sequence.  I suspect this
@@ -4059,200 +4499,313 @@ static int last_message_index(struct ast_vm_user *vmu, char *dir)
 #endif /* #else of #ifdef ODBC_STORAGE */
 #ifndef IMAP_STORAGE
 /*!
- * \brief Utility function to copy a file.
- * \param infile The path to the file to be copied. The file must be readable, it is opened in read only mode.
- * \param outfile The path for which to copy the file to. The directory permissions must allow the creation (or truncation) of the file, and allow for opening the file in write only mode.
+ * \brief Copy an open file to a new file.
+ * \param ifd The file to copy.  Its file offset is neither used nor changed, so one descriptor may be copied to several files.
+ * \param infile The path of ifd, for messages.
+ * \param outfile The path for which to copy the file to.
  *
- * When the compiler option HARDLINK_WHEN_POSSIBLE is set, the copy operation will attempt to use the hard link facility instead of copy the file (to save disk space). If the link operation fails, it falls back to the copy operation.
- * The copy operation copies up to 4096 bytes at once.
+ * The copy is made in the kernel where possible: first by sharing the
+ * blocks of the source (FICLONE), then with copy_file_range() and then
+ * with sendfile().  Whatever is left is copied through a buffer.
  *
  * \return zero on success, -1 on error.
  */
-static int copy(char *infile, char *outfile)
+static int vm_copy_fd(int ifd, const char *infile, const char *outfile)
 {
-	int ifd;
 	int ofd;
-	int res;
-	int len;
-	char buf[4096];
+	ssize_t len = 0;
+	off_t off = 0;
+	struct stat st;
+	char buf[8192];
 
-#ifdef HARDLINK_WHEN_POSSIBLE
-	/* Hard link if possible; saves disk space & is faster */
-	if (link(infile, outfile)) {
-#endif
-		if ((ifd = open(infile, O_RDONLY)) < 0) {
-			ast_log(AST_LOG_WARNING, "Unable to open %s in read-only mode: %s\n", infile, strerror(errno));
-			return -1;
-		}
-		if ((ofd = open(outfile, O_WRONLY | O_TRUNC | O_CREAT, VOICEMAIL_FILE_MODE)) < 0) {
-			ast_log(AST_LOG_WARNING, "Unable to open %s in write-only mode: %s\n", outfile, strerror(errno));
-			close(ifd);
-			return -1;
-		}
-		do {
-			len = read(ifd, buf, sizeof(buf));
-			if (len < 0) {
-				ast_log(AST_LOG_WARNING, "Read failed on %s: %s\n", infile, strerror(errno));
-				close(ifd);
-				close(ofd);
-				unlink(outfile);
-			}
-			if (len) {
-				res = write(ofd, buf, len);
-				if (errno == ENOMEM || errno == ENOSPC || res != len) {
-					ast_log(AST_LOG_WARNING, "Write failed on %s (%d of %d): %s\n", outfile, res, len, strerror(errno));
-					close(ifd);
-					close(ofd);
-					unlink(outfile);
-				}
-			}
-		} while (len);
-		close(ifd);
+	if (fstat(ifd, &st)) {
+		ast_log(AST_LOG_WARNING, "Unable to stat %s: %s\n", infile, strerror(errno));
+		return -1;
+	}
+	if ((ofd = open(outfile, O_WRONLY | O_TRUNC | O_CREAT, VOICEMAIL_FILE_MODE)) < 0) {
+		ast_log(AST_LOG_WARNING, "Unable to open %s in write-only mode: %s\n", outfile, strerror(errno));
+		return -1;
+	}
+
+#ifdef FICLONE
+	if (!ioctl(ofd, FICLONE, ifd)) {
 		close(ofd);
 		return 0;
-#ifdef HARDLINK_WHEN_POSSIBLE
-	} else {
-		/* Hard link succeeded */
-		return 0;
 	}
 #endif
+#ifdef __NR_copy_file_range
+	{
+		loff_t in_off = 0;
+
+		while (in_off < st.st_size && syscall(__NR_copy_file_range, ifd, &in_off, ofd, NULL, (size_t) (st.st_size - in_off), 0) > 0);
+		off = in_off;
+	}
+#endif
+#ifdef __linux__
+	while (off < st.st_size && sendfile(ofd, ifd, &off, st.st_size - off) > 0);
+#endif
+
+	/* Both of the above leave the output file offset just after what they copied */
+	while ((len = pread(ifd, buf, sizeof(buf), off)) > 0) {
+		if (write(ofd, buf, len) != len) {
+			ast_log(AST_LOG_WARNING, "Write failed on %s: %s\n", outfile, strerror(errno));
+			break;
+		}
+		off += len;
+	}
+	if (len < 0) {
+		ast_log(AST_LOG_WARNING, "Read failed on %s: %s\n", infile, strerror(errno));
+	}
+	close(ofd);
+	if (len) {
+		unlink(outfile);
+		return -1;
+	}
+	return 0;
 }
 
 /*!
- * \brief Copies a voicemail information (envelope) file.
- * \param frompath
- * \param topath 
+ * \brief Copy a file that is already open.
+ * \param ifd Descriptor of the file, open for reading.
+ * \param infile The path the file was opened as.
+ * \param outfile The path for which to copy the file to.
  *
- * Every voicemail has the data (.wav) file, and the information file.
- * This function performs the file system copying of the information file for a voicemail, handling the internal fields and their values.
- * This is used by the COPY macro when not using IMAP storage.
+ * When the compiler option HARDLINK_WHEN_POSSIBLE is set, the copy operation will attempt to use the hard link facility instead of copy the file (to save disk space). If the link operation fails, it falls back to the copy operation.
+ * The link is only made while infile still is the open file; a message
+ * copied in the background may have been deleted or renumbered since.
+ *
+ * \return zero on success, -1 on error.
  */
-static void copy_plain_file(char *frompath, char *topath)
+static int copy_fd(int ifd, char *infile, char *outfile)
 {
-	char frompath2[PATH_MAX], topath2[PATH_MAX];
-	struct ast_variable *tmp,*var = NULL;
-	const char *origmailbox = NULL, *context = NULL, *macrocontext = NULL, *exten = NULL, *priority = NULL, *callerchan = NULL, *callerid = NULL, *origdate = NULL, *origtime = NULL, *category = NULL, *duration = NULL;
-	ast_filecopy(frompath, topath, NULL);
-	snprintf(frompath2, sizeof(frompath2), "%s.txt", frompath);
-	snprintf(topath2, sizeof(topath2), "%s.txt", topath);
-	if (ast_check_realtime("voicemail_data")) {
-		var = ast_load_realtime("voicemail_data", "filename", frompath, SENTINEL);
-		/* This cycle converts ast_variable linked list, to va_list list of arguments, may be there is a better way to do it? */
-		for (tmp = var; tmp; tmp = tmp->next) {
-			if (!strcasecmp(tmp->name, "origmailbox")) {
-				origmailbox = tmp->value;
-			} else if (!strcasecmp(tmp->name, "context")) {
-				context = tmp->value;
-			} else if (!strcasecmp(tmp->name, "macrocontext")) {
-				macrocontext = tmp->value;
-			} else if (!strcasecmp(tmp->name, "exten")) {
-				exten = tmp->value;
-			} else if (!strcasecmp(tmp->name, "priority")) {
-				priority = tmp->value;
-			} else if (!strcasecmp(tmp->name, "callerchan")) {
-				callerchan = tmp->value;
-			} else if (!strcasecmp(tmp->name, "callerid")) {
-				callerid = tmp->value;
-			} else if (!strcasecmp(tmp->name, "origdate")) {
-				origdate = tmp->value;
-			} else if (!strcasecmp(tmp->name, "origtime")) {
-				origtime = tmp->value;
-			} else if (!strcasecmp(tmp->name, "category")) {
-				category = tmp->value;
-			} else if (!strcasecmp(tmp->name, "duration")) {
-				duration = tmp->value;
-			}
-		}
-		ast_store_realtime("voicemail_data", "filename", topath, "origmailbox", origmailbox, "context", context, "macrocontext", macrocontext, "exten", exten, "priority", priority, "callerchan", callerchan, "callerid", callerid, "origdate", origdate, "origtime", origtime, "category", category, "duration", duration, SENTINEL);
-	}
-	copy(frompath2, topath2);
-	ast_variables_destroy(var);
-}
+#ifdef HARDLINK_WHEN_POSSIBLE
+	struct stat ist, pst;
+
+	/* Hard link if possible; saves disk space & is faster */
+	if (!fstat(ifd, &ist) && !stat(infile, &pst)
+		&& ist.st_dev == pst.st_dev && ist.st_ino == pst.st_ino
+		&& !link(infile, outfile)) {
+		return 0;
+	}
 #endif
+	return vm_copy_fd(ifd, infile, outfile);
+}
 
-/*! 
- * \brief Removes the voicemail sound and information file.
- * \param file The path to the sound file. This will be the the folder and message index, without the extension.
+/*!
+ * \brief Utility function to copy a file.
+ * \param infile The path to the file to be copied. The file must be readable, it is opened in read only mode.
+ * \param outfile The path for which to copy the file to. The directory permissions must allow the creation (or truncation) of the file, and allow for opening the file in write only mode.
  *
- * This is used by the DELETE macro when voicemails are stored on the file system.
+ * The copy itself, or the hard link, is done by copy_fd().
  *
  * \return zero on success, -1 on error.
  */
-static int vm_delete(char *file)
+static int copy(char *infile, char *outfile)
 {
-	char *txt;
-	int txtsize = 0;
+	int ifd;
+	int res;
 
-	txtsize = (strlen(file) + 5)*sizeof(char);
-	txt = alloca(txtsize);
-	/* Sprintf here would safe because we alloca'd exactly the right length,
-	 * but trying to eliminate all sprintf's anyhow
-	 */
-	if (ast_check_realtime("voicemail_data")) {
-		ast_destroy_realtime("voicemail_data", "filename", file, SENTINEL);
+	if ((ifd = open(infile, O_RDONLY)) < 0) {
+		ast_log(AST_LOG_WARNING, "Unable to open %s in read-only mode: %s\n", infile, strerror(errno));
+		return -1;
 	}
-	snprintf(txt, txtsize, "%s.txt", file);
-	unlink(txt);
-	return ast_filedelete(file, NULL);
+	res = copy_fd(ifd, infile, outfile);
+	close(ifd);
+	return res;
+}
+
+/*! \brief Copies the voicemail_data realtime entry of a message, if realtime is in use. */
+static void copy_realtime_data(const char *frompath, const char *topath)
+{
+	struct ast_variable *tmp,*var = NULL;
+	const char *origmailbox = NULL, *context = NULL, *macrocontext = NULL, *exten = NULL, *priority = NULL, *callerchan = NULL, *callerid = NULL, *origdate = NULL, *origtime = NULL, *category = NULL, *duration = NULL;
+
+	if (!ast_check_realtime("voicemail_data")) {
+		return;
+	}
+	var = ast_load_realtime("voicemail_data", "filename", frompath, SENTINEL);
+	/* This cycle converts ast_variable linked list, to va_list list of arguments, may be there is a better way to do it? */
+	for (tmp = var; tmp; tmp = tmp->next) {
+		if (!strcasecmp(tmp->name, "origmailbox")) {
+			origmailbox = tmp->value;
+		} else if (!strcasecmp(tmp->name, "context")) {
+			context = tmp->value;
+		} else if (!strcasecmp(tmp->name, "macrocontext")) {
+			macrocontext = tmp->value;
+		} else if (!strcasecmp(tmp->name, "exten")) {
+			exten = tmp->value;
+		} else if (!strcasecmp(tmp->name, "priority")) {
+			priority = tmp->value;
+		} else if (!strcasecmp(tmp->name, "callerchan")) {
+			callerchan = tmp->value;
+		} else if (!strcasecmp(tmp->name, "callerid")) {
+			callerid = tmp->value;
+		} else if (!strcasecmp(tmp->name, "origdate")) {
+			origdate = tmp->value;
+		} else if (!strcasecmp(tmp->name, "origtime")) {
+			origtime = tmp->value;
+		} else if (!strcasecmp(tmp->name, "category")) {
+			category = tmp->value;
+		} else if (!strcasecmp(tmp->name, "duration")) {
+			duration = tmp->value;
+		}
+	}
+	ast_store_realtime("voicemail_data", "filename", topath, "origmailbox", origmailbox, "context", context, "macrocontext", macrocontext, "exten", exten, "priority", priority, "callerchan", callerchan, "callerid", callerid, "origdate", origdate, "origtime", origtime, "category", category, "duration", duration, SENTINEL);
+	ast_variables_destroy(var);
 }
 
 /*!
- * \brief utility used by inchar(), for base_encode()
+ * \brief The files of one message, opened once so that they can be copied to any number of mailboxes.
+ *
+ * The open descriptors also keep the message around if it is deleted or
+ * moved while copies are still being made.
  */
-static int inbuf(struct baseio *bio, FILE *fi)
+struct vm_copy_source {
+	/*! The message, without extension */
+	char path[PATH_MAX];
+	int count;
+	struct {
+		char ext[16];
+		int fd;
+	} files[16];
+};
+
+/*!
+ * \brief Open every file (each sound format and the information file) of a message.
+ * \return zero on success, -1 if the message has no files.
+ */
+static int vm_copy_source_open(struct vm_copy_source *src, const char *path)
 {
-	int l;
+	char pattern[PATH_MAX];
+	const char *ext;
+	glob_t globbuf;
+	size_t i;
+	int fd;
 
-	if (bio->ateof)
-		return 0;
+	ast_copy_string(src->path, path, sizeof(src->path));
+	src->count = 0;
 
-	if ((l = fread(bio->iobuf, 1, BASEMAXINLINE, fi)) <= 0) {
-		if (ferror(fi))
-			return -1;
+	snprintf(pattern, sizeof(pattern), "%s.*", path);
+	if (glob(pattern, 0, NULL, &globbuf)) {
+		return -1;
+	}
+	for (i = 0; i < globbuf.gl_pathc && src->count < ARRAY_LEN(src->files); i++) {
+		ext = globbuf.gl_pathv[i] + strlen(path) + 1;
+		if (strchr(ext, '.') || strlen(ext) >= sizeof(src->files[0].ext)) {
+			continue;
+		}
+		if ((fd = open(globbuf.gl_pathv[i], O_RDONLY)) < 0) {
+			ast_log(AST_LOG_WARNING, "Unable to open %s in read-only mode: %s\n", globbuf.gl_pathv[i], strerror(errno));
+			continue;
+		}
+		ast_copy_string(src->files[src->count].ext, ext, sizeof(src->files[0].ext));
+		src->files[src->count++].fd = fd;
+	}
+	globfree(&globbuf);
 
-		bio->ateof = 1;
-		return 0;
+	return src->count ? 0 : -1;
+}
+
+static void vm_copy_source_close(struct vm_copy_source *src)
+{
+	int i;
+
+	for (i = 0; i < src->count; i++) {
+		close(src->files[i].fd);
 	}
+	src->count = 0;
+}
 
-	bio->iolen = l;
-	bio->iocp = 0;
+/*! \brief Test whether the message has a sound file, and not just an information file. */
+static int vm_copy_source_has_sound(struct vm_copy_source *src)
+{
+	int i;
 
-	return 1;
+	for (i = 0; i < src->count; i++) {
+		if (strcmp(src->files[i].ext, "txt")) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
 /*!
- * \brief utility used by base_encode()
+ * \brief Copy an opened message.
+ * \param src The message.
+ * \param topath The path of the copy, without extension.
+ *
+ * The information file is written last, so the copy is not counted as a
+ * message before its sound files are complete.
  */
-static int inchar(struct baseio *bio, FILE *fi)
+static void vm_copy_source_to(struct vm_copy_source *src, const char *topath)
 {
-	if (bio->iocp>=bio->iolen) {
-		if (!inbuf(bio, fi))
-			return EOF;
-	}
+	char infile[PATH_MAX], outfile[PATH_MAX];
+	int i, txt;
 
-	return bio->iobuf[bio->iocp++];
+	for (txt = 0; txt < 2; txt++) {
+		if (txt) {
+			copy_realtime_data(src->path, topath);
+		}
+		for (i = 0; i < src->count; i++) {
+			if (!strcmp(src->files[i].ext, "txt") != txt) {
+				continue;
+			}
+			snprintf(infile, sizeof(infile), "%s.%s", src->path, src->files[i].ext);
+			snprintf(outfile, sizeof(outfile), "%s.%s", topath, src->files[i].ext);
+			if (!copy_fd(src->files[i].fd, infile, outfile) && txt) {
+				vm_index_note(topath, 1);
+			}
+		}
+	}
 }
 
 /*!
- * \brief utility used by base_encode()
+ * \brief Copies a voicemail information (envelope) file.
+ * \param frompath
+ * \param topath 
+ *
+ * Every voicemail has the data (.wav) file, and the information file.
+ * This function performs the file system copying of the information file for a voicemail, handling the internal fields and their values.
+ * This is used by the COPY macro when not using IMAP storage.
+ * Each file goes through copy_fd(), so HARDLINK_WHEN_POSSIBLE applies.
  */
-static int ochar(struct baseio *bio, int c, FILE *so)
+static void copy_plain_file(char *frompath, char *topath)
 {
-	if (bio->linelength >= BASELINELEN) {
-		if (fputs(ENDL, so) == EOF) {
-			return -1;
-		}
+	struct vm_copy_source src;
 
-		bio->linelength = 0;
-	}
-
-	if (putc(((unsigned char) c), so) == EOF) {
-		return -1;
+	if (!vm_copy_source_open(&src, frompath)) {
+		vm_copy_source_to(&src, topath);
+		vm_copy_source_close(&src);
 	}
+}
+#endif
 
-	bio->linelength++;
+/*! 
+ * \brief Removes the voicemail sound and information file.
+ * \param file The path to the sound file. This will be the the folder and message index, without the extension.
+ *
+ * This is used by the DELETE macro when voicemails are stored on the file system.
+ *
+ * \return zero on success, -1 on error.
+ */
+static int vm_delete(char *file)
+{
+	char *txt;
+	int txtsize = 0;
 
-	return 1;
+	txtsize = (strlen(file) + 5)*sizeof(char);
+	txt = alloca(txtsize);
+	/* Sprintf here would safe because we alloca'd exactly the right length,
+	 * but trying to eliminate all sprintf's anyhow
+	 */
+	if (ast_check_realtime("voicemail_data")) {
+		ast_destroy_realtime("voicemail_data", "filename", file, SENTINEL);
+	}
+	snprintf(txt, txtsize, "%s.txt", file);
+	if (!unlink(txt)) {
+		vm_index_note(file, 0);
+	}
+	return ast_filedelete(file, NULL);
 }
 
 /*!
@@ -4260,58 +4813,35 @@ static int ochar(struct baseio *bio, int c, FILE *so)
  * \param filename The path to the file to be encoded. Must be readable, file is opened in read mode.
  * \param so A FILE handle to the output file to receive the base 64 encoded contents of the input file, identified by filename.
  *
- * TODO: shouldn't this (and the above 3 support functions) be put into some kind of external utility location, such as funcs/func_base64.c ?
+ * The file is read BASELINES lines at a time and each line is encoded as a
+ * block by ast_base64encode().
  *
  * \return zero on success, -1 on error.
  */
 static int base_encode(char *filename, FILE *so)
 {
-	static const unsigned char dtable[] = { 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K',
-		'L', 'M', 'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-		'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', '0',
-		'1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'};
-	int i, hiteof = 0;
+	unsigned char ibuf[BASELINELEN / 4 * 3 * BASELINES];
+	char obuf[BASELINELEN + 1];
+	size_t len, off, n;
+	int first = 1;
 	FILE *fi;
-	struct baseio bio;
-
-	memset(&bio, 0, sizeof(bio));
-	bio.iocp = BASEMAXINLINE;
 
 	if (!(fi = fopen(filename, "rb"))) {
 		ast_log(AST_LOG_WARNING, "Failed to open file: %s: %s\n", filename, strerror(errno));
 		return -1;
 	}
 
-	while (!hiteof){
-		unsigned char igroup[3], ogroup[4];
-		int c, n;
-
-		memset(igroup, 0, sizeof(igroup));
-
-		for (n = 0; n < 3; n++) {
-			if ((c = inchar(&bio, fi)) == EOF) {
-				hiteof = 1;
-				break;
-			}
-
-			igroup[n] = (unsigned char) c;
-		}
-
-		if (n > 0) {
-			ogroup[0]= dtable[igroup[0] >> 2];
-			ogroup[1]= dtable[((igroup[0] & 3) << 4) | (igroup[1] >> 4)];
-			ogroup[2]= dtable[((igroup[1] & 0xF) << 2) | (igroup[2] >> 6)];
-			ogroup[3]= dtable[igroup[2] & 0x3F];
-
-			if (n < 3) {
-				ogroup[3] = '=';
-
-				if (n < 2)
-					ogroup[2] = '=';
+	/* fread() only comes up short at the end of the file, so every line
+	 * but the last is a whole number of 3 byte groups */
+	while ((len = fread(ibuf, 1, sizeof(ibuf), fi)) > 0) {
+		for (off = 0; off < len; off += n) {
+			n = MIN(len - off, BASELINELEN / 4 * 3);
+			ast_base64encode(obuf, ibuf + off, n, sizeof(obuf));
+			if ((!first && fputs(ENDL, so) == EOF) || fputs(obuf, so) == EOF) {
+				fclose(fi);
+				return 0;
 			}
-
-			for (i = 0; i < 4; i++)
-				ochar(&bio, ogroup[i], so);
+			first = 0;
 		}
 	}
 
@@ -4791,48 +5321,379 @@ static int add_email_attachment(FILE *p, struct ast_vm_user *vmu, char *format,
 	int tmpfd = -1;
 	int soxstatus = 0;
 
-	/* Eww. We want formats to tell us their own MIME type */
-	char *ctype = (!strcasecmp(format, "ogg")) ? "application/" : "audio/x-";
+	/* Eww. We want formats to tell us their own MIME type */
+	char *ctype = (!strcasecmp(format, "ogg")) ? "application/" : "audio/x-";
+
+	if (vmu->volgain < -.001 || vmu->volgain > .001) {
+		create_dirpath(tmpdir, sizeof(tmpdir), vmu->context, vmu->mailbox, "tmp");
+		snprintf(newtmp, sizeof(newtmp), "%s/XXXXXX", tmpdir);
+		tmpfd = mkstemp(newtmp);
+		chmod(newtmp, VOICEMAIL_FILE_MODE & ~my_umask);
+		ast_debug(3, "newtmp: %s\n", newtmp);
+		if (tmpfd > -1) {
+			snprintf(tmpcmd, sizeof(tmpcmd), "sox -v %.4f %s.%s %s.%s", vmu->volgain, attach, format, newtmp, format);
+			if ((soxstatus = ast_safe_system(tmpcmd)) == 0) {
+				attach = newtmp;
+				ast_debug(3, "VOLGAIN: Stored at: %s.%s - Level: %.4f - Mailbox: %s\n", attach, format, vmu->volgain, mailbox);
+			} else {
+				ast_log(LOG_WARNING, "Sox failed to re-encode %s.%s: %s (have you installed support for all sox file formats?)\n", attach, format,
+					soxstatus == 1 ? "Problem with command line options" : "An error occurred during file processing");
+				ast_log(LOG_WARNING, "Voicemail attachment will have no volume gain.\n");
+			}
+		}
+	}
+	fprintf(p, "--%s" ENDL, bound);
+	if (msgnum > -1)
+		fprintf(p, "Content-Type: %s%s; name=\"%s\"" ENDL, ctype, format, filename);
+	else
+		fprintf(p, "Content-Type: %s%s; name=\"%s.%s\"" ENDL, ctype, format, greeting_attachment, format);
+	fprintf(p, "Content-Transfer-Encoding: base64" ENDL);
+	fprintf(p, "Content-Description: Voicemail sound attachment." ENDL);
+	if (msgnum > -1)
+		fprintf(p, "Content-Disposition: attachment; filename=\"%s\"" ENDL ENDL, filename);
+	else
+		fprintf(p, "Content-Disposition: attachment; filename=\"%s.%s\"" ENDL ENDL, greeting_attachment, format);
+	snprintf(fname, sizeof(fname), "%s.%s", attach, format);
+	base_encode(fname, p);
+	if (last)
+		fprintf(p, ENDL ENDL "--%s--" ENDL "." ENDL, bound);
+	if (tmpfd > -1) {
+		if (soxstatus == 0) {
+			unlink(fname);
+		}
+		close(tmpfd);
+		unlink(newtmp);
+	}
+	return 0;
+}
+
+/*! Number of threads sending voicemail e-mail */
+#define VM_MAIL_WORKERS 4
+
+static struct ast_taskprocessor *mail_tps[VM_MAIL_WORKERS];
+static int mail_tps_next;
+
+/*!
+ * \brief A voicemail e-mail waiting for a mail thread.
+ *
+ * The attachments are hard linked into a private directory, so they
+ * survive the message being deleted or disposed of before we get to them.
+ */
+struct vm_mail_job {
+	AST_DECLARE_STRING_FIELDS(
+		AST_STRING_FIELD(srcemail);
+		AST_STRING_FIELD(context);
+		AST_STRING_FIELD(mailbox);
+		AST_STRING_FIELD(fromfolder);
+		AST_STRING_FIELD(cidnum);
+		AST_STRING_FIELD(cidname);
+		AST_STRING_FIELD(attach);
+		AST_STRING_FIELD(attach2);
+		AST_STRING_FIELD(format);
+		AST_STRING_FIELD(category);
+		AST_STRING_FIELD(flag);
+		AST_STRING_FIELD(mailcmd);
+	);
+	struct ast_vm_user vmu;
+	int msgnum;
+	int duration;
+	int attach_user_voicemail;
+	char linkdir[256];
+};
+
+static void vm_mail_job_destroy(struct vm_mail_job *job)
+{
+	char fn[PATH_MAX];
+
+	if (!ast_strlen_zero(job->linkdir)) {
+		if (!ast_strlen_zero(job->attach)) {
+			snprintf(fn, sizeof(fn), "%s.%s", job->attach, job->format);
+			unlink(fn);
+		}
+		if (!ast_strlen_zero(job->attach2)) {
+			snprintf(fn, sizeof(fn), "%s.%s", job->attach2, job->format);
+			unlink(fn);
+		}
+		rmdir(job->linkdir);
+	}
+	ast_free(job->vmu.emailsubject);
+	ast_free(job->vmu.emailbody);
+	ast_string_field_free_memory(job);
+	ast_free(job);
+}
+
+/*!
+ * \brief Hard link an attachment into the job's directory.
+ * \return zero on success, -1 on error.
+ */
+static int vm_mail_link(struct vm_mail_job *job, const char *attach, char *dst, size_t len)
+{
+	char src[PATH_MAX], dstfile[PATH_MAX];
+	const char *base = strrchr(attach, '/');
+
+	snprintf(dst, len, "%s/%s", job->linkdir, base ? base + 1 : attach);
+	snprintf(src, sizeof(src), "%s.%s", attach, job->format);
+	snprintf(dstfile, sizeof(dstfile), "%s.%s", dst, job->format);
+	return link(src, dstfile);
+}
+
+/*! Seconds the mail command gets to take an e-mail and exit before it is killed */
+#define VM_MAIL_TIMEOUT 120
+
+/*!
+ * \brief Feed a spooled e-mail to the mail command's stdin and wait for it.
+ *
+ * The pipe is written without blocking and the mail command reaped with
+ * WNOHANG, both against the same deadline, so a mail command that stops
+ * reading or never exits costs the mail thread VM_MAIL_TIMEOUT seconds
+ * and is then killed.
+ *
+ * \return zero if the mail command took the e-mail and exited cleanly,
+ * -1 otherwise.
+ */
+static int vm_mail_pipe(const char *mailcmd, FILE *p)
+{
+	struct timeval start;
+	char buf[4096];
+	size_t len = 0, off = 0;
+	int fds[2], status = 0, res = -1, ms, backoff = 1000;
+	pid_t pid;
+
+	if (pipe(fds)) {
+		ast_log(AST_LOG_WARNING, "Unable to launch '%s' (pipe failed: %s)\n", mailcmd, strerror(errno));
+		return -1;
+	}
+
+	/* Stop the reaper, so the exit status is ours to collect */
+	if ((pid = ast_safe_fork(1)) < 0) {
+		ast_log(AST_LOG_WARNING, "Unable to launch '%s' (fork failed: %s)\n", mailcmd, strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	} else if (!pid) {
+		/* child */
+		close(fds[1]);
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		ast_close_fds_above_n(STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", mailcmd, (char *) NULL);
+		_exit(1);
+	}
+
+	close(fds[0]);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	start = ast_tvnow();
+	rewind(p);
+	for (;;) {
+		struct pollfd pfd = { .fd = fds[1], .events = POLLOUT, };
+		ssize_t written;
+
+		if (off == len) {
+			if (!(len = fread(buf, 1, sizeof(buf), p))) {
+				res = ferror(p) ? -1 : 0;
+				break;
+			}
+			off = 0;
+		}
+		if ((ms = VM_MAIL_TIMEOUT * 1000 - ast_tvdiff_ms(ast_tvnow(), start)) <= 0) {
+			ast_log(AST_LOG_WARNING, "Mail command '%s' did not take the e-mail within %d seconds\n", mailcmd, VM_MAIL_TIMEOUT);
+			break;
+		}
+		if (ast_poll(&pfd, 1, ms) <= 0) {
+			continue;
+		}
+		if ((written = write(fds[1], buf + off, len - off)) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			/* EPIPE: it exited without reading all of it */
+			ast_log(AST_LOG_WARNING, "Unable to write to mail command '%s': %s\n", mailcmd, strerror(errno));
+			break;
+		}
+		off += written;
+	}
+	close(fds[1]);
+
+	/* Give it the rest of the deadline to exit; most finish at once */
+	for (;;) {
+		pid_t ret = waitpid(pid, &status, WNOHANG);
+
+		if (ret == pid) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				ast_log(AST_LOG_WARNING, "Mail command '%s' failed (status %d)\n", mailcmd, status);
+				res = -1;
+			}
+			break;
+		} else if (ret < 0 && errno != EINTR) {
+			res = -1;
+			break;
+		} else if (ast_tvdiff_ms(ast_tvnow(), start) >= VM_MAIL_TIMEOUT * 1000) {
+			ast_log(AST_LOG_WARNING, "Mail command '%s' still running after %d seconds, killing it\n", mailcmd, VM_MAIL_TIMEOUT);
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			res = -1;
+			break;
+		}
+		usleep(backoff);
+		backoff = MIN(backoff * 2, 100000);
+	}
+	ast_safe_fork_cleanup();
+
+	return res;
+}
+
+/*!
+ * \brief Build a queued e-mail and hand it to the mail command.
+ *
+ * Runs on a mail thread, so the sox run for the volume gain and the
+ * encoding of the attachments never hold up a channel.  The e-mail is
+ * spooled to an unlinked temporary file first, so a mail command that
+ * hangs cannot block make_email_file() halfway, and is then streamed
+ * to the mail command by vm_mail_pipe(), which bounds how long it may
+ * hold up the e-mail queued behind it.
+ */
+static int vm_mail_send(void *data)
+{
+	struct vm_mail_job *job = data;
+	char tmp[80] = "/tmp/astmail-XXXXXX";
+	FILE *p;
+
+	if (!(p = vm_mkftemp(tmp))) {
+		ast_log(AST_LOG_WARNING, "Unable to launch '%s' (can't create temporary file)\n", job->mailcmd);
+	} else {
+		unlink(tmp);
+		make_email_file(p, (char *) job->srcemail, &job->vmu, job->msgnum, (char *) job->context, (char *) job->mailbox,
+			job->fromfolder, (char *) S_OR(job->cidnum, NULL), (char *) S_OR(job->cidname, NULL), (char *) job->attach,
+			(char *) job->attach2, (char *) job->format, job->duration, job->attach_user_voicemail, NULL,
+			S_OR(job->category, NULL), 0, job->flag);
+		if (fflush(p) || vm_mail_pipe(job->mailcmd, p)) {
+			ast_log(AST_LOG_WARNING, "E-mail to %s for %s@%s may not have been sent\n", job->vmu.email, job->mailbox, job->context);
+		} else {
+			ast_debug(1, "Sent mail to %s with command '%s'\n", job->vmu.email, job->mailcmd);
+		}
+		fclose(p);
+	}
+	vm_mail_job_destroy(job);
+	return 0;
+}
+
+/*! \brief Taskprocessors being drained by vm_tps_drain() */
+struct vm_tps_barrier {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int pending;
+};
+
+/*! \brief Task queued behind everything else: the taskprocessor is drained */
+static int vm_tps_barrier_task(void *data)
+{
+	struct vm_tps_barrier *barrier = data;
+
+	ast_mutex_lock(&barrier->lock);
+	if (!--barrier->pending) {
+		ast_cond_signal(&barrier->cond);
+	}
+	ast_mutex_unlock(&barrier->lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Wait for the jobs already queued on some taskprocessors.
+ *
+ * A taskprocessor throws away what is still queued when it is destroyed,
+ * which would leak the jobs and leave their link directories behind, so
+ * this is called before the last reference goes on unload.
+ */
+static void vm_tps_drain(struct ast_taskprocessor **tps, int count)
+{
+	struct vm_tps_barrier barrier;
+	int i;
+
+	ast_mutex_init(&barrier.lock);
+	ast_cond_init(&barrier.cond, NULL);
+	barrier.pending = count;
+
+	ast_mutex_lock(&barrier.lock);
+	for (i = 0; i < count; i++) {
+		if (!tps[i] || ast_taskprocessor_push(tps[i], vm_tps_barrier_task, &barrier)) {
+			barrier.pending--;
+		}
+	}
+	while (barrier.pending) {
+		ast_cond_wait(&barrier.cond, &barrier.lock);
+	}
+	ast_mutex_unlock(&barrier.lock);
+
+	ast_cond_destroy(&barrier.cond);
+	ast_mutex_destroy(&barrier.lock);
+}
+
+/*!
+ * \brief Hand an e-mail to one of the mail threads.
+ * \return zero if the e-mail was queued, -1 if it must be sent by the caller.
+ */
+static int vm_mail_queue(char *srcemail, struct ast_vm_user *vmu, int msgnum, char *context, char *mailbox, const char *fromfolder, char *cidnum, char *cidname, char *attach, char *attach2, char *format, int duration, int attach_user_voicemail, const char *category, const char *flag)
+{
+	struct ast_taskprocessor *tps = mail_tps[ast_atomic_fetchadd_int(&mail_tps_next, 1) % VM_MAIL_WORKERS];
+	struct vm_mail_job *job;
+	char tmpdir[256], link1[PATH_MAX] = "", link2[PATH_MAX] = "";
 
-	if (vmu->volgain < -.001 || vmu->volgain > .001) {
+	if (!vmu || !tps || !(job = ast_calloc(1, sizeof(*job)))) {
+		return -1;
+	}
+	if (ast_string_field_init(job, 256)) {
+		ast_free(job);
+		return -1;
+	}
+	ast_string_field_set(job, format, format);
+
+	if (attach_user_voicemail) {
 		create_dirpath(tmpdir, sizeof(tmpdir), vmu->context, vmu->mailbox, "tmp");
-		snprintf(newtmp, sizeof(newtmp), "%s/XXXXXX", tmpdir);
-		tmpfd = mkstemp(newtmp);
-		chmod(newtmp, VOICEMAIL_FILE_MODE & ~my_umask);
-		ast_debug(3, "newtmp: %s\n", newtmp);
-		if (tmpfd > -1) {
-			snprintf(tmpcmd, sizeof(tmpcmd), "sox -v %.4f %s.%s %s.%s", vmu->volgain, attach, format, newtmp, format);
-			if ((soxstatus = ast_safe_system(tmpcmd)) == 0) {
-				attach = newtmp;
-				ast_debug(3, "VOLGAIN: Stored at: %s.%s - Level: %.4f - Mailbox: %s\n", attach, format, vmu->volgain, mailbox);
-			} else {
-				ast_log(LOG_WARNING, "Sox failed to re-encode %s.%s: %s (have you installed support for all sox file formats?)\n", attach, format,
-					soxstatus == 1 ? "Problem with command line options" : "An error occurred during file processing");
-				ast_log(LOG_WARNING, "Voicemail attachment will have no volume gain.\n");
-			}
+		snprintf(job->linkdir, sizeof(job->linkdir), "%s/mailXXXXXX", tmpdir);
+		if (!mkdtemp(job->linkdir)) {
+			job->linkdir[0] = '\0';
+			vm_mail_job_destroy(job);
+			return -1;
 		}
-	}
-	fprintf(p, "--%s" ENDL, bound);
-	if (msgnum > -1)
-		fprintf(p, "Content-Type: %s%s; name=\"%s\"" ENDL, ctype, format, filename);
-	else
-		fprintf(p, "Content-Type: %s%s; name=\"%s.%s\"" ENDL, ctype, format, greeting_attachment, format);
-	fprintf(p, "Content-Transfer-Encoding: base64" ENDL);
-	fprintf(p, "Content-Description: Voicemail sound attachment." ENDL);
-	if (msgnum > -1)
-		fprintf(p, "Content-Disposition: attachment; filename=\"%s\"" ENDL ENDL, filename);
-	else
-		fprintf(p, "Content-Disposition: attachment; filename=\"%s.%s\"" ENDL ENDL, greeting_attachment, format);
-	snprintf(fname, sizeof(fname), "%s.%s", attach, format);
-	base_encode(fname, p);
-	if (last)
-		fprintf(p, ENDL ENDL "--%s--" ENDL "." ENDL, bound);
-	if (tmpfd > -1) {
-		if (soxstatus == 0) {
-			unlink(fname);
+		if (vm_mail_link(job, attach, link1, sizeof(link1))) {
+			/* Probably a spool on a file system without hard links */
+			ast_debug(1, "Unable to link %s.%s for mailing: %s\n", attach, format, strerror(errno));
+			vm_mail_job_destroy(job);
+			return -1;
 		}
-		close(tmpfd);
-		unlink(newtmp);
+		ast_string_field_set(job, attach, link1);
+		if (!ast_strlen_zero(attach2)) {
+			if (vm_mail_link(job, attach2, link2, sizeof(link2))) {
+				vm_mail_job_destroy(job);
+				return -1;
+			}
+			ast_string_field_set(job, attach2, link2);
+		}
+	} else {
+		ast_string_field_set(job, attach, attach);
+		ast_string_field_set(job, attach2, attach2);
+	}
+
+	ast_string_field_set(job, srcemail, srcemail);
+	ast_string_field_set(job, context, context);
+	ast_string_field_set(job, mailbox, mailbox);
+	ast_string_field_set(job, fromfolder, fromfolder);
+	ast_string_field_set(job, cidnum, cidnum);
+	ast_string_field_set(job, cidname, cidname);
+	ast_string_field_set(job, category, category);
+	ast_string_field_set(job, flag, flag);
+	ast_string_field_set(job, mailcmd, mailcmd);
+	job->vmu = *vmu;
+	job->vmu.emailsubject = ast_strdup(vmu->emailsubject);
+	job->vmu.emailbody = ast_strdup(vmu->emailbody);
+	job->msgnum = msgnum;
+	job->duration = duration;
+	job->attach_user_voicemail = attach_user_voicemail;
+
+	if (ast_taskprocessor_push(tps, vm_mail_send, job) < 0) {
+		vm_mail_job_destroy(job);
+		return -1;
 	}
 	return 0;
 }
@@ -4857,6 +5718,9 @@ static int sendmail(char *srcemail, struct ast_vm_user *vmu, int msgnum, char *c
 	if (!strcmp(format, "wav49"))
 		format = "WAV";
 	ast_debug(3, "Attaching file '%s', format '%s', uservm is '%d', global is %d\n", attach, format, attach_user_voicemail, ast_test_flag((&globalflags), VM_ATTACH));
+	if (!vm_mail_queue(srcemail, vmu, msgnum, context, mailbox, fromfolder, cidnum, cidname, attach, attach2, format, duration, attach_user_voicemail, category, flag)) {
+		return 0;
+	}
 	/* Make a temporary file instead of piping directly to sendmail, in case the mail
 	   command hangs */
 	if ((p = vm_mkftemp(tmp)) == NULL) {
@@ -5364,6 +6228,135 @@ static int copy_message(struct ast_channel *chan, struct ast_vm_user *vmu, int i
 #endif
 #if !(defined(IMAP_STORAGE) || defined(ODBC_STORAGE))
 
+/*! Copies a message left for several mailboxes to all but the first of them */
+static struct ast_taskprocessor *copy_tps;
+
+/*! \brief A message to be copied to a list of mailboxes, in the background. */
+struct vm_fanout {
+	struct ast_channel *chan;
+	struct vm_copy_source src;
+	char context[AST_MAX_CONTEXT];
+	char mailbox[AST_MAX_EXTENSION];
+	char fmt[80];
+	char flag[80];
+	char *cidnum;
+	char *cidname;
+	long duration;
+	AST_LIST_HEAD_NOLOCK(, ast_vm_user) recips;
+};
+
+static void vm_fanout_destroy(struct vm_fanout *job)
+{
+	struct ast_vm_user *recip;
+
+	while ((recip = AST_LIST_REMOVE_HEAD(&job->recips, list))) {
+		free_user(recip);
+	}
+	vm_copy_source_close(&job->src);
+	if (job->chan) {
+		job->chan = ast_channel_unref(job->chan);
+	}
+	ast_free(job->cidnum);
+	ast_free(job->cidname);
+	ast_free(job);
+}
+
+/*!
+ * \brief Copy the message of a fan-out to one recipient.
+ *
+ * Does what copy_message() does, but from the already opened source files.
+ */
+static void vm_fanout_copy(struct vm_fanout *job, struct ast_vm_user *recip)
+{
+	char todir[PATH_MAX], topath[PATH_MAX];
+	const char *userfolder = !strcmp(job->flag, "Urgent") ? "Urgent" : "INBOX";
+	int recipmsgnum;
+
+	ast_log(AST_LOG_NOTICE, "Copying message from %s@%s to %s@%s\n", job->mailbox, job->context, recip->mailbox, recip->context);
+
+	create_dirpath(todir, sizeof(todir), recip->context, recip->mailbox, userfolder);
+	if (vm_lock_path(todir)) {
+		return;
+	}
+	recipmsgnum = last_message_index(recip, todir) + 1;
+	if (recipmsgnum < recip->maxmsg - inprocess_count(job->mailbox, job->context, 0)) {
+		if (vm_copy_source_has_sound(&job->src)) {
+			make_file(topath, sizeof(topath), todir, recipmsgnum);
+			vm_copy_source_to(&job->src, topath);
+		}
+	} else {
+		ast_log(AST_LOG_ERROR, "Recipient mailbox %s@%s is full\n", recip->mailbox, recip->context);
+	}
+	ast_unlock_path(todir);
+	notify_new_message(job->chan, recip, NULL, recipmsgnum, job->duration, job->fmt, job->cidnum, job->cidname, job->flag);
+}
+
+static int vm_fanout_exec(void *data)
+{
+	struct vm_fanout *job = data;
+	struct ast_vm_user *recip;
+
+	AST_LIST_TRAVERSE(&job->recips, recip, list) {
+		vm_fanout_copy(job, recip);
+	}
+	vm_fanout_destroy(job);
+	return 0;
+}
+
+/*!
+ * \brief Copy a message just left to the other mailboxes it was left for.
+ * \param recipients '&' separated list of mailbox[@context].
+ *
+ * The message files are opened here and the copies are made by the copy
+ * taskprocessor, so a message left for a long list of mailboxes does not
+ * hold up the caller.  The files of each message are read once for the
+ * whole list, and each destination folder is locked once.
+ *
+ * \retval NULL the copies have been queued.
+ * \retval recipients the caller must make the copies.
+ */
+static char *vm_fanout(struct ast_channel *chan, struct ast_vm_user *vmu, int msgnum, long duration, char *fmt, char *dir, const char *flag, char *recipients)
+{
+	struct vm_fanout *job;
+	struct ast_vm_user *recip;
+	char frompath[PATH_MAX], *list = ast_strdupa(recipients), *exten, *cntx;
+
+	if (!copy_tps || !(job = ast_calloc(1, sizeof(*job)))) {
+		return recipients;
+	}
+	make_file(frompath, sizeof(frompath), dir, msgnum);
+	if (vm_copy_source_open(&job->src, frompath)) {
+		ast_free(job);
+		return recipients;
+	}
+
+	while ((exten = strsep(&list, "&"))) {
+		if ((cntx = strchr(exten, '@'))) {
+			*cntx++ = '\0';
+		}
+		if ((recip = find_user(NULL, cntx, exten))) {
+			AST_LIST_INSERT_TAIL(&job->recips, recip, list);
+		}
+	}
+
+	ast_copy_string(job->context, vmu->context, sizeof(job->context));
+	ast_copy_string(job->mailbox, vmu->mailbox, sizeof(job->mailbox));
+	ast_copy_string(job->fmt, fmt, sizeof(job->fmt));
+	ast_copy_string(job->flag, S_OR(flag, ""), sizeof(job->flag));
+	ast_channel_lock(chan);
+	job->cidnum = ast_strdup(S_COR(chan->caller.id.number.valid, chan->caller.id.number.str, NULL));
+	job->cidname = ast_strdup(S_COR(chan->caller.id.name.valid, chan->caller.id.name.str, NULL));
+	ast_channel_unlock(chan);
+	job->duration = duration;
+	job->chan = ast_channel_ref(chan);
+
+	if (ast_taskprocessor_push(copy_tps, vm_fanout_exec, job) < 0) {
+		vm_fanout_destroy(job);
+		return recipients;
+	}
+	return NULL;
+}
+
 static int messagecount(const char *context, const char *mailbox, const char *folder)
 {
 	return __has_voicemail(context, mailbox, folder, 0) + (folder && strcmp(folder, "INBOX") ? 0 : __has_voicemail(context, mailbox, "Urgent", 0));
@@ -5375,6 +6368,7 @@ static int __has_voicemail(const char *context, const char *mailbox, const char
 	struct dirent *de;
 	char fn[256];
 	int ret = 0;
+	struct vm_folder_index *idx;
 
 	/* If no mailbox, return immediately */
 	if (ast_strlen_zero(mailbox))
@@ -5387,6 +6381,12 @@ static int __has_voicemail(const char *context, const char *mailbox, const char
 
 	snprintf(fn, sizeof(fn), "%s%s/%s/%s", VM_SPOOL_DIR, context, mailbox, folder);
 
+	if ((idx = vm_index_get(fn))) {
+		ret = shortcircuit ? idx->count > 0 : idx->count;
+		vm_index_release(idx);
+		return ret;
+	}
+
 	if (!(dir = opendir(fn)))
 		return 0;
 
@@ -6020,7 +7020,9 @@ static int leave_voicemail(struct ast_channel *chan, char *ext, struct leave_vm_
 
 					snprintf(txtfile, sizeof(txtfile), "%s.txt", fn);
 					ast_filerename(tmptxtfile, fn, NULL);
-					rename(tmptxtfile, txtfile);
+					if (!rename(tmptxtfile, txtfile)) {
+						vm_index_note(fn, 1);
+					}
 					inprocess_count(vmu->mailbox, vmu->context, -1);
 
 					/* Properly set permissions on voicemail text descriptor file.
@@ -6040,6 +7042,11 @@ static int leave_voicemail(struct ast_channel *chan, char *ext, struct leave_vm_
 						STORE(dir, vmu->mailbox, vmu->context, msgnum, chan, vmu, fmt, duration, vms, flag);
 					}
 
+#if !(defined(IMAP_STORAGE) || defined(ODBC_STORAGE))
+					if (tmpptr) {
+						tmpptr = vm_fanout(chan, vmu, msgnum, duration, fmt, dir, flag, tmpptr);
+					}
+#endif
 					/* Are there to be more recipients of this message? */
 					while (tmpptr) {
 						struct ast_vm_user recipu, *recip;
@@ -12338,6 +13345,23 @@ static int actual_load_config(int reload, struct ast_config *cfg, struct ast_con
 		if ((val = ast_variable_retrieve(cfg, "general", "pollmailboxes")))
 			poll_mailboxes = ast_true(val);
 
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+		vm_folder_index_mode = VM_FOLDER_INDEX_ON;
+		if ((val = ast_variable_retrieve(cfg, "general", "folderindex"))) {
+			if (!strcasecmp(val, "stat")) {
+				vm_folder_index_mode = VM_FOLDER_INDEX_STAT;
+			} else if (ast_false(val)) {
+				vm_folder_index_mode = VM_FOLDER_INDEX_OFF;
+			}
+		}
+#ifdef HAVE_INOTIFY
+		if (vm_folder_index_mode == VM_FOLDER_INDEX_ON && vm_folder_is_remote(VM_SPOOL_DIR)) {
+			ast_log(AST_LOG_NOTICE, "Voicemail spool %s is on a network file system, using folderindex=stat\n", VM_SPOOL_DIR);
+			vm_folder_index_mode = VM_FOLDER_INDEX_STAT;
+		}
+#endif
+#endif
+
 		memset(fromstring, 0, sizeof(fromstring));
 		memset(pagerfromstring, 0, sizeof(pagerfromstring));
 		strcpy(charset, "ISO-8859-1");
@@ -12831,6 +13855,138 @@ AST_TEST_DEFINE(test_voicemail_msgcount)
 	return res;
 }
 
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+/*!
+ * \brief Compare what a folder index says with reading the folder.
+ *
+ * Changes made behind the index's back reach a watched index through the
+ * inotify thread, so give it a moment to catch up before failing.
+ */
+static int test_vm_index_agrees(struct ast_test *test, struct ast_vm_user *vmu, char *dir, enum vm_folder_index_mode mode, const char *step)
+{
+	int tries, count = 0, last = 0, want_count = 0, want_last = 0;
+
+	for (tries = 0; tries < 20; tries++) {
+		vm_folder_index_mode = VM_FOLDER_INDEX_OFF;
+		want_count = count_messages(vmu, dir);
+		want_last = last_message_index(vmu, dir);
+		vm_folder_index_mode = mode;
+		count = count_messages(vmu, dir);
+		last = last_message_index(vmu, dir);
+		if (count == want_count && last == want_last) {
+			return 0;
+		}
+		usleep(100000);
+	}
+	ast_test_status_update(test, "folderindex=%s, %s: index has %d messages, last %d; folder has %d, last %d\n",
+		mode == VM_FOLDER_INDEX_STAT ? "stat" : "yes", step, count, last, want_count, want_last);
+	return -1;
+}
+
+/*! \brief Create or remove msgNNNN.txt directly, as another host sharing the spool would */
+static int test_vm_index_touch(const char *dir, int msgnum, int present)
+{
+	char fn[PATH_MAX];
+	FILE *txt;
+
+	snprintf(fn, sizeof(fn), "%s/msg%04d.txt", dir, msgnum);
+	if (!present) {
+		return unlink(fn);
+	}
+	if (!(txt = fopen(fn, "w"))) {
+		return -1;
+	}
+	fprintf(txt, "; just a stub\n[message]\n");
+	fclose(txt);
+	return 0;
+}
+
+AST_TEST_DEFINE(test_voicemail_folderindex)
+{
+	int res = AST_TEST_PASS, syserr, m;
+	enum vm_folder_index_mode saved_mode = vm_folder_index_mode;
+	static const enum vm_folder_index_mode modes[] = { VM_FOLDER_INDEX_ON, VM_FOLDER_INDEX_STAT };
+	struct ast_vm_user *vmu;
+	char dir[256], src[PATH_MAX], dst[PATH_MAX];
+	char syscmd[256];
+	const char testcontext[] = "test";
+	const char testmailbox[] = "00000000";
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "test_voicemail_folderindex";
+		info->category = "/apps/app_voicemail/";
+		info->summary = "Test the voicemail folder index";
+		info->description =
+			"Verify that message counts and the last message number taken from the\n"
+			"folder index match reading the folder, with folderindex=yes and stat,\n"
+			"when messages are created, removed and renamed behind its back.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	snprintf(syscmd, sizeof(syscmd), "rm -rf \"%s%s/%s\"", VM_SPOOL_DIR, testcontext, testmailbox);
+	if ((syserr = ast_safe_system(syscmd))) {
+		ast_test_status_update(test, "Unable to clear test directory: %s\n",
+			syserr > 0 ? strerror(syserr) : "unable to fork()");
+		return AST_TEST_FAIL;
+	}
+
+	if (!(vmu = find_user(NULL, testcontext, testmailbox)) &&
+		!(vmu = find_or_create(testcontext, testmailbox))) {
+		ast_test_status_update(test, "Cannot create vmu structure\n");
+		return AST_TEST_FAIL;
+	}
+	populate_defaults(vmu);
+
+#ifdef HAVE_INOTIFY
+	if (vm_folder_is_remote(VM_SPOOL_DIR)) {
+		ast_test_status_update(test, "%s is on a network file system, folders are not watched\n", VM_SPOOL_DIR);
+	}
+#endif
+
+	create_dirpath(dir, sizeof(dir), testcontext, testmailbox, "INBOX");
+	for (m = 0; m < ARRAY_LEN(modes) && res == AST_TEST_PASS; m++) {
+		if (test_vm_index_agrees(test, vmu, dir, modes[m], "empty folder")) {
+			res = AST_TEST_FAIL;
+			break;
+		}
+		if (test_vm_index_touch(dir, 0, 1) || test_vm_index_touch(dir, 1, 1) || test_vm_index_touch(dir, 3, 1)) {
+			ast_test_status_update(test, "Unable to create test messages in %s: %s\n", dir, strerror(errno));
+			res = AST_TEST_FAIL;
+			break;
+		}
+		if (test_vm_index_agrees(test, vmu, dir, modes[m], "messages created")) {
+			res = AST_TEST_FAIL;
+		}
+		test_vm_index_touch(dir, 1, 0);
+		if (test_vm_index_agrees(test, vmu, dir, modes[m], "message removed")) {
+			res = AST_TEST_FAIL;
+		}
+		snprintf(src, sizeof(src), "%s/msg%04d.txt", dir, 3);
+		snprintf(dst, sizeof(dst), "%s/msg%04d.txt", dir, 1);
+		if (rename(src, dst) || test_vm_index_agrees(test, vmu, dir, modes[m], "message renamed")) {
+			res = AST_TEST_FAIL;
+		}
+		test_vm_index_touch(dir, 0, 0);
+		test_vm_index_touch(dir, 1, 0);
+		if (test_vm_index_agrees(test, vmu, dir, modes[m], "messages removed")) {
+			res = AST_TEST_FAIL;
+		}
+	}
+	vm_folder_index_mode = saved_mode;
+
+	snprintf(syscmd, sizeof(syscmd), "rm -rf \"%s%s/%s\"", VM_SPOOL_DIR, testcontext, testmailbox);
+	if ((syserr = ast_safe_system(syscmd))) {
+		ast_test_status_update(test, "Unable to clear test directory: %s\n",
+			syserr > 0 ? strerror(syserr) : "unable to fork()");
+	}
+
+	return res;
+}
+#endif
+
 AST_TEST_DEFINE(test_voicemail_notify_endl)
 {
 	int res = AST_TEST_PASS;
@@ -13015,6 +14171,106 @@ cleanup:
 	return res;
 }
 
+/*!
+ * \brief The bit at a time base64 encoder ast_base64encode_full() used to be,
+ * kept as the reference for the table driven one the attachments go through.
+ */
+static int test_base64encode_ref(char *dst, const unsigned char *src, int srclen, int max, int linebreaks)
+{
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int cnt = 0;
+	int col = 0;
+	unsigned int byte = 0;
+	int bits = 0;
+	int cntin = 0;
+	/* Reserve space for null byte at end of string */
+	max--;
+	while ((cntin < srclen) && (cnt < max)) {
+		byte <<= 8;
+		byte |= *(src++);
+		bits += 8;
+		cntin++;
+		if ((bits == 24) && (cnt + 4 <= max)) {
+			*dst++ = base64[(byte >> 18) & 0x3f];
+			*dst++ = base64[(byte >> 12) & 0x3f];
+			*dst++ = base64[(byte >> 6) & 0x3f];
+			*dst++ = base64[byte & 0x3f];
+			cnt += 4;
+			col += 4;
+			bits = 0;
+			byte = 0;
+		}
+		if (linebreaks && (cnt < max) && (col == 64)) {
+			*dst++ = '\n';
+			cnt++;
+			col = 0;
+		}
+	}
+	if (bits && (cnt + 4 <= max)) {
+		byte <<= 24 - bits;
+		*dst++ = base64[(byte >> 18) & 0x3f];
+		*dst++ = base64[(byte >> 12) & 0x3f];
+		if (bits == 16)
+			*dst++ = base64[(byte >> 6) & 0x3f];
+		else
+			*dst++ = '=';
+		*dst++ = '=';
+		cnt += 4;
+	}
+	if (linebreaks && (cnt < max)) {
+		*dst++ = '\n';
+		cnt++;
+	}
+	*dst = '\0';
+	return cnt;
+}
+
+AST_TEST_DEFINE(test_voicemail_base64)
+{
+	unsigned char src[200];
+	char out[400], ref[400];
+	int srclen, max, linebreaks, i, got, want;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "test_voicemail_base64";
+		info->category = "/apps/app_voicemail/";
+		info->summary = "Test the base64 encoding of attachments";
+		info->description =
+			"Verify that ast_base64encode_full() produces the same output, byte for byte,\n"
+			"as the bit at a time encoder it replaced, for every input length, line\n"
+			"breaking and output buffer size, including buffers that truncate the output.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(src); i++) {
+		src[i] = ast_random() & 0xff;
+	}
+	/* Make sure the first characters of the table and the padding are hit, too */
+	src[0] = 0x00;
+	src[1] = 0xff;
+
+	for (linebreaks = 0; linebreaks < 2; linebreaks++) {
+		for (srclen = 0; srclen <= ARRAY_LEN(src); srclen++) {
+			for (max = 1; max <= sizeof(out); max++) {
+				memset(out, 'X', sizeof(out));
+				memset(ref, 'X', sizeof(ref));
+				got = ast_base64encode_full(out, src, srclen, max, linebreaks);
+				want = test_base64encode_ref(ref, src, srclen, max, linebreaks);
+				if (got != want || memcmp(out, ref, sizeof(out))) {
+					ast_test_status_update(test, "Mismatch for %d bytes, max %d, linebreaks %d: got %d '%s', expected %d '%s'\n",
+						srclen, max, linebreaks, got, out, want, ref);
+					return AST_TEST_FAIL;
+				}
+			}
+		}
+	}
+
+	return AST_TEST_PASS;
+}
+
 #endif /* defined(TEST_FRAMEWORK) */
 
 static int reload(void)
@@ -13025,6 +14281,7 @@ static int reload(void)
 static int unload_module(void)
 {
 	int res;
+	int i;
 
 	res = ast_unregister_application(app);
 	res |= ast_unregister_application(app2);
@@ -13037,18 +14294,39 @@ static int unload_module(void)
 #ifdef TEST_FRAMEWORK
 	res |= AST_TEST_UNREGISTER(test_voicemail_vmsayname);
 	res |= AST_TEST_UNREGISTER(test_voicemail_msgcount);
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	res |= AST_TEST_UNREGISTER(test_voicemail_folderindex);
+#endif
 	res |= AST_TEST_UNREGISTER(test_voicemail_vmuser);
 	res |= AST_TEST_UNREGISTER(test_voicemail_notify_endl);
 	res |= AST_TEST_UNREGISTER(test_voicemail_load_config);
+	res |= AST_TEST_UNREGISTER(test_voicemail_base64);
 #endif
 	ast_cli_unregister_multiple(cli_voicemail, ARRAY_LEN(cli_voicemail));
 	ast_uninstall_vm_functions();
-	ao2_ref(inprocess_container, -1);
 
 	if (poll_thread != AST_PTHREADT_NULL)
 		stop_poll_thread();
 
+	/* Queued work uses everything below, so it goes first.  Copies first,
+	 * since each one can queue e-mail; each copy job also holds a channel
+	 * reference. */
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	vm_tps_drain(&copy_tps, 1);
+	copy_tps = ast_taskprocessor_unreference(copy_tps);
+#endif
+	/* Send the e-mail that is still queued rather than losing it. */
+	vm_tps_drain(mail_tps, VM_MAIL_WORKERS);
+	for (i = 0; i < VM_MAIL_WORKERS; i++) {
+		mail_tps[i] = ast_taskprocessor_unreference(mail_tps[i]);
+	}
 	mwi_subscription_tps = ast_taskprocessor_unreference(mwi_subscription_tps);
+
+	ao2_ref(inprocess_container, -1);
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	vm_folder_index_destroy();
+#endif
+
 	ast_unload_realtime("voicemail");
 	ast_unload_realtime("voicemail_data");
 
@@ -13060,6 +14338,7 @@ static int unload_module(void)
 static int load_module(void)
 {
 	int res;
+	int i;
 	my_umask = umask(0);
 	umask(my_umask);
 
@@ -13067,6 +14346,14 @@ static int load_module(void)
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	if (vm_folder_index_init()) {
+		vm_folder_index_destroy();
+		ao2_ref(inprocess_container, -1);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+#endif
+
 	/* compute the location of the voicemail spool directory */
 	snprintf(VM_SPOOL_DIR, sizeof(VM_SPOOL_DIR), "%s/voicemail/", ast_config_AST_SPOOL_DIR);
 	
@@ -13074,6 +14361,20 @@ static int load_module(void)
 		ast_log(AST_LOG_WARNING, "failed to reference mwi subscription taskprocessor.  MWI will not work\n");
 	}
 
+	for (i = 0; i < VM_MAIL_WORKERS; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "app_voicemail_mail%d", i);
+		if (!(mail_tps[i] = ast_taskprocessor_get(name, 0))) {
+			ast_log(AST_LOG_WARNING, "failed to reference mail taskprocessor.  E-mail will be sent from the calling thread\n");
+		}
+	}
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	if (!(copy_tps = ast_taskprocessor_get("app_voicemail_copy", 0))) {
+		ast_log(AST_LOG_WARNING, "failed to reference copy taskprocessor.  Messages will be copied from the calling thread\n");
+	}
+#endif
+
 	if ((res = load_config(0)))
 		return res;
 
@@ -13087,9 +14388,13 @@ static int load_module(void)
 #ifdef TEST_FRAMEWORK
 	res |= AST_TEST_REGISTER(test_voicemail_vmsayname);
 	res |= AST_TEST_REGISTER(test_voicemail_msgcount);
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	res |= AST_TEST_REGISTER(test_voicemail_folderindex);
+#endif
 	res |= AST_TEST_REGISTER(test_voicemail_vmuser);
 	res |= AST_TEST_REGISTER(test_voicemail_notify_endl);
 	res |= AST_TEST_REGISTER(test_voicemail_load_config);
+	res |= AST_TEST_REGISTER(test_voicemail_base64);
 #endif
 
 	if (res)
@@ -93,10 +93,42 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 352956 $")
 #include "asterisk/test.h"
 #include "asterisk/data.h"
 #include "asterisk/netsock2.h"
+#include "asterisk/hashtab.h"
 
 #include "iax2.h"
 #include "iax2-parser.h"
 #include "iax2-provision.h"
+
+/*
+ * With OpenSSL, ast_aes keys are AES_KEY and can be fed to AES-NI directly.
+ * The AES-NI functions carry target attributes, so the rest of the module
+ * is still built for any x86, but the intrinsics headers only accept that
+ * from GCC 4.9 and clang 3.8 on.  Older compilers get AES-NI only when the
+ * whole build has it enabled (-maes -mssse3).
+ */
+#if defined(__clang__)
+#if defined(__apple_build_version__)
+#define IAX2_AESNI_TARGET_ATTR (__clang_major__ >= 8)
+#else
+#define IAX2_AESNI_TARGET_ATTR (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))
+#endif
+#elif defined(__GNUC__)
+#define IAX2_AESNI_TARGET_ATTR (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#else
+#define IAX2_AESNI_TARGET_ATTR 0
+#endif
+#if defined(HAVE_CRYPTO) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+	&& (IAX2_AESNI_TARGET_ATTR || (defined(__AES__) && defined(__SSSE3__)))
+#define IAX2_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+/* recvmmsg() and sendmmsg() move a whole batch of datagrams per system call */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define IAX2_MMSG
+#endif
 #include "jitterbuf.h"
 
 /*** DOCUMENTATION
@@ -630,6 +662,8 @@ static AST_LIST_HEAD_STATIC(registrations, iax2_registry);
 
 static int iaxthreadcount = DEFAULT_THREAD_COUNT;
 static int iaxmaxthreadcount = DEFAULT_MAX_THREAD_COUNT;
+/*! Receive workers datagrams are steered to by call number, 0 to use the thread pool */
+static int iaxrxworkers = 0;
 static int iaxdynamicthreadcount = 0;
 static int iaxdynamicthreadnum = 0;
 static int iaxactivethreadcount = 0;
@@ -879,9 +913,12 @@ static const time_t MAX_CALLTOKEN_DELAY = 10;
 #else
 #define MAX_PEER_BUCKETS 563
 #endif
+/*! Bucket count actually used for the peer, user and per-address containers.
+ * MAX_PEER_BUCKETS unless overridden by peerbuckets in iax.conf, read once
+ * at load since the containers can't be resized. */
+static int peer_buckets = MAX_PEER_BUCKETS;
 static struct ao2_container *peers;
 
-#define MAX_USER_BUCKETS MAX_PEER_BUCKETS
 static struct ao2_container *users;
 
 /*! Table containing peercnt objects for every ip address consuming a callno */
@@ -1043,6 +1080,48 @@ static AST_LIST_HEAD_STATIC(idle_list, iax2_thread);
 static AST_LIST_HEAD_STATIC(active_list, iax2_thread);
 static AST_LIST_HEAD_STATIC(dynamic_list, iax2_thread);
 
+/*! \brief A datagram read by socket_read() that has to wait for its thread */
+struct iax2_rx_pkt {
+	AST_LIST_ENTRY(iax2_rx_pkt) entry;
+	int fd;
+	struct sockaddr_in sin;
+	size_t len;
+	/*! One more than len, socket_process() may terminate text frames */
+	unsigned char buf[1];
+};
+
+/*! Most datagrams kept for the thread pool while every thread is busy */
+#define IAX_RX_BACKLOG 512
+
+/*! Datagrams read while every thread was busy, protected by the idle_list
+ *  lock.  A thread takes one of them instead of going back to idle, see
+ *  insert_idle_thread(), so there is never an idle thread and a datagram
+ *  waiting at the same time. */
+static AST_LIST_HEAD_NOLOCK_STATIC(rx_backlog, iax2_rx_pkt);
+static int rx_backlog_len;
+static unsigned int rx_backlog_dropped;
+
+/*! Most datagrams queued to a receive worker */
+#define IAX_RX_QUEUE_MAX 1024
+
+/*! \brief A receive worker, processing in order every datagram steered to it */
+struct iax2_rx_worker {
+	pthread_t threadid;
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	AST_LIST_HEAD_NOLOCK(, iax2_rx_pkt) queue;
+	int queued;
+	unsigned int processed;
+	unsigned int dropped;
+	unsigned char stop;
+	/*! What socket_process() finds the datagram in */
+	struct iax2_thread ctx;
+};
+
+static struct iax2_rx_worker *rx_workers;
+/*! Receive workers running, set before the network thread starts */
+static int rx_worker_count;
+
 static void *iax2_process_thread(void *data);
 static void iax2_destroy(int callno);
 
@@ -1187,7 +1266,8 @@ static int iax2_transfer(struct ast_channel *c, const char *dest);
 static int iax2_write(struct ast_channel *c, struct ast_frame *f);
 static int iax2_sched_add(struct ast_sched_context *sched, int when, ast_sched_cb callback, const void *data);
 
-static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now);
+struct iax2_trunk_batch;
+static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now, struct iax2_trunk_batch *batch);
 static int send_command(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
 static int send_command_final(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
 static int send_command_immediate(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
@@ -1374,20 +1454,30 @@ static void iax2_free_variable_datastore(void *old)
 
 /* WARNING: insert_idle_thread should only ever be called within the
  * context of an iax2_process_thread() thread.
+ *
+ * \return a datagram that was waiting for a thread, for the thread to
+ * process instead of going idle, or NULL once it is on its idle list
  */
-static void insert_idle_thread(struct iax2_thread *thread)
+static struct iax2_rx_pkt *insert_idle_thread(struct iax2_thread *thread)
 {
+	struct iax2_rx_pkt *pkt;
+
+	AST_LIST_LOCK(&idle_list);
+	if ((pkt = AST_LIST_REMOVE_HEAD(&rx_backlog, entry))) {
+		rx_backlog_len--;
+		AST_LIST_UNLOCK(&idle_list);
+		return pkt;
+	}
 	if (thread->type == IAX_THREAD_TYPE_DYNAMIC) {
 		AST_LIST_LOCK(&dynamic_list);
 		AST_LIST_INSERT_TAIL(&dynamic_list, thread, list);
 		AST_LIST_UNLOCK(&dynamic_list);
 	} else {
-		AST_LIST_LOCK(&idle_list);
 		AST_LIST_INSERT_TAIL(&idle_list, thread, list);
-		AST_LIST_UNLOCK(&idle_list);
 	}
+	AST_LIST_UNLOCK(&idle_list);
 
-	return;
+	return NULL;
 }
 
 static struct iax2_thread *find_idle_thread(void)
@@ -6231,7 +6321,7 @@ static int iax2_trunk_queue(struct chan_iax2_pvt *pvt, struct iax_frame *fr)
 		/* if we have enough for a full MTU, ship it now without waiting */
 		if (global_max_trunk_mtu > 0 && tpeer->trunkdatalen + f->datalen + 4 >= global_max_trunk_mtu) {
 			now = ast_tvnow();
-			send_trunk(tpeer, &now); 
+			send_trunk(tpeer, &now, NULL);
 			trunk_untimed ++; 
 		}
 
@@ -6268,42 +6358,147 @@ static void build_ecx_key(const unsigned char *digest, struct chan_iax2_pvt *pvt
 	ast_aes_set_decrypt_key(digest, &pvt->mydcx);
 }
 
-static void memcpy_decrypt(unsigned char *dst, const unsigned char *src, int len, ast_aes_decrypt_key *dcx)
+#ifdef IAX2_AESNI
+/*!
+ * \brief AES-NI CBC for encrypted calls
+ *
+ * With OpenSSL, ast_aes keys are AES_KEY schedules, and the 128 bit round
+ * keys in them are exactly the ones AESENC/AESDEC want (the decrypt schedule
+ * already has InvMixColumns applied), give or take the byte order of each
+ * 32 bit word, which depends on how libcrypto was built.  iax2_aesni_init()
+ * finds out which order is in use from a known answer test, and leaves
+ * aesni_layout at 0 (use ast_aes one block at a time) if the CPU has no
+ * AES-NI or neither order gives the right answer.
+ */
+enum {
+	AESNI_OFF = 0,
+	AESNI_RAW,
+	AESNI_BSWAP,
+};
+static int aesni_layout = AESNI_OFF;
+
+__attribute__((target("aes,ssse3")))
+static void aesni_load_keys(__m128i *k, const unsigned int *rd_key)
 {
-#if 0
-	/* Debug with "fake encryption" */
+	const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
 	int x;
-	if (len % 16)
-		ast_log(LOG_WARNING, "len should be multiple of 16, not %d!\n", len);
-	for (x=0;x<len;x++)
-		dst[x] = src[x] ^ 0xff;
-#else	
+
+	for (x = 0; x < 11; x++) {
+		k[x] = _mm_loadu_si128((const __m128i *) (rd_key + 4 * x));
+		if (aesni_layout == AESNI_BSWAP) {
+			k[x] = _mm_shuffle_epi8(k[x], bswap);
+		}
+	}
+}
+
+__attribute__((target("aes,ssse3")))
+static void aesni_cbc_encrypt(unsigned char *dst, const unsigned char *src, int len, const ast_aes_encrypt_key *ecx)
+{
+	__m128i k[11], b, iv = _mm_setzero_si128();
+	int x;
+
+	aesni_load_keys(k, ecx->rd_key);
+	for (; len > 0; len -= 16, src += 16, dst += 16) {
+		b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) src), iv);
+		b = _mm_xor_si128(b, k[0]);
+		for (x = 1; x < 10; x++) {
+			b = _mm_aesenc_si128(b, k[x]);
+		}
+		iv = _mm_aesenclast_si128(b, k[10]);
+		_mm_storeu_si128((__m128i *) dst, iv);
+	}
+}
+
+__attribute__((target("aes,ssse3")))
+static void aesni_cbc_decrypt(unsigned char *dst, const unsigned char *src, int len, const ast_aes_decrypt_key *dcx)
+{
+	__m128i k[11], b, c, iv = _mm_setzero_si128();
+	int x;
+
+	aesni_load_keys(k, dcx->rd_key);
+	for (; len > 0; len -= 16, src += 16, dst += 16) {
+		c = _mm_loadu_si128((const __m128i *) src);
+		b = _mm_xor_si128(c, k[0]);
+		for (x = 1; x < 10; x++) {
+			b = _mm_aesdec_si128(b, k[x]);
+		}
+		b = _mm_aesdeclast_si128(b, k[10]);
+		_mm_storeu_si128((__m128i *) dst, _mm_xor_si128(b, iv));
+		iv = c;
+	}
+}
+
+static void iax2_aesni_init(void)
+{
+	/* FIPS-197 appendix C.1 */
+	static const unsigned char key[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+	static const unsigned char plain[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+	static const unsigned char cipher[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+	ast_aes_encrypt_key ecx;
+	ast_aes_decrypt_key dcx;
+	unsigned char buf[16];
+	unsigned int eax, ebx, ecx_reg, edx;
+
+	aesni_layout = AESNI_OFF;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx_reg, &edx) || !(ecx_reg & bit_AES) || !(ecx_reg & bit_SSSE3)) {
+		return;
+	}
+
+	ast_aes_set_encrypt_key(key, &ecx);
+	ast_aes_set_decrypt_key(key, &dcx);
+	if (ecx.rounds != 10 || dcx.rounds != 10) {
+		return;
+	}
+
+	for (aesni_layout = AESNI_RAW; aesni_layout <= AESNI_BSWAP; aesni_layout++) {
+		aesni_cbc_encrypt(buf, plain, sizeof(buf), &ecx);
+		if (memcmp(buf, cipher, sizeof(buf))) {
+			continue;
+		}
+		aesni_cbc_decrypt(buf, cipher, sizeof(buf), &dcx);
+		if (!memcmp(buf, plain, sizeof(buf))) {
+			ast_verb(2, "IAX2 encryption using AES-NI\n");
+			return;
+		}
+	}
+
+	aesni_layout = AESNI_OFF;
+}
+#else
+static void iax2_aesni_init(void)
+{
+}
+#endif
+
+/*! \brief AES-128-CBC decrypt with a zero IV using ast_aes one block at a time */
+static void cbc_decrypt_blocks(unsigned char *dst, const unsigned char *src, int len, ast_aes_decrypt_key *dcx)
+{
 	unsigned char lastblock[16] = { 0 };
+	unsigned char curblock[16];
 	int x;
+
 	while(len > 0) {
-		ast_aes_decrypt(src, dst, dcx);
+		memcpy(curblock, src, sizeof(curblock));
+		ast_aes_decrypt(curblock, dst, dcx);
 		for (x=0;x<16;x++)
 			dst[x] ^= lastblock[x];
-		memcpy(lastblock, src, sizeof(lastblock));
+		memcpy(lastblock, curblock, sizeof(lastblock));
 		dst += 16;
 		src += 16;
 		len -= 16;
 	}
-#endif
 }
 
-static void memcpy_encrypt(unsigned char *dst, const unsigned char *src, int len, ast_aes_encrypt_key *ecx)
+/*! \brief AES-128-CBC encrypt with a zero IV using ast_aes one block at a time */
+static void cbc_encrypt_blocks(unsigned char *dst, const unsigned char *src, int len, ast_aes_encrypt_key *ecx)
 {
-#if 0
-	/* Debug with "fake encryption" */
-	int x;
-	if (len % 16)
-		ast_log(LOG_WARNING, "len should be multiple of 16, not %d!\n", len);
-	for (x=0;x<len;x++)
-		dst[x] = src[x] ^ 0xff;
-#else
 	unsigned char curblock[16] = { 0 };
 	int x;
+
 	while(len > 0) {
 		for (x=0;x<16;x++)
 			curblock[x] ^= src[x];
@@ -6313,31 +6508,82 @@ static void memcpy_encrypt(unsigned char *dst, const unsigned char *src, int len
 		src += 16;
 		len -= 16;
 	}
+}
+
+/*! \brief AES-128-CBC decrypt with a zero IV; dst may be the same as src */
+static void memcpy_decrypt(unsigned char *dst, const unsigned char *src, int len, ast_aes_decrypt_key *dcx)
+{
+#if 0
+	/* Debug with "fake encryption" */
+	int x;
+	if (len % 16)
+		ast_log(LOG_WARNING, "len should be multiple of 16, not %d!\n", len);
+	for (x=0;x<len;x++)
+		dst[x] = src[x] ^ 0xff;
+#else	
+#ifdef IAX2_AESNI
+	if (aesni_layout) {
+		aesni_cbc_decrypt(dst, src, len, dcx);
+		return;
+	}
 #endif
+	cbc_decrypt_blocks(dst, src, len, dcx);
+#endif
+}
+
+/*! \brief AES-128-CBC encrypt with a zero IV; dst may be the same as src */
+static void memcpy_encrypt(unsigned char *dst, const unsigned char *src, int len, ast_aes_encrypt_key *ecx)
+{
+#if 0
+	/* Debug with "fake encryption" */
+	int x;
+	if (len % 16)
+		ast_log(LOG_WARNING, "len should be multiple of 16, not %d!\n", len);
+	for (x=0;x<len;x++)
+		dst[x] = src[x] ^ 0xff;
+#else
+#ifdef IAX2_AESNI
+	if (aesni_layout) {
+		aesni_cbc_encrypt(dst, src, len, ecx);
+		return;
+	}
+#endif
+	cbc_encrypt_blocks(dst, src, len, ecx);
+#endif
+}
+
+/*! \brief Work out the padding of an encrypted frame from its first block, without touching the frame */
+static int decode_padding(const unsigned char *encdata, ast_aes_decrypt_key *dcx)
+{
+	unsigned char block[16];
+
+	memcpy_decrypt(block, encdata, sizeof(block), dcx);
+
+	return 16 + (block[15] & 0x0f);
 }
 
 static int decode_frame(ast_aes_decrypt_key *dcx, struct ast_iax2_full_hdr *fh, struct ast_frame *f, int *datalen)
 {
 	int padding;
-	unsigned char *workspace;
 
-	workspace = alloca(*datalen);
 	memset(f, 0, sizeof(*f));
 	if (ntohs(fh->scallno) & IAX_FLAG_FULL) {
 		struct ast_iax2_full_enc_hdr *efh = (struct ast_iax2_full_enc_hdr *)fh;
 		if (*datalen < 16 + sizeof(struct ast_iax2_full_hdr))
 			return -1;
-		/* Decrypt */
-		memcpy_decrypt(workspace, efh->encdata, *datalen - sizeof(struct ast_iax2_full_enc_hdr), dcx);
 
-		padding = 16 + (workspace[15] & 0x0f);
+		/* Check the padding first, so that a frame we can't decode is left
+		 * as it was for the next key to be tried on */
+		padding = decode_padding(efh->encdata, dcx);
 		if (iaxdebug)
-			ast_debug(1, "Decoding full frame with length %d (padding = %d) (15=%02x)\n", *datalen, padding, workspace[15]);
+			ast_debug(1, "Decoding full frame with length %d (padding = %d)\n", *datalen, padding);
 		if (*datalen < padding + sizeof(struct ast_iax2_full_hdr))
 			return -1;
 
+		/* Decrypt in place */
+		memcpy_decrypt(efh->encdata, efh->encdata, *datalen - sizeof(struct ast_iax2_full_enc_hdr), dcx);
 		*datalen -= padding;
-		memcpy(efh->encdata, workspace + padding, *datalen - sizeof(struct ast_iax2_full_enc_hdr));
+		memmove(efh->encdata, efh->encdata + padding, *datalen - sizeof(struct ast_iax2_full_enc_hdr));
 		f->frametype = fh->type;
 		if (f->frametype == AST_FRAME_VIDEO) {
 			ast_format_from_old_bitfield(&f->subclass.format, (uncompress_subclass(fh->csub & ~0x40) | ((fh->csub >> 6) & 0x1)));
@@ -6352,54 +6598,57 @@ static int decode_frame(ast_aes_decrypt_key *dcx, struct ast_iax2_full_hdr *fh,
 			ast_debug(1, "Decoding mini with length %d\n", *datalen);
 		if (*datalen < 16 + sizeof(struct ast_iax2_mini_hdr))
 			return -1;
-		/* Decrypt */
-		memcpy_decrypt(workspace, efh->encdata, *datalen - sizeof(struct ast_iax2_mini_enc_hdr), dcx);
-		padding = 16 + (workspace[15] & 0x0f);
+		padding = decode_padding(efh->encdata, dcx);
 		if (*datalen < padding + sizeof(struct ast_iax2_mini_hdr))
 			return -1;
+		/* Decrypt in place */
+		memcpy_decrypt(efh->encdata, efh->encdata, *datalen - sizeof(struct ast_iax2_mini_enc_hdr), dcx);
 		*datalen -= padding;
-		memcpy(efh->encdata, workspace + padding, *datalen - sizeof(struct ast_iax2_mini_enc_hdr));
+		memmove(efh->encdata, efh->encdata + padding, *datalen - sizeof(struct ast_iax2_mini_enc_hdr));
 	}
 	return 0;
 }
 
-static int encrypt_frame(ast_aes_encrypt_key *ecx, struct ast_iax2_full_hdr *fh, unsigned char *poo, int *datalen)
+/*! \brief Pad and encrypt the payload after an encrypted header in place
+ * \note The buffer must have room for up to 31 bytes of padding after the payload,
+ * as it always did.  The last 32 bytes of plaintext become the next padding.
+ * \return the number of bytes of padding added
+ */
+static int encrypt_payload(ast_aes_encrypt_key *ecx, unsigned char *encdata, int enclen, unsigned char *poo)
 {
+	unsigned char tail[32];
 	int padding;
-	unsigned char *workspace;
-	workspace = alloca(*datalen + 32);
-	if (!workspace)
-		return -1;
+
+	padding = 16 - (enclen % 16);
+	padding = 16 + (padding & 0xf);
+	memmove(encdata + padding, encdata, enclen);
+	memcpy(encdata, poo, padding);
+	encdata[15] &= 0xf0;
+	encdata[15] |= (padding & 0xf);
+	enclen += padding;
+	if (enclen >= 32) {
+		memcpy(tail, encdata + enclen - 32, 32);
+	}
+	memcpy_encrypt(encdata, encdata, enclen, ecx);
+	if (enclen >= 32) {
+		memcpy(poo, tail, 32);
+	}
+
+	return padding;
+}
+
+static int encrypt_frame(ast_aes_encrypt_key *ecx, struct ast_iax2_full_hdr *fh, unsigned char *poo, int *datalen)
+{
 	if (ntohs(fh->scallno) & IAX_FLAG_FULL) {
 		struct ast_iax2_full_enc_hdr *efh = (struct ast_iax2_full_enc_hdr *)fh;
 		if (iaxdebug)
 			ast_debug(1, "Encoding full frame %d/%d with length %d\n", fh->type, fh->csub, *datalen);
-		padding = 16 - ((*datalen - sizeof(struct ast_iax2_full_enc_hdr)) % 16);
-		padding = 16 + (padding & 0xf);
-		memcpy(workspace, poo, padding);
-		memcpy(workspace + padding, efh->encdata, *datalen - sizeof(struct ast_iax2_full_enc_hdr));
-		workspace[15] &= 0xf0;
-		workspace[15] |= (padding & 0xf);
-		if (iaxdebug)
-			ast_debug(1, "Encoding full frame %d/%d with length %d + %d padding (15=%02x)\n", fh->type, fh->csub, *datalen, padding, workspace[15]);
-		*datalen += padding;
-		memcpy_encrypt(efh->encdata, workspace, *datalen - sizeof(struct ast_iax2_full_enc_hdr), ecx);
-		if (*datalen >= 32 + sizeof(struct ast_iax2_full_enc_hdr))
-			memcpy(poo, workspace + *datalen - 32, 32);
+		*datalen += encrypt_payload(ecx, efh->encdata, *datalen - sizeof(struct ast_iax2_full_enc_hdr), poo);
 	} else {
 		struct ast_iax2_mini_enc_hdr *efh = (struct ast_iax2_mini_enc_hdr *)fh;
 		if (iaxdebug)
 			ast_debug(1, "Encoding mini frame with length %d\n", *datalen);
-		padding = 16 - ((*datalen - sizeof(struct ast_iax2_mini_enc_hdr)) % 16);
-		padding = 16 + (padding & 0xf);
-		memcpy(workspace, poo, padding);
-		memcpy(workspace + padding, efh->encdata, *datalen - sizeof(struct ast_iax2_mini_enc_hdr));
-		workspace[15] &= 0xf0;
-		workspace[15] |= (padding & 0x0f);
-		*datalen += padding;
-		memcpy_encrypt(efh->encdata, workspace, *datalen - sizeof(struct ast_iax2_mini_enc_hdr), ecx);
-		if (*datalen >= 32 + sizeof(struct ast_iax2_mini_enc_hdr))
-			memcpy(poo, workspace + *datalen - 32, 32);
+		*datalen += encrypt_payload(ecx, efh->encdata, *datalen - sizeof(struct ast_iax2_mini_enc_hdr), poo);
 	}
 	return 0;
 }
@@ -6860,7 +7109,7 @@ static char *handle_cli_iax2_show_threads(struct ast_cli_entry *e, int cmd, stru
 {
 	struct iax2_thread *thread = NULL;
 	time_t t;
-	int threadcount = 0, dynamiccount = 0;
+	int threadcount = 0, dynamiccount = 0, x;
 	char type;
 
 	switch (cmd) {
@@ -6922,6 +7171,18 @@ static char *handle_cli_iax2_show_threads(struct ast_cli_entry *e, int cmd, stru
 	}
 	AST_LIST_UNLOCK(&dynamic_list);
 	ast_cli(a->fd, "%d of %d threads accounted for with %d dynamic threads\n", threadcount, iaxthreadcount, dynamiccount);
+	AST_LIST_LOCK(&idle_list);
+	ast_cli(a->fd, "%d datagrams waiting for a thread, %u dropped\n", rx_backlog_len, rx_backlog_dropped);
+	AST_LIST_UNLOCK(&idle_list);
+	if (rx_worker_count) {
+		ast_cli(a->fd, "Receive Workers:\n");
+		for (x = 0; x < rx_worker_count; x++) {
+			ast_mutex_lock(&rx_workers[x].lock);
+			ast_cli(a->fd, "Worker %d: queued=%d, processed=%u, dropped=%u\n",
+				x + 1, rx_workers[x].queued, rx_workers[x].processed, rx_workers[x].dropped);
+			ast_mutex_unlock(&rx_workers[x].lock);
+		}
+	}
 	return CLI_SUCCESS;
 }
 
@@ -9181,7 +9442,93 @@ static int iax2_poke_peer_s(const void *data)
 	return 0;
 }
 
-static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now)
+#ifdef IAX2_MMSG
+/*! Most trunk frames timing_read() collects before sending them */
+#define IAX_TRUNK_SEND_BATCH 32
+
+/*! \brief Trunk frames collected by timing_read(), sent with sendmmsg() once
+ *  all trunk peers have been visited.  The frames are copied, since the trunk
+ *  peers keep queueing into their own buffers as soon as they are unlocked. */
+struct iax2_trunk_batch {
+	int count;
+	size_t used;
+	size_t size;
+	unsigned char *buf;
+	struct {
+		int sockfd;
+		struct sockaddr_in sin;
+		size_t offset;
+		size_t len;
+	} msgs[IAX_TRUNK_SEND_BATCH];
+};
+
+/*! Only timing_read() on the network thread uses this */
+static struct iax2_trunk_batch trunk_batch;
+
+/*! \brief Send everything collected in a trunk batch */
+static void trunk_batch_flush(struct iax2_trunk_batch *batch)
+{
+	struct mmsghdr msgs[IAX_TRUNK_SEND_BATCH];
+	struct iovec iov[IAX_TRUNK_SEND_BATCH];
+	int x = 0, n, res;
+
+	while (x < batch->count) {
+		/* sendmmsg() takes one socket, so send runs of frames that share one */
+		memset(msgs, 0, sizeof(msgs));
+		for (n = 0; x + n < batch->count && batch->msgs[x + n].sockfd == batch->msgs[x].sockfd; n++) {
+			iov[n].iov_base = batch->buf + batch->msgs[x + n].offset;
+			iov[n].iov_len = batch->msgs[x + n].len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			msgs[n].msg_hdr.msg_name = &batch->msgs[x + n].sin;
+			msgs[n].msg_hdr.msg_namelen = sizeof(batch->msgs[x + n].sin);
+		}
+		if ((res = sendmmsg(batch->msgs[x].sockfd, msgs, n, 0)) < 0) {
+			ast_debug(1, "Received error: %s\n", strerror(errno));
+			handle_error();
+			/* Drop the frame that failed and carry on with the rest */
+			res = 1;
+		}
+		x += res;
+	}
+	batch->count = 0;
+	batch->used = 0;
+}
+
+/*! \brief Add a trunk frame to a batch, sending it straight away if it can't be added */
+static int trunk_batch_add(struct iax2_trunk_batch *batch, struct iax_frame *f, struct sockaddr_in *sin, int sockfd)
+{
+	if (batch->count == IAX_TRUNK_SEND_BATCH) {
+		trunk_batch_flush(batch);
+	}
+
+	if (batch->used + f->datalen > batch->size) {
+		size_t size = MAX(batch->size * 2, batch->used + f->datalen);
+		unsigned char *buf;
+
+		if (!(buf = ast_realloc(batch->buf, size))) {
+			return transmit_trunk(f, sin, sockfd);
+		}
+		batch->buf = buf;
+		batch->size = size;
+	}
+
+	memcpy(batch->buf + batch->used, f->data, f->datalen);
+	batch->msgs[batch->count].sockfd = sockfd;
+	batch->msgs[batch->count].sin = *sin;
+	batch->msgs[batch->count].offset = batch->used;
+	batch->msgs[batch->count].len = f->datalen;
+	batch->used += f->datalen;
+	batch->count++;
+
+	return 0;
+}
+#endif /* IAX2_MMSG */
+
+/*! \brief Send the frame queued up for a trunk peer
+ * \param batch if not NULL, the frame is added to it instead of being sent right away
+ */
+static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now, struct iax2_trunk_batch *batch)
 {
 	int res = 0;
 	struct iax_frame *fr;
@@ -9210,7 +9557,12 @@ static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now)
 		/* Any appropriate call will do */
 		fr->data = fr->afdata;
 		fr->datalen = tpeer->trunkdatalen + sizeof(struct ast_iax2_meta_hdr) + sizeof(struct ast_iax2_meta_trunk_hdr);
-		res = transmit_trunk(fr, &tpeer->addr, tpeer->sockfd);
+#ifdef IAX2_MMSG
+		if (batch) {
+			res = trunk_batch_add(batch, fr, &tpeer->addr, tpeer->sockfd);
+		} else
+#endif
+			res = transmit_trunk(fr, &tpeer->addr, tpeer->sockfd);
 		calls = tpeer->calls;
 #if 0
 		ast_debug(1, "Trunking %d call chunks in %d bytes to %s:%d, ts=%d\n", calls, fr->datalen, ast_inet_ntoa(tpeer->addr.sin_addr), ntohs(tpeer->addr.sin_port), ntohl(mth->ts));
@@ -9259,7 +9611,11 @@ static int timing_read(int *id, int fd, short events, void *cbdata)
 			AST_LIST_REMOVE_CURRENT(list);
 			drop = tpeer;
 		} else {
-			res = send_trunk(tpeer, &now);
+#ifdef IAX2_MMSG
+			res = send_trunk(tpeer, &now, &trunk_batch);
+#else
+			res = send_trunk(tpeer, &now, NULL);
+#endif
 			trunk_timed++;
 			if (iaxtrunkdebug)
 				ast_verbose(" - Trunk peer (%s:%d) has %d call chunk%s in transit, %d bytes backloged and has hit a high water mark of %d bytes\n", ast_inet_ntoa(tpeer->addr.sin_addr), ntohs(tpeer->addr.sin_port), res, (res != 1) ? "s" : "", tpeer->trunkdatalen, tpeer->trunkdataalloc);
@@ -9271,6 +9627,10 @@ static int timing_read(int *id, int fd, short events, void *cbdata)
 	AST_LIST_TRAVERSE_SAFE_END;
 	AST_LIST_UNLOCK(&tpeers);
 
+#ifdef IAX2_MMSG
+	trunk_batch_flush(&trunk_batch);
+#endif
+
 	if (drop) {
 		ast_mutex_lock(&drop->lock);
 		/* Once we have this lock, we're sure nobody else is using it or could use it once we release it, 
@@ -9672,42 +10032,74 @@ static void defer_full_frame(struct iax2_thread *from_here, struct iax2_thread *
 	ast_mutex_unlock(&to_here->lock);
 }
 
-static int socket_read(int *id, int fd, short events, void *cbdata)
+/*! Most datagrams socket_read() takes off a socket per wakeup */
+#define IAX_READ_BATCH 32
+
+/*! Datagrams read by socket_read() before they are handed on.
+ *  Only the network thread reads from the sockets, so one set will do. */
+static unsigned char read_batch_buf[IAX_READ_BATCH][4096];
+static struct sockaddr_in read_batch_sin[IAX_READ_BATCH];
+static ssize_t read_batch_len[IAX_READ_BATCH];
+
+/*! \brief Read whatever is waiting on a socket, up to IAX_READ_BATCH datagrams
+ * \return number of datagrams read, or -1 with errno set if the first read failed
+ */
+static int socket_read_batch(int fd)
 {
-	struct iax2_thread *thread;
-	socklen_t len;
-	time_t t;
-	static time_t last_errtime = 0;
-	struct ast_iax2_full_hdr *fh;
+	int x;
+#ifdef IAX2_MMSG
+	struct mmsghdr msgs[IAX_READ_BATCH];
+	struct iovec iov[IAX_READ_BATCH];
+	int res;
 
-	if (!(thread = find_idle_thread())) {
-		time(&t);
-		if (t != last_errtime)
-			ast_debug(1, "Out of idle IAX2 threads for I/O, pausing!\n");
-		last_errtime = t;
-		usleep(1);
-		return 1;
+	memset(msgs, 0, sizeof(msgs));
+	for (x = 0; x < IAX_READ_BATCH; x++) {
+		iov[x].iov_base = read_batch_buf[x];
+		iov[x].iov_len = sizeof(read_batch_buf[x]);
+		msgs[x].msg_hdr.msg_iov = &iov[x];
+		msgs[x].msg_hdr.msg_iovlen = 1;
+		msgs[x].msg_hdr.msg_name = &read_batch_sin[x];
+		msgs[x].msg_hdr.msg_namelen = sizeof(read_batch_sin[x]);
 	}
 
-	len = sizeof(thread->iosin);
-	thread->iofd = fd;
-	thread->buf_len = recvfrom(fd, thread->readbuf, sizeof(thread->readbuf), 0, (struct sockaddr *) &thread->iosin, &len);
-	thread->buf_size = sizeof(thread->readbuf);
-	thread->buf = thread->readbuf;
-	if (thread->buf_len < 0) {
-		if (errno != ECONNREFUSED && errno != EAGAIN)
-			ast_log(LOG_WARNING, "Error: %s\n", strerror(errno));
-		handle_error();
-		thread->iostate = IAX_IOSTATE_IDLE;
-		signal_condition(&thread->lock, &thread->cond);
-		return 1;
+	if ((res = recvmmsg(fd, msgs, IAX_READ_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+		return -1;
 	}
+	for (x = 0; x < res; x++) {
+		read_batch_len[x] = msgs[x].msg_len;
+	}
+
+	return res;
+#else
+	socklen_t len;
+
+	for (x = 0; x < IAX_READ_BATCH; x++) {
+		len = sizeof(read_batch_sin[x]);
+		read_batch_len[x] = recvfrom(fd, read_batch_buf[x], sizeof(read_batch_buf[x]), MSG_DONTWAIT,
+			(struct sockaddr *) &read_batch_sin[x], &len);
+		if (read_batch_len[x] < 0) {
+			/* Anything after the first datagram will be seen again next time */
+			return x ? x : -1;
+		}
+	}
+
+	return x;
+#endif
+}
+
+/*! \brief Get a datagram, already in a thread's buffer, ready for that thread
+ * \retval 1 the thread is to process it
+ * \retval 0 it was dropped or queued to the thread already processing its call
+ */
+static int socket_dispatch(struct iax2_thread *thread)
+{
+	struct ast_iax2_full_hdr *fh;
+
 	if (test_losspct && ((100.0 * ast_random() / (RAND_MAX + 1.0)) < test_losspct)) { /* simulate random loss condition */
 		thread->iostate = IAX_IOSTATE_IDLE;
-		signal_condition(&thread->lock, &thread->cond);
-		return 1;
+		return 0;
 	}
-	
+
 	/* Determine if this frame is a full frame; if so, and any thread is currently
 	   processing a full frame for the same callno from this peer, then drop this
 	   frame (and the peer will retransmit it) */
@@ -9728,8 +10120,7 @@ static int socket_read(int *id, int fd, short events, void *cbdata)
 			defer_full_frame(thread, cur);
 			AST_LIST_UNLOCK(&active_list);
 			thread->iostate = IAX_IOSTATE_IDLE;
-			signal_condition(&thread->lock, &thread->cond);
-			return 1;
+			return 0;
 		} else {
 			/* this thread is going to process this frame, so mark it */
 			thread->ffinfo.callno = callno;
@@ -9746,11 +10137,217 @@ static int socket_read(int *id, int fd, short events, void *cbdata)
 #ifdef DEBUG_SCHED_MULTITHREAD
 	ast_copy_string(thread->curfunc, "socket_process", sizeof(thread->curfunc));
 #endif
+	return 1;
+}
+
+/*! \brief Copy a datagram into a thread's own buffer */
+static void socket_load(struct iax2_thread *thread, int fd, const struct sockaddr_in *sin,
+	const unsigned char *buf, size_t len)
+{
+	memcpy(thread->readbuf, buf, len);
+	memcpy(&thread->iosin, sin, sizeof(thread->iosin));
+	thread->iofd = fd;
+	thread->buf = thread->readbuf;
+	thread->buf_len = len;
+	thread->buf_size = sizeof(thread->readbuf);
+}
+
+static struct iax2_rx_pkt *rx_pkt_alloc(int fd, int x)
+{
+	struct iax2_rx_pkt *pkt;
+
+	if (!(pkt = ast_malloc(sizeof(*pkt) + read_batch_len[x]))) {
+		return NULL;
+	}
+	pkt->fd = fd;
+	pkt->sin = read_batch_sin[x];
+	pkt->len = read_batch_len[x];
+	memcpy(pkt->buf, read_batch_buf[x], pkt->len);
+
+	return pkt;
+}
+
+/*! \brief Keep a datagram for the next thread to finish
+ * \return a thread that went idle meanwhile, in which case pkt is not kept
+ */
+static struct iax2_thread *rx_backlog_add(struct iax2_rx_pkt *pkt)
+{
+	struct iax2_thread *thread;
+
+	AST_LIST_LOCK(&idle_list);
+	if (!(thread = AST_LIST_REMOVE_HEAD(&idle_list, list))) {
+		AST_LIST_LOCK(&dynamic_list);
+		thread = AST_LIST_REMOVE_HEAD(&dynamic_list, list);
+		AST_LIST_UNLOCK(&dynamic_list);
+	}
+	if (!thread) {
+		if (rx_backlog_len < IAX_RX_BACKLOG) {
+			AST_LIST_INSERT_TAIL(&rx_backlog, pkt, entry);
+			rx_backlog_len++;
+		} else {
+			rx_backlog_dropped++;
+			ast_free(pkt);
+		}
+	}
+	AST_LIST_UNLOCK(&idle_list);
+
+	if (thread) {
+		memset(&thread->ffinfo, 0, sizeof(thread->ffinfo));
+	}
+
+	return thread;
+}
+
+/*! \brief Hand datagram x of the read batch to a thread of the pool
+ *
+ * When every thread is busy and no more may be started, the datagram is
+ * kept in rx_backlog for the first thread to finish.  The network thread
+ * never waits here; it has trunk timing to do too.
+ */
+static void socket_hand_off(int fd, int x)
+{
+	struct iax2_thread *thread;
+	struct iax2_rx_pkt *pkt;
+	time_t t;
+	static time_t last_errtime = 0;
+
+	if (!(thread = find_idle_thread())) {
+		if (!(pkt = rx_pkt_alloc(fd, x))) {
+			return;
+		}
+		if (!(thread = rx_backlog_add(pkt))) {
+			time(&t);
+			if (t != last_errtime)
+				ast_debug(1, "Out of idle IAX2 threads for I/O, %d datagrams waiting for one\n", rx_backlog_len);
+			last_errtime = t;
+			return;
+		}
+		ast_free(pkt);
+	}
+
+	socket_load(thread, fd, &read_batch_sin[x], read_batch_buf[x], read_batch_len[x]);
+	socket_dispatch(thread);
+	/* Wake it either way, to process the datagram or to go back to idle */
 	signal_condition(&thread->lock, &thread->cond);
+}
+
+/*! \brief Queue datagram x of the read batch to the receive worker of its call
+ *
+ * Full and mini frames start with the source call number, video and meta
+ * frames with zeros and then the call number or the meta command, so every
+ * frame of a call from a given address goes to the same worker, which
+ * processes them in order.  Trunked media goes to the worker of its trunk.
+ */
+static void rx_worker_queue(int fd, int x)
+{
+	const unsigned char *buf = read_batch_buf[x];
+	struct iax2_rx_worker *worker;
+	struct iax2_rx_pkt *pkt;
+	unsigned int callno = 0, hash;
+	int wake;
+
+	if (test_losspct && ((100.0 * ast_random() / (RAND_MAX + 1.0)) < test_losspct)) { /* simulate random loss condition */
+		return;
+	}
+
+	if (read_batch_len[x] >= 4) {
+		if (!(callno = ((buf[0] << 8) | buf[1]) & ~IAX_FLAG_FULL)) {
+			callno = ((buf[2] << 8) | buf[3]) & ~0x8000;
+		}
+	}
+	hash = ntohl(read_batch_sin[x].sin_addr.s_addr) ^ ntohs(read_batch_sin[x].sin_port) ^ (callno * 2654435761U);
+	worker = &rx_workers[hash % rx_worker_count];
+
+	ast_mutex_lock(&worker->lock);
+	if (worker->queued >= IAX_RX_QUEUE_MAX) {
+		worker->dropped++;
+		ast_mutex_unlock(&worker->lock);
+		return;
+	}
+	ast_mutex_unlock(&worker->lock);
+
+	if (!(pkt = rx_pkt_alloc(fd, x))) {
+		return;
+	}
+
+	ast_mutex_lock(&worker->lock);
+	/* The worker only sleeps with an empty queue */
+	wake = AST_LIST_EMPTY(&worker->queue);
+	AST_LIST_INSERT_TAIL(&worker->queue, pkt, entry);
+	worker->queued++;
+	if (wake) {
+		ast_cond_signal(&worker->cond);
+	}
+	ast_mutex_unlock(&worker->lock);
+}
+
+/*! \brief Read what is waiting on a socket and hand it on
+ *
+ * A batch is read first, with a single recvmmsg() where available, and
+ * only then is a thread taken for each datagram actually read, or the
+ * datagram steered to the receive worker of its call.
+ */
+static int socket_read(int *id, int fd, short events, void *cbdata)
+{
+	int count, x;
+
+	if ((count = socket_read_batch(fd)) < 0) {
+		if (errno != ECONNREFUSED && errno != EAGAIN)
+			ast_log(LOG_WARNING, "Error: %s\n", strerror(errno));
+		handle_error();
+		return 1;
+	}
+
+	for (x = 0; x < count; x++) {
+		if (rx_worker_count) {
+			rx_worker_queue(fd, x);
+		} else {
+			socket_hand_off(fd, x);
+		}
+	}
 
 	return 1;
 }
 
+/*! \brief Receive worker thread, see rx_worker_queue() */
+static void *iax2_rx_worker_thread(void *data)
+{
+	struct iax2_rx_worker *worker = data;
+	AST_LIST_HEAD_NOLOCK(, iax2_rx_pkt) batch;
+	struct iax2_rx_pkt *pkt;
+
+	AST_LIST_HEAD_INIT_NOLOCK(&batch);
+
+	for (;;) {
+		ast_mutex_lock(&worker->lock);
+		while (AST_LIST_EMPTY(&worker->queue) && !worker->stop) {
+			ast_cond_wait(&worker->cond, &worker->lock);
+		}
+		if (worker->stop) {
+			ast_mutex_unlock(&worker->lock);
+			break;
+		}
+		/* Take everything queued, so the network thread can queue more meanwhile */
+		AST_LIST_APPEND_LIST(&batch, &worker->queue, entry);
+		worker->queued = 0;
+		ast_mutex_unlock(&worker->lock);
+
+		while ((pkt = AST_LIST_REMOVE_HEAD(&batch, entry))) {
+			worker->ctx.buf = pkt->buf;
+			worker->ctx.buf_len = pkt->len;
+			worker->ctx.buf_size = pkt->len + 1;
+			worker->ctx.iofd = pkt->fd;
+			memcpy(&worker->ctx.iosin, &pkt->sin, sizeof(worker->ctx.iosin));
+			socket_process(&worker->ctx);
+			worker->ctx.buf = NULL;
+			worker->processed++;
+			ast_free(pkt);
+		}
+	}
+
+	return NULL;
+}
+
 static int socket_process_meta(int packet_len, struct ast_iax2_meta_hdr *meta, struct sockaddr_in *sin, int sockfd,
 	struct iax_frame *fr)
 {
@@ -11732,6 +12329,7 @@ static void iax2_process_thread_cleanup(void *data)
 static void *iax2_process_thread(void *data)
 {
 	struct iax2_thread *thread = data;
+	struct iax2_rx_pkt *pkt;
 	struct timeval wait;
 	struct timespec ts;
 	int put_into_idle = 0;
@@ -11758,9 +12356,16 @@ static void *iax2_process_thread(void *data)
 			first_time = 0;
 		}
 
-		/* Put into idle list if applicable */
-		if (put_into_idle) {
-			insert_idle_thread(thread);
+		/* Put into idle list if applicable, unless a datagram is waiting for a thread */
+		if (put_into_idle && (pkt = insert_idle_thread(thread))) {
+			ast_mutex_unlock(&thread->lock);
+			memset(&thread->ffinfo, 0, sizeof(thread->ffinfo));
+			socket_load(thread, pkt->fd, &pkt->sin, pkt->buf, pkt->len);
+			ast_free(pkt);
+			if (!socket_dispatch(thread)) {
+				continue;
+			}
+			goto process;
 		}
 
 		if (thread->type == IAX_THREAD_TYPE_DYNAMIC) {
@@ -11808,6 +12413,7 @@ static void *iax2_process_thread(void *data)
 
 		ast_mutex_unlock(&thread->lock);
 
+process:
 		if (thread->stop) {
 			break;
 		}
@@ -12283,6 +12889,7 @@ static int start_network_thread(void)
 	struct iax2_thread *thread;
 	int threadcount = 0;
 	int x;
+
 	for (x = 0; x < iaxthreadcount; x++) {
 		thread = ast_calloc(1, sizeof(*thread));
 		if (thread) {
@@ -12307,11 +12914,57 @@ static int start_network_thread(void)
 			AST_LIST_UNLOCK(&idle_list);
 		}
 	}
+	if (iaxrxworkers && (rx_workers = ast_calloc(iaxrxworkers, sizeof(*rx_workers)))) {
+		for (x = 0; x < iaxrxworkers; x++) {
+			ast_mutex_init(&rx_workers[x].lock);
+			ast_cond_init(&rx_workers[x].cond, NULL);
+			if (ast_pthread_create_background(&rx_workers[x].threadid, NULL, iax2_rx_worker_thread, &rx_workers[x])) {
+				ast_log(LOG_WARNING, "Failed to create receive worker, starting %d\n", x);
+				ast_mutex_destroy(&rx_workers[x].lock);
+				ast_cond_destroy(&rx_workers[x].cond);
+				break;
+			}
+		}
+		/* Workers are picked by hash, so only ever the ones that did start */
+		rx_worker_count = x;
+		ast_verb(2, "%d receive workers started\n", rx_worker_count);
+	}
 	ast_pthread_create_background(&netthreadid, NULL, network_thread, NULL);
 	ast_verb(2, "%d helper threads started\n", threadcount);
 	return 0;
 }
 
+/*! \brief Stop the receive workers and drop what the thread pool never got to,
+ *  once the network thread is gone */
+static void stop_rx_workers(void)
+{
+	struct iax2_rx_pkt *pkt;
+	int x;
+
+	for (x = 0; x < rx_worker_count; x++) {
+		ast_mutex_lock(&rx_workers[x].lock);
+		rx_workers[x].stop = 1;
+		ast_cond_signal(&rx_workers[x].cond);
+		ast_mutex_unlock(&rx_workers[x].lock);
+		pthread_join(rx_workers[x].threadid, NULL);
+		while ((pkt = AST_LIST_REMOVE_HEAD(&rx_workers[x].queue, entry))) {
+			ast_free(pkt);
+		}
+		ast_mutex_destroy(&rx_workers[x].lock);
+		ast_cond_destroy(&rx_workers[x].cond);
+	}
+	rx_worker_count = 0;
+	ast_free(rx_workers);
+	rx_workers = NULL;
+
+	AST_LIST_LOCK(&idle_list);
+	while ((pkt = AST_LIST_REMOVE_HEAD(&rx_backlog, entry))) {
+		ast_free(pkt);
+	}
+	rx_backlog_len = 0;
+	AST_LIST_UNLOCK(&idle_list);
+}
+
 static struct iax2_context *build_context(const char *context)
 {
 	struct iax2_context *con;
@@ -13218,6 +13871,20 @@ static int set_config(const char *config_file, int reload)
 					iaxthreadcount = 256;
 				}
 			}
+		} else if (!strcasecmp(v->name, "iaxrxworkers")) {
+			if (reload) {
+				if (atoi(v->value) != iaxrxworkers)
+					ast_log(LOG_NOTICE, "Ignoring any changes to iaxrxworkers during reload\n");
+			} else {
+				iaxrxworkers = atoi(v->value);
+				if (iaxrxworkers < 0) {
+					ast_log(LOG_NOTICE, "iaxrxworkers must be at least 0.\n");
+					iaxrxworkers = 0;
+				} else if (iaxrxworkers > 64) {
+					ast_log(LOG_NOTICE, "Limiting iaxrxworkers to 64\n");
+					iaxrxworkers = 64;
+				}
+			}
 		} else if (!strcasecmp(v->name, "iaxmaxthreadcount")) {
 			if (reload) {
 				AST_LIST_LOCK(&dynamic_list);
@@ -14374,6 +15041,150 @@ AST_TEST_DEFINE(test_iax2_users_get)
 
 	return AST_TEST_PASS;
 }
+
+/*! \brief Fill a buffer and an AES key pair for the encryption tests */
+static void test_iax2_crypto_setup(unsigned char *buf, int len, ast_aes_encrypt_key *ecx, ast_aes_decrypt_key *dcx)
+{
+	unsigned char key[16];
+	int x;
+
+	for (x = 0; x < sizeof(key); x++) {
+		key[x] = ast_random() & 0xff;
+	}
+	for (x = 0; x < len; x++) {
+		buf[x] = ast_random() & 0xff;
+	}
+	ast_aes_set_encrypt_key(key, ecx);
+	ast_aes_set_decrypt_key(key, dcx);
+}
+
+AST_TEST_DEFINE(test_iax2_aesni_cbc)
+{
+	unsigned char plain[1024], ref[1024], out[1024];
+	ast_aes_encrypt_key ecx;
+	ast_aes_decrypt_key dcx;
+	int len, key;
+
+	switch (cmd) {
+		case TEST_INIT:
+			info->name = "iax2_aesni_cbc_test";
+			info->category = "/channels/chan_iax2/";
+			info->summary = "IAX2 AES-NI encryption unit test";
+			info->description =
+				"Tests that encrypting and decrypting frames with AES-NI gives the same\n"
+				"bytes as ast_aes one block at a time, both ways and in place, and that\n"
+				"the frames survive the round trip.";
+			return AST_TEST_NOT_RUN;
+		case TEST_EXECUTE:
+			break;
+	}
+
+#ifdef IAX2_AESNI
+	if (!aesni_layout) {
+		ast_test_status_update(test, "AES-NI is not in use, only testing the round trip\n");
+	}
+#else
+	ast_test_status_update(test, "Built without AES-NI, only testing the round trip\n");
+#endif
+
+	for (key = 0; key < 8; key++) {
+		test_iax2_crypto_setup(plain, sizeof(plain), &ecx, &dcx);
+		for (len = 16; len <= sizeof(plain); len += 16) {
+			cbc_encrypt_blocks(ref, plain, len, &ecx);
+			memcpy_encrypt(out, plain, len, &ecx);
+			if (memcmp(out, ref, len)) {
+				ast_test_status_update(test, "Encrypting %d bytes gave the wrong ciphertext\n", len);
+				return AST_TEST_FAIL;
+			}
+			memcpy(out, plain, len);
+			memcpy_encrypt(out, out, len, &ecx);
+			if (memcmp(out, ref, len)) {
+				ast_test_status_update(test, "Encrypting %d bytes in place gave the wrong ciphertext\n", len);
+				return AST_TEST_FAIL;
+			}
+
+			memcpy_decrypt(out, ref, len, &dcx);
+			if (memcmp(out, plain, len)) {
+				ast_test_status_update(test, "Decrypting %d bytes did not give the plaintext back\n", len);
+				return AST_TEST_FAIL;
+			}
+			memcpy(out, ref, len);
+			memcpy_decrypt(out, out, len, &dcx);
+			if (memcmp(out, plain, len)) {
+				ast_test_status_update(test, "Decrypting %d bytes in place did not give the plaintext back\n", len);
+				return AST_TEST_FAIL;
+			}
+			cbc_decrypt_blocks(out, ref, len, &dcx);
+			if (memcmp(out, plain, len)) {
+				ast_test_status_update(test, "Decrypting %d bytes a block at a time did not give the plaintext back\n", len);
+				return AST_TEST_FAIL;
+			}
+		}
+	}
+
+	return AST_TEST_PASS;
+}
+
+AST_TEST_DEFINE(test_iax2_aesni_throughput)
+{
+	/* Encrypted full frames: G.729 and GSM, 20 ms of ulaw, 40 ms of slin */
+	static const int sizes[] = { 48, 64, 176, 656 };
+	unsigned char buf[656];
+	ast_aes_encrypt_key ecx;
+	ast_aes_decrypt_key dcx;
+	struct timeval start;
+	int64_t blocks_ms, fast_ms;
+	int x, i, frames;
+
+	switch (cmd) {
+		case TEST_INIT:
+			info->name = "iax2_aesni_throughput_test";
+			info->category = "/channels/chan_iax2/";
+			info->summary = "IAX2 encryption throughput at voice frame sizes";
+			info->description =
+				"Encrypts and decrypts frames of voice sizes with ast_aes one block at a\n"
+				"time and with the encryption calls actually use (AES-NI where available)\n"
+				"and reports the frames per second of each.  Fails only if the frames do\n"
+				"not survive the round trip.";
+			return AST_TEST_NOT_RUN;
+		case TEST_EXECUTE:
+			break;
+	}
+
+	test_iax2_crypto_setup(buf, sizeof(buf), &ecx, &dcx);
+
+	for (i = 0; i < ARRAY_LEN(sizes); i++) {
+		unsigned char plain[sizeof(buf)];
+
+		/* About 16 MB each way, whatever the frame size */
+		frames = (16 * 1024 * 1024) / sizes[i];
+		memcpy(plain, buf, sizes[i]);
+
+		start = ast_tvnow();
+		for (x = 0; x < frames; x++) {
+			cbc_encrypt_blocks(buf, buf, sizes[i], &ecx);
+			cbc_decrypt_blocks(buf, buf, sizes[i], &dcx);
+		}
+		blocks_ms = ast_tvdiff_ms(ast_tvnow(), start);
+
+		start = ast_tvnow();
+		for (x = 0; x < frames; x++) {
+			memcpy_encrypt(buf, buf, sizes[i], &ecx);
+			memcpy_decrypt(buf, buf, sizes[i], &dcx);
+		}
+		fast_ms = ast_tvdiff_ms(ast_tvnow(), start);
+
+		if (memcmp(buf, plain, sizes[i])) {
+			ast_test_status_update(test, "%d byte frames did not survive %d round trips\n", sizes[i], frames * 2);
+			return AST_TEST_FAIL;
+		}
+
+		ast_test_status_update(test, "%4d byte frames: %lld frames/s a block at a time, %lld frames/s in use\n",
+			sizes[i], (long long) frames * 2000 / MAX(blocks_ms, 1), (long long) frames * 2000 / MAX(fast_ms, 1));
+	}
+
+	return AST_TEST_PASS;
+}
 #endif
 
 static void cleanup_thread_list(void *head)
@@ -14424,6 +15235,8 @@ static int __unload_module(void)
 		}
 	}
 
+	stop_rx_workers();
+
 	/* Call for all threads to halt */
 	cleanup_thread_list(&idle_list);
 	cleanup_thread_list(&active_list);
@@ -14444,6 +15257,8 @@ static int __unload_module(void)
 #ifdef TEST_FRAMEWORK
 	AST_TEST_UNREGISTER(test_iax2_peers_get);
 	AST_TEST_UNREGISTER(test_iax2_users_get);
+	AST_TEST_UNREGISTER(test_iax2_aesni_cbc);
+	AST_TEST_UNREGISTER(test_iax2_aesni_throughput);
 #endif
 	ast_data_unregister(NULL);
 	ast_cli_unregister_multiple(cli_iax2, ARRAY_LEN(cli_iax2));
@@ -14535,24 +15350,55 @@ static int transfercallno_pvt_cmp_cb(void *obj, void *arg, int flags)
 		pvt2->frames_received) ? CMP_MATCH | CMP_STOP : 0;
 }
 
+/*! \brief Read peerbuckets from iax.conf, rounded up to a prime */
+static void load_peer_buckets(void)
+{
+	struct ast_flags config_flags = { 0 };
+	struct ast_config *cfg;
+	const char *value;
+	int size;
+
+	peer_buckets = MAX_PEER_BUCKETS;
+
+	cfg = ast_config_load("iax.conf", config_flags);
+	if (cfg == CONFIG_STATUS_FILEMISSING || cfg == CONFIG_STATUS_FILEINVALID) {
+		return;
+	}
+
+	if ((value = ast_variable_retrieve(cfg, "general", "peerbuckets"))) {
+		if (sscanf(value, "%30d", &size) != 1 || size < 1) {
+			ast_log(LOG_WARNING, "Invalid peerbuckets '%s' in iax.conf, using %d\n", value, peer_buckets);
+		} else {
+			while (!ast_is_prime(size)) {
+				size++;
+			}
+			peer_buckets = size;
+		}
+	}
+
+	ast_config_destroy(cfg);
+}
+
 static int load_objects(void)
 {
 	peers = users = iax_peercallno_pvts = iax_transfercallno_pvts = NULL;
 	peercnts = callno_limits = calltoken_ignores = callno_pool = callno_pool_trunk = NULL;
 
-	if (!(peers = ao2_container_alloc(MAX_PEER_BUCKETS, peer_hash_cb, peer_cmp_cb))) {
+	load_peer_buckets();
+
+	if (!(peers = ao2_container_alloc(peer_buckets, peer_hash_cb, peer_cmp_cb))) {
 		goto container_fail;
-	} else if (!(users = ao2_container_alloc(MAX_USER_BUCKETS, user_hash_cb, user_cmp_cb))) {
+	} else if (!(users = ao2_container_alloc(peer_buckets, user_hash_cb, user_cmp_cb))) {
 		goto container_fail;
 	} else if (!(iax_peercallno_pvts = ao2_container_alloc(IAX_MAX_CALLS, pvt_hash_cb, pvt_cmp_cb))) {
 		goto container_fail;
 	} else if (!(iax_transfercallno_pvts = ao2_container_alloc(IAX_MAX_CALLS, transfercallno_pvt_hash_cb, transfercallno_pvt_cmp_cb))) {
 		goto container_fail;
-	} else if (!(peercnts = ao2_container_alloc(MAX_PEER_BUCKETS, peercnt_hash_cb, peercnt_cmp_cb))) {
+	} else if (!(peercnts = ao2_container_alloc(peer_buckets, peercnt_hash_cb, peercnt_cmp_cb))) {
 		goto container_fail;
-	} else if (!(callno_limits = ao2_container_alloc(MAX_PEER_BUCKETS, addr_range_hash_cb, addr_range_cmp_cb))) {
+	} else if (!(callno_limits = ao2_container_alloc(peer_buckets, addr_range_hash_cb, addr_range_cmp_cb))) {
 		goto container_fail;
-	} else if (!(calltoken_ignores = ao2_container_alloc(MAX_PEER_BUCKETS, addr_range_hash_cb, addr_range_cmp_cb))) {
+	} else if (!(calltoken_ignores = ao2_container_alloc(peer_buckets, addr_range_hash_cb, addr_range_cmp_cb))) {
 		goto container_fail;
 	} else if (create_callno_pools()) {
 		goto container_fail;
@@ -14788,6 +15634,8 @@ static int load_module(void)
 		return AST_MODULE_LOAD_FAILURE;
 	}
 
+	iax2_aesni_init();
+
 	memset(iaxs, 0, sizeof(iaxs));
 
 	for (x = 0; x < ARRAY_LEN(iaxsl); x++) {
@@ -14851,6 +15699,8 @@ static int load_module(void)
 #ifdef TEST_FRAMEWORK
 	AST_TEST_REGISTER(test_iax2_peers_get);
 	AST_TEST_REGISTER(test_iax2_users_get);
+	AST_TEST_REGISTER(test_iax2_aesni_cbc);
+	AST_TEST_REGISTER(test_iax2_aesni_throughput);
 #endif
 
 	/* Register AstData providers */
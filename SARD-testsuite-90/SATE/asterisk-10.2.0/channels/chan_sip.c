@@ -258,6 +258,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 357265 $")
 #include "asterisk/localtime.h"
 #include "asterisk/abstract_jb.h"
 #include "asterisk/threadstorage.h"
+#include "asterisk/taskprocessor.h"
+#include "asterisk/hashtab.h"
 #include "asterisk/translate.h"
 #include "asterisk/ast_version.h"
 #include "asterisk/event.h"
@@ -736,6 +738,7 @@ static char global_sdpowner[AST_MAX_EXTENSION];     /*!< SDP owner name for the
 static int global_authfailureevents;     /*!< Whether we send authentication failure manager events or not. Default no. */
 static int global_t1;           /*!< T1 time */
 static int global_t1min;        /*!< T1 roundtrip time minimum */
+static int global_udpthreads;   /*!< Configured number of UDP receive workers */
 static int global_timer_b;      /*!< Timer B - RFC 3261 Section 17.1.1.2 */
 static unsigned int global_autoframing; /*!< Turn autoframing on or off. */
 static int global_qualifyfreq;          /*!< Qualify frequency */
@@ -785,6 +788,11 @@ AST_MUTEX_DEFINE_STATIC(monlock);
 
 AST_MUTEX_DEFINE_STATIC(sip_reload_lock);
 
+/*! \brief Held for reading while a SIP message is handled, and for writing while
+ * reload_config() replaces the settings and the UDP socket, so the UDP workers
+ * and TCP/TLS threads never see a half reloaded configuration. */
+AST_RWLOCK_DEFINE_STATIC(sip_config_lock);
+
 /*! \brief This is the thread for the monitor which checks for input on the channels
    which are not currently in use.  */
 static pthread_t monitor_thread = AST_PTHREADT_NULL;
@@ -795,6 +803,16 @@ static enum channelreloadreason sip_reloadreason;       /*!< Reason for last rel
 struct ast_sched_context *sched;     /*!< The scheduling context */
 static struct io_context *io;           /*!< The IO context */
 static int *sipsock_read_id;            /*!< ID of IO entry for sipsock FD */
+static struct ast_taskprocessor **sip_udp_workers; /*!< Running UDP receive workers, see sipsock_read() */
+static int sip_udp_worker_count;       /*!< Number of entries in sip_udp_workers */
+
+/*! \brief Upper bounds, in ms, of the scheduler latency histogram buckets */
+static const int sched_latency_bounds[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+/*! \brief How late the monitor thread got around to running due scheduler entries.
+ * The last bucket counts everything at or above the last bound.  Only written
+ * by the monitor thread. */
+static unsigned int sched_latency_hist[ARRAY_LEN(sched_latency_bounds) + 1];
+
 struct sip_pkt;
 static AST_LIST_HEAD_STATIC(domain_list, domain);    /*!< The SIP domain list */
 
@@ -830,6 +848,13 @@ static const int HASH_PEER_SIZE = 563;	/*!< Size of peer hash table, prime numbe
 static const int HASH_DIALOG_SIZE = 563;
 #endif
 
+/*! \brief Bucket counts the peer and dialog containers were created with.
+ * \note ao2 containers can't be resized, so these come from peerbuckets and
+ * dialogbuckets in sip.conf once, at load time.
+ */
+static int hash_peer_size;
+static int hash_dialog_size;
+
 static const struct {
 	enum ast_cc_service_type service;
 	const char *service_string;
@@ -7400,9 +7425,225 @@ static const char *find_full_alias(const char *name, const char *_default)
 	return _default;
 }
 
+/*!
+ * \brief Per-thread index of the headers of recently parsed requests
+ *
+ * parse_request() hashes every header name once, with compact forms
+ * folded to their long form, so that __get_header() only needs to look
+ * at the headers that can possibly match instead of comparing the name
+ * against every header twice (long form, then compact form).
+ *
+ * The index can't live in struct sip_request without growing every copy
+ * of it, so it is kept here and matched back to the request it was built
+ * for.  Anything that changes the request afterwards (add_header(),
+ * copy_request() into another request, deinit_req()) makes the match
+ * fail, and __get_header() falls back to scanning the headers.
+ */
+#define SIP_HEADER_INDEX_BUCKETS	64	/*!< must be a power of two */
+#define SIP_HEADER_INDEX_SLOTS		4	/*!< requests indexed per thread */
+#define SIP_HEADER_INDEX_MAX_NAME	255	/*!< longer names are not indexed */
+
+struct sip_header_index {
+	const struct sip_request *req;	/*!< request this was built for, NULL if unused */
+	const char *buf;		/*!< req->data buffer when built */
+	size_t len;			/*!< req->data length when built */
+	int headers;			/*!< req->headers when built */
+	ptrdiff_t offsets[SIP_MAX_HEADERS];	/*!< req->header[] when built */
+	signed char bucket[SIP_HEADER_INDEX_BUCKETS];	/*!< first header in each bucket, -1 if none */
+	signed char next[SIP_MAX_HEADERS];	/*!< next header in the same bucket, in message order */
+	unsigned int hash[SIP_MAX_HEADERS];	/*!< hash of the long form of each header name */
+	unsigned char namelen[SIP_MAX_HEADERS];	/*!< length of each header name as sent */
+	unsigned short colon[SIP_MAX_HEADERS];	/*!< offset of the ':' in each header */
+};
+
+struct sip_header_index_cache {
+	unsigned int next_slot;
+	struct sip_header_index slot[SIP_HEADER_INDEX_SLOTS];
+};
+
+AST_THREADSTORAGE(sip_header_index_buf);
+
+/*! \brief Case insensitive hash of a header name */
+static unsigned int sip_header_hash(const char *name, size_t len)
+{
+	unsigned int hash = 0;
+
+	while (len--) {
+		hash = hash * 31 + tolower((unsigned char) *name++);
+	}
+
+	return hash;
+}
+
+/*! \brief Find the long form of a one letter header name, the name itself if it has none */
+static const char *sip_header_long_form(const char *name, size_t *len)
+{
+	int x;
+
+	if (*len == 1) {
+		for (x = 0; x < ARRAY_LEN(aliases); x++) {
+			if (tolower((unsigned char) aliases[x].shortname[0]) == tolower((unsigned char) *name)) {
+				*len = strlen(aliases[x].fullname);
+				return aliases[x].fullname;
+			}
+		}
+	}
+
+	return name;
+}
+
+/*! \brief Index the headers of a request that has just been through parse_request() */
+static void sip_header_index_build(const struct sip_request *req)
+{
+	struct sip_header_index_cache *cache;
+	struct sip_header_index *idx = NULL;
+	signed char tail[SIP_HEADER_INDEX_BUCKETS];
+	int x;
+
+	if (!req->data || !(cache = ast_threadstorage_get(&sip_header_index_buf, sizeof(*cache)))) {
+		return;
+	}
+
+	for (x = 0; x < SIP_HEADER_INDEX_SLOTS; x++) {
+		if (cache->slot[x].req == req) {
+			idx = &cache->slot[x];
+			break;
+		}
+	}
+	if (!idx) {
+		idx = &cache->slot[cache->next_slot++ % SIP_HEADER_INDEX_SLOTS];
+	}
+
+	memset(idx->bucket, -1, sizeof(idx->bucket));
+	memset(tail, -1, sizeof(tail));
+
+	for (x = 0; x < req->headers; x++) {
+		const char *header = REQ_OFFSET_TO_STR(req, header[x]);
+		const char *end = header, *name;
+		size_t len;
+		unsigned int b;
+
+		idx->next[x] = -1;
+
+		while (*end && *end != ':' && *end != ' ' && *end != '\t') {
+			end++;
+		}
+		len = end - header;
+		end = ast_skip_blanks(end);
+		if (*end != ':' || !len || len > SIP_HEADER_INDEX_MAX_NAME || end - header > USHRT_MAX) {
+			/* Not a header line we could ever return */
+			continue;
+		}
+
+		idx->namelen[x] = len;
+		idx->colon[x] = end - header;
+
+		name = sip_header_long_form(header, &len);
+		idx->hash[x] = sip_header_hash(name, len);
+
+		b = idx->hash[x] & (SIP_HEADER_INDEX_BUCKETS - 1);
+		if (tail[b] < 0) {
+			idx->bucket[b] = x;
+		} else {
+			idx->next[(int) tail[b]] = x;
+		}
+		tail[b] = x;
+	}
+
+	idx->req = req;
+	idx->buf = ast_str_buffer(req->data);
+	idx->len = ast_str_strlen(req->data);
+	idx->headers = req->headers;
+	memcpy(idx->offsets, req->header, req->headers * sizeof(req->header[0]));
+}
+
+/*! \brief Find the header index built for this request, if it is still valid */
+static const struct sip_header_index *sip_header_index_get(const struct sip_request *req)
+{
+	struct sip_header_index_cache *cache;
+	int x;
+
+	if (!req->data || !(cache = ast_threadstorage_get(&sip_header_index_buf, sizeof(*cache)))) {
+		return NULL;
+	}
+
+	for (x = 0; x < SIP_HEADER_INDEX_SLOTS; x++) {
+		const struct sip_header_index *idx = &cache->slot[x];
+
+		if (idx->req == req
+			&& idx->headers == req->headers
+			&& idx->buf == ast_str_buffer(req->data)
+			&& idx->len == ast_str_strlen(req->data)
+			&& !memcmp(idx->offsets, req->header, req->headers * sizeof(req->header[0]))) {
+			return idx;
+		}
+	}
+
+	return NULL;
+}
+
+/*! \brief Drop this thread's index of a request that is going away */
+static void sip_header_index_forget(const struct sip_request *req)
+{
+	struct sip_header_index_cache *cache;
+	int x;
+
+	if (!(cache = ast_threadstorage_get(&sip_header_index_buf, sizeof(*cache)))) {
+		return;
+	}
+
+	for (x = 0; x < SIP_HEADER_INDEX_SLOTS; x++) {
+		if (cache->slot[x].req == req) {
+			cache->slot[x].req = NULL;
+		}
+	}
+}
+
+/*! \brief Look up a header through the index, long and compact forms alike, in message order */
+static const char *sip_header_index_find(const struct sip_header_index *idx, const struct sip_request *req,
+	const char *name, size_t len, int *start)
+{
+	const char *compact;
+	size_t compactlen;
+	unsigned int hash;
+	int x;
+
+	name = sip_header_long_form(name, &len);
+	compact = find_alias(name, NULL);
+	compactlen = compact ? strlen(compact) : 0;
+	hash = sip_header_hash(name, len);
+
+	for (x = idx->bucket[hash & (SIP_HEADER_INDEX_BUCKETS - 1)]; x >= 0; x = idx->next[x]) {
+		const char *header;
+
+		if (x < *start || idx->hash[x] != hash) {
+			continue;
+		}
+		if (!sip_cfg.pedanticsipchecking && idx->colon[x] != idx->namelen[x]) {
+			/* Whitespace before the ':' */
+			continue;
+		}
+
+		header = REQ_OFFSET_TO_STR(req, header[x]);
+		if ((idx->namelen[x] == len && !strncasecmp(header, name, len))
+			|| (idx->namelen[x] == compactlen && !strncasecmp(header, compact, compactlen))) {
+			*start = x + 1;
+			return ast_skip_blanks(header + idx->colon[x] + 1);
+		}
+	}
+
+	return "";
+}
+
 static const char *__get_header(const struct sip_request *req, const char *name, int *start)
 {
 	int pass;
+	const struct sip_header_index *idx;
+	size_t len;
+
+	if (name && (len = strlen(name)) <= SIP_HEADER_INDEX_MAX_NAME && (idx = sip_header_index_get(req))) {
+		return sip_header_index_find(idx, req, name, len, start);
+	}
 
 	/*
 	 * Technically you can place arbitrary whitespace both before and after the ':' in
@@ -8729,6 +8970,8 @@ static int parse_request(struct sip_request *req)
 		ast_log(LOG_WARNING, "Too many lines, skipping <%s>\n", c);
 	}
 
+	sip_header_index_build(req);
+
 	/* Split up the first line parts */
 	return determine_firstline_parts(req);
 }
@@ -10379,6 +10622,7 @@ e_return:
 /*! \brief Deinitialize SIP response/request */
 static void deinit_req(struct sip_request *req)
 {
+	sip_header_index_forget(req);
 	if (req->data) {
 		ast_free(req->data);
 		req->data = NULL;
@@ -18336,6 +18580,7 @@ static char *sip_show_user(struct ast_cli_entry *e, int cmd, struct ast_cli_args
 static char *sip_show_sched(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	struct ast_str *cbuf;
+	int x;
 	struct ast_cb_names cbnames = {9, { "retrans_pkt",
                                         "__sip_autodestruct",
                                         "expire_register",
@@ -18360,7 +18605,8 @@ static char *sip_show_sched(struct ast_cli_entry *e, int cmd, struct ast_cli_arg
 		e->command = "sip show sched";
 		e->usage =
 			"Usage: sip show sched\n"
-			"       Shows stats on what's in the sched queue at the moment\n";
+			"       Shows stats on what's in the sched queue at the moment, and\n"
+			"       a histogram of how late the monitor thread ran due entries\n";
 		return NULL;
 	case CLI_GENERATE:
 		return NULL;
@@ -18372,6 +18618,15 @@ static char *sip_show_sched(struct ast_cli_entry *e, int cmd, struct ast_cli_arg
 	ast_sched_report(sched, &cbuf, &cbnames);
 	ast_cli(a->fd, "%s", cbuf->str);
 
+	ast_cli(a->fd, "\nScheduler latency (how late due entries were run):\n");
+	for (x = 0; x < ARRAY_LEN(sched_latency_hist); x++) {
+		if (x < ARRAY_LEN(sched_latency_bounds)) {
+			ast_cli(a->fd, "  < %4d ms: %u\n", sched_latency_bounds[x], sched_latency_hist[x]);
+		} else {
+			ast_cli(a->fd, "  >= %3d ms: %u\n", sched_latency_bounds[x - 1], sched_latency_hist[x]);
+		}
+	}
+
 	return CLI_SUCCESS;
 }
 
@@ -18751,6 +19006,9 @@ static char *sip_show_settings(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	ast_cli(a->fd, "  Session Min-SE:         %d secs\n", global_min_se);
  	ast_cli(a->fd, "  Timer T1:               %d\n", global_t1);
 	ast_cli(a->fd, "  Timer T1 minimum:       %d\n", global_t1min);
+	ast_cli(a->fd, "  UDP worker threads:     %d\n", sip_udp_worker_count);
+	ast_cli(a->fd, "  Peer buckets:           %d\n", hash_peer_size);
+	ast_cli(a->fd, "  Dialog buckets:         %d\n", hash_dialog_size);
  	ast_cli(a->fd, "  Timer B:                %d\n", global_timer_b);
 	ast_cli(a->fd, "  No premature media:     %s\n", AST_CLI_YESNO(global_prematuremediafilter));
 	ast_cli(a->fd, "  Max forwards:           %d\n", sip_cfg.default_max_forwards);
@@ -26054,21 +26312,190 @@ static int handle_incoming(struct sip_pvt *p, struct sip_request *req, struct as
 	return res;
 }
 
-/*! \brief Read data from SIP UDP socket
-\note sipsock_read locks the owner channel while we are processing the SIP message
-\return 1 on error, 0 on success
-\note Successful messages is connected to SIP call and forwarded to handle_incoming()
-*/
-static int sipsock_read(int *id, int fd, short events, void *ignore)
+/*!
+ * \brief UDP receive workers
+ *
+ * With udpthreads set, the monitor thread only reads packets off the UDP
+ * socket and hands each one to a worker taskprocessor, which does the
+ * parsing and handling.  The worker is chosen by hashing the Call-ID, so
+ * all messages of a dialog are handled in order by the same worker while
+ * different dialogs are handled in parallel.
+ *
+ * The workers are only ever started, stopped and pushed to from the
+ * monitor thread (and from unload_module() once that thread is gone), so
+ * the array itself needs no lock.
+ */
+#define SIP_UDP_READ_BATCH	64	/*!< packets read per wakeup when dispatching to workers */
+
+/*! \brief A received UDP packet on its way to a worker */
+struct sip_udp_packet {
+	struct sip_request req;
+	struct ast_sockaddr addr;
+};
+
+/*! \brief Worker task: handle one UDP packet */
+static int sip_udp_packet_task(void *data)
+{
+	struct sip_udp_packet *pkt = data;
+
+	handle_request_do(&pkt->req, &pkt->addr);
+	deinit_req(&pkt->req);
+	ast_free(pkt);
+
+	return 0;
+}
+
+/*! \brief Pick the worker for a raw SIP message, by Call-ID
+ * \note Messages without a Call-ID (keepalives and garbage) are spread by source address.
+ */
+static unsigned int sip_udp_dispatch_hash(const char *buf, const struct ast_sockaddr *addr)
+{
+	const char *c = buf;
+	unsigned int hash;
+
+	while ((c = strchr(c, '\n'))) {
+		c++;
+		if (*c == '\r' || *c == '\n') {
+			/* End of headers */
+			break;
+		}
+		if (!strncasecmp(c, "Call-ID", 7)) {
+			c += 7;
+		} else if (*c == 'i' || *c == 'I') {
+			c += 1;
+		} else {
+			continue;
+		}
+		c = ast_skip_blanks(c);
+		if (*c != ':') {
+			continue;
+		}
+		c = ast_skip_blanks(c + 1);
+
+		/* Call-IDs compare case sensitively */
+		for (hash = 0; *c && *c != '\r' && *c != '\n' && *c != ' ' && *c != '\t'; c++) {
+			hash = hash * 31 + (unsigned char) *c;
+		}
+		return hash;
+	}
+
+	return ast_sockaddr_hash(addr);
+}
+
+/*! \brief Signalled by the last worker to run its barrier task, see sip_udp_workers_stop() */
+struct sip_udp_barrier {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int pending;
+};
+
+/*! \brief Worker task: everything queued before it has been handled */
+static int sip_udp_barrier_task(void *data)
+{
+	struct sip_udp_barrier *barrier = data;
+
+	ast_mutex_lock(&barrier->lock);
+	if (!--barrier->pending) {
+		ast_cond_signal(&barrier->cond);
+	}
+	ast_mutex_unlock(&barrier->lock);
+
+	return 0;
+}
+
+/*! \brief Stop all UDP receive workers, letting them finish what they have queued
+ * \note A taskprocessor drops what is still queued when it is destroyed, so a
+ * barrier task is queued behind the packets and waited for first.  Nothing else
+ * pushes to the workers meanwhile, see sipsock_read().
+ */
+static void sip_udp_workers_stop(void)
+{
+	struct sip_udp_barrier barrier;
+	int x;
+
+	if (!sip_udp_worker_count) {
+		return;
+	}
+
+	ast_mutex_init(&barrier.lock);
+	ast_cond_init(&barrier.cond, NULL);
+	barrier.pending = sip_udp_worker_count;
+
+	ast_mutex_lock(&barrier.lock);
+	for (x = 0; x < sip_udp_worker_count; x++) {
+		if (ast_taskprocessor_push(sip_udp_workers[x], sip_udp_barrier_task, &barrier)) {
+			barrier.pending--;
+		}
+	}
+	while (barrier.pending) {
+		ast_cond_wait(&barrier.cond, &barrier.lock);
+	}
+	ast_mutex_unlock(&barrier.lock);
+
+	ast_cond_destroy(&barrier.cond);
+	ast_mutex_destroy(&barrier.lock);
+
+	for (x = 0; x < sip_udp_worker_count; x++) {
+		ast_taskprocessor_unreference(sip_udp_workers[x]);
+	}
+	ast_free(sip_udp_workers);
+	sip_udp_workers = NULL;
+	sip_udp_worker_count = 0;
+}
+
+/*! \brief Start or resize the UDP receive workers to match udpthreads */
+static void sip_udp_workers_apply(void)
+{
+	struct ast_taskprocessor **workers;
+	char name[32];
+	int x;
+
+	if (global_udpthreads == sip_udp_worker_count) {
+		return;
+	}
+
+	/* Queued packets must be drained before a dialog can hash to a different worker */
+	sip_udp_workers_stop();
+
+	if (global_udpthreads <= 0 || !(workers = ast_calloc(global_udpthreads, sizeof(*workers)))) {
+		return;
+	}
+
+	for (x = 0; x < global_udpthreads; x++) {
+		snprintf(name, sizeof(name), "chan_sip/udp-%d", x);
+		if (!(workers[x] = ast_taskprocessor_get(name, TPS_REF_DEFAULT))) {
+			ast_log(LOG_WARNING, "Unable to start SIP UDP worker %d, handling UDP on the monitor thread\n", x);
+			while (x--) {
+				ast_taskprocessor_unreference(workers[x]);
+			}
+			ast_free(workers);
+			return;
+		}
+	}
+
+	sip_udp_workers = workers;
+	sip_udp_worker_count = global_udpthreads;
+	ast_verb(2, "SIP handling UDP with %d worker threads\n", sip_udp_worker_count);
+}
+
+/*! \brief Read one packet from the SIP UDP socket and handle or dispatch it
+ * \retval 0 packet read
+ * \retval -1 nothing (more) to read
+ */
+static int sipsock_read_one(int fd, int flags)
 {
 	struct sip_request req;
+	struct sip_udp_packet *pkt = NULL;
 	struct ast_sockaddr addr;
 	int res;
 	static char readbuf[65535];
 
 	memset(&req, 0, sizeof(req));
-	res = ast_recvfrom(fd, readbuf, sizeof(readbuf) - 1, 0, &addr);
+	res = ast_recvfrom(fd, readbuf, sizeof(readbuf) - 1, flags, &addr);
 	if (res < 0) {
+		if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return -1;
+		}
 #if !defined(__FreeBSD__)
 		if (errno == EAGAIN)
 			ast_log(LOG_NOTICE, "SIP: Received packet with bad UDP checksum\n");
@@ -26076,16 +26503,17 @@ static int sipsock_read(int *id, int fd, short events, void *ignore)
 #endif
 		if (errno != ECONNREFUSED)
 			ast_log(LOG_WARNING, "Recv error: %s\n", strerror(errno));
-		return 1;
+		return -1;
 	}
 
 	readbuf[res] = '\0';
 
 	if (!(req.data = ast_str_create(SIP_MIN_PACKET))) {
-		return 1;
+		return -1;
 	}
 
 	if (ast_str_set(&req.data, 0, "%s", readbuf) == AST_DYNSTR_BUILD_FAILED) {
+		deinit_req(&req);
 		return -1;
 	}
 
@@ -26094,9 +26522,42 @@ static int sipsock_read(int *id, int fd, short events, void *ignore)
 	req.socket.tcptls_session	= NULL;
 	req.socket.port = htons(ast_sockaddr_port(&bindaddr));
 
+	if (sip_udp_worker_count && (pkt = ast_malloc(sizeof(*pkt)))) {
+		struct ast_taskprocessor *worker;
+
+		worker = sip_udp_workers[sip_udp_dispatch_hash(readbuf, &addr) % sip_udp_worker_count];
+		pkt->req = req;
+		ast_sockaddr_copy(&pkt->addr, &addr);
+		if (!ast_taskprocessor_push(worker, sip_udp_packet_task, pkt)) {
+			return 0;
+		}
+		ast_free(pkt);
+	}
+
 	handle_request_do(&req, &addr);
 	deinit_req(&req);
 
+	return 0;
+}
+
+/*! \brief Read data from SIP UDP socket
+\note Without UDP workers this locks the owner channel while we are processing the SIP message
+\return always 1, to stay registered with the I/O context
+\note Successful messages are connected to a SIP call and forwarded to handle_incoming(),
+	either directly or on one of the UDP workers
+*/
+static int sipsock_read(int *id, int fd, short events, void *ignore)
+{
+	int packets = 0;
+
+	/* When workers do the handling, reading is cheap enough to drain a burst
+	 * per wakeup instead of going back through ast_io_wait() for every packet. */
+	do {
+		if (sipsock_read_one(fd, packets ? MSG_DONTWAIT : 0)) {
+			break;
+		}
+	} while (sip_udp_worker_count && ++packets < SIP_UDP_READ_BATCH);
+
 	return 1;
 }
 
@@ -26111,6 +26572,14 @@ static int handle_request_do(struct sip_request *req, struct ast_sockaddr *addr)
 	int recount = 0;
 	int nounlock = 0;
 
+	/* The configuration and sipsock stay put while we handle the message. */
+	ast_rwlock_rdlock(&sip_config_lock);
+	if (req->socket.type == SIP_TRANSPORT_UDP) {
+		/* A packet queued for a UDP worker may have been read before a
+		 * reload replaced the socket. */
+		req->socket.fd = sipsock;
+	}
+
 	if (sip_debug_test_addr(addr))	/* Set the debug flag early on packet level */
 		req->debug = 1;
 	if (sip_cfg.pedanticsipchecking)
@@ -26122,6 +26591,7 @@ static int handle_request_do(struct sip_request *req, struct ast_sockaddr *addr)
 
 	if (parse_request(req) == -1) { /* Bad packet, can't parse */
 		ast_str_reset(req->data); /* nulling this out is NOT a good idea here. */
+		ast_rwlock_unlock(&sip_config_lock);
 		return 1;
 	}
 	req->method = find_sip_method(REQ_OFFSET_TO_STR(req, rlPart1));
@@ -26131,8 +26601,15 @@ static int handle_request_do(struct sip_request *req, struct ast_sockaddr *addr)
 
 	if (req->headers < 2) {	/* Must have at least two headers */
 		ast_str_reset(req->data); /* nulling this out is NOT a good idea here. */
+		ast_rwlock_unlock(&sip_config_lock);
 		return 1;
 	}
+
+	/* netlock only serializes finding or creating the dialog, so that two
+	 * transports can't create the same dialog twice.  From there on the
+	 * dialog lock keeps the messages of one dialog apart, and messages for
+	 * different dialogs can be handled in parallel by the UDP workers and
+	 * TCP/TLS threads. */
 	ast_mutex_lock(&netlock);
 
 	/* Find the active SIP dialog or create a new one */
@@ -26140,12 +26617,14 @@ static int handle_request_do(struct sip_request *req, struct ast_sockaddr *addr)
 	if (p == NULL) {
 		ast_debug(1, "Invalid SIP message - rejected , no callid, len %zu\n", ast_str_strlen(req->data));
 		ast_mutex_unlock(&netlock);
+		ast_rwlock_unlock(&sip_config_lock);
 		return 1;
 	}
 
 	/* Lock both the pvt and the owner if owner is present.  This will
 	 * not fail. */
 	owner_chan_ref = sip_pvt_lock_full(p);
+	ast_mutex_unlock(&netlock);
 
 	copy_socket_data(&p->socket, &req->socket);
 	ast_sockaddr_copy(&p->recv, addr);
@@ -26175,7 +26654,7 @@ static int handle_request_do(struct sip_request *req, struct ast_sockaddr *addr)
 	}
 	sip_pvt_unlock(p);
 	ao2_t_ref(p, -1, "throw away dialog ptr from find_call at end of routine"); /* p is gone after the return */
-	ast_mutex_unlock(&netlock);
+	ast_rwlock_unlock(&sip_config_lock);
 
 	return 1;
 }
@@ -26581,6 +27060,17 @@ static int check_rtp_timeout(struct sip_pvt *dialog, time_t t)
 	return 0;
 }
 
+/*! \brief Count one scheduler run that was ms late */
+static void sched_latency_record(int64_t ms)
+{
+	int x = 0;
+
+	while (x < ARRAY_LEN(sched_latency_bounds) && ms >= sched_latency_bounds[x]) {
+		x++;
+	}
+	sched_latency_hist[x]++;
+}
+
 /*! \brief The SIP monitoring thread
 \note	This thread monitors all the SIP sessions and peers that needs notification of mwi
 	(and thus do not have a separate thread) indefinitely
@@ -26590,6 +27080,9 @@ static void *do_monitor(void *data)
 	int res;
 	time_t t;
 	int reloading;
+	struct timeval due;
+
+	sip_udp_workers_apply();
 
 	/* Add an I/O event to our SIP UDP socket */
 	if (sipsock > -1)
@@ -26605,6 +27098,7 @@ static void *do_monitor(void *data)
 		if (reloading) {
 			ast_verb(1, "Reloading SIP\n");
 			sip_do_reload(sip_reloadreason);
+			sip_udp_workers_apply();
 
 			/* Change the I/O fd of our UDP socket */
 			if (sipsock > -1) {
@@ -26644,11 +27138,15 @@ static void *do_monitor(void *data)
 		pthread_testcancel();
 		/* Wait for sched or io */
 		res = ast_sched_wait(sched);
+		due = res < 0 ? ast_tv(0, 0) : ast_tvadd(ast_tvnow(), ast_samp2tv(res, 1000));
 		if ((res < 0) || (res > 1000))
 			res = 1000;
 		res = ast_io_wait(io, res);
 		if (res > 20)
 			ast_debug(1, "chan_sip: ast_io_wait ran %d all at once\n", res);
+		if (!ast_tvzero(due) && ast_tvcmp(ast_tvnow(), due) >= 0) {
+			sched_latency_record(ast_tvdiff_ms(ast_tvnow(), due));
+		}
 		ast_mutex_lock(&monlock);
 		res = ast_sched_runq(sched);
 		if (res >= 20)
@@ -28995,6 +29493,7 @@ static int reload_config(enum channelreloadreason reason)
 	global_t1 = DEFAULT_TIMER_T1;
 	global_timer_b = 64 * DEFAULT_TIMER_T1;
 	global_t1min = DEFAULT_T1MIN;
+	global_udpthreads = 0;
 	global_qualifyfreq = DEFAULT_QUALIFYFREQ;
 	global_t38_maxdatagram = -1;
 	global_shrinkcallerid = 1;
@@ -29079,6 +29578,11 @@ static int reload_config(enum channelreloadreason reason)
 			timerb_set = 1;
 		} else if (!strcasecmp(v->name, "t1min")) {
 			global_t1min = atoi(v->value);
+		} else if (!strcasecmp(v->name, "udpthreads")) {
+			if ((sscanf(v->value, "%30d", &global_udpthreads) != 1) || (global_udpthreads < 0)) {
+				ast_log(LOG_WARNING, "Invalid udpthreads value '%s' at line %d of %s, handling UDP on the monitor thread\n", v->value, v->lineno, config);
+				global_udpthreads = 0;
+			}
 		} else if (!strcasecmp(v->name, "transport") && !ast_strlen_zero(v->value)) {
 			char *val = ast_strdupa(v->value);
 			char *trans;
@@ -30338,10 +30842,16 @@ static int sip_is_xml_parsable(void)
 #endif
 }
 
-/*! \brief Send a poke to all known peers */
+/*! \brief Send a poke to all known peers
+\note	The pokes are spread evenly over each peer's qualify interval, so that
+	the replies (and the rescheduled pokes after them) don't keep arriving
+	in bursts.  On top of that the pokes go out in order, at most
+	qualifypeers of them at once and bursts at least qualifygap ms apart.
+*/
 static void sip_poke_all_peers(void)
 {
-	int ms = 0, num = 0;
+	int start = 0, last = 0, num = 0, count, when;
+	int64_t pos = 0;
 	struct ao2_iterator i;
 	struct sip_peer *peer;
 
@@ -30349,16 +30859,25 @@ static void sip_poke_all_peers(void)
 		return;
 	}
 
+	count = ao2_container_count(peers);
+
 	i = ao2_iterator_init(peers, 0);
 	while ((peer = ao2_t_iterator_next(&i, "iterate thru peers table"))) {
 		ao2_lock(peer);
-		if (num == global_qualify_peers) {
-			ms += global_qualify_gap;
+		/* Where this peer's poke falls in its qualify interval, but not
+		 * before the previous one */
+		when = count ? (int) (pos++ * peer->qualifyfreq / count) : 0;
+		when = MAX(when, last);
+		if (when >= start + global_qualify_gap || num >= global_qualify_peers) {
+			/* Past the current burst, or the burst is full: start the next
+			 * one, no sooner than qualifygap after this one */
+			start = MAX(when, start + global_qualify_gap);
+			when = start;
 			num = 0;
-		} else {
-			num++;
 		}
-		AST_SCHED_REPLACE_UNREF(peer->pokeexpire, sched, ms, sip_poke_peer_s, peer,
+		num++;
+		last = when;
+		AST_SCHED_REPLACE_UNREF(peer->pokeexpire, sched, when, sip_poke_peer_s, peer,
 				sip_unref_peer(_data, "removing poke peer ref"),
 				sip_unref_peer(peer, "removing poke peer ref"),
 				sip_ref_peer(peer, "adding poke peer ref"));
@@ -30467,7 +30986,10 @@ static int sip_do_reload(enum channelreloadreason reason)
 {
 	time_t start_poke, end_poke;
 
+	/* Wait for the messages being handled, and hold off new ones */
+	ast_rwlock_wrlock(&sip_config_lock);
 	reload_config(reason);
+	ast_rwlock_unlock(&sip_config_lock);
 	ast_sched_dump(sched);
 
 	start_poke = time(0);
@@ -31126,9 +31648,32 @@ static const struct ast_data_entry sip_data_providers[] = {
 	AST_DATA_ENTRY("asterisk/channel/sip/peers", &peers_data_provider),
 };
 
+/*! \brief Read a container size from the [general] section of sip.conf, rounded up to a prime */
+static int sip_hash_size(struct ast_config *cfg, const char *name, int def)
+{
+	const char *value;
+	int size;
+
+	if (!cfg || !(value = ast_variable_retrieve(cfg, "general", name))) {
+		return def;
+	}
+	if (sscanf(value, "%30d", &size) != 1 || size < 1) {
+		ast_log(LOG_WARNING, "Invalid %s '%s' in %s, using %d\n", name, value, config, def);
+		return def;
+	}
+	while (!ast_is_prime(size)) {
+		size++;
+	}
+
+	return size;
+}
+
 /*! \brief PBX load module - initialization */
 static int load_module(void)
 {
+	struct ast_flags config_flags = { 0 };
+	struct ast_config *cfg;
+
 	ast_verbose("SIP channel loading...\n");
 
 	if (!(sip_tech.capabilities = ast_format_cap_alloc())) {
@@ -31136,12 +31681,23 @@ static int load_module(void)
 	}
 
 	/* the fact that ao2_containers can't resize automatically is a major worry! */
-	/* if the number of objects gets above MAX_XXX_BUCKETS, things will slow down */
-	peers = ao2_t_container_alloc(HASH_PEER_SIZE, peer_hash_cb, peer_cmp_cb, "allocate peers");
-	peers_by_ip = ao2_t_container_alloc(HASH_PEER_SIZE, peer_iphash_cb, peer_ipcmp_cb, "allocate peers_by_ip");
-	dialogs = ao2_t_container_alloc(HASH_DIALOG_SIZE, dialog_hash_cb, dialog_cmp_cb, "allocate dialogs");
+	/* if the number of objects gets above the bucket count, things will slow down,
+	 * so large installations can size them in sip.conf */
+	cfg = ast_config_load(config, config_flags);
+	if (cfg == CONFIG_STATUS_FILEMISSING || cfg == CONFIG_STATUS_FILEINVALID) {
+		cfg = NULL;
+	}
+	hash_peer_size = sip_hash_size(cfg, "peerbuckets", HASH_PEER_SIZE);
+	hash_dialog_size = sip_hash_size(cfg, "dialogbuckets", HASH_DIALOG_SIZE);
+	if (cfg) {
+		ast_config_destroy(cfg);
+	}
+
+	peers = ao2_t_container_alloc(hash_peer_size, peer_hash_cb, peer_cmp_cb, "allocate peers");
+	peers_by_ip = ao2_t_container_alloc(hash_peer_size, peer_iphash_cb, peer_ipcmp_cb, "allocate peers_by_ip");
+	dialogs = ao2_t_container_alloc(hash_dialog_size, dialog_hash_cb, dialog_cmp_cb, "allocate dialogs");
 	dialogs_needdestroy = ao2_t_container_alloc(1, NULL, NULL, "allocate dialogs_needdestroy");
-	dialogs_rtpcheck = ao2_t_container_alloc(HASH_DIALOG_SIZE, dialog_hash_cb, dialog_cmp_cb, "allocate dialogs for rtpchecks");
+	dialogs_rtpcheck = ao2_t_container_alloc(hash_dialog_size, dialog_hash_cb, dialog_cmp_cb, "allocate dialogs for rtpchecks");
 	threadt = ao2_t_container_alloc(HASH_DIALOG_SIZE, threadt_hash_cb, threadt_cmp_cb, "allocate threadt table");
 	if (!peers || !peers_by_ip || !dialogs || !dialogs_needdestroy || !dialogs_rtpcheck
 		|| !threadt) {
@@ -31370,6 +31926,9 @@ static int unload_module(void)
 	monitor_thread = AST_PTHREADT_STOP;
 	ast_mutex_unlock(&monlock);
 
+	/* Nothing reads the UDP socket any more; finish what was already received */
+	sip_udp_workers_stop();
+
 	/* Destroy all the dialogs and free their memory */
 	i = ao2_iterator_init(dialogs, 0);
 	while ((p = ao2_t_iterator_next(&i, "iterate thru dialogs"))) {
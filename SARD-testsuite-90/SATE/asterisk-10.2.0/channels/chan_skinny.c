@@ -73,6 +73,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 346240 $")
 #include "asterisk/event.h"
 #include "asterisk/indications.h"
 #include "asterisk/linkedlists.h"
+#include "asterisk/astobj2.h"
 
 /*** DOCUMENTATION
 	<manager name="SKINNYdevices" language="en_US">
@@ -1410,6 +1411,9 @@ struct skinny_device {
 	struct ast_format_cap *cap;
 	struct ast_format_cap *confcap;
 	AST_LIST_HEAD(, skinny_line) lines;
+	/*! Registered lines by instance, see skinny_device_index_lines() */
+	struct skinny_line **lineinstances;
+	int numlineinstances;
 	AST_LIST_HEAD(, skinny_speeddial) speeddials;
 	AST_LIST_HEAD(, skinny_addon) addons;
 	AST_LIST_ENTRY(skinny_device) list;
@@ -1428,7 +1432,7 @@ static struct skinny_device_options {
 };
 static struct skinny_device_options *default_device = &default_device_struct;
 	
-static AST_LIST_HEAD_STATIC(devices, skinny_device);
+static AST_RWLIST_HEAD_STATIC(devices, skinny_device);
 
 struct skinnysession {
 	pthread_t t;
@@ -1530,6 +1534,7 @@ static struct skinny_device *skinny_device_destroy(struct skinny_device *d)
 {
 	d->cap = ast_format_cap_destroy(d->cap);
 	d->confcap = ast_format_cap_destroy(d->confcap);
+	ast_free(d->lineinstances);
 	ast_free(d);
 	return NULL;
 }
@@ -1685,9 +1690,126 @@ static struct skinny_req *req_alloc(size_t size, int response_message)
 	return req;
 }
 
+/*!
+ * \brief An entry in one of the lookup indexes.
+ *
+ * The indexes sit alongside the devices list and the per line
+ * subchannel lists, so that the lookups done for every registration,
+ * call and stimulus message do not have to walk every device and line
+ * while holding the devices list lock.  Entries only point back at the
+ * object they index; they are always unlinked before that is freed.
+ */
+struct skinny_index_entry {
+	/*! The device, line or subchannel */
+	void *obj;
+	/*! The device a line was configured on */
+	struct skinny_device *device;
+	/*! Call reference, for subchannels */
+	unsigned int callid;
+	/*! Device id or line name */
+	char name[80];
+};
+
+#define SKINNY_INDEX_BUCKETS 563
+
+/*! \brief Devices by id */
+static struct ao2_container *device_index;
+/*! \brief Lines by name, one entry for each device the line is on */
+static struct ao2_container *line_index;
+/*! \brief Subchannels by call reference */
+static struct ao2_container *subchannel_index;
+
+static int skinny_index_name_hash(const void *obj, const int flags)
+{
+	const struct skinny_index_entry *entry = obj;
+	return ast_str_case_hash(entry->name);
+}
+
+static int skinny_index_name_cmp(void *obj, void *arg, int flags)
+{
+	struct skinny_index_entry *entry = obj, *entry2 = arg;
+	return !strcasecmp(entry->name, entry2->name) && entry->obj == entry2->obj && entry->device == entry2->device ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static int skinny_index_callid_hash(const void *obj, const int flags)
+{
+	const struct skinny_index_entry *entry = obj;
+	return abs((int) entry->callid);
+}
+
+static int skinny_index_callid_cmp(void *obj, void *arg, int flags)
+{
+	struct skinny_index_entry *entry = obj, *entry2 = arg;
+	return entry->obj == entry2->obj ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static void skinny_index_link(struct ao2_container *index, void *obj, struct skinny_device *device, const char *name, unsigned int callid)
+{
+	struct skinny_index_entry *entry;
+
+	if (!(entry = ao2_alloc(sizeof(*entry), NULL))) {
+		return;
+	}
+	entry->obj = obj;
+	entry->device = device;
+	entry->callid = callid;
+	ast_copy_string(entry->name, name, sizeof(entry->name));
+	ao2_link(index, entry);
+	ao2_ref(entry, -1);
+}
+
+static void skinny_index_unlink(struct ao2_container *index, void *obj, struct skinny_device *device, const char *name, unsigned int callid)
+{
+	struct skinny_index_entry tmp = { .obj = obj, .device = device, .callid = callid, };
+
+	ast_copy_string(tmp.name, name, sizeof(tmp.name));
+	ao2_find(index, &tmp, OBJ_POINTER | OBJ_UNLINK | OBJ_NODATA);
+}
+
+static void skinny_sub_index_link(struct skinny_subchannel *sub)
+{
+	skinny_index_link(subchannel_index, sub, NULL, "", sub->callid);
+}
+
+static void skinny_sub_index_unlink(struct skinny_subchannel *sub)
+{
+	skinny_index_unlink(subchannel_index, sub, NULL, "", sub->callid);
+}
+
+/*!
+ * \brief Rebuild the table of the device's lines by instance.
+ * \note Needed whenever the instances of its lines change.
+ */
+static void skinny_device_index_lines(struct skinny_device *d)
+{
+	struct skinny_line *l, **lineinstances = NULL;
+	int num = 0;
+
+	AST_LIST_TRAVERSE(&d->lines, l, list) {
+		if (l->instance >= num) {
+			num = l->instance + 1;
+		}
+	}
+	if (num > 1 && !(lineinstances = ast_calloc(num, sizeof(*lineinstances)))) {
+		num = 0;
+	}
+	/* The first line with an instance wins, as it would on the list */
+	AST_LIST_TRAVERSE(&d->lines, l, list) {
+		if (lineinstances && l->instance > 0 && !lineinstances[l->instance]) {
+			lineinstances[l->instance] = l;
+		}
+	}
+
+	ast_mutex_lock(&d->lock);
+	ast_free(d->lineinstances);
+	d->lineinstances = lineinstances;
+	d->numlineinstances = lineinstances ? num : 0;
+	ast_mutex_unlock(&d->lock);
+}
+
 static struct skinny_line *find_line_by_instance(struct skinny_device *d, int instance)
 {
-	struct skinny_line *l;
+	struct skinny_line *l = NULL;
 
 	/*Dialing from on hook or on a 7920 uses instance 0 in requests
 	  but we need to start looking at instance 1 */
@@ -1695,9 +1817,18 @@ static struct skinny_line *find_line_by_instance(struct skinny_device *d, int in
 	if (!instance)
 		instance = 1;
 
-	AST_LIST_TRAVERSE(&d->lines, l, list){
-		if (l->instance == instance)
-			break;
+	ast_mutex_lock(&d->lock);
+	if (instance > 0 && instance < d->numlineinstances) {
+		l = d->lineinstances[instance];
+	}
+	ast_mutex_unlock(&d->lock);
+
+	/* Not registered yet, or the table is out of date */
+	if (!l || l->instance != instance) {
+		AST_LIST_TRAVERSE(&d->lines, l, list){
+			if (l->instance == instance)
+				break;
+		}
 	}
 
 	if (!l) {
@@ -1706,52 +1837,64 @@ static struct skinny_line *find_line_by_instance(struct skinny_device *d, int in
 	return l;
 }
 
+struct line_search {
+	const char *device;
+	struct skinny_device *founddevice;
+	struct skinny_line *found;
+	int ambiguous;
+};
+
+static int line_search_cb(void *obj, void *arg, void *data, int flags)
+{
+	struct skinny_index_entry *entry = obj, *tmp = arg;
+	struct line_search *search = data;
+
+	if (strcasecmp(entry->name, tmp->name)) {
+		return 0;
+	}
+	if (search->device) {
+		if (strcasecmp(entry->device->name, search->device)) {
+			return 0;
+		}
+		/* Only the first device of that name is searched */
+		if (search->found && entry->device != search->founddevice) {
+			return CMP_STOP;
+		}
+		if (skinnydebug && !search->found)
+			ast_verb(2, "Found device: %s\n", entry->device->name);
+	}
+	if (search->found) {
+		search->ambiguous = 1;
+		return CMP_STOP;
+	}
+	search->found = entry->obj;
+	search->founddevice = entry->device;
+	return 0;
+}
+
 static struct skinny_line *find_line_by_name(const char *dest)
 {
-	struct skinny_line *l;
-	struct skinny_line *tmpl = NULL;
-	struct skinny_device *d;
+	struct skinny_index_entry tmp = { .obj = NULL, };
+	struct line_search search = { .device = NULL, };
 	char line[256];
 	char *at;
-	char *device;
-	int checkdevice = 0;
 
 	ast_copy_string(line, dest, sizeof(line));
 	at = strchr(line, '@');
 	if (at)
 		*at++ = '\0';
-	device = at;
 
-	if (!ast_strlen_zero(device))
-		checkdevice = 1;
+	if (!ast_strlen_zero(at))
+		search.device = at;
+	ast_copy_string(tmp.name, line, sizeof(tmp.name));
 
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list){
-		if (checkdevice && tmpl)
-			break;
-		else if (!checkdevice) {
-			/* This is a match, since we're checking for line on every device. */
-		} else if (!strcasecmp(d->name, device)) {
-			if (skinnydebug)
-				ast_verb(2, "Found device: %s\n", d->name);
-		} else
-			continue;
+	ao2_callback_data(line_index, OBJ_POINTER | OBJ_NODATA | OBJ_MULTIPLE, line_search_cb, &tmp, &search);
 
-		/* Found the device (or we don't care which device) */
-		AST_LIST_TRAVERSE(&d->lines, l, list){
-			/* Search for the right line */
-			if (!strcasecmp(l->name, line)) {
-				if (tmpl) {
-					ast_verb(2, "Ambiguous line name: %s\n", line);
-					AST_LIST_UNLOCK(&devices);
-					return NULL;
-				} else
-					tmpl = l;
-			}
-		}
+	if (search.ambiguous) {
+		ast_verb(2, "Ambiguous line name: %s\n", tmp.name);
+		return NULL;
 	}
-	AST_LIST_UNLOCK(&devices);
-	return tmpl;
+	return search.found;
 }
 
 static struct skinny_subline *find_subline_by_name(const char *dest)
@@ -1761,14 +1904,14 @@ static struct skinny_subline *find_subline_by_name(const char *dest)
 	struct skinny_subline *tmpsubline = NULL;
 	struct skinny_device *d;
 
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list){
+	AST_RWLIST_RDLOCK(&devices);
+	AST_RWLIST_TRAVERSE(&devices, d, list){
 		AST_LIST_TRAVERSE(&d->lines, l, list){
 			AST_LIST_TRAVERSE(&l->sublines, subline, list){
 				if (!strcasecmp(subline->name, dest)) {
 					if (tmpsubline) {
 						ast_verb(2, "Ambiguous subline name: %s\n", dest);
-						AST_LIST_UNLOCK(&devices);
+						AST_RWLIST_UNLOCK(&devices);
 						return NULL;
 					} else
 						tmpsubline = subline;
@@ -1776,7 +1919,7 @@ static struct skinny_subline *find_subline_by_name(const char *dest)
 			}
 		}
 	}
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 	return tmpsubline;
 }
 
@@ -1823,6 +1966,41 @@ static int skinny_sched_add(int when, ast_sched_cb callback, const void *data)
 	return ast_sched_add(sched, when, callback, data);
 }
 
+struct sub_search {
+	struct skinny_device *device;
+	struct skinny_line *line;
+};
+
+static int sub_search_cb(void *obj, void *arg, void *data, int flags)
+{
+	struct skinny_index_entry *entry = obj, *tmp = arg;
+	struct sub_search *search = data;
+	struct skinny_subchannel *sub = entry->obj;
+
+	if (entry->callid != tmp->callid || !sub->line) {
+		return 0;
+	}
+	if (search->line ? sub->line != search->line : sub->line->device != search->device) {
+		return 0;
+	}
+	return CMP_MATCH | CMP_STOP;
+}
+
+/*! \brief Look a subchannel up by call reference, on one line or on any line of a device */
+static struct skinny_subchannel *find_subchannel_by_callid(struct skinny_device *d, struct skinny_line *l, int reference)
+{
+	struct skinny_index_entry tmp = { .callid = reference, };
+	struct sub_search search = { .device = d, .line = l, };
+	struct skinny_index_entry *entry;
+	struct skinny_subchannel *sub = NULL;
+
+	if ((entry = ao2_callback_data(subchannel_index, OBJ_POINTER, sub_search_cb, &tmp, &search))) {
+		sub = entry->obj;
+		ao2_ref(entry, -1);
+	}
+	return sub;
+}
+
 /* It's quicker/easier to find the subchannel when we know the instance number too */
 static struct skinny_subchannel *find_subchannel_by_instance_reference(struct skinny_device *d, int instance, int reference)
 {
@@ -1839,10 +2017,7 @@ static struct skinny_subchannel *find_subchannel_by_instance_reference(struct sk
 	if (!reference)
 		sub = AST_LIST_FIRST(&l->sub);
 	else {
-		AST_LIST_TRAVERSE(&l->sub, sub, list) {
-			if (sub->callid == reference)
-				break;
-		}
+		sub = find_subchannel_by_callid(d, l, reference);
 	}
 	if (!sub) {
 		ast_log(LOG_WARNING, "Could not find subchannel with reference '%d' on '%s'\n", reference, d->name);
@@ -1853,24 +2028,10 @@ static struct skinny_subchannel *find_subchannel_by_instance_reference(struct sk
 /* Find the subchannel when we only have the callid - this shouldn't happen often */
 static struct skinny_subchannel *find_subchannel_by_reference(struct skinny_device *d, int reference)
 {
-	struct skinny_line *l;
-	struct skinny_subchannel *sub = NULL;
-
-	AST_LIST_TRAVERSE(&d->lines, l, list){
-		AST_LIST_TRAVERSE(&l->sub, sub, list){
-			if (sub->callid == reference)
-				break;
-		}
-		if (sub)
-			break;
-	}
+	struct skinny_subchannel *sub = find_subchannel_by_callid(d, NULL, reference);
 
-	if (!l) {
-		ast_log(LOG_WARNING, "Could not find any lines that contained a subchannel with reference '%d' on device '%s'\n", reference, d->name);
-	} else {
-		if (!sub) {
-			ast_log(LOG_WARNING, "Could not find subchannel with reference '%d' on '%s@%s'\n", reference, l->name, d->name);
-		}
+	if (!sub) {
+		ast_log(LOG_WARNING, "Could not find subchannel with reference '%d' on device '%s'\n", reference, d->name);
 	}
 	return sub;
 }
@@ -2042,12 +2203,23 @@ static void unregister_exten(struct skinny_line *l)
 	}
 }
 
+static int device_register_cb(void *obj, void *arg, void *data, int flags)
+{
+	struct skinny_index_entry *entry = obj, *tmp = arg;
+	struct skinny_device *d = entry->obj;
+	struct ast_sockaddr *addr = data;
+
+	return !strcasecmp(entry->name, tmp->name) && ast_apply_ha(d->ha, addr) ? CMP_MATCH | CMP_STOP : 0;
+}
+
 static int skinny_register(struct skinny_req *req, struct skinnysession *s)
 {
-	struct skinny_device *d;
+	struct skinny_device *d = NULL;
 	struct skinny_line *l;
 	struct skinny_subline *subline;
 	struct skinny_speeddial *sd;
+	struct skinny_index_entry tmp, *entry;
+	struct ast_sockaddr addr;
 	struct sockaddr_in sin;
 	socklen_t slen;
 	int instance;
@@ -2057,66 +2229,72 @@ static int skinny_register(struct skinny_req *req, struct skinnysession *s)
 		return 0;
 	}
 
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list){
-		struct ast_sockaddr addr;
-		ast_sockaddr_from_sin(&addr, &s->sin);
-		if (!strcasecmp(req->data.reg.name, d->id)
-				&& ast_apply_ha(d->ha, &addr)) {
-			s->device = d;
-			d->type = letohl(req->data.reg.type);
-			if (ast_strlen_zero(d->version_id)) {
-				ast_copy_string(d->version_id, version_id, sizeof(d->version_id));
-			}
-			d->registered = 1;
-			d->session = s;
+	ast_sockaddr_from_sin(&addr, &s->sin);
+	ast_copy_string(tmp.name, req->data.reg.name, sizeof(tmp.name));
 
-			slen = sizeof(sin);
-			if (getsockname(s->fd, (struct sockaddr *)&sin, &slen)) {
-				ast_log(LOG_WARNING, "Cannot get socket name\n");
-				sin.sin_addr = __ourip;
-			}
-			d->ourip = sin.sin_addr;
+	/* Registrations only change the device they are for, so any number
+	 * of them can go ahead at once; reloads take the write lock. */
+	AST_RWLIST_RDLOCK(&devices);
+	if ((entry = ao2_callback_data(device_index, OBJ_POINTER, device_register_cb, &tmp, &addr))) {
+		d = entry->obj;
+		ao2_ref(entry, -1);
+	}
+	if (d) {
+		ast_mutex_lock(&d->lock);
+		s->device = d;
+		d->type = letohl(req->data.reg.type);
+		if (ast_strlen_zero(d->version_id)) {
+			ast_copy_string(d->version_id, version_id, sizeof(d->version_id));
+		}
+		d->registered = 1;
+		d->session = s;
 
-			AST_LIST_TRAVERSE(&d->speeddials, sd, list) {
-				sd->stateid = ast_extension_state_add(sd->context, sd->exten, skinny_extensionstate_cb, sd->container);
-			}
-			instance = 0;
-			AST_LIST_TRAVERSE(&d->lines, l, list) {
-				instance++;
-			}
-			AST_LIST_TRAVERSE(&d->lines, l, list) {
-				/* FIXME: All sorts of issues will occur if this line is already connected to a device */
-				if (l->device) {
-					manager_event(EVENT_FLAG_SYSTEM, "PeerStatus", "ChannelType: Skinny\r\nPeer: Skinny/%s@%s\r\nPeerStatus: Rejected\r\nCause: LINE_ALREADY_CONNECTED\r\n", l->name, l->device->name); 
-					ast_verb(1, "Line %s already connected to %s. Not connecting to %s.\n", l->name, l->device->name, d->name);
-				} else {
-					l->device = d;
-					ast_format_cap_joint_copy(l->confcap, d->cap, l->cap);
-					l->prefs = l->confprefs;
-					if (!l->prefs.order[0]) {
-						l->prefs = d->confprefs;
-					}
-					/* l->capability = d->capability;
-					l->prefs = d->prefs; */
-					l->instance = instance;
-					l->newmsgs = ast_app_has_voicemail(l->mailbox, NULL);
-					set_callforwards(l, NULL, 0);
-					manager_event(EVENT_FLAG_SYSTEM, "PeerStatus", "ChannelType: Skinny\r\nPeer: Skinny/%s@%s\r\nPeerStatus: Registered\r\n", l->name, d->name);
-					register_exten(l);
-					/* initialize MWI on line and device */
-					mwi_event_cb(0, l);
-					AST_LIST_TRAVERSE(&l->sublines, subline, list) {
-						ast_extension_state_add(subline->context, subline->exten, skinny_extensionstate_cb, subline->container);
-					}
-					ast_devstate_changed(AST_DEVICE_NOT_INUSE, "Skinny/%s", l->name);
+		slen = sizeof(sin);
+		if (getsockname(s->fd, (struct sockaddr *)&sin, &slen)) {
+			ast_log(LOG_WARNING, "Cannot get socket name\n");
+			sin.sin_addr = __ourip;
+		}
+		d->ourip = sin.sin_addr;
+
+		AST_LIST_TRAVERSE(&d->speeddials, sd, list) {
+			sd->stateid = ast_extension_state_add(sd->context, sd->exten, skinny_extensionstate_cb, sd->container);
+		}
+		instance = 0;
+		AST_LIST_TRAVERSE(&d->lines, l, list) {
+			instance++;
+		}
+		AST_LIST_TRAVERSE(&d->lines, l, list) {
+			/* FIXME: All sorts of issues will occur if this line is already connected to a device */
+			if (l->device) {
+				manager_event(EVENT_FLAG_SYSTEM, "PeerStatus", "ChannelType: Skinny\r\nPeer: Skinny/%s@%s\r\nPeerStatus: Rejected\r\nCause: LINE_ALREADY_CONNECTED\r\n", l->name, l->device->name); 
+				ast_verb(1, "Line %s already connected to %s. Not connecting to %s.\n", l->name, l->device->name, d->name);
+			} else {
+				l->device = d;
+				ast_format_cap_joint_copy(l->confcap, d->cap, l->cap);
+				l->prefs = l->confprefs;
+				if (!l->prefs.order[0]) {
+					l->prefs = d->confprefs;
+				}
+				/* l->capability = d->capability;
+				l->prefs = d->prefs; */
+				l->instance = instance;
+				l->newmsgs = ast_app_has_voicemail(l->mailbox, NULL);
+				set_callforwards(l, NULL, 0);
+				manager_event(EVENT_FLAG_SYSTEM, "PeerStatus", "ChannelType: Skinny\r\nPeer: Skinny/%s@%s\r\nPeerStatus: Registered\r\n", l->name, d->name);
+				register_exten(l);
+				/* initialize MWI on line and device */
+				mwi_event_cb(0, l);
+				AST_LIST_TRAVERSE(&l->sublines, subline, list) {
+					ast_extension_state_add(subline->context, subline->exten, skinny_extensionstate_cb, subline->container);
 				}
-				--instance;
+				ast_devstate_changed(AST_DEVICE_NOT_INUSE, "Skinny/%s", l->name);
 			}
-			break;
+			--instance;
 		}
+		skinny_device_index_lines(d);
+		ast_mutex_unlock(&d->lock);
 	}
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 	if (!d) {
 		return 0;
 	}
@@ -2150,6 +2328,7 @@ static int skinny_unregister(struct skinny_req *req, struct skinnysession *s)
 				ast_devstate_changed(AST_DEVICE_UNAVAILABLE, "Skinny/%s", l->name);
 			}
 		}
+		skinny_device_index_lines(d);
 	}
 
 	return -1; /* main loop will destroy the session */
@@ -3358,7 +3537,7 @@ static char *complete_skinny_devices(const char *word, int state)
 	char *result = NULL;
 	int wordlen = strlen(word), which = 0;
 
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		if (!strncasecmp(word, d->id, wordlen) && ++which > state)
 			result = ast_strdup(d->id);
 	}
@@ -3386,7 +3565,7 @@ static char *complete_skinny_show_line(const char *line, const char *word, int p
 	if (pos != 3)
 		return NULL;
 	
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		AST_LIST_TRAVERSE(&d->lines, l, list) {
 			if (!strncasecmp(word, l->name, wordlen) && ++which > state)
 				result = ast_strdup(l->name);
@@ -3414,8 +3593,8 @@ static char *handle_skinny_reset(struct ast_cli_entry *e, int cmd, struct ast_cl
 	if (a->argc < 3 || a->argc > 4)
 		return CLI_SHOWUSAGE;
 
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_RDLOCK(&devices);
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		int fullrestart = 0;
 		if (!strcasecmp(a->argv[2], d->id) || !strcasecmp(a->argv[2], d->name) || !strcasecmp(a->argv[2], "all")) {
 			if (!(d->session))
@@ -3427,7 +3606,7 @@ static char *handle_skinny_reset(struct ast_cli_entry *e, int cmd, struct ast_cl
 			transmit_reset(d, fullrestart);
 		}
 	}
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 	return CLI_SUCCESS;
 }
 
@@ -3565,8 +3744,8 @@ static char *_skinny_show_devices(int fd, int *total, struct mansession *s, cons
 		ast_cli(fd, "-------------------- ---------------- --------------- --------------- - --\n");
 	}
 
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_RDLOCK(&devices);
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		int numlines = 0;
 		total_devices++;
 		AST_LIST_TRAVERSE(&d->lines, l, list) {
@@ -3600,7 +3779,7 @@ static char *_skinny_show_devices(int fd, int *total, struct mansession *s, cons
 				numlines);
 		}
 	}
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 
 	if (total)
 		*total = total_devices;
@@ -3662,8 +3841,8 @@ static char *_skinny_show_device(int type, int fd, struct mansession *s, const s
 		return CLI_SHOWUSAGE;
 	}
 
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_RDLOCK(&devices);
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		if (!strcasecmp(argv[3], d->id) || !strcasecmp(argv[3], d->name)) {
 			int numlines = 0, numaddons = 0, numspeeddials = 0;
 
@@ -3742,7 +3921,7 @@ static char *_skinny_show_device(int type, int fd, struct mansession *s, const s
 			}
 		}
 	}
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 	return CLI_SUCCESS;
 }
 
@@ -3927,10 +4106,10 @@ static char *_skinny_show_line(int type, int fd, struct mansession *s, const str
 		return CLI_SHOWUSAGE;
 	}
 
-	AST_LIST_LOCK(&devices);
+	AST_RWLIST_RDLOCK(&devices);
 
 	/* Show all lines matching the one supplied */
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		if (argc == 6 && (strcasecmp(argv[5], d->id) && strcasecmp(argv[5], d->name))) {
 			continue;
 		}
@@ -4043,7 +4222,7 @@ static char *_skinny_show_line(int type, int fd, struct mansession *s, const str
 		}
 	}
 	
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 	return CLI_SUCCESS;
 }
 
@@ -4413,6 +4592,7 @@ static int skinny_hangup(struct ast_channel *ast)
 		sub->rtp = NULL;
 	}
 	ast_mutex_unlock(&sub->lock);
+	skinny_sub_index_unlink(sub);
 	ast_free(sub);
 	ast_module_unref(ast_module_info->self);
 	return 0;
@@ -4833,6 +5013,7 @@ static struct ast_channel *skinny_new(struct skinny_line *l, struct skinny_subli
 			}
 			
 			AST_LIST_INSERT_HEAD(&l->sub, sub, list);
+			skinny_sub_index_link(sub);
 			//l->activesub = sub;
 		}
 		tmp->tech = &skinny_tech;
@@ -5014,6 +5195,7 @@ static void setsubstate(struct skinny_subchannel *sub, int state)
 		switch (actualstate) {
 		case SUBSTATE_ONHOOK:
 			AST_LIST_REMOVE(&l->sub, sub, list);
+			skinny_sub_index_unlink(sub);
 			if (sub->related) {
 				sub->related->related = NULL;
 			}
@@ -5125,6 +5307,7 @@ static void setsubstate(struct skinny_subchannel *sub, int state)
 		break;
 	case SUBSTATE_ONHOOK:
 		AST_LIST_REMOVE(&l->sub, sub, list);
+		skinny_sub_index_unlink(sub);
 		if (sub->related) {
 			sub->related->related = NULL;
 		}
@@ -7388,7 +7571,7 @@ static struct ast_channel *skinny_request(const char *type, struct ast_format_ca
 						struct skinny_device *d;
 						struct skinny_line *l2;
 						int lineinuse = 0;
-						AST_LIST_TRAVERSE(&devices, d, list) {
+						AST_RWLIST_TRAVERSE(&devices, d, list) {
 							AST_LIST_TRAVERSE(&d->lines, l2, list) {
 								if (l2 == l && strcasecmp(d->id, CDEV->id)) {
 									ast_log(LOG_WARNING, "Line %s already used by %s. Not connecting to %s.\n", l->name, d->name, CDEV->name);
@@ -7402,6 +7585,7 @@ static struct ast_channel *skinny_request(const char *type, struct ast_format_ca
 							}
 							lineInstance++;
 							AST_LIST_INSERT_HEAD(&CDEV->lines, l, list);
+							skinny_index_link(line_index, l, CDEV, l->name, 0);
 						}
  						break;
  					}
@@ -7597,8 +7781,8 @@ static struct ast_channel *skinny_request(const char *type, struct ast_format_ca
  
  	ast_log(LOG_NOTICE, "Configuring skinny device %s.\n", dname);
 
- 	AST_LIST_LOCK(&devices);
- 	AST_LIST_TRAVERSE(&devices, temp, list) {
+ 	AST_RWLIST_WRLOCK(&devices);
+ 	AST_RWLIST_TRAVERSE(&devices, temp, list) {
  		if (!strcasecmp(dname, temp->name) && temp->prune) {
 			update = 1;
  			break;
@@ -7607,17 +7791,17 @@ static struct ast_channel *skinny_request(const char *type, struct ast_format_ca
 
  	if (!(d = skinny_device_alloc())) {
  		ast_verb(1, "Unable to allocate memory for device %s.\n", dname);
- 		AST_LIST_UNLOCK(&devices);
+ 		AST_RWLIST_UNLOCK(&devices);
  		return NULL;
  	}
  	memcpy(d, default_device, sizeof(*default_device));
  	ast_mutex_init(&d->lock);
  	ast_copy_string(d->name, dname, sizeof(d->name));
 	ast_format_cap_copy(d->confcap, default_cap);
- 	AST_LIST_INSERT_TAIL(&devices, d, list);
+ 	AST_RWLIST_INSERT_TAIL(&devices, d, list);
 
  	ast_mutex_lock(&d->lock);
- 	AST_LIST_UNLOCK(&devices);
+ 	AST_RWLIST_UNLOCK(&devices);
  
  	config_parse_variables(TYPE_DEVICE, d, v);
  
@@ -7631,8 +7815,8 @@ static struct ast_channel *skinny_request(const char *type, struct ast_format_ca
  	}
  
 	if (skinnyreload){
-		AST_LIST_LOCK(&devices);
-		AST_LIST_TRAVERSE(&devices, temp, list) {
+		AST_RWLIST_RDLOCK(&devices);
+		AST_RWLIST_TRAVERSE(&devices, temp, list) {
 			if (strcasecmp(d->id, temp->id) || !temp->prune || !temp->session) {
 				continue;
 			}
@@ -7665,13 +7849,17 @@ static struct ast_channel *skinny_request(const char *type, struct ast_format_ca
 				AST_LIST_UNLOCK(&temp->lines);
 			}
 			AST_LIST_UNLOCK(&d->lines);
+			skinny_device_index_lines(d);
 			ast_mutex_unlock(&d->lock);
 		}
-		AST_LIST_UNLOCK(&devices);
+		AST_RWLIST_UNLOCK(&devices);
 	}
 
  	ast_mutex_unlock(&d->lock);
 
+	/* Only now that its session has been carried over may the device register */
+	skinny_index_link(device_index, d, NULL, d->id, 0);
+
 	ast_verb(3, "%s config for device '%s'\n", update ? "Updated" : (skinnyreload ? "Reloaded" : "Created"), d->name);
 	
 	return d;
@@ -7797,13 +7985,15 @@ static void delete_devices(void)
 	struct skinny_speeddial *sd;
 	struct skinny_addon *a;
 
-	AST_LIST_LOCK(&devices);
+	AST_RWLIST_WRLOCK(&devices);
 	AST_LIST_LOCK(&lines);
 
 	/* Delete all devices */
-	while ((d = AST_LIST_REMOVE_HEAD(&devices, list))) {
+	while ((d = AST_RWLIST_REMOVE_HEAD(&devices, list))) {
+		skinny_index_unlink(device_index, d, NULL, d->id, 0);
 		/* Delete all lines for this device */
 		while ((l = AST_LIST_REMOVE_HEAD(&d->lines, list))) {
+			skinny_index_unlink(line_index, l, d, l->name, 0);
 			AST_LIST_REMOVE(&lines, l, all);
 			AST_LIST_REMOVE(&d->lines, l, list);
 			l = skinny_line_destroy(l);
@@ -7820,7 +8010,7 @@ static void delete_devices(void)
 		d = skinny_device_destroy(d);
 	}
 	AST_LIST_UNLOCK(&lines);
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 }
 
 int skinny_reload(void)
@@ -7839,11 +8029,11 @@ int skinny_reload(void)
 	skinnyreload = 1;
 
 	/* Mark all devices and lines as candidates to be pruned */
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_WRLOCK(&devices);
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		d->prune = 1;
 	}
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_UNLOCK(&devices);
 
 	AST_LIST_LOCK(&lines);
 	AST_LIST_TRAVERSE(&lines, l, all) {
@@ -7854,8 +8044,8 @@ int skinny_reload(void)
         config_load();
 
 	/* Remove any devices that no longer exist in the config */
-	AST_LIST_LOCK(&devices);
-	AST_LIST_TRAVERSE_SAFE_BEGIN(&devices, d, list) {
+	AST_RWLIST_WRLOCK(&devices);
+	AST_RWLIST_TRAVERSE_SAFE_BEGIN(&devices, d, list) {
 		if (!d->prune) {
 			continue;
 		}
@@ -7864,6 +8054,7 @@ int skinny_reload(void)
 		   We do not want to free the line here, that
 		   will happen below. */
 		while ((l = AST_LIST_REMOVE_HEAD(&d->lines, list))) {
+			skinny_index_unlink(line_index, l, d, l->name, 0);
 		}
 		/* Delete all speeddials for this device */
 		while ((sd = AST_LIST_REMOVE_HEAD(&d->speeddials, list))) {
@@ -7873,11 +8064,12 @@ int skinny_reload(void)
 		while ((a = AST_LIST_REMOVE_HEAD(&d->addons, list))) {
 			free(a);
 		}
-		AST_LIST_REMOVE_CURRENT(list);
+		skinny_index_unlink(device_index, d, NULL, d->id, 0);
+		AST_RWLIST_REMOVE_CURRENT(list);
 		d = skinny_device_destroy(d);
 	}
-	AST_LIST_TRAVERSE_SAFE_END;
-	AST_LIST_UNLOCK(&devices);
+	AST_RWLIST_TRAVERSE_SAFE_END;
+	AST_RWLIST_UNLOCK(&devices);
 
 	AST_LIST_LOCK(&lines);  
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&lines, l, all) {
@@ -7889,7 +8081,7 @@ int skinny_reload(void)
 	AST_LIST_TRAVERSE_SAFE_END;
 	AST_LIST_UNLOCK(&lines);  
 
-	AST_LIST_TRAVERSE(&devices, d, list) {
+	AST_RWLIST_TRAVERSE(&devices, d, list) {
 		/* Do a soft reset to re-register the devices after
 		   cleaning up the removed devices and lines */
 		if (d->session) {
@@ -7923,6 +8115,12 @@ static int load_module(void)
 	for (; res < ARRAY_LEN(soft_key_template_default); res++) {
 		soft_key_template_default[res].softKeyEvent = htolel(soft_key_template_default[res].softKeyEvent);
 	}
+	if (!(device_index = ao2_container_alloc(SKINNY_INDEX_BUCKETS, skinny_index_name_hash, skinny_index_name_cmp))
+		|| !(line_index = ao2_container_alloc(SKINNY_INDEX_BUCKETS, skinny_index_name_hash, skinny_index_name_cmp))
+		|| !(subchannel_index = ao2_container_alloc(SKINNY_INDEX_BUCKETS, skinny_index_callid_hash, skinny_index_callid_cmp))) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	/* load and parse config */
 	res = config_load();
 	if (res == -1) {
@@ -8004,6 +8202,10 @@ static int unload_module(void)
 
 	delete_devices();
 
+	ao2_ref(device_index, -1);
+	ao2_ref(line_index, -1);
+	ao2_ref(subchannel_index, -1);
+
 	ast_mutex_lock(&netlock);
 	if (accept_t && (accept_t != AST_PTHREADT_STOP)) {
 		pthread_cancel(accept_t);
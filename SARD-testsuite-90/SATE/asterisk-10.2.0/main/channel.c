@@ -67,6 +67,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 357265 $")
 #include "asterisk/stringfields.h"
 #include "asterisk/global_datastores.h"
 #include "asterisk/data.h"
+#include "asterisk/options.h"
+#include "asterisk/hashtab.h"
 
 #ifdef HAVE_EPOLL
 #include <sys/epoll.h>
@@ -81,6 +83,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 357265 $")
 struct ast_epoll_data {
 	struct ast_channel *chan;
 	int which;
+	/*! Changes whenever the fd is set, so that a reused fd number is noticed */
+	unsigned int gen;
 };
 
 /* uncomment if you have problems with 'monitoring' synchronized files */
@@ -94,6 +98,10 @@ static int shutting_down;
 
 static int uniqueint;
 
+#ifdef HAVE_EPOLL
+static int epoll_data_gen;
+#endif
+
 unsigned long global_fin, global_fout;
 
 AST_THREADSTORAGE(state2str_threadbuf);
@@ -606,9 +614,211 @@ static char *handle_cli_core_show_channeltype(struct ast_cli_entry *e, int cmd,
 	return CLI_SUCCESS;
 }
 
+/*! Frames whose time on the read queue is measured at once */
+#define READQ_TRACK 64
+
+/*! \brief Read queue counters, kept on a channel datastore */
+struct readq_stats {
+	/*! Frames on the queue, and how many of them are voice */
+	unsigned int frames;
+	unsigned int voice_frames;
+	/*! Longest the queue has been */
+	unsigned int max_frames;
+	/*! Frames queued, read, and dropped because the queue was too long */
+	uint64_t enqueued;
+	uint64_t dequeued;
+	uint64_t dropped;
+	/*! Time from being queued to being read, in microseconds */
+	uint64_t latency_total;
+	unsigned int latency_max;
+	uint64_t latency_samples;
+	/*! When the frames at the tail of the queue were queued, oldest first */
+	struct {
+		const struct ast_frame *f;
+		struct timeval tv;
+	} track[READQ_TRACK];
+	unsigned int track_head;
+	unsigned int track_count;
+};
+
+static const struct ast_datastore_info readq_stats_info = {
+	.type = "readq_stats",
+	.destroy = ast_free_ptr,
+};
+
+/*!
+ * \brief Find the read queue counters of a channel, which must be locked.
+ *
+ * This runs for every frame queued and read, so the datastore is kept at
+ * the head of the channel's datastore list, where it is found without a
+ * walk.  The list is only walked, and the datastore moved back to the
+ * front, after another datastore was added in front of it.
+ */
+static struct readq_stats *readq_stats_find(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore = AST_LIST_FIRST(&chan->datastores);
+
+	if (datastore && datastore->info == &readq_stats_info) {
+		return datastore->data;
+	}
+	if (!(datastore = ast_channel_datastore_find(chan, &readq_stats_info, NULL))) {
+		return NULL;
+	}
+	AST_LIST_REMOVE(&chan->datastores, datastore, entry);
+	AST_LIST_INSERT_HEAD(&chan->datastores, datastore, entry);
+	return datastore->data;
+}
+
+/*! \brief Find or create the read queue counters of a channel, which must be locked */
+static struct readq_stats *readq_stats_get(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore;
+	struct readq_stats *stats;
+	struct ast_frame *cur;
+
+	if ((stats = readq_stats_find(chan))) {
+		return stats;
+	}
+	if (!(datastore = ast_datastore_alloc(&readq_stats_info, NULL))) {
+		return NULL;
+	}
+	if (!(stats = ast_calloc(1, sizeof(*stats)))) {
+		ast_datastore_free(datastore);
+		return NULL;
+	}
+	/* Frames may have been queued before we were asked to count them */
+	AST_LIST_TRAVERSE(&chan->readq, cur, frame_list) {
+		stats->frames++;
+		if (cur->frametype == AST_FRAME_VOICE) {
+			stats->voice_frames++;
+		}
+	}
+	stats->max_frames = stats->frames;
+	datastore->data = stats;
+	ast_channel_datastore_add(chan, datastore);
+	return stats;
+}
+
+/*! \brief Recount the frames on a channel's read queue, after it was changed behind our back */
+static void readq_stats_recount(struct ast_channel *chan, struct readq_stats *stats)
+{
+	struct ast_frame *cur;
+
+	stats->frames = stats->voice_frames = 0;
+	AST_LIST_TRAVERSE(&chan->readq, cur, frame_list) {
+		stats->frames++;
+		if (cur->frametype == AST_FRAME_VOICE) {
+			stats->voice_frames++;
+		}
+	}
+	stats->track_count = 0;
+}
+
+static void readq_stats_track(struct readq_stats *stats, const struct ast_frame *f, struct timeval now)
+{
+	unsigned int slot;
+
+	if (stats->track_count == READQ_TRACK) {
+		stats->track_head = (stats->track_head + 1) % READQ_TRACK;
+		stats->track_count--;
+	}
+	slot = (stats->track_head + stats->track_count++) % READQ_TRACK;
+	stats->track[slot].f = f;
+	stats->track[slot].tv = now;
+}
+
+static void readq_stats_dequeue(struct readq_stats *stats, const struct ast_frame *f)
+{
+	unsigned int i, slot;
+	int64_t latency;
+
+	stats->dequeued++;
+	if (stats->frames) {
+		stats->frames--;
+	}
+	if (f->frametype == AST_FRAME_VOICE && stats->voice_frames) {
+		stats->voice_frames--;
+	}
+
+	/* Frames are nearly always read in the order they were queued, so
+	 * anything tracked before this one has left the queue some other way. */
+	for (i = 0; i < stats->track_count; i++) {
+		slot = (stats->track_head + i) % READQ_TRACK;
+		if (stats->track[slot].f != f) {
+			continue;
+		}
+		latency = ast_tvdiff_us(ast_tvnow(), stats->track[slot].tv);
+		if (latency >= 0) {
+			stats->latency_total += latency;
+			stats->latency_samples++;
+			if (latency > stats->latency_max) {
+				stats->latency_max = latency;
+			}
+		}
+		stats->track_head = (slot + 1) % READQ_TRACK;
+		stats->track_count -= i + 1;
+		break;
+	}
+}
+
+/*! \brief Show read queue counters - CLI command */
+static char *handle_cli_core_show_readq(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+#define FORMAT "%-40.40s %6s %6s %10s %10s %8s %10s %10s\n"
+#define FORMAT2 "%-40.40s %6u %6u %10llu %10llu %8llu %10llu %10u\n"
+	struct ast_channel_iterator *iter;
+	struct ast_channel *chan;
+	struct ast_datastore *datastore;
+	struct readq_stats *stats;
+	int count = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core show readq";
+		e->usage =
+			"Usage: core show readq [<channel>]\n"
+			"       Shows the length of the channels' read queues, how many frames\n"
+			"       went through them and how long the frames waited, in microseconds.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return ast_complete_channels(a->line, a->word, a->pos, a->n, 3);
+	}
+
+	if (a->argc != 3 && a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	iter = a->argc == 4 ? ast_channel_iterator_by_name_new(a->argv[3], 0) : ast_channel_iterator_all_new();
+	if (!iter) {
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, FORMAT, "Channel", "Qlen", "Max", "Queued", "Read", "Dropped", "Avg wait", "Max wait");
+	for (; (chan = ast_channel_iterator_next(iter)); ast_channel_unref(chan)) {
+		ast_channel_lock(chan);
+		if ((datastore = ast_channel_datastore_find(chan, &readq_stats_info, NULL))) {
+			stats = datastore->data;
+			ast_cli(a->fd, FORMAT2, chan->name, stats->frames, stats->max_frames,
+				(unsigned long long) stats->enqueued, (unsigned long long) stats->dequeued,
+				(unsigned long long) stats->dropped,
+				(unsigned long long) (stats->latency_samples ? stats->latency_total / stats->latency_samples : 0),
+				stats->latency_max);
+			count++;
+		}
+		ast_channel_unlock(chan);
+	}
+	ast_channel_iterator_destroy(iter);
+
+	ast_cli(a->fd, "%d channel%s\n", count, ESS(count));
+
+	return CLI_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+
 static struct ast_cli_entry cli_channel[] = {
 	AST_CLI_DEFINE(handle_cli_core_show_channeltypes, "List available channel types"),
-	AST_CLI_DEFINE(handle_cli_core_show_channeltype,  "Give more details on that channel type")
+	AST_CLI_DEFINE(handle_cli_core_show_channeltype,  "Give more details on that channel type"),
+	AST_CLI_DEFINE(handle_cli_core_show_readq,        "Show read queue statistics of channels")
 };
 
 static struct ast_frame *kill_read(struct ast_channel *chan)
@@ -1413,12 +1623,34 @@ static int __ast_queue_frame(struct ast_channel *chan, struct ast_frame *fin, in
 {
 	struct ast_frame *f;
 	struct ast_frame *cur;
+	struct readq_stats *stats, nostats;
+	struct timeval now;
 	unsigned int new_frames = 0;
 	unsigned int new_voice_frames = 0;
-	unsigned int queued_frames = 0;
-	unsigned int queued_voice_frames = 0;
+	int was_empty;
 	AST_LIST_HEAD_NOLOCK(, ast_frame) frames;
 
+	/*
+	 * Build copies of all the new frames and count them.  This is
+	 * done before locking the channel, so that whoever reads from it
+	 * does not wait on our allocations.
+	 */
+	AST_LIST_HEAD_INIT_NOLOCK(&frames);
+	for (cur = fin; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+		if (!(f = ast_frdup(cur))) {
+			if (AST_LIST_FIRST(&frames)) {
+				ast_frfree(AST_LIST_FIRST(&frames));
+			}
+			return -1;
+		}
+
+		AST_LIST_INSERT_TAIL(&frames, f, frame_list);
+		new_frames++;
+		if (f->frametype == AST_FRAME_VOICE) {
+			new_voice_frames++;
+		}
+	}
+
 	ast_channel_lock(chan);
 
 	/*
@@ -1437,6 +1669,9 @@ static int __ast_queue_frame(struct ast_channel *chan, struct ast_frame *fin, in
 				 */
 				AST_LIST_REMOVE(&chan->readq, cur, frame_list);
 				ast_frfree(cur);
+				if ((stats = readq_stats_find(chan)) && stats->frames) {
+					stats->frames--;
+				}
 
 				/*
 				 * This has degenerated to a normal queue append anyway.  Since
@@ -1450,41 +1685,28 @@ static int __ast_queue_frame(struct ast_channel *chan, struct ast_frame *fin, in
 		case AST_CONTROL_HANGUP:
 			/* Don't queue anything. */
 			ast_channel_unlock(chan);
+			ast_frfree(AST_LIST_FIRST(&frames));
 			return 0;
 		default:
 			break;
 		}
 	}
 
-	/* Build copies of all the new frames and count them */
-	AST_LIST_HEAD_INIT_NOLOCK(&frames);
-	for (cur = fin; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
-		if (!(f = ast_frdup(cur))) {
-			if (AST_LIST_FIRST(&frames)) {
-				ast_frfree(AST_LIST_FIRST(&frames));
-			}
-			ast_channel_unlock(chan);
-			return -1;
-		}
-
-		AST_LIST_INSERT_TAIL(&frames, f, frame_list);
-		new_frames++;
-		if (f->frametype == AST_FRAME_VOICE) {
-			new_voice_frames++;
-		}
+	/* The queue is counted as it changes, rather than walked every time */
+	if (!(stats = readq_stats_get(chan))) {
+		/* Queue anyway; without counters, count the queue as we go */
+		stats = &nostats;
+		memset(stats, 0, sizeof(*stats));
+		readq_stats_recount(chan, stats);
 	}
 
-	/* Count how many frames exist on the queue */
-	AST_LIST_TRAVERSE(&chan->readq, cur, frame_list) {
-		queued_frames++;
-		if (cur->frametype == AST_FRAME_VOICE) {
-			queued_voice_frames++;
-		}
+	if ((stats->frames + new_frames > 128 || stats->voice_frames + new_voice_frames > 96)) {
+		/* Only trust the counts when acting on them */
+		readq_stats_recount(chan, stats);
 	}
-
-	if ((queued_frames + new_frames > 128 || queued_voice_frames + new_voice_frames > 96)) {
+	if ((stats->frames + new_frames > 128 || stats->voice_frames + new_voice_frames > 96)) {
 		int count = 0;
-		ast_log(LOG_WARNING, "Exceptionally long %squeue length queuing to %s\n", queued_frames + new_frames > 128 ? "" : "voice ", chan->name);
+		ast_log(LOG_WARNING, "Exceptionally long %squeue length queuing to %s\n", stats->frames + new_frames > 128 ? "" : "voice ", chan->name);
 		AST_LIST_TRAVERSE_SAFE_BEGIN(&chan->readq, cur, frame_list) {
 			/* Save the most recent frame */
 			if (!AST_LIST_NEXT(cur, frame_list)) {
@@ -1494,12 +1716,26 @@ static int __ast_queue_frame(struct ast_channel *chan, struct ast_frame *fin, in
 					break;
 				}
 				AST_LIST_REMOVE_CURRENT(frame_list);
+				stats->frames--;
+				if (cur->frametype == AST_FRAME_VOICE) {
+					stats->voice_frames--;
+				}
+				stats->dropped++;
 				ast_frfree(cur);
 			}
 		}
 		AST_LIST_TRAVERSE_SAFE_END;
 	}
 
+	was_empty = AST_LIST_EMPTY(&chan->readq);
+	if (!after && !head) {
+		/* Only appended frames are timed; they leave the queue in order */
+		now = ast_tvnow();
+		AST_LIST_TRAVERSE(&frames, cur, frame_list) {
+			readq_stats_track(stats, cur, now);
+		}
+	}
+
 	if (after) {
 		AST_LIST_INSERT_LIST_AFTER(&chan->readq, &frames, after, frame_list);
 	} else {
@@ -1510,13 +1746,25 @@ static int __ast_queue_frame(struct ast_channel *chan, struct ast_frame *fin, in
 		AST_LIST_APPEND_LIST(&chan->readq, &frames, frame_list);
 	}
 
+	stats->frames += new_frames;
+	stats->voice_frames += new_voice_frames;
+	stats->enqueued += new_frames;
+	if (stats->frames > stats->max_frames) {
+		stats->max_frames = stats->frames;
+	}
+
+	/*
+	 * The alertpipe stays readable for as long as there is anything on
+	 * the queue, so it only needs a poke when the queue stops being
+	 * empty, however many frames were queued; __ast_read() drains it
+	 * once the queue is empty again.
+	 */
 	if (chan->alertpipe[1] > -1) {
-		int blah[new_frames];
+		int poke = 0;
 
-		memset(blah, 1, sizeof(blah));
-		if (write(chan->alertpipe[1], &blah, sizeof(blah)) != (sizeof(blah))) {
-			ast_log(LOG_WARNING, "Unable to write to alert pipe on %s (qlen = %d): %s!\n",
-				chan->name, queued_frames, strerror(errno));
+		if (was_empty && write(chan->alertpipe[1], &poke, sizeof(poke)) != sizeof(poke)) {
+			ast_log(LOG_WARNING, "Unable to write to alert pipe on %s (qlen = %u): %s!\n",
+				chan->name, stats->frames, strerror(errno));
 		}
 	} else if (chan->timingfd > -1) {
 		ast_timer_enable_continuous(chan->timer);
@@ -2620,6 +2868,7 @@ void ast_channel_set_fd(struct ast_channel *chan, int which, int fd)
 		chan->epfd_data[which] = aed;
 		aed->chan = chan;
 		aed->which = which;
+		aed->gen = ast_atomic_fetchadd_int(&epoll_data_gen, +1);
 		
 		ev.events = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP;
 		ev.data.ptr = aed;
@@ -2694,8 +2943,13 @@ void ast_channel_clear_softhangup(struct ast_channel *chan, int flag)
 		fr = AST_LIST_LAST(&chan->readq);
 		if (fr && fr->frametype == AST_FRAME_CONTROL &&
 				fr->subclass.integer == AST_CONTROL_END_OF_Q) {
+			struct readq_stats *stats;
+
 			AST_LIST_REMOVE(&chan->readq, fr, frame_list);
 			ast_frfree(fr);
+			if ((stats = readq_stats_find(chan))) {
+				readq_stats_recount(chan, stats);
+			}
 		}
 	}
 
@@ -3395,14 +3649,228 @@ static struct ast_channel *ast_waitfor_nandfds_simple(struct ast_channel *chan,
 	return chan;
 }
 
-static struct ast_channel *ast_waitfor_nandfds_complex(struct ast_channel **c, int n, int *ms)
+/*! \brief A file descriptor registered in a thread's wait set */
+struct ast_waitfor_reg {
+	int fd;
+	/*! ast_epoll_data generation of the fd when it was registered */
+	unsigned int gen;
+	/*! Position of the channel in c[] and fd number, as given to epoll */
+	uint64_t data;
+};
+
+/*!
+ * \brief The epoll set a thread waits on channels with.
+ *
+ * It is kept from one call to the next, and only the file descriptors
+ * that were added, removed or replaced (by a fixup or masquerade) since
+ * the last call are updated.  Waiting on the same channels again, which
+ * is what bridges and dialing loops do for every frame, costs nothing
+ * but the epoll_wait() itself.
+ */
+struct ast_waitfor_set {
+	int epfd;
+	/*! The channels of the last call */
+	struct ast_channel **chans;
+	/*! Their fds and generations on the last call, AST_MAX_FDS per channel */
+	int *fds;
+	unsigned int *gens;
+	int nchans;
+	int chansize;
+	/*! What is in the epoll set, sorted by fd */
+	struct ast_waitfor_reg *regs;
+	int nregs;
+};
+
+/*! Individual fds are told apart from channel fds by this bit */
+#define WAITFOR_DATA_FD (1ULL << 63)
+/*! At most this many events are collected per wait */
+#define WAITFOR_MAX_EVENTS 64
+
+static int waitfor_set_init(void *data)
+{
+	struct ast_waitfor_set *set = data;
+
+	set->epfd = epoll_create(WAITFOR_MAX_EVENTS);
+	return 0;
+}
+
+static void waitfor_set_cleanup(void *data)
+{
+	struct ast_waitfor_set *set = data;
+
+	if (set->epfd > -1) {
+		close(set->epfd);
+	}
+	ast_free(set->chans);
+	ast_free(set->fds);
+	ast_free(set->gens);
+	ast_free(set->regs);
+	ast_free(set);
+}
+
+AST_THREADSTORAGE_CUSTOM(waitfor_set_buf, waitfor_set_init, waitfor_set_cleanup);
+
+static int waitfor_reg_cmp(const void *a, const void *b)
+{
+	const struct ast_waitfor_reg *reg_a = a, *reg_b = b;
+
+	return reg_a->fd - reg_b->fd;
+}
+
+/*! \brief Add or update an fd in the epoll set, whatever the kernel thinks it holds */
+static int waitfor_set_add(int epfd, int fd, uint64_t data)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP, };
+
+	ev.data.u64 = data;
+	if (!epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		return 0;
+	}
+	/* Already there, or a closed fd that was not yet dropped was reused */
+	return errno == EEXIST ? epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) : -1;
+}
+
+/*! \brief Start over with an empty set, after it could not be updated */
+static void waitfor_set_reset(struct ast_waitfor_set *set)
+{
+	close(set->epfd);
+	set->epfd = epoll_create(WAITFOR_MAX_EVENTS);
+	set->nchans = 0;
+	set->nregs = 0;
+}
+
+/*!
+ * \brief Bring a thread's epoll set up to date with the channels to wait on.
+ * \retval 0 the set holds exactly the fds of c[]
+ * \retval -1 the set could not be updated and must not be used
+ */
+static int waitfor_set_sync(struct ast_waitfor_set *set, struct ast_channel **c, int n)
+{
+	struct ast_waitfor_reg *regs = NULL;
+	int x, y, nregs = 0, old, res = 0;
+	size_t size = n * AST_MAX_FDS;
+
+	/* Same channels as last time, with the same fds: nothing to do */
+	if (n == set->nchans && !memcmp(c, set->chans, n * sizeof(*c))) {
+		for (x = 0; x < n; x++) {
+			for (y = 0; y < AST_MAX_FDS; y++) {
+				if (c[x]->fds[y] != set->fds[x * AST_MAX_FDS + y]
+					|| (c[x]->fds[y] > -1 && c[x]->epfd_data[y]
+						&& c[x]->epfd_data[y]->gen != set->gens[x * AST_MAX_FDS + y])) {
+					break;
+				}
+			}
+			if (y < AST_MAX_FDS) {
+				break;
+			}
+		}
+		if (x == n) {
+			return 0;
+		}
+	}
+
+	if (n > set->chansize) {
+		struct ast_channel **chans;
+		int *fds;
+		unsigned int *gens;
+
+		if (!(chans = ast_realloc(set->chans, n * sizeof(*chans)))) {
+			return -1;
+		}
+		set->chans = chans;
+		if (!(fds = ast_realloc(set->fds, size * sizeof(*fds)))) {
+			return -1;
+		}
+		set->fds = fds;
+		if (!(gens = ast_realloc(set->gens, size * sizeof(*gens)))) {
+			return -1;
+		}
+		set->gens = gens;
+		set->chansize = n;
+	}
+	if (!(regs = ast_malloc(size * sizeof(*regs)))) {
+		return -1;
+	}
+	set->nchans = 0;
+
+	/* What we want in the set, sorted by fd so it can be compared with what is there */
+	for (x = 0; x < n; x++) {
+		for (y = 0; y < AST_MAX_FDS; y++) {
+			struct ast_epoll_data *aed = c[x]->epfd_data[y];
+			int fd = c[x]->fds[y];
+
+			set->fds[x * AST_MAX_FDS + y] = fd;
+			set->gens[x * AST_MAX_FDS + y] = aed ? aed->gen : 0;
+			if (fd < 0) {
+				continue;
+			}
+			regs[nregs].fd = fd;
+			regs[nregs].gen = aed ? aed->gen : 0;
+			regs[nregs].data = ((uint64_t) x << 8) | y;
+			nregs++;
+		}
+	}
+	qsort(regs, nregs, sizeof(*regs), waitfor_reg_cmp);
+
+	/* An fd shared by two channels (say, during a masquerade) goes to the first */
+	for (x = 0, y = 0; x < nregs; x++) {
+		if (y && regs[y - 1].fd == regs[x].fd) {
+			if (regs[x].data < regs[y - 1].data) {
+				regs[y - 1] = regs[x];
+			}
+			continue;
+		}
+		regs[y++] = regs[x];
+	}
+	nregs = y;
+
+	/* Walk both sorted lists, changing only what differs */
+	for (x = 0, old = 0; x < nregs || old < set->nregs; ) {
+		struct ast_waitfor_reg *want = x < nregs ? &regs[x] : NULL;
+		struct ast_waitfor_reg *have = old < set->nregs ? &set->regs[old] : NULL;
+
+		if (!want || (have && have->fd < want->fd)) {
+			struct epoll_event ev;
+
+			/* Not wanted any more.  It may already be gone if it was closed. */
+			epoll_ctl(set->epfd, EPOLL_CTL_DEL, have->fd, &ev);
+			old++;
+		} else if (!have || want->fd < have->fd) {
+			res |= waitfor_set_add(set->epfd, want->fd, want->data);
+			x++;
+		} else {
+			if (want->gen != have->gen || want->data != have->data) {
+				res |= waitfor_set_add(set->epfd, want->fd, want->data);
+			}
+			x++;
+			old++;
+		}
+	}
+
+	ast_free(set->regs);
+	set->regs = regs;
+	set->nregs = nregs;
+	if (res) {
+		waitfor_set_reset(set);
+		return -1;
+	}
+	memcpy(set->chans, c, n * sizeof(*c));
+	set->nchans = n;
+
+	return 0;
+}
+
+static struct ast_channel *ast_waitfor_nandfds_complex(struct ast_channel **c, int n, int *fds, int nfds,
+					int *exception, int *outfd, int *ms, struct ast_waitfor_set *set)
 {
 	struct timeval start = { 0 , 0 };
-	int res = 0, i;
-	struct epoll_event ev[25] = { { 0, } };
+	int res = 0, i, x, y;
+	struct epoll_event ev[WAITFOR_MAX_EVENTS];
 	struct timeval now = { 0, 0 };
 	long whentohangup = 0, diff = 0, rms = *ms;
 	struct ast_channel *winner = NULL;
+	uint64_t best = 0;
+	int fdwinner = 0;
 
 	for (i = 0; i < n; i++) {
 		if (c[i]->masq && ast_do_masquerade(c[i])) {
@@ -3424,9 +3892,35 @@ static struct ast_channel *ast_waitfor_nandfds_complex(struct ast_channel **c, i
 				whentohangup = diff;
 		}
 		ast_channel_unlock(c[i]);
-		CHECK_BLOCKING(c[i]);
 	}
 
+	/* Masquerades are done, so the fds are final */
+	if (waitfor_set_sync(set, c, n)) {
+		return ast_waitfor_nandfds_classic(c, n, fds, nfds, exception, outfd, ms);
+	}
+
+	/* Individual fds come and go with every call */
+	for (x = 0; x < nfds; x++) {
+		if (fds[x] < 0) {
+			continue;
+		}
+		for (y = 0; y < set->nregs && set->regs[y].fd != fds[x]; y++);
+		if (y < set->nregs || waitfor_set_add(set->epfd, fds[x], WAITFOR_DATA_FD | x)) {
+			/* Also a channel fd, or unusable: leave this one to poll() */
+			for (y = 0; y < x; y++) {
+				struct epoll_event dummy;
+
+				if (fds[y] > -1) {
+					epoll_ctl(set->epfd, EPOLL_CTL_DEL, fds[y], &dummy);
+				}
+			}
+			return ast_waitfor_nandfds_classic(c, n, fds, nfds, exception, outfd, ms);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		CHECK_BLOCKING(c[i]);
+
 	rms = *ms;
 	if (whentohangup) {
 		rms = whentohangup;
@@ -3437,11 +3931,19 @@ static struct ast_channel *ast_waitfor_nandfds_complex(struct ast_channel **c, i
 	if (*ms > 0)
 		start = ast_tvnow();
 
-	res = epoll_wait(c[0]->epfd, ev, 25, rms);
+	res = epoll_wait(set->epfd, ev, WAITFOR_MAX_EVENTS, rms);
 
 	for (i = 0; i < n; i++)
 		ast_clear_flag(c[i], AST_FLAG_BLOCKING);
 
+	for (x = 0; x < nfds; x++) {
+		struct epoll_event dummy;
+
+		if (fds[x] > -1) {
+			epoll_ctl(set->epfd, EPOLL_CTL_DEL, fds[x], &dummy);
+		}
+	}
+
 	if (res < 0) {
 		if (errno != EINTR)
 			*ms = -1;
@@ -3464,18 +3966,38 @@ static struct ast_channel *ast_waitfor_nandfds_complex(struct ast_channel **c, i
 		return winner;
 	}
 
+	/*
+	 * Pick the same winner poll() would have: individual fds first,
+	 * then the channel fd that comes last in c[] and fds[].
+	 */
 	for (i = 0; i < res; i++) {
-		struct ast_epoll_data *aed = ev[i].data.ptr;
+		uint64_t data = ev[i].data.u64;
 
-		if (!ev[i].events || !aed)
+		if (!ev[i].events) {
 			continue;
-
-		winner = aed->chan;
+		}
+		if (data & WAITFOR_DATA_FD) {
+			if (!fdwinner || data >= best) {
+				best = data;
+				fdwinner = 1;
+				if (outfd)
+					*outfd = fds[data & ~WAITFOR_DATA_FD];
+				if (exception)
+					*exception = (ev[i].events & EPOLLPRI) ? -1 : 0;
+			}
+			winner = NULL;
+			continue;
+		}
+		if (fdwinner || (winner && data < best) || (data >> 8) >= n) {
+			continue;
+		}
+		best = data;
+		winner = c[data >> 8];
 		if (ev[i].events & EPOLLPRI)
 			ast_set_flag(winner, AST_FLAG_EXCEPTION);
 		else
 			ast_clear_flag(winner, AST_FLAG_EXCEPTION);
-		winner->fdno = aed->which;
+		winner->fdno = data & 0xff;
 	}
 
 	if (*ms > 0) {
@@ -3490,19 +4012,23 @@ static struct ast_channel *ast_waitfor_nandfds_complex(struct ast_channel **c, i
 struct ast_channel *ast_waitfor_nandfds(struct ast_channel **c, int n, int *fds, int nfds,
 					int *exception, int *outfd, int *ms)
 {
+	struct ast_waitfor_set *set;
+
 	/* Clear all provided values in one place. */
 	if (outfd)
 		*outfd = -99999;
 	if (exception)
 		*exception = 0;
 
-	/* If no epoll file descriptor is available resort to classic nandfds */
-	if (!n || nfds || c[0]->epfd == -1)
-		return ast_waitfor_nandfds_classic(c, n, fds, nfds, exception, outfd, ms);
-	else if (!nfds && n == 1)
+	/* A single channel waits on its own epoll set */
+	if (n == 1 && !nfds && c[0]->epfd > -1)
 		return ast_waitfor_nandfds_simple(c[0], ms);
-	else
-		return ast_waitfor_nandfds_complex(c, n, ms);
+
+	/* Anything else uses the thread's, if one is available */
+	if (n && (set = ast_threadstorage_get(&waitfor_set_buf, sizeof(*set))) && set->epfd > -1)
+		return ast_waitfor_nandfds_complex(c, n, fds, nfds, exception, outfd, ms, set);
+
+	return ast_waitfor_nandfds_classic(c, n, fds, nfds, exception, outfd, ms);
 }
 #endif
 
@@ -3763,10 +4289,39 @@ static inline int calc_monitor_jump(int samples, int sample_rate, int seek_rate)
 	return samples;
 }
 
+/*!
+ * \brief Empty a channel's alertpipe
+ * \note Only called with the channel locked and nothing on its read queue.
+ * \retval -1 the alertpipe could not be made nonblocking
+ */
+static int alertpipe_drain(struct ast_channel *chan)
+{
+	int flags = fcntl(chan->alertpipe[0], F_GETFL);
+	int blah[16];
+	ssize_t res;
+
+	/* For some odd reason, the alertpipe occasionally loses nonblocking status,
+	 * which immediately causes a deadlock scenario.  Detect and prevent this. */
+	if ((flags & O_NONBLOCK) == 0) {
+		ast_log(LOG_ERROR, "Alertpipe on channel %s lost O_NONBLOCK?!!\n", chan->name);
+		if (fcntl(chan->alertpipe[0], F_SETFL, flags | O_NONBLOCK) < 0) {
+			ast_log(LOG_WARNING, "Unable to set alertpipe nonblocking! (%d: %s)\n", errno, strerror(errno));
+			return -1;
+		}
+	}
+	do {
+		res = read(chan->alertpipe[0], blah, sizeof(blah));
+	} while (res == sizeof(blah));
+	if (res < 0 && errno != EINTR && errno != EAGAIN) {
+		ast_log(LOG_WARNING, "read() failed: %s\n", strerror(errno));
+	}
+	return 0;
+}
+
 static struct ast_frame *__ast_read(struct ast_channel *chan, int dropaudio)
 {
 	struct ast_frame *f = NULL;	/* the return value */
-	int blah;
+	struct readq_stats *stats;
 	int prestate;
 	int cause = 0;
 
@@ -3828,23 +4383,11 @@ static struct ast_frame *__ast_read(struct ast_channel *chan, int dropaudio)
 
 	prestate = chan->_state;
 
-	/* Read and ignore anything on the alertpipe, but read only
-	   one sizeof(blah) per frame that we send from it */
-	if (chan->alertpipe[0] > -1) {
-		int flags = fcntl(chan->alertpipe[0], F_GETFL);
-		/* For some odd reason, the alertpipe occasionally loses nonblocking status,
-		 * which immediately causes a deadlock scenario.  Detect and prevent this. */
-		if ((flags & O_NONBLOCK) == 0) {
-			ast_log(LOG_ERROR, "Alertpipe on channel %s lost O_NONBLOCK?!!\n", chan->name);
-			if (fcntl(chan->alertpipe[0], F_SETFL, flags | O_NONBLOCK) < 0) {
-				ast_log(LOG_WARNING, "Unable to set alertpipe nonblocking! (%d: %s)\n", errno, strerror(errno));
-				f = &ast_null_frame;
-				goto done;
-			}
-		}
-		if (read(chan->alertpipe[0], &blah, sizeof(blah)) < 0) {
-			if (errno != EINTR && errno != EAGAIN)
-				ast_log(LOG_WARNING, "read() failed: %s\n", strerror(errno));
+	/* The alertpipe is only drained once the read queue is empty, see __ast_queue_frame() */
+	if (chan->alertpipe[0] > -1 && AST_LIST_EMPTY(&chan->readq) && chan->fdno == AST_ALERT_FD) {
+		if (alertpipe_drain(chan)) {
+			f = &ast_null_frame;
+			goto done;
 		}
 	}
 
@@ -3917,15 +4460,15 @@ static struct ast_frame *__ast_read(struct ast_channel *chan, int dropaudio)
 		AST_LIST_TRAVERSE_SAFE_END;
 		
 		if (!f) {
-			/* There were no acceptable frames on the readq. */
+			/* There were no acceptable frames on the readq.  They are still
+			 * there, so the alertpipe is left as it is. */
 			f = &ast_null_frame;
-			if (chan->alertpipe[0] > -1) {
-				int poke = 0;
-				/* Restore the state of the alertpipe since we aren't ready for any
-				 * of the frames in the readq. */
-				if (write(chan->alertpipe[1], &poke, sizeof(poke)) != sizeof(poke)) {
-					ast_log(LOG_ERROR, "Failed to write to alertpipe: %s\n", strerror(errno));
-				}
+		} else {
+			if ((stats = readq_stats_find(chan))) {
+				readq_stats_dequeue(stats, f);
+			}
+			if (AST_LIST_EMPTY(&chan->readq) && chan->alertpipe[0] > -1) {
+				alertpipe_drain(chan);
 			}
 		}
 
@@ -6786,6 +7329,8 @@ int ast_do_masquerade(struct ast_channel *original)
 	 */
 	{
 		AST_LIST_HEAD_NOLOCK(, ast_frame) tmp_readq;
+		struct readq_stats *stats;
+
 		AST_LIST_HEAD_SET_NOLOCK(&tmp_readq, NULL);
 
 		AST_LIST_APPEND_LIST(&tmp_readq, &original->readq, frame_list);
@@ -6801,6 +7346,10 @@ int ast_do_masquerade(struct ast_channel *original)
 				}
 			}
 		}
+
+		if ((stats = readq_stats_find(original))) {
+			readq_stats_recount(original, stats);
+		}
 	}
 
 	/* Swap the raw formats */
@@ -8173,7 +8722,19 @@ static const struct ast_data_entry channel_providers[] = {
 
 void ast_channels_init(void)
 {
-	channels = ao2_container_alloc(NUM_CHANNEL_BUCKETS,
+	int buckets = NUM_CHANNEL_BUCKETS;
+
+	/* The container can't grow later, so when asterisk.conf allows more
+	 * channels than the default table handles well, size it for maxcalls
+	 * (at two channels per bucket) up front. */
+	if (option_maxcalls / 2 > buckets) {
+		buckets = option_maxcalls / 2;
+		while (!ast_is_prime(buckets)) {
+			buckets++;
+		}
+	}
+
+	channels = ao2_container_alloc(buckets,
 			ast_channel_hash_cb, ast_channel_cmp_cb);
 
 	ast_cli_register_multiple(cli_channel, ARRAY_LEN(cli_channel));
@@ -99,6 +99,14 @@ struct ast_event {
  */
 struct ast_event_ref {
 	struct ast_event *event;
+	/*! Set once ie_offsets has been filled in by event_ref_index_ies() */
+	unsigned int indexed:1;
+	/*!
+	 * \brief Offset of the first IE of each type in the event, 0 if absent
+	 *
+	 * \note Only allocated for events being dispatched, see ast_event_queue().
+	 */
+	uint16_t ie_offsets[0];
 };
 
 struct ast_event_ie_val {
@@ -125,6 +133,8 @@ struct ast_event_sub {
 	uint32_t uniqueid;
 	AST_LIST_HEAD_NOLOCK(, ast_event_ie_val) ie_vals;
 	AST_RWDLLIST_ENTRY(ast_event_sub) entry;
+	/*! Entry in ast_event_sub_index, for indexed event types */
+	AST_DLLIST_ENTRY(ast_event_sub) index_entry;
 };
 
 static uint32_t sub_uniqueid;
@@ -133,6 +143,44 @@ static uint32_t sub_uniqueid;
  * The event subscribers are indexed by which event they are subscribed to */
 static AST_RWDLLIST_HEAD(ast_event_sub_list, ast_event_sub) ast_event_subs[AST_EVENT_TOTAL];
 
+#ifdef LOW_MEMORY
+#define NUM_SUB_BUCKETS 17
+#else
+#define NUM_SUB_BUCKETS 1021
+#endif
+
+AST_DLLIST_HEAD_NOLOCK(ast_event_sub_bucket, ast_event_sub);
+
+/*!
+ * \brief Subscribers of busy event types, indexed by one string IE.
+ *
+ * \details Subscriptions asking for a particular value of the key IE,
+ * such as one device, are kept in the bucket for the hash of that value.
+ * The others are kept in the unkeyed list.  An event is then only checked
+ * against one bucket and the unkeyed list instead of against every
+ * subscriber of its type.
+ *
+ * \note Every subscription also stays in ast_event_subs[], whose lock
+ * protects the index as well.
+ */
+static struct {
+	/*! \brief The IE subscriptions are keyed on */
+	enum ast_event_ie_type ie_type;
+	/*! \brief Allocated in ast_event_init() for the indexed event types */
+	struct ast_event_sub_bucket *buckets;
+	struct ast_event_sub_bucket unkeyed;
+} ast_event_sub_index[AST_EVENT_TOTAL] = {
+	[AST_EVENT_MWI] = {
+		.ie_type = AST_EVENT_IE_MAILBOX,
+	},
+	[AST_EVENT_DEVICE_STATE] = {
+		.ie_type = AST_EVENT_IE_DEVICE,
+	},
+	[AST_EVENT_DEVICE_STATE_CHANGE] = {
+		.ie_type = AST_EVENT_IE_DEVICE,
+	},
+};
+
 static int ast_event_cmp(void *obj, void *arg, int flags);
 static int ast_event_hash_mwi(const void *obj, const int flags);
 static int ast_event_hash_devstate(const void *obj, const int flags);
@@ -436,13 +484,81 @@ static int match_sub_ie_val_to_event(const struct ast_event_ie_val *sub_ie_val,
 	return res;
 }
 
+/*!
+ * \internal
+ * \brief Find the index list a subscription belongs on.
+ *
+ * \return The list, or NULL if the event type is not indexed.
+ */
+static struct ast_event_sub_bucket *sub_index_list(const struct ast_event_sub *sub)
+{
+	const struct ast_event_ie_val *ie_val;
+
+	if (!ast_event_sub_index[sub->type].buckets) {
+		return NULL;
+	}
+
+	AST_LIST_TRAVERSE(&sub->ie_vals, ie_val, entry) {
+		if (ie_val->ie_type == ast_event_sub_index[sub->type].ie_type
+			&& ie_val->ie_pltype == AST_EVENT_IE_PLTYPE_STR) {
+			return &ast_event_sub_index[sub->type].buckets[ie_val->payload.hash % NUM_SUB_BUCKETS];
+		}
+	}
+
+	return &ast_event_sub_index[sub->type].unkeyed;
+}
+
+/*!
+ * \internal
+ * \brief Check whether all of a subscription's IEs match a check list.
+ */
+static int match_sub_to_check_list(const struct ast_event_sub *sub, const struct ast_ev_check_list *check_ie_vals)
+{
+	const struct ast_event_ie_val *ie_val;
+
+	AST_LIST_TRAVERSE(&sub->ie_vals, ie_val, entry) {
+		if (!match_sub_ie_val_to_event(ie_val, check_ie_vals)) {
+			/* The current subscription ie did not match an event ie. */
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*!
+ * \internal
+ * \brief Find the bucket a check list could match in the subscriber index.
+ *
+ * \return The bucket, or NULL if every subscriber must be checked.
+ */
+static struct ast_event_sub_bucket *sub_index_check_bucket(enum ast_event_type type, const struct ast_ev_check_list *check_ie_vals)
+{
+	const struct ast_event_ie_val *ie_val;
+
+	if (!ast_event_sub_index[type].buckets) {
+		return NULL;
+	}
+
+	AST_LIST_TRAVERSE(&check_ie_vals->ie_vals, ie_val, entry) {
+		if (ie_val->ie_type == ast_event_sub_index[type].ie_type) {
+			break;
+		}
+	}
+	if (!ie_val || ie_val->ie_pltype != AST_EVENT_IE_PLTYPE_STR) {
+		return NULL;
+	}
+
+	return &ast_event_sub_index[type].buckets[ast_str_hash(ie_val->payload.str) % NUM_SUB_BUCKETS];
+}
+
 enum ast_event_subscriber_res ast_event_check_subscriber(enum ast_event_type type, ...)
 {
 	va_list ap;
 	enum ast_event_ie_type ie_type;
 	enum ast_event_subscriber_res res = AST_EVENT_SUB_NONE;
-	struct ast_event_ie_val *ie_val;
 	struct ast_event_sub *sub;
+	struct ast_event_sub_bucket *bucket;
 	struct ast_ev_check_list check_ie_vals = {
 		.ie_vals = AST_LIST_HEAD_NOLOCK_INIT_VALUE
 	};
@@ -508,15 +624,24 @@ enum ast_event_subscriber_res ast_event_check_subscriber(enum ast_event_type typ
 
 	for (i = 0; i < ARRAY_LEN(event_types); i++) {
 		AST_RWDLLIST_RDLOCK(&ast_event_subs[event_types[i]]);
-		if (want_specific_event) {
-			AST_RWDLLIST_TRAVERSE(&ast_event_subs[event_types[i]], sub, entry) {
-				AST_LIST_TRAVERSE(&sub->ie_vals, ie_val, entry) {
-					if (!match_sub_ie_val_to_event(ie_val, &check_ie_vals)) {
-						/* The current subscription ie did not match an event ie. */
+		if (want_specific_event
+			&& (bucket = sub_index_check_bucket(event_types[i], &check_ie_vals))) {
+			/* Only subscribers keyed on this value, or not keyed at all, can match. */
+			AST_DLLIST_TRAVERSE(bucket, sub, index_entry) {
+				if (match_sub_to_check_list(sub, &check_ie_vals)) {
+					break;
+				}
+			}
+			if (!sub) {
+				AST_DLLIST_TRAVERSE(&ast_event_sub_index[event_types[i]].unkeyed, sub, index_entry) {
+					if (match_sub_to_check_list(sub, &check_ie_vals)) {
 						break;
 					}
 				}
-				if (!ie_val) {
+			}
+		} else if (want_specific_event) {
+			AST_RWDLLIST_TRAVERSE(&ast_event_subs[event_types[i]], sub, entry) {
+				if (match_sub_to_check_list(sub, &check_ie_vals)) {
 					/* Everything matched.  A subscriber is looking for this event. */
 					break;
 				}
@@ -534,11 +659,66 @@ enum ast_event_subscriber_res ast_event_check_subscriber(enum ast_event_type typ
 	return sub ? AST_EVENT_SUB_EXISTS : AST_EVENT_SUB_NONE;
 }
 
+/*!
+ * \internal
+ * \brief Find the first IE of a type in an event.
+ *
+ * \param event event to search
+ * \param ie_offsets optional offset table built by event_ref_index_ies()
+ * \param ie_type IE type to look for
+ *
+ * \return The IE, or NULL if the event does not have one of this type.
+ */
+static const struct ast_event_ie *event_find_ie(const struct ast_event *event,
+		const uint16_t *ie_offsets, enum ast_event_ie_type ie_type)
+{
+	struct ast_event_iterator iterator;
+	int res;
+
+	if (ie_offsets) {
+		if (ie_type <= 0 || ie_type >= AST_EVENT_IE_TOTAL || !ie_offsets[ie_type]) {
+			return NULL;
+		}
+		return (const struct ast_event_ie *) (((const char *) event) + ie_offsets[ie_type]);
+	}
+
+	for (res = ast_event_iterator_init(&iterator, event); !res; res = ast_event_iterator_next(&iterator)) {
+		if (ast_event_iterator_get_ie_type(&iterator) == ie_type) {
+			return iterator.ie;
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \internal
+ * \brief Record where the first IE of each type is in a referenced event.
+ *
+ * \note The event_ref must have been allocated with room for the table.
+ */
+static void event_ref_index_ies(struct ast_event_ref *event_ref)
+{
+	struct ast_event_iterator iterator;
+	enum ast_event_ie_type ie_type;
+	int res;
+
+	memset(event_ref->ie_offsets, 0, sizeof(event_ref->ie_offsets[0]) * AST_EVENT_IE_TOTAL);
+	for (res = ast_event_iterator_init(&iterator, event_ref->event); !res; res = ast_event_iterator_next(&iterator)) {
+		ie_type = ast_event_iterator_get_ie_type(&iterator);
+		if (ie_type > 0 && ie_type < AST_EVENT_IE_TOTAL && !event_ref->ie_offsets[ie_type]) {
+			event_ref->ie_offsets[ie_type] = ((char *) iterator.ie) - ((char *) event_ref->event);
+		}
+	}
+	event_ref->indexed = 1;
+}
+
 /*!
  * \internal
  * \brief Check if an ie_val matches an event
  *
  * \param event event to check against
+ * \param ie_offsets optional IE offset table of event
  * \param ie_val IE value to check
  * \param event2 optional event, if specified, the value to compare against will be pulled
  *        from this event instead of from the ie_val structure.  In this case, only the IE
@@ -547,15 +727,18 @@ enum ast_event_subscriber_res ast_event_check_subscriber(enum ast_event_type typ
  * \retval 0 not matched
  * \retval non-zero matched
  */
-static int match_ie_val(const struct ast_event *event,
+static int match_ie_val(const struct ast_event *event, const uint16_t *ie_offsets,
 		const struct ast_event_ie_val *ie_val, const struct ast_event *event2)
 {
+	const struct ast_event_ie *ie = event_find_ie(event, ie_offsets, ie_val->ie_type);
+	const void *payload = ie ? ie->ie_payload : NULL;
+
 	switch (ie_val->ie_pltype) {
 	case AST_EVENT_IE_PLTYPE_UINT:
 	{
 		uint32_t val = event2 ? ast_event_get_ie_uint(event2, ie_val->ie_type) : ie_val->payload.uint;
 
-		return (val == ast_event_get_ie_uint(event, ie_val->ie_type)) ? 1 : 0;
+		return (val == (payload ? ntohl(get_unaligned_uint32(payload)) : 0)) ? 1 : 0;
 	}
 
 	case AST_EVENT_IE_PLTYPE_BITFLAGS:
@@ -566,21 +749,22 @@ static int match_ie_val(const struct ast_event *event,
 		 * If the subscriber has requested *any* of the bitflags that this event provides,
 		 * then it's a match.
 		 */
-		return (flags & ast_event_get_ie_bitflags(event, ie_val->ie_type)) ? 1 : 0;
+		return (flags & (payload ? ntohl(get_unaligned_uint32(payload)) : 0)) ? 1 : 0;
 	}
 
 	case AST_EVENT_IE_PLTYPE_STR:
 	{
+		const struct ast_event_ie_str_payload *str_payload = payload;
 		const char *str;
 		uint32_t hash;
 
 		hash = event2 ? ast_event_get_ie_str_hash(event2, ie_val->ie_type) : ie_val->payload.hash;
-		if (hash != ast_event_get_ie_str_hash(event, ie_val->ie_type)) {
+		if (hash != (str_payload ? str_payload->hash : 0)) {
 			return 0;
 		}
 
 		str = event2 ? ast_event_get_ie_str(event2, ie_val->ie_type) : ie_val->payload.str;
-		if (str && !strcmp(str, ast_event_get_ie_str(event, ie_val->ie_type))) {
+		if (str && str_payload && !strcmp(str, str_payload->str)) {
 			return 1;
 		}
 
@@ -593,13 +777,13 @@ static int match_ie_val(const struct ast_event *event,
 		uint16_t ie_payload_len = event2 ? ast_event_get_ie_raw_payload_len(event2, ie_val->ie_type) : ie_val->raw_datalen;
 
 		return (buf
-			&& ie_payload_len == ast_event_get_ie_raw_payload_len(event, ie_val->ie_type)
-			&& !memcmp(buf, ast_event_get_ie_raw(event, ie_val->ie_type), ie_payload_len)) ? 1 : 0;
+			&& ie_payload_len == (ie ? ntohs(ie->ie_payload_len) : 0)
+			&& !memcmp(buf, payload, ie_payload_len)) ? 1 : 0;
 	}
 
 	case AST_EVENT_IE_PLTYPE_EXISTS:
 	{
-		return ast_event_get_ie_raw(event, ie_val->ie_type) ? 1 : 0;
+		return payload ? 1 : 0;
 	}
 
 	case AST_EVENT_IE_PLTYPE_UNKNOWN:
@@ -617,7 +801,7 @@ static int dump_cache_cb(void *obj, void *arg, int flags)
 	struct ast_event_ie_val *ie_val = NULL;
 
 	AST_LIST_TRAVERSE(&event_sub->ie_vals, ie_val, entry) {
-		if (!match_ie_val(event, ie_val, NULL)) {
+		if (!match_ie_val(event, NULL, ie_val, NULL)) {
 			break;
 		}
 	}
@@ -862,6 +1046,8 @@ int ast_event_sub_append_ie_raw(struct ast_event_sub *sub,
 
 int ast_event_sub_activate(struct ast_event_sub *sub)
 {
+	struct ast_event_sub_bucket *bucket;
+
 	if (ast_event_check_subscriber(AST_EVENT_SUB,
 		AST_EVENT_IE_EVENTTYPE, AST_EVENT_IE_PLTYPE_UINT, sub->type,
 		AST_EVENT_IE_END) != AST_EVENT_SUB_NONE) {
@@ -875,6 +1061,9 @@ int ast_event_sub_activate(struct ast_event_sub *sub)
 
 	AST_RWDLLIST_WRLOCK(&ast_event_subs[sub->type]);
 	AST_RWDLLIST_INSERT_TAIL(&ast_event_subs[sub->type], sub, entry);
+	if ((bucket = sub_index_list(sub))) {
+		AST_DLLIST_INSERT_TAIL(bucket, sub, index_entry);
+	}
 	AST_RWDLLIST_UNLOCK(&ast_event_subs[sub->type]);
 
 	return 0;
@@ -961,9 +1150,13 @@ const char *ast_event_subscriber_get_description(struct ast_event_sub *sub)
 struct ast_event_sub *ast_event_unsubscribe(struct ast_event_sub *sub)
 {
 	struct ast_event *event;
+	struct ast_event_sub_bucket *bucket;
 
 	AST_RWDLLIST_WRLOCK(&ast_event_subs[sub->type]);
 	AST_DLLIST_REMOVE(&ast_event_subs[sub->type], sub, entry);
+	if ((bucket = sub_index_list(sub))) {
+		AST_DLLIST_REMOVE(bucket, sub, index_entry);
+	}
 	AST_RWDLLIST_UNLOCK(&ast_event_subs[sub->type]);
 
 	if (ast_event_check_subscriber(AST_EVENT_UNSUB,
@@ -1084,30 +1277,16 @@ const char *ast_event_get_ie_str(const struct ast_event *event, enum ast_event_i
 
 const void *ast_event_get_ie_raw(const struct ast_event *event, enum ast_event_ie_type ie_type)
 {
-	struct ast_event_iterator iterator;
-	int res;
+	const struct ast_event_ie *ie = event_find_ie(event, NULL, ie_type);
 
-	for (res = ast_event_iterator_init(&iterator, event); !res; res = ast_event_iterator_next(&iterator)) {
-		if (ast_event_iterator_get_ie_type(&iterator) == ie_type) {
-			return ast_event_iterator_get_ie_raw(&iterator);
-		}
-	}
-
-	return NULL;
+	return ie ? ie->ie_payload : NULL;
 }
 
 uint16_t ast_event_get_ie_raw_payload_len(const struct ast_event *event, enum ast_event_ie_type ie_type)
 {
-	struct ast_event_iterator iterator;
-	int res;
+	const struct ast_event_ie *ie = event_find_ie(event, NULL, ie_type);
 
-	for (res = ast_event_iterator_init(&iterator, event); !res; res = ast_event_iterator_next(&iterator)) {
-		if (ast_event_iterator_get_ie_type(&iterator) == ie_type) {
-			return ast_event_iterator_get_ie_raw_payload_len(&iterator);
-		}
-	}
-
-	return 0;
+	return ie ? ntohs(ie->ie_payload_len) : 0;
 }
 
 int ast_event_append_ie_str(struct ast_event **event, enum ast_event_ie_type ie_type,
@@ -1442,6 +1621,24 @@ int ast_event_queue_and_cache(struct ast_event *event)
 	return 0;
 }
 
+/*!
+ * \internal
+ * \brief Deliver an event to a subscriber if all of its IEs match.
+ */
+static void event_deliver(const struct ast_event_ref *event_ref, struct ast_event_sub *sub)
+{
+	struct ast_event_ie_val *ie_val;
+	const uint16_t *ie_offsets = event_ref->indexed ? event_ref->ie_offsets : NULL;
+
+	AST_LIST_TRAVERSE(&sub->ie_vals, ie_val, entry) {
+		if (!match_ie_val(event_ref->event, ie_offsets, ie_val, NULL)) {
+			/* The current subscription ie did not match an event ie. */
+			return;
+		}
+	}
+	sub->cb(event_ref->event, sub->userdata);
+}
+
 static int handle_event(void *data)
 {
 	struct ast_event_ref *event_ref = data;
@@ -1450,24 +1647,29 @@ static int handle_event(void *data)
 		ntohs(event_ref->event->type),
 		AST_EVENT_ALL
 	};
+	const struct ast_event_ie *ie;
+	const struct ast_event_ie_str_payload *str_payload;
 	int i;
 
 	for (i = 0; i < ARRAY_LEN(event_types); i++) {
 		AST_RWDLLIST_RDLOCK(&ast_event_subs[event_types[i]]);
-		AST_RWDLLIST_TRAVERSE(&ast_event_subs[event_types[i]], sub, entry) {
-			struct ast_event_ie_val *ie_val;
-
-			AST_LIST_TRAVERSE(&sub->ie_vals, ie_val, entry) {
-				if (!match_ie_val(event_ref->event, ie_val, NULL)) {
-					/* The current subscription ie did not match an event ie. */
-					break;
+		if (ast_event_sub_index[event_types[i]].buckets) {
+			/* Subscribers keyed on another value cannot match. */
+			ie = event_find_ie(event_ref->event, event_ref->indexed ? event_ref->ie_offsets : NULL,
+				ast_event_sub_index[event_types[i]].ie_type);
+			if (ie) {
+				str_payload = (const struct ast_event_ie_str_payload *) ie->ie_payload;
+				AST_DLLIST_TRAVERSE(&ast_event_sub_index[event_types[i]].buckets[str_payload->hash % NUM_SUB_BUCKETS], sub, index_entry) {
+					event_deliver(event_ref, sub);
 				}
 			}
-			if (ie_val) {
-				/* The event did not match this subscription. */
-				continue;
+			AST_DLLIST_TRAVERSE(&ast_event_sub_index[event_types[i]].unkeyed, sub, index_entry) {
+				event_deliver(event_ref, sub);
+			}
+		} else {
+			AST_RWDLLIST_TRAVERSE(&ast_event_subs[event_types[i]], sub, entry) {
+				event_deliver(event_ref, sub);
 			}
-			sub->cb(event_ref->event, sub->userdata);
 		}
 		AST_RWDLLIST_UNLOCK(&ast_event_subs[event_types[i]]);
 	}
@@ -1499,11 +1701,14 @@ int ast_event_queue(struct ast_event *event)
 		return 0;
 	}
 
-	if (!(event_ref = alloc_event_ref())) {
+	/* Room for the IE offset table used when matching subscribers. */
+	if (!(event_ref = ao2_alloc(sizeof(*event_ref) + sizeof(event_ref->ie_offsets[0]) * AST_EVENT_IE_TOTAL,
+			ast_event_ref_destroy))) {
 		return -1;
 	}
 
 	event_ref->event = event;
+	event_ref_index_ies(event_ref);
 
 	res = ast_taskprocessor_push(event_dispatcher, handle_event, event_ref);
 	if (res) {
@@ -1610,7 +1815,7 @@ static int ast_event_cmp(void *obj, void *arg, int flags)
 			.ie_type = cache_args[i],
 		};
 
-		if (!match_ie_val(event, &ie_val, event2)) {
+		if (!match_ie_val(event, NULL, &ie_val, event2)) {
 			res = 0;
 			break;
 		}
@@ -1753,6 +1958,18 @@ int ast_event_init(void)
 		AST_RWDLLIST_HEAD_INIT(&ast_event_subs[i]);
 	}
 
+	for (i = 0; i < AST_EVENT_TOTAL; i++) {
+		if (!ast_event_sub_index[i].ie_type) {
+			/* Subscribers to this event type are not indexed. */
+			continue;
+		}
+
+		if (!(ast_event_sub_index[i].buckets = ast_calloc(NUM_SUB_BUCKETS,
+				sizeof(*ast_event_sub_index[i].buckets)))) {
+			return -1;
+		}
+	}
+
 	for (i = 0; i < AST_EVENT_TOTAL; i++) {
 		if (!ast_event_cache[i].hash_fn) {
 			/* This event type is not cached. */
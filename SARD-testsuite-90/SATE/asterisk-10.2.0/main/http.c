@@ -42,7 +42,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 328247 $")
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/signal.h>
+#include <sys/socket.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "asterisk/paths.h"	/* use ast_config_AST_DATA_DIR */
 #include "asterisk/cli.h"
@@ -57,11 +61,21 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 328247 $")
 #include "asterisk/_private.h"
 #include "asterisk/astobj2.h"
 #include "asterisk/netsock2.h"
+#include "asterisk/threadstorage.h"
+#include "asterisk/poll-compat.h"
 
 #define MAX_PREFIX 80
 #define DEFAULT_PORT 8088
 #define DEFAULT_TLS_PORT 8089
 #define DEFAULT_SESSION_LIMIT 100
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_REQUEST_TIMEOUT 30
+#define DEFAULT_WORKERS 16
+#define DEFAULT_LONGPOLL_WORKERS 32
+/*! A worker held by one request for this long counts as stalled */
+#define WORKER_STALL_MS 1000
+/*! Requests served on one connection before it is closed */
+#define MAX_KEEPALIVE_REQUESTS 100
 
 /* See http.h for more information about the SSL implementation */
 #if defined(HAVE_OPENSSL) && (defined(HAVE_FUNOPEN) || defined(HAVE_FOPENCOOKIE))
@@ -70,6 +84,63 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 328247 $")
 
 static int session_limit = DEFAULT_SESSION_LIMIT;
 static int session_count = 0;
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+static int request_timeout = DEFAULT_REQUEST_TIMEOUT;
+static int http_workers = DEFAULT_WORKERS;
+static int http_longpoll_workers = DEFAULT_LONGPOLL_WORKERS;
+
+/*
+ * Where stdio's read buffer can be looked into, pipelined requests are
+ * found there; elsewhere the pool reads its connections unbuffered, so
+ * nothing ever hides from poll() but what TLS holds.
+ */
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define HTTP_READ_PEEK
+#endif
+
+/*! \brief The request being handled by this thread */
+struct http_request_state {
+	/*! The connection stays open after the response */
+	unsigned int keepalive:1;
+	/*! A response has been sent */
+	unsigned int responded:1;
+};
+
+AST_THREADSTORAGE(http_request_state_buf);
+
+/*! \brief A connection, waiting for its next request or for a worker */
+struct http_worker_job {
+	struct ast_tcptls_session_instance *ser;
+	/*! Requests already handled on the connection */
+	int requests;
+	/*! When an idle connection is closed */
+	struct timeval deadline;
+	/*! When a worker took the connection */
+	struct timeval started;
+	/*! The poller saw the connection become readable */
+	unsigned int ready:1;
+	AST_LIST_ENTRY(http_worker_job) entry;
+};
+
+/*! Connections waiting for a worker */
+static AST_LIST_HEAD_STATIC(http_worker_queue, http_worker_job);
+static ast_cond_t http_worker_cond;
+/*! Number of worker threads running */
+static int http_worker_count;
+/*! Number of worker threads wanted, at most session_limit */
+static int http_worker_target;
+/*! Number of worker threads waiting for a connection */
+static int http_worker_idle;
+/*! Connections being served, oldest first; protected by http_worker_queue */
+static AST_LIST_HEAD_NOLOCK_STATIC(http_busy_list, http_worker_job);
+
+/*! Connections waiting for a request, watched by the poller thread */
+static AST_LIST_HEAD_STATIC(http_idle_list, http_worker_job);
+/*! Number of connections in http_idle_list */
+static int http_idle_count;
+/*! Wakes up the poller when a connection is added */
+static int http_idle_pipe[2] = { -1, -1 };
+static pthread_t http_idle_thread = AST_PTHREADT_NULL;
 
 static struct ast_tls_config http_tls_cfg;
 
@@ -136,6 +207,427 @@ struct http_uri_redirect {
 
 static AST_RWLIST_HEAD_STATIC(uri_redirects, http_uri_redirect);
 
+/*!
+ * \brief Per handler counters, kept across rebuilds of the routing trie
+ */
+struct http_route {
+	const struct ast_http_uri *urih;
+	/*! Copy of urih->has_subtree, so the trie can be searched without touching urih */
+	unsigned int has_subtree:1;
+	/*! The handler was unlinked but the snapshot could not be rebuilt; skip it */
+	int gone;
+	/*! Requests dispatched to the handler */
+	unsigned int hits;
+	/*! Time spent finding the handler for those requests */
+	uint64_t lookup_ns;
+};
+
+/*!
+ * \brief A node of the routing trie.
+ *
+ * Each node stands for one '/' separated segment of a URI, so a path
+ * through the trie is a URI and matches can only end on a segment
+ * boundary, as they always have.
+ */
+struct http_route_node {
+	/*! The segment, compared without regard to case */
+	char *segment;
+	size_t seglen;
+	struct http_route_node **children;
+	int nchildren;
+	/*! Handlers registered for this URI, most recent first */
+	struct http_route **routes;
+	int nroutes;
+	/*! Destination, if this URI is redirected */
+	char *redirect;
+};
+
+/*!
+ * \brief An immutable snapshot of the handlers and redirects.
+ *
+ * Requests search the current snapshot without taking any lock: they
+ * only count themselves in the reader counter of the current epoch
+ * (see http_routes_enter()).  Linking, unlinking and reloading build a
+ * new snapshot, publish it, move to the other epoch and wait for the
+ * readers of the previous one to leave.  Only then is the old snapshot
+ * freed, and only then may an unlinked handler go away.  Should a new
+ * snapshot not be built, the old one stays with the routes of unlinked
+ * handlers marked gone, and the readers are waited for all the same.
+ */
+struct http_routes {
+	struct http_route_node *uris;
+	struct http_route_node *redirects;
+};
+
+#define HTTP_ROUTE_MAX_DEPTH 32
+#define ROUTE_BUCKETS 53
+
+static struct http_routes * volatile routes;
+/*! Incremented on each publication; its low bit selects the reader counter */
+static volatile int routes_epoch;
+/*! Requests searching the snapshots, for each of the two epochs */
+static volatile int routes_readers[2];
+/*! A rebuild is waiting for the readers of an epoch to leave */
+static volatile int routes_draining;
+/*! How long a rebuild waits for readers before checking on them again, in ms */
+#define ROUTES_DRAIN_RECHECK 10
+AST_MUTEX_DEFINE_STATIC(routes_lock);
+static ast_cond_t routes_drained;
+/*! Serializes rebuilds, and protects route_stats */
+AST_MUTEX_DEFINE_STATIC(routes_build_lock);
+static struct ao2_container *route_stats;
+
+static int route_hash_fn(const void *obj, const int flags)
+{
+	const struct http_route *route = obj;
+	return abs((int) ((intptr_t) route->urih >> 4));
+}
+
+static int route_cmp_fn(void *obj, void *arg, int flags)
+{
+	struct http_route *route = obj, *route2 = arg;
+	return route->urih == route2->urih ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static void http_route_node_free(struct http_route_node *node)
+{
+	int i;
+
+	if (!node) {
+		return;
+	}
+	for (i = 0; i < node->nchildren; i++) {
+		http_route_node_free(node->children[i]);
+	}
+	for (i = 0; i < node->nroutes; i++) {
+		ao2_ref(node->routes[i], -1);
+	}
+	ast_free(node->children);
+	ast_free(node->routes);
+	ast_free(node->segment);
+	ast_free(node->redirect);
+	ast_free(node);
+}
+
+static void http_routes_destructor(void *obj)
+{
+	struct http_routes *r = obj;
+
+	http_route_node_free(r->uris);
+	http_route_node_free(r->redirects);
+}
+
+static struct http_route_node *http_route_child(struct http_route_node *node, const char *segment, size_t len)
+{
+	int i;
+
+	for (i = 0; i < node->nchildren; i++) {
+		if (node->children[i]->seglen == len && !strncasecmp(node->children[i]->segment, segment, len)) {
+			return node->children[i];
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Find or add the node for a path.  \return NULL on allocation failure or if the path is too deep. */
+static struct http_route_node *http_route_node_add(struct http_route_node *node, const char *path)
+{
+	struct http_route_node *child, **children;
+	const char *end;
+	int depth = 0;
+
+	for (;;) {
+		if (++depth > HTTP_ROUTE_MAX_DEPTH) {
+			return NULL;
+		}
+		if (!(end = strchr(path, '/'))) {
+			end = path + strlen(path);
+		}
+		if (!(child = http_route_child(node, path, end - path))) {
+			if (!(child = ast_calloc(1, sizeof(*child)))
+				|| !(child->segment = ast_strndup(path, end - path))
+				|| !(children = ast_realloc(node->children, (node->nchildren + 1) * sizeof(*children)))) {
+				http_route_node_free(child);
+				return NULL;
+			}
+			child->seglen = end - path;
+			children[node->nchildren++] = child;
+			node->children = children;
+		}
+		node = child;
+		if (!*end) {
+			return node;
+		}
+		path = end + 1;
+	}
+}
+
+/*!
+ * \brief Build a snapshot of the current handlers and redirects.
+ * \note Called with routes_build_lock held.
+ */
+static struct http_routes *http_routes_build(struct ao2_container *stats)
+{
+	struct http_routes *r;
+	struct ast_http_uri *urih;
+	struct http_uri_redirect *redirect;
+	struct http_route_node *node;
+	struct http_route *route, **nroutes, tmp;
+
+	if (!(r = ao2_alloc(sizeof(*r), http_routes_destructor))) {
+		return NULL;
+	}
+	if (!(r->uris = ast_calloc(1, sizeof(*r->uris))) || !(r->redirects = ast_calloc(1, sizeof(*r->redirects)))) {
+		ao2_ref(r, -1);
+		return NULL;
+	}
+
+	/* The list is ordered by length, most recent first, which is also
+	 * the order handlers for the same URI are tried in. */
+	AST_RWLIST_RDLOCK(&uris);
+	AST_RWLIST_TRAVERSE(&uris, urih, entry) {
+		node = ast_strlen_zero(urih->uri) ? r->uris : http_route_node_add(r->uris, urih->uri);
+		if (!node) {
+			ast_log(LOG_WARNING, "Unable to route HTTP URI '%s'\n", urih->uri);
+			continue;
+		}
+		tmp.urih = urih;
+		if (!(route = ao2_find(route_stats, &tmp, OBJ_POINTER))) {
+			if (!(route = ao2_alloc(sizeof(*route), NULL))) {
+				continue;
+			}
+			route->urih = urih;
+			route->has_subtree = urih->has_subtree;
+		}
+		/* Linked again since a failed rebuild */
+		route->gone = 0;
+		if (!(nroutes = ast_realloc(node->routes, (node->nroutes + 1) * sizeof(*nroutes)))) {
+			ao2_ref(route, -1);
+			continue;
+		}
+		ao2_link(stats, route);
+		nroutes[node->nroutes++] = route;
+		node->routes = nroutes;
+	}
+	AST_RWLIST_UNLOCK(&uris);
+
+	AST_RWLIST_RDLOCK(&uri_redirects);
+	AST_RWLIST_TRAVERSE(&uri_redirects, redirect, entry) {
+		/* The first (longest, most recent) redirect for a target wins */
+		if ((node = http_route_node_add(r->redirects, redirect->target)) && !node->redirect) {
+			node->redirect = ast_strdup(redirect->dest);
+		}
+	}
+	AST_RWLIST_UNLOCK(&uri_redirects);
+
+	return r;
+}
+
+/*!
+ * \brief Start searching the routing snapshot.
+ * \return The epoch to pass to http_routes_leave().
+ *
+ * Until then, routes is not freed, nor any handler it refers to.
+ */
+static int http_routes_enter(void)
+{
+	int epoch;
+
+	for (;;) {
+		epoch = routes_epoch & 1;
+		ast_atomic_fetchadd_int(&routes_readers[epoch], 1);
+		if ((routes_epoch & 1) == epoch) {
+			return epoch;
+		}
+		/* A rebuild moved on meanwhile; count ourselves in the new epoch. */
+		ast_atomic_fetchadd_int(&routes_readers[epoch], -1);
+	}
+}
+
+static void http_routes_leave(int epoch)
+{
+	/* Both the decrement here and the increment of routes_draining in
+	 * http_routes_drain() are full barriers, so either this sees the
+	 * rebuild waiting or the rebuild sees the count at zero. */
+	if (ast_atomic_dec_and_test(&routes_readers[epoch]) && routes_draining) {
+		ast_mutex_lock(&routes_lock);
+		ast_cond_signal(&routes_drained);
+		ast_mutex_unlock(&routes_lock);
+	}
+}
+
+/*!
+ * \brief Move to the next epoch and wait for the readers of the current one.
+ * \note Called with routes_build_lock held, after changing what readers may reach.
+ */
+static void http_routes_drain(void)
+{
+	int epoch = routes_epoch & 1;
+	struct timeval wait;
+	struct timespec ts;
+
+	/* Readers entering from now on use the other counter. */
+	ast_atomic_fetchadd_int(&routes_epoch, 1);
+
+	ast_mutex_lock(&routes_lock);
+	ast_atomic_fetchadd_int(&routes_draining, 1);
+	while (routes_readers[epoch]) {
+		/* Timed, and rechecked, so that a wakeup lost anyway only costs a delay */
+		wait = ast_tvadd(ast_tvnow(), ast_samp2tv(ROUTES_DRAIN_RECHECK, 1000));
+		ts.tv_sec = wait.tv_sec;
+		ts.tv_nsec = wait.tv_usec * 1000;
+		ast_cond_timedwait(&routes_drained, &routes_lock, &ts);
+	}
+	ast_atomic_fetchadd_int(&routes_draining, -1);
+	ast_mutex_unlock(&routes_lock);
+}
+
+/*!
+ * \brief Publish a routing snapshot and wait until the old one is unused.
+ * \note Called with routes_build_lock held.
+ */
+static void http_routes_publish(struct http_routes *r)
+{
+	struct http_routes *old = routes;
+
+	routes = r;
+	http_routes_drain();
+
+	if (old) {
+		ao2_ref(old, -1);
+	}
+}
+
+/*! \brief Mark the route of a handler that is no longer linked as gone */
+static int http_route_retire(void *obj, void *arg, int flags)
+{
+	struct http_route *route = obj;
+	struct ast_http_uri *urih;
+
+	AST_RWLIST_RDLOCK(&uris);
+	AST_RWLIST_TRAVERSE(&uris, urih, entry) {
+		if (urih == route->urih) {
+			break;
+		}
+	}
+	AST_RWLIST_UNLOCK(&uris);
+
+	if (!urih) {
+		route->gone = 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Replace the routing snapshot after the handlers or redirects changed.
+ *
+ * On return, no request is searching a snapshot that refers to a handler
+ * no longer linked, so an unlinked handler may be freed.
+ */
+static void http_routes_rebuild(void)
+{
+	struct http_routes *r = NULL;
+	struct ao2_container *stats;
+
+	ast_mutex_lock(&routes_build_lock);
+	if (!route_stats) {
+		route_stats = ao2_container_alloc(ROUTE_BUCKETS, route_hash_fn, route_cmp_fn);
+	}
+	/* Counters of handlers that are gone are dropped with the old container */
+	if (route_stats && (stats = ao2_container_alloc(ROUTE_BUCKETS, route_hash_fn, route_cmp_fn))) {
+		if ((r = http_routes_build(stats))) {
+			ao2_ref(route_stats, -1);
+			route_stats = stats;
+		} else {
+			ao2_ref(stats, -1);
+		}
+	}
+	if (r) {
+		http_routes_publish(r);
+	} else {
+		/* Keep serving what we have, except for unlinked handlers: route_stats
+		 * holds the routes of the current snapshot. */
+		ast_log(LOG_ERROR, "Unable to rebuild the HTTP routes, keeping the previous ones\n");
+		if (route_stats) {
+			ao2_callback(route_stats, OBJ_NODATA, http_route_retire, NULL);
+		}
+		http_routes_drain();
+	}
+	ast_mutex_unlock(&routes_build_lock);
+}
+
+/*!
+ * \brief Find the handler for a URI, the longest registered prefix ending on a segment boundary.
+ * \param root The handler trie.
+ * \param uri The URI, without the prefix.
+ * \param rest Set to the part of the URI after the handler's.
+ */
+static struct http_route *http_route_find(struct http_route_node *root, char *uri, char **rest)
+{
+	struct http_route_node *path[HTTP_ROUTE_MAX_DEPTH + 1];
+	char *pos[HTTP_ROUTE_MAX_DEPTH + 1];
+	struct http_route_node *node = root;
+	char *c = uri, *end;
+	int depth = 0, i;
+
+	path[0] = root;
+	pos[0] = uri;
+	while (*c && depth < HTTP_ROUTE_MAX_DEPTH) {
+		if (!(end = strchr(c, '/'))) {
+			end = c + strlen(c);
+		}
+		if (!(node = http_route_child(node, c, end - c))) {
+			break;
+		}
+		path[++depth] = node;
+		pos[depth] = end;
+		if (!*end) {
+			break;
+		}
+		c = end + 1;
+	}
+
+	for (; depth >= 0; depth--) {
+		c = pos[depth];
+		if (*c && *c != '/') {
+			continue;
+		}
+		if (*c == '/') {
+			c++;
+		}
+		for (i = 0; i < path[depth]->nroutes; i++) {
+			if (path[depth]->routes[i]->gone) {
+				continue;
+			}
+			if (!*c || path[depth]->routes[i]->has_subtree) {
+				*rest = c;
+				return path[depth]->routes[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Find the redirect for a URI, which must match the target exactly. */
+static const char *http_redirect_find(struct http_route_node *node, const char *uri)
+{
+	const char *end;
+
+	for (;;) {
+		if (!(end = strchr(uri, '/'))) {
+			end = uri + strlen(uri);
+		}
+		if (!(node = http_route_child(node, uri, end - uri))) {
+			return NULL;
+		}
+		if (!*end) {
+			return node->redirect;
+		}
+		uri = end + 1;
+	}
+}
+
 static const struct ast_cfhttp_methods_text {
 	enum ast_http_method method;
 	const char *text;
@@ -385,8 +877,38 @@ static struct ast_http_uri staticuri = {
 };
 
 
+/*!
+ * \brief Send the contents of a file to the client.
+ *
+ * Plain connections are flushed and the file is handed to sendfile(), so
+ * it never passes through user space.  TLS connections, and whatever
+ * sendfile() could not send, go through ser->f.
+ *
+ * \return zero on success, -1 on error.
+ */
+static int http_send_fd(struct ast_tcptls_session_instance *ser, int fd, off_t len)
+{
+	char buf[8192];
+	ssize_t n = 0;
+	off_t off = 0;
+
+#ifdef __linux__
+	if (!ser->ssl && !fflush(ser->f)) {
+		while (off < len && (n = sendfile(ser->fd, fd, &off, len - off)) > 0);
+	}
+#endif
+	while (off < len && (n = pread(fd, buf, MIN(sizeof(buf), len - off), off)) > 0) {
+		if (fwrite(buf, n, 1, ser->f) != 1) {
+			ast_log(LOG_WARNING, "fwrite() failed: %s\n", strerror(errno));
+			return -1;
+		}
+		off += n;
+	}
+	return n < 0 ? -1 : 0;
+}
+
 /* send http/1.1 response */
-/* free content variable and close socket*/
+/* free content variable and close socket, unless the connection is kept alive */
 void ast_http_send(struct ast_tcptls_session_instance *ser,
 	enum ast_http_method method, int status_code, const char *status_title,
 	struct ast_str *http_header, struct ast_str *out, const int fd,
@@ -395,7 +917,11 @@ void ast_http_send(struct ast_tcptls_session_instance *ser,
 	struct timeval now = ast_tvnow();
 	struct ast_tm tm;
 	char timebuf[80];
-	int content_length = 0;
+	off_t content_length = 0;
+	off_t file_length = 0;
+	struct stat st;
+	struct http_request_state *state = ast_threadstorage_get(&http_request_state_buf, sizeof(*state));
+	int keepalive = state && state->keepalive && !state->responded;
 
 	if (!ser || 0 == ser->f) {
 		return;
@@ -405,46 +931,42 @@ void ast_http_send(struct ast_tcptls_session_instance *ser,
 
 	/* calc content length */
 	if (out) {
-		content_length += strlen(ast_str_buffer(out));
+		content_length += ast_str_strlen(out);
 	}
 
 	if (fd) {
-		content_length += lseek(fd, 0, SEEK_END);
-		lseek(fd, 0, SEEK_SET);
+		if (!fstat(fd, &st)) {
+			file_length = st.st_size;
+		}
+		content_length += file_length;
 	}
 
 	/* send http header */
 	fprintf(ser->f, "HTTP/1.1 %d %s\r\n"
 		"Server: Asterisk/%s\r\n"
 		"Date: %s\r\n"
-		"Connection: close\r\n"
+		"Connection: %s\r\n"
 		"%s"
-		"Content-Length: %d\r\n"
+		"Content-Length: %ld\r\n"
 		"%s"
 		"\r\n",
 		status_code, status_title ? status_title : "OK",
 		ast_get_version(),
 		timebuf,
+		keepalive ? "Keep-Alive" : "close",
 		static_content ? "" : "Cache-Control: no-cache, no-store\r\n",
-		content_length,
+		(long) content_length,
 		http_header ? ast_str_buffer(http_header) : ""
 		);
 
 	/* send content */
 	if (method != AST_HTTP_HEAD || status_code >= 400) {
 		if (out) {
-			fprintf(ser->f, "%s", ast_str_buffer(out));
+			fwrite(ast_str_buffer(out), ast_str_strlen(out), 1, ser->f);
 		}
 
-		if (fd) {
-			char buf[256];
-			int len;
-			while ((len = read(fd, buf, sizeof(buf))) > 0) {
-				if (fwrite(buf, len, 1, ser->f) != 1) {
-					ast_log(LOG_WARNING, "fwrite() failed: %s\n", strerror(errno));
-					break;
-				}
-			}
+		if (fd && http_send_fd(ser, fd, file_length)) {
+			keepalive = 0;
 		}
 	}
 
@@ -455,6 +977,15 @@ void ast_http_send(struct ast_tcptls_session_instance *ser,
 		ast_free(out);
 	}
 
+	if (state) {
+		state->responded = 1;
+	}
+	if (keepalive && !fflush(ser->f)) {
+		return;
+	}
+	if (state) {
+		state->keepalive = 0;
+	}
 	fclose(ser->f);
 	ser->f = 0;
 	return;
@@ -547,6 +1078,7 @@ int ast_http_uri_link(struct ast_http_uri *urih)
 	if ( AST_RWLIST_EMPTY(&uris) || strlen(AST_RWLIST_FIRST(&uris)->uri) <= len ) {
 		AST_RWLIST_INSERT_HEAD(&uris, urih, entry);
 		AST_RWLIST_UNLOCK(&uris);
+		http_routes_rebuild();
 		return 0;
 	}
 
@@ -555,6 +1087,7 @@ int ast_http_uri_link(struct ast_http_uri *urih)
 			strlen(AST_RWLIST_NEXT(uri, entry)->uri) <= len) {
 			AST_RWLIST_INSERT_AFTER(&uris, uri, urih, entry);
 			AST_RWLIST_UNLOCK(&uris);
+			http_routes_rebuild();
 
 			return 0;
 		}
@@ -563,6 +1096,7 @@ int ast_http_uri_link(struct ast_http_uri *urih)
 	AST_RWLIST_INSERT_TAIL(&uris, urih, entry);
 
 	AST_RWLIST_UNLOCK(&uris);
+	http_routes_rebuild();
 
 	return 0;
 }
@@ -572,16 +1106,28 @@ void ast_http_uri_unlink(struct ast_http_uri *urih)
 	AST_RWLIST_WRLOCK(&uris);
 	AST_RWLIST_REMOVE(&uris, urih, entry);
 	AST_RWLIST_UNLOCK(&uris);
+	http_routes_rebuild();
 }
 
 void ast_http_uri_unlink_all_with_key(const char *key)
 {
 	struct ast_http_uri *urih;
+	AST_LIST_HEAD_NOLOCK(, ast_http_uri) removed = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+
 	AST_RWLIST_WRLOCK(&uris);
 	AST_RWLIST_TRAVERSE_SAFE_BEGIN(&uris, urih, entry) {
 		if (!strcmp(urih->key, key)) {
 			AST_RWLIST_REMOVE_CURRENT(entry);
+			AST_LIST_INSERT_TAIL(&removed, urih, entry);
 		}
+	}
+	AST_RWLIST_TRAVERSE_SAFE_END;
+	AST_RWLIST_UNLOCK(&uris);
+
+	/* Requests may still be looking at them until the new routes are out */
+	http_routes_rebuild();
+
+	while ((urih = AST_LIST_REMOVE_HEAD(&removed, entry))) {
 		if (urih->dmallocd) {
 			ast_free(urih->data);
 		}
@@ -589,8 +1135,6 @@ void ast_http_uri_unlink_all_with_key(const char *key)
 			ast_free(urih);
 		}
 	}
-	AST_RWLIST_TRAVERSE_SAFE_END;
-	AST_RWLIST_UNLOCK(&uris);
 }
 
 /*
@@ -654,13 +1198,16 @@ struct ast_variable *ast_http_get_post_vars(
 static int handle_uri(struct ast_tcptls_session_instance *ser, char *uri,
 	enum ast_http_method method, struct ast_variable *headers)
 {
-	char *c;
 	int res = -1;
 	char *params = uri;
-	struct ast_http_uri *urih = NULL;
+	const struct ast_http_uri *urih = NULL;
 	int l;
 	struct ast_variable *get_vars = NULL, *v, *prev = NULL;
-	struct http_uri_redirect *redirect;
+	struct http_routes *r;
+	struct http_route *route = NULL;
+	const char *redirect;
+	struct timespec start, end;
+	int epoch;
 
 	ast_debug(2, "HTTP Request URI is %s \n", uri);
 
@@ -689,45 +1236,37 @@ static int handle_uri(struct ast_tcptls_session_instance *ser, char *uri,
 	}
 	ast_uri_decode(uri, ast_uri_http_legacy);
 
-	AST_RWLIST_RDLOCK(&uri_redirects);
-	AST_RWLIST_TRAVERSE(&uri_redirects, redirect, entry) {
-		if (!strcasecmp(uri, redirect->target)) {
-			struct ast_str *http_header = ast_str_create(128);
-			ast_str_set(&http_header, 0, "Location: %s\r\n", redirect->dest);
-			ast_http_send(ser, method, 302, "Moved Temporarily", http_header, NULL, 0, 0);
-
-			break;
-		}
+	epoch = http_routes_enter();
+	if (!(r = routes)) {
+		http_routes_leave(epoch);
+		ast_http_error(ser, 500, "Server Error", "Internal Server Error");
+		goto cleanup;
 	}
-	AST_RWLIST_UNLOCK(&uri_redirects);
-	if (redirect) {
+
+	if ((redirect = http_redirect_find(r->redirects, uri))) {
+		struct ast_str *http_header = ast_str_create(128);
+		ast_str_set(&http_header, 0, "Location: %s\r\n", redirect);
+		http_routes_leave(epoch);
+		ast_http_send(ser, method, 302, "Moved Temporarily", http_header, NULL, 0, 0);
 		goto cleanup;
 	}
 
 	/* We want requests to start with the (optional) prefix and '/' */
 	l = strlen(prefix);
 	if (!strncasecmp(uri, prefix, l) && uri[l] == '/') {
-		uri += l + 1;
-		/* scan registered uris to see if we match one. */
-		AST_RWLIST_RDLOCK(&uris);
-		AST_RWLIST_TRAVERSE(&uris, urih, entry) {
-			ast_debug(2, "match request [%s] with handler [%s] len %d\n", uri, urih->uri, l);
-			l = strlen(urih->uri);
-			c = uri + l;	/* candidate */
-			if (strncasecmp(urih->uri, uri, l) /* no match */
-			    || (*c && *c != '/')) { /* substring */
-				continue;
-			}
-			if (*c == '/') {
-				c++;
-			}
-			if (!*c || urih->has_subtree) {
-				uri = c;
-				break;
-			}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((route = http_route_find(r->uris, uri + l + 1, &uri))) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			urih = route->urih;
+			ao2_lock(route);
+			route->hits++;
+			route->lookup_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+			ao2_unlock(route);
+			ast_debug(2, "HTTP request matched handler [%s]\n", urih->uri);
 		}
-		AST_RWLIST_UNLOCK(&uris);
 	}
+	http_routes_leave(epoch);
+
 	if (urih) {
 		res = urih->callback(ser, urih, uri, method, get_vars, headers);
 	} else {
@@ -835,22 +1374,32 @@ struct ast_variable *ast_http_get_cookies(struct ast_variable *headers)
 }
 
 
-static void *httpd_helper_thread(void *data)
+/*!
+ * \brief Read and handle one request.
+ * \param ser The connection.
+ * \param requests Number of requests already handled on this connection.
+ * \retval 1 the connection was kept open for another request.
+ * \retval 0 the connection is done.
+ */
+static int httpd_process_request(struct ast_tcptls_session_instance *ser, int requests)
 {
 	char buf[4096];
 	char header_line[4096];
-	struct ast_tcptls_session_instance *ser = data;
 	struct ast_variable *headers = NULL;
 	struct ast_variable *tail = headers;
-	char *uri, *method;
+	char *uri, *method, *version = "";
 	enum ast_http_method http_method = AST_HTTP_UNKNOWN;
+	struct http_request_state *state;
+	int keepalive;
 
-	if (ast_atomic_fetchadd_int(&session_count, +1) >= session_limit) {
-		goto done;
+	if (!(state = ast_threadstorage_get(&http_request_state_buf, sizeof(*state)))) {
+		return 0;
 	}
+	state->keepalive = 0;
+	state->responded = 0;
 
 	if (!fgets(buf, sizeof(buf), ser->f)) {
-		goto done;
+		return 0;
 	}
 
 	/* Get method */
@@ -876,10 +1425,19 @@ static void *httpd_helper_thread(void *data)
 		char *c = ast_skip_nonblanks(uri);
 
 		if (*c) {
-			*c = '\0';
+			*c++ = '\0';
+			version = ast_skip_blanks(c);
+			ast_trim_blanks(version);
 		}
 	}
 
+	/* HTTP/1.1 connections persist unless the client says otherwise;
+	 * only requests without a body are eligible, since a handler may
+	 * leave part of a body unread. */
+	keepalive = keepalive_timeout && requests + 1 < MAX_KEEPALIVE_REQUESTS
+		&& (http_method == AST_HTTP_GET || http_method == AST_HTTP_HEAD)
+		&& !strcasecmp(version, "HTTP/1.1");
+
 	/* process "Request Headers" lines */
 	while (fgets(header_line, sizeof(header_line), ser->f)) {
 		char *name, *value;
@@ -903,6 +1461,13 @@ static void *httpd_helper_thread(void *data)
 
 		ast_trim_blanks(name);
 
+		if (!strcasecmp(name, "Connection") && !strcasecmp(value, "close")) {
+			keepalive = 0;
+		} else if ((!strcasecmp(name, "Content-Length") && strcmp(value, "0"))
+			|| !strcasecmp(name, "Transfer-Encoding")) {
+			keepalive = 0;
+		}
+
 		if (!headers) {
 			headers = ast_variable_new(name, value, __FILE__);
 			tail = headers;
@@ -912,26 +1477,414 @@ static void *httpd_helper_thread(void *data)
 		}
 	}
 
+	state->keepalive = keepalive;
+
 	if (!*uri) {
+		state->keepalive = 0;
 		ast_http_error(ser, 400, "Bad Request", "Invalid Request");
-		goto done;
+	} else {
+		handle_uri(ser, uri, http_method, headers);
 	}
 
-	handle_uri(ser, uri, http_method, headers);
-
-done:
-	ast_atomic_fetchadd_int(&session_count, -1);
-
 	/* clean up all the header information */
 	if (headers) {
 		ast_variables_destroy(headers);
 	}
 
+	/* A handler that sent nothing gets the connection closed, as before */
+	return ser->f && state->keepalive && state->responded;
+}
+
+/*! \brief Set how long a read on the connection may block */
+static void http_set_read_timeout(struct ast_tcptls_session_instance *ser, int timeout)
+{
+	struct timeval tv = { timeout, 0 };
+
+	setsockopt(ser->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/*!
+ * \brief Check for request data already read from the socket.
+ *
+ * A pipelined request may sit in the stdio buffer, or in the TLS
+ * layer, where poll() on the socket cannot see it.  Without
+ * HTTP_READ_PEEK the pool's connections have no stdio buffer.
+ *
+ * \retval 1 data is buffered.
+ * \retval 0 nothing is buffered.
+ */
+static int http_read_pending(struct ast_tcptls_session_instance *ser)
+{
+#ifdef DO_SSL
+	if (ser->ssl && SSL_pending(ser->ssl) > 0) {
+		return 1;
+	}
+#endif
+#if defined(__GLIBC__)
+	return ser->f->_IO_read_ptr < ser->f->_IO_read_end;
+#elif defined(HTTP_READ_PEEK)
+	return ser->f->_r > 0;
+#else
+	return 0;
+#endif
+}
+
+/*! \brief Close a connection and forget its session */
+static void http_session_close(struct ast_tcptls_session_instance *ser)
+{
+	ast_atomic_fetchadd_int(&session_count, -1);
+
 	if (ser->f) {
 		fclose(ser->f);
 	}
 	ao2_ref(ser, -1);
-	ser = NULL;
+}
+
+/*!
+ * \brief Serve the requests of one connection until it is closed.
+ *
+ * Used when there is no worker pool.  Every read is bounded by
+ * request_timeout, and after a response sent with keep-alive the next
+ * request (possibly already buffered, if the client pipelines) has to
+ * arrive within keepalive_timeout seconds.
+ */
+static void httpd_session(struct ast_tcptls_session_instance *ser)
+{
+	int requests = 0;
+
+	http_set_read_timeout(ser, request_timeout);
+	while (httpd_process_request(ser, requests)) {
+		if (!requests++) {
+			http_set_read_timeout(ser, keepalive_timeout);
+		}
+	}
+
+	http_session_close(ser);
+}
+
+static void *http_worker_thread(void *data);
+
+/*!
+ * \brief Count the workers held by one request for WORKER_STALL_MS or more.
+ * \note http_worker_queue must be locked.
+ */
+static int http_worker_stalled(void)
+{
+	struct http_worker_job *job;
+	struct timeval now = ast_tvnow();
+	int stalled = 0;
+
+	AST_LIST_TRAVERSE(&http_busy_list, job, entry) {
+		if (ast_tvdiff_ms(now, job->started) < WORKER_STALL_MS) {
+			break;
+		}
+		stalled++;
+	}
+	return stalled;
+}
+
+/*!
+ * \brief Start a worker for each one a long request holds, if connections wait.
+ *
+ * Handlers that hold on to a request, such as a manager WaitEvent over
+ * HTTP, would otherwise take the whole pool and starve everyone else.
+ * The workers started here are capped by longpollworkers, on top of the
+ * pool, and exit again once they are idle and no longer needed.
+ *
+ * \note http_worker_queue must be locked.
+ */
+static void http_worker_overflow(void)
+{
+	pthread_t thread;
+	int stalled;
+
+	if (AST_LIST_EMPTY(&http_worker_queue) || http_worker_idle || !http_worker_target) {
+		return;
+	}
+	stalled = MIN(http_worker_stalled(), http_longpoll_workers);
+	while (http_worker_count < http_worker_target + stalled) {
+		if (ast_pthread_create_background(&thread, NULL, http_worker_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start HTTP worker thread\n");
+			break;
+		}
+		http_worker_count++;
+	}
+}
+
+/*! \brief Queue a connection with a request to read for the workers */
+static void http_worker_queue_add(struct http_worker_job *job)
+{
+	AST_LIST_LOCK(&http_worker_queue);
+	AST_LIST_INSERT_TAIL(&http_worker_queue, job, entry);
+	ast_cond_signal(&http_worker_cond);
+	http_worker_overflow();
+	AST_LIST_UNLOCK(&http_worker_queue);
+}
+
+/*!
+ * \brief Hand a connection to the poller until its next request arrives.
+ * \param job The connection.
+ * \param timeout Seconds the request may take to arrive.
+ */
+static void http_idle_add(struct http_worker_job *job, int timeout)
+{
+	job->deadline = ast_tvadd(ast_tvnow(), ast_tv(timeout, 0));
+	job->ready = 0;
+
+	AST_LIST_LOCK(&http_idle_list);
+	AST_LIST_INSERT_TAIL(&http_idle_list, job, entry);
+	http_idle_count++;
+	AST_LIST_UNLOCK(&http_idle_list);
+
+	if (write(http_idle_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+		ast_log(LOG_WARNING, "Unable to wake up the HTTP poller: %s\n", strerror(errno));
+	}
+}
+
+/*!
+ * \brief Poller thread: watch idle connections for their next request.
+ *
+ * Connections waiting for a request, new ones and keep-alive ones alike,
+ * are kept here rather than on a worker, so the pool is only busy with
+ * requests that are actually being read or answered.  A connection that
+ * becomes readable goes to the worker queue; one whose deadline passes
+ * is closed.
+ */
+static void *http_idle_poller(void *data)
+{
+	struct pollfd *pfds = NULL, *tmp;
+	struct http_worker_job *job;
+	struct timeval now;
+	int alloc = 0, n, i, timeout, ms;
+	char buf[64];
+
+	for (;;) {
+		/* Connections still queued behind long requests get more workers */
+		AST_LIST_LOCK(&http_worker_queue);
+		http_worker_overflow();
+		timeout = AST_LIST_EMPTY(&http_worker_queue) ? -1 : WORKER_STALL_MS;
+		AST_LIST_UNLOCK(&http_worker_queue);
+
+		now = ast_tvnow();
+
+		AST_LIST_LOCK(&http_idle_list);
+		if (http_idle_count + 1 > alloc) {
+			if (!(tmp = ast_realloc(pfds, (http_idle_count + 1) * sizeof(*pfds)))) {
+				AST_LIST_UNLOCK(&http_idle_list);
+				usleep(100000);
+				continue;
+			}
+			pfds = tmp;
+			alloc = http_idle_count + 1;
+		}
+		pfds[0].fd = http_idle_pipe[0];
+		pfds[0].events = POLLIN;
+		n = 1;
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&http_idle_list, job, entry) {
+			if ((ms = ast_tvdiff_ms(job->deadline, now)) <= 0) {
+				AST_LIST_REMOVE_CURRENT(entry);
+				http_idle_count--;
+				http_session_close(job->ser);
+				ast_free(job);
+				continue;
+			}
+			if (timeout < 0 || ms < timeout) {
+				timeout = ms;
+			}
+			pfds[n].fd = job->ser->fd;
+			pfds[n].events = POLLIN;
+			n++;
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+		AST_LIST_UNLOCK(&http_idle_list);
+
+		if (ast_poll(pfds, n, timeout) <= 0) {
+			continue;
+		}
+		if (pfds[0].revents) {
+			while (read(http_idle_pipe[0], buf, sizeof(buf)) > 0);
+		}
+
+		/* Only this thread removes connections, and new ones are added
+		 * at the tail, so the first n - 1 are still the ones polled. */
+		i = 1;
+		AST_LIST_LOCK(&http_idle_list);
+		AST_LIST_TRAVERSE(&http_idle_list, job, entry) {
+			if (i == n) {
+				break;
+			}
+			job->ready = pfds[i++].revents != 0;
+		}
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&http_idle_list, job, entry) {
+			if (job->ready) {
+				AST_LIST_REMOVE_CURRENT(entry);
+				http_idle_count--;
+				/* A hangup or error is read, and handled, as a closed connection. */
+				http_worker_queue_add(job);
+			}
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+		AST_LIST_UNLOCK(&http_idle_list);
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Handle the requests a connection has ready.
+ *
+ * Pipelined requests that are already buffered are handled right away.
+ *
+ * \retval 0 the connection goes back to the poller.
+ * \retval -1 the connection is to be closed.
+ */
+static int http_worker_serve(struct http_worker_job *job)
+{
+	struct ast_tcptls_session_instance *ser = job->ser;
+
+	do {
+		if (!httpd_process_request(ser, job->requests++)) {
+			return -1;
+		}
+	} while (http_read_pending(ser));
+
+	return 0;
+}
+
+static void *http_worker_thread(void *data)
+{
+	struct http_worker_job *job;
+	struct timespec ts;
+	int res;
+
+	for (;;) {
+		AST_LIST_LOCK(&http_worker_queue);
+		while (!(job = AST_LIST_REMOVE_HEAD(&http_worker_queue, entry))) {
+			if (http_worker_count > http_worker_target + MIN(http_worker_stalled(), http_longpoll_workers)) {
+				/* The pool was made smaller, or the long requests we stood in for are done. */
+				http_worker_count--;
+				AST_LIST_UNLOCK(&http_worker_queue);
+				return NULL;
+			}
+			http_worker_idle++;
+			if (http_worker_count > http_worker_target) {
+				/* Look again later whether we are still needed */
+				ts.tv_sec = ast_tvnow().tv_sec + 5;
+				ts.tv_nsec = 0;
+				ast_cond_timedwait(&http_worker_cond, &http_worker_queue.lock, &ts);
+			} else {
+				ast_cond_wait(&http_worker_cond, &http_worker_queue.lock);
+			}
+			http_worker_idle--;
+		}
+		job->started = ast_tvnow();
+		AST_LIST_INSERT_TAIL(&http_busy_list, job, entry);
+		AST_LIST_UNLOCK(&http_worker_queue);
+
+		res = http_worker_serve(job);
+
+		AST_LIST_LOCK(&http_worker_queue);
+		AST_LIST_REMOVE(&http_busy_list, job, entry);
+		AST_LIST_UNLOCK(&http_worker_queue);
+
+		if (res) {
+			http_session_close(job->ser);
+			ast_free(job);
+		} else {
+			http_idle_add(job, keepalive_timeout);
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Size the worker pool.
+ *
+ * Workers only hold a connection while a request is read and answered,
+ * so more than session_limit of them can never be busy; the pool is
+ * workers threads, capped at session_limit.  Surplus workers exit once
+ * they are idle.  The poller thread is started with the first workers.
+ * Workers held by long requests are stood in for by up to longpollworkers
+ * more, see http_worker_overflow().
+ */
+static void http_workers_start(void)
+{
+	pthread_t thread;
+	int target = MIN(http_workers, session_limit);
+
+	if (!target && http_idle_thread != AST_PTHREADT_NULL) {
+		/* Connections already with the poller still need a worker. */
+		target = 1;
+	}
+	if (target && http_idle_pipe[0] < 0) {
+		if (pipe(http_idle_pipe)) {
+			ast_log(LOG_WARNING, "Unable to create the HTTP poller pipe: %s\n", strerror(errno));
+			return;
+		}
+		fcntl(http_idle_pipe[0], F_SETFL, fcntl(http_idle_pipe[0], F_GETFL) | O_NONBLOCK);
+		fcntl(http_idle_pipe[1], F_SETFL, fcntl(http_idle_pipe[1], F_GETFL) | O_NONBLOCK);
+	}
+	if (target && http_idle_thread == AST_PTHREADT_NULL
+		&& ast_pthread_create_background(&http_idle_thread, NULL, http_idle_poller, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start HTTP poller thread\n");
+		http_idle_thread = AST_PTHREADT_NULL;
+		return;
+	}
+
+	AST_LIST_LOCK(&http_worker_queue);
+	http_worker_target = target;
+	while (http_worker_count < http_worker_target) {
+		if (ast_pthread_create_background(&thread, NULL, http_worker_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start HTTP worker thread\n");
+			break;
+		}
+		http_worker_count++;
+	}
+	ast_cond_broadcast(&http_worker_cond);
+	AST_LIST_UNLOCK(&http_worker_queue);
+}
+
+/*!
+ * \brief Entry point for a new connection.
+ *
+ * The TCP/TLS layer gives every connection a thread of its own; that
+ * thread only hands the connection to the poller, which queues it for
+ * the worker pool once its first request arrives.  The request has
+ * request_timeout seconds to arrive, and every read from it after that
+ * is bounded by the same timeout.
+ */
+static void *httpd_helper_thread(void *data)
+{
+	struct ast_tcptls_session_instance *ser = data;
+	struct http_worker_job *job;
+
+	if (ast_atomic_fetchadd_int(&session_count, +1) >= session_limit) {
+		ast_atomic_fetchadd_int(&session_count, -1);
+		if (ser->f) {
+			fclose(ser->f);
+		}
+		ao2_ref(ser, -1);
+		return NULL;
+	}
+
+	if (http_worker_target && http_idle_thread != AST_PTHREADT_NULL
+		&& (job = ast_calloc(1, sizeof(*job)))) {
+		job->ser = ser;
+#ifndef HTTP_READ_PEEK
+		/* Nothing may be buffered where http_read_pending() cannot see it */
+		setvbuf(ser->f, NULL, _IONBF, 0);
+#endif
+		http_set_read_timeout(ser, request_timeout);
+		if (http_read_pending(ser)) {
+			http_worker_queue_add(job);
+		} else {
+			http_idle_add(job, request_timeout);
+		}
+		return NULL;
+	}
+
+	httpd_session(ser);
 	return NULL;
 }
 
@@ -1066,6 +2019,30 @@ static int __ast_http_load(int reload)
 				}
 			} else if (!strcasecmp(v->name, "redirect")) {
 				add_redirect(v->value);
+			} else if (!strcasecmp(v->name, "keepalivetimeout")) {
+				if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+							&keepalive_timeout, DEFAULT_KEEPALIVE_TIMEOUT, 0, 3600)) {
+					ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of http.conf\n",
+							v->name, v->value, v->lineno);
+				}
+			} else if (!strcasecmp(v->name, "requesttimeout")) {
+				if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+							&request_timeout, DEFAULT_REQUEST_TIMEOUT, 1, 3600)) {
+					ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of http.conf\n",
+							v->name, v->value, v->lineno);
+				}
+			} else if (!strcasecmp(v->name, "workers")) {
+				if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+							&http_workers, DEFAULT_WORKERS, 0, 1024)) {
+					ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of http.conf\n",
+							v->name, v->value, v->lineno);
+				}
+			} else if (!strcasecmp(v->name, "longpollworkers")) {
+				if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+							&http_longpoll_workers, DEFAULT_LONGPOLL_WORKERS, 0, 1024)) {
+					ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of http.conf\n",
+							v->name, v->value, v->lineno);
+				}
 			} else if (!strcasecmp(v->name, "sessionlimit")) {
 				if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
 							&session_limit, DEFAULT_SESSION_LIMIT, 1, INT_MAX)) {
@@ -1080,11 +2057,18 @@ static int __ast_http_load(int reload)
 		ast_config_destroy(cfg);
 	}
 
+	/* Pick up the new set of redirects */
+	http_routes_rebuild();
+
 	if (strcmp(prefix, newprefix)) {
 		ast_copy_string(prefix, newprefix, sizeof(prefix));
 	}
 	enablestatic = newenablestatic;
 
+	if (enabled) {
+		http_workers_start();
+	}
+
 	if (num_addrs && enabled) {
 		int i;
 		for (i = 0; i < num_addrs; ++i) {
@@ -1135,6 +2119,7 @@ static char *handle_show_http(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 {
 	struct ast_http_uri *urih;
 	struct http_uri_redirect *redirect;
+	struct http_route *route, tmp;
 
 	switch (cmd) {
 	case CLI_INIT:
@@ -1152,6 +2137,10 @@ static char *handle_show_http(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 	}
 	ast_cli(a->fd, "HTTP Server Status:\n");
 	ast_cli(a->fd, "Prefix: %s\n", prefix);
+	ast_cli(a->fd, "Sessions: %d of %d, %d idle, %d workers, keep-alive %s\n", session_count, session_limit,
+		http_idle_count, http_worker_count, keepalive_timeout ? "enabled" : "disabled");
+	ast_cli(a->fd, "Request timeout: %d seconds\n", request_timeout);
+	ast_cli(a->fd, "Workers: %d in the pool, up to %d more for long requests\n", http_worker_target, http_longpoll_workers);
 	if (ast_sockaddr_isnull(&http_desc.old_address)) {
 		ast_cli(a->fd, "Server Disabled\n\n");
 	} else {
@@ -1168,8 +2157,23 @@ static char *handle_show_http(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 	if (AST_RWLIST_EMPTY(&uris)) {
 		ast_cli(a->fd, "None.\n");
 	} else {
-		AST_RWLIST_TRAVERSE(&uris, urih, entry)
-			ast_cli(a->fd, "%s/%s%s => %s\n", prefix, urih->uri, (urih->has_subtree ? "/..." : "" ), urih->description);
+		ast_mutex_lock(&routes_build_lock);
+		AST_RWLIST_TRAVERSE(&uris, urih, entry) {
+			unsigned int hits = 0;
+			uint64_t lookup_ns = 0;
+
+			tmp.urih = urih;
+			if (route_stats && (route = ao2_find(route_stats, &tmp, OBJ_POINTER))) {
+				ao2_lock(route);
+				hits = route->hits;
+				lookup_ns = route->lookup_ns;
+				ao2_unlock(route);
+				ao2_ref(route, -1);
+			}
+			ast_cli(a->fd, "%s/%s%s => %s (%u hits, %lu ns/lookup)\n", prefix, urih->uri, (urih->has_subtree ? "/..." : "" ),
+				urih->description, hits, hits ? (unsigned long) (lookup_ns / hits) : 0UL);
+		}
+		ast_mutex_unlock(&routes_build_lock);
 	}
 	AST_RWLIST_UNLOCK(&uris);
 
@@ -1196,6 +2200,8 @@ static struct ast_cli_entry cli_http[] = {
 
 int ast_http_init(void)
 {
+	ast_cond_init(&http_worker_cond, NULL);
+	ast_cond_init(&routes_drained, NULL);
 	ast_http_uri_link(&statusuri);
 	ast_http_uri_link(&staticuri);
 	ast_cli_register_multiple(cli_http, ARRAY_LEN(cli_http));
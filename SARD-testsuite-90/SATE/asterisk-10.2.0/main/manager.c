@@ -856,6 +856,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 347439 $")
 				<para>- If there are black filters only: implied white all filter processed first, then black filters.</para>
 				<para>- If there are both white and black filters: implied black all filter processed first, then white
 				filters, and lastly black filters.</para>
+				<para>A filter of the form "Event: Name", with no regular expression characters,
+				matches the event called Name exactly.  Sessions whose white filters are all of
+				that form are not woken for other events.</para>
 			</parameter>
 		</syntax>
 		<description>
@@ -897,35 +900,86 @@ enum add_filter_result {
 	FILTER_COMPILE_FAIL,
 };
 
+/*! \brief Default number of slots in the event ring (eventqueuesize in manager.conf) */
+#define DEFAULT_EVENT_RING_SIZE	2048
+/*! \brief Limits for eventqueuesize; the slab costs EVENT_SLOT_SIZE bytes per slot */
+#define MIN_EVENT_RING_SIZE	64
+#define MAX_EVENT_RING_SIZE	65536
+/*! \brief Bytes of slab storage per slot; larger events go to the heap */
+#define EVENT_SLOT_SIZE		1024
+
 /*!
- * Linked list of events.
- * Global events are appended to the list by append_event().
- * The usecount is the number of stored pointers to the element,
- * excluding the list pointers. So an element that is only in
- * the list has a usecount of 0, not 1.
+ * Ring of events.
+ * Global events are stored in the ring by append_event().
+ *
+ * Each event gets a sequence number, claimed atomically, and goes
+ * into slot (seq % event_ring_size), overwriting whatever was there
+ * event_ring_size events ago.  Producers only contend with each other
+ * when they land on the same slot, and nothing is freed behind their
+ * back: the ring is bounded, and old events simply get overwritten.
  *
- * Clients have a pointer to the last event processed, and for each
- * of these clients we track the usecount of the elements.
- * If we have a pointer to an entry in the list, it is safe to navigate
- * it forward because elements will not be deleted, but only appended.
- * The worst that can happen is seeing the pointer still NULL.
+ * Clients keep the sequence number of the next event they want.  When
+ * that slot already holds a newer event the client has fallen a full
+ * ring behind; the events it missed are counted as dropped, the client
+ * is sent an EventsDropped event, and it resumes from the oldest event
+ * still available.
  *
- * When the usecount of an element drops to 0, and the element is the
- * first in the list, we can remove it. Removal is done within the
- * main thread, which is woken up for the purpose.
+ * HTTP sessions only collect their events when the client polls, so
+ * while any exist an overwritten event is moved to the retention list
+ * (event_spill) instead of being lost.  That list is bounded too, to
+ * EVENT_SPILL_LAPS times the ring in events and half the slab size per
+ * event in bytes; past that its oldest events go, and a session that
+ * wanted them gets an EventsDropped event.  purge_sessions() also drops
+ * events every HTTP session has already read, and those older than 2.5
+ * times the HTTP timeout.
  *
- * For simplicity of implementation, we make sure the list is never empty.
+ * Event text is kept in a slab of EVENT_SLOT_SIZE bytes per slot, so
+ * the usual event costs no allocation at all.
  */
 struct eventqent {
-	int usecount;		/*!< # of clients who still need the event */
+	ast_rwlock_t lock;	/*!< held for writing while the slot is filled */
+	int category;
+	unsigned int seq;	/*!< sequence number of the event in the slot */
+	struct timeval tv;	/*!< When event was queued */
+	char *eventdata;	/*!< points into the slab, or to a heap block for large events */
+};
+
+static struct eventqent *event_ring;
+static char *event_slab;
+/*! \brief Number of slots in the ring, a power of two fixed at startup */
+static unsigned int event_ring_size = DEFAULT_EVENT_RING_SIZE;
+/*! \brief Next sequence number to hand out */
+static int event_seq;
+
+/*! \brief An event kept for HTTP sessions after its ring slot was reused */
+struct eventspill {
+	unsigned int seq;	/*!< sequence number the event had in the ring */
 	int category;
-	unsigned int seq;	/*!< sequence number */
-	struct timeval tv;  /*!< When event was allocated */
-	AST_RWLIST_ENTRY(eventqent) eq_next;
-	char eventdata[1];	/*!< really variable size, allocated by append_event() */
+	struct timeval tv;	/*!< When event was queued */
+	size_t len;		/*!< bytes of eventdata, terminator included */
+	char eventdata[0];
 };
 
-static AST_RWLIST_HEAD_STATIC(all_events, eventqent);
+/*! \brief The retention list holds at most this many laps of the event ring */
+#define EVENT_SPILL_LAPS	4
+
+/*!
+ * \brief Retention list, a ring of event_spill_size entries indexed by
+ * sequence number like the event ring; all of it is protected by
+ * event_spill_lock.
+ */
+static struct eventspill **event_spill;
+static unsigned int event_spill_size;
+/*! \brief No event below this one is retained */
+static unsigned int event_spill_floor;
+/*! \brief One past the newest event retained */
+static unsigned int event_spill_next;
+static unsigned int event_spill_count;
+static size_t event_spill_bytes;
+static size_t event_spill_max_bytes;
+AST_MUTEX_DEFINE_STATIC(event_spill_lock);
+/*! \brief Number of HTTP sessions; nothing is retained while there are none */
+static int http_sessions;
 
 static int displayconnects = 1;
 static int allowmultiplelogin = 1;
@@ -1018,8 +1072,12 @@ struct mansession_session {
 	int inlen;		/*!< number of buffered bytes */
 	struct ao2_container *whitefilters;	/*!< Manager event filters - white list */
 	struct ao2_container *blackfilters;	/*!< Manager event filters - black list */
+	struct ao2_container *eventindex;	/*!< "Event: Name" white filters, by name */
+	int eventindex_all;	/*!< some white filter is not in eventindex, or there are none */
 	int send_events;	/*!<  XXX what ? */
-	struct eventqent *last_ev;	/*!< last event processed. */
+	unsigned int last_ev;	/*!< sequence number of the next event to process */
+	unsigned int dropped_events;	/*!< events overwritten before we could process them */
+	int http_counted;	/*!< counted in http_sessions */
 	int writetimeout;	/*!< Timeout for ast_carefulwrite() */
 	time_t authstart;
 	int pending_event;         /*!< Pending events indicator in case when waiting_thread is NULL */
@@ -1082,12 +1140,39 @@ static AST_RWLIST_HEAD_STATIC(users, ast_manager_user);
 /*! \brief list of actions registered */
 static AST_RWLIST_HEAD_STATIC(actions, manager_action);
 
+/*! \brief Number of buckets in the action name hash */
+#define ACTION_BUCKETS 127
+
+/*!
+ * \brief Registered actions hashed by name.
+ *
+ * \note Holds the same objects as the actions list, which is kept for
+ * the alphabetical listings.  Both are modified under the actions
+ * write lock.
+ */
+static struct ao2_container *action_hash;
+
+static int action_hash_fn(const void *obj, const int flags)
+{
+	const struct manager_action *act = obj;
+
+	return ast_str_case_hash(act->action);
+}
+
+static int action_cmp_fn(void *obj, void *arg, int flags)
+{
+	struct manager_action *act = obj, *act2 = arg;
+
+	return !strcasecmp(act->action, act2->action) ? CMP_MATCH | CMP_STOP : 0;
+}
+
 /*! \brief list of hooks registered */
 static AST_RWLIST_HEAD_STATIC(manager_hooks, manager_custom_hook);
 
 static void free_channelvars(void);
 
 static enum add_filter_result manager_add_filter(const char *filter_pattern, struct ao2_container *whitefilters, struct ao2_container *blackfilters);
+static int match_filter(struct mansession_session *session, const char *eventdata);
 
 /*!
  * \internal
@@ -1099,18 +1184,13 @@ static enum add_filter_result manager_add_filter(const char *filter_pattern, str
  */
 static struct manager_action *action_find(const char *name)
 {
-	struct manager_action *act;
+	struct manager_action tmp = { .action = name, };
 
-	AST_RWLIST_RDLOCK(&actions);
-	AST_RWLIST_TRAVERSE(&actions, act, list) {
-		if (!strcasecmp(name, act->action)) {
-			ao2_t_ref(act, +1, "found action object");
-			break;
-		}
+	if (!action_hash) {
+		return NULL;
 	}
-	AST_RWLIST_UNLOCK(&actions);
 
-	return act;
+	return ao2_t_find(action_hash, &tmp, OBJ_POINTER, "found action object");
 }
 
 /*! \brief Add a custom hook to be called when an event is fired */
@@ -1140,55 +1220,251 @@ int check_webmanager_enabled(void)
 }
 
 /*!
- * Grab a reference to the last event, update usecount as needed.
- * Can handle a NULL pointer.
+ * Return the sequence number a new session should start reading from,
+ * so that it only sees events queued from now on.
  */
-static struct eventqent *grab_last(void)
+static unsigned int grab_last(void)
 {
-	struct eventqent *ret;
+	return (unsigned int) ast_atomic_fetchadd_int(&event_seq, 0);
+}
 
-	AST_RWLIST_WRLOCK(&all_events);
-	ret = AST_RWLIST_LAST(&all_events);
-	/* the list is never empty now, but may become so when
-	 * we optimize it in the future, so be prepared.
-	 */
-	if (ret) {
-		ast_atomic_fetchadd_int(&ret->usecount, 1);
+/*!
+ * \internal
+ * \brief Turn an eventqueuesize value into a usable ring size.
+ *
+ * The ring is indexed by masking the sequence number, so the size is
+ * rounded up to a power of two and kept within the allowed range.
+ */
+static unsigned int event_ring_size_parse(const char *val)
+{
+	unsigned int want, size = MIN_EVENT_RING_SIZE;
+
+	if (sscanf(val, "%30u", &want) != 1) {
+		ast_log(LOG_WARNING, "Invalid eventqueuesize '%s', using %d\n", val, DEFAULT_EVENT_RING_SIZE);
+		return DEFAULT_EVENT_RING_SIZE;
 	}
-	AST_RWLIST_UNLOCK(&all_events);
-	return ret;
+	while (size < want && size < MAX_EVENT_RING_SIZE) {
+		size <<= 1;
+	}
+	if (size != want) {
+		ast_log(LOG_NOTICE, "eventqueuesize %u adjusted to %u\n", want, size);
+	}
+	return size;
 }
 
 /*!
- * Purge unused events. Remove elements from the head
- * as long as their usecount is 0 and there is a next element.
+ * \brief Allocate the event ring and its slab
+ *
+ * \note The size comes from eventqueuesize in manager.conf.  Readers
+ * and producers index the ring without a global lock, so it cannot be
+ * resized later; a changed value takes effect on the next restart.
  */
-static void purge_events(void)
+static int event_ring_init(void)
 {
-	struct eventqent *ev;
-	struct timeval now = ast_tvnow();
+	struct ast_flags config_flags = { 0 };
+	struct ast_config *cfg;
+	const char *val;
+	int x;
 
-	AST_RWLIST_WRLOCK(&all_events);
-	while ( (ev = AST_RWLIST_FIRST(&all_events)) &&
-	    ev->usecount == 0 && AST_RWLIST_NEXT(ev, eq_next)) {
-		AST_RWLIST_REMOVE_HEAD(&all_events, eq_next);
-		ast_free(ev);
+	if (event_ring) {
+		return 0;
 	}
 
-	AST_RWLIST_TRAVERSE_SAFE_BEGIN(&all_events, ev, eq_next) {
-		/* Never release the last event */
-		if (!AST_RWLIST_NEXT(ev, eq_next)) {
+	cfg = ast_config_load2("manager.conf", "manager", config_flags);
+	if (cfg && cfg != CONFIG_STATUS_FILEINVALID) {
+		if ((val = ast_variable_retrieve(cfg, "general", "eventqueuesize"))) {
+			event_ring_size = event_ring_size_parse(val);
+		}
+		ast_config_destroy(cfg);
+	}
+
+	event_spill_size = event_ring_size * EVENT_SPILL_LAPS;
+	event_spill_max_bytes = event_spill_size * (EVENT_SLOT_SIZE / 2);
+	if (!(event_spill = ast_calloc(event_spill_size, sizeof(*event_spill)))) {
+		return -1;
+	}
+	if (!(event_slab = ast_malloc(event_ring_size * EVENT_SLOT_SIZE))) {
+		ast_free(event_spill);
+		event_spill = NULL;
+		return -1;
+	}
+	if (!(event_ring = ast_calloc(event_ring_size, sizeof(*event_ring)))) {
+		ast_free(event_slab);
+		event_slab = NULL;
+		ast_free(event_spill);
+		event_spill = NULL;
+		return -1;
+	}
+	for (x = 0; x < event_ring_size; x++) {
+		ast_rwlock_init(&event_ring[x].lock);
+		/* Mark the slot as holding an event from one lap ago. */
+		event_ring[x].seq = x - event_ring_size;
+		event_ring[x].eventdata = event_slab + x * EVENT_SLOT_SIZE;
+		event_ring[x].eventdata[0] = '\0';
+	}
+
+	return 0;
+}
+
+/*! \brief How long events are retained for HTTP sessions, in seconds */
+static int event_retention(void)
+{
+	/* 2.5 times the HTTP timeout, at most 2.5 hours, as the event list used to keep them */
+	return (httptimeout > 3600 ? 3600 : httptimeout) * 5 / 2;
+}
+
+/*! \brief Drop the oldest retained event, with event_spill_lock held */
+static void event_spill_drop_oldest(void)
+{
+	struct eventspill **entry = &event_spill[event_spill_floor & (event_spill_size - 1)];
+
+	/* Events that could not be retained leave holes */
+	if (*entry && (*entry)->seq == event_spill_floor) {
+		event_spill_bytes -= (*entry)->len;
+		event_spill_count--;
+		ast_free(*entry);
+		*entry = NULL;
+	}
+	event_spill_floor++;
+}
+
+/*!
+ * \brief Drop retained events
+ *
+ * \param now Events older than the retention time at this time are dropped.
+ * \param cursor If not NULL, events before this one are dropped as well.
+ *
+ * \note Called from purge_sessions(), not from producers: it walks every
+ * event it drops.
+ */
+static void event_spill_purge(struct timeval now, const unsigned int *cursor)
+{
+	int retention = event_retention();
+	struct eventspill *spill;
+
+	ast_mutex_lock(&event_spill_lock);
+	while (event_spill_count) {
+		spill = event_spill[event_spill_floor & (event_spill_size - 1)];
+		if (spill && spill->seq == event_spill_floor
+			&& (!cursor || (int) (spill->seq - *cursor) >= 0)
+			&& ast_tvdiff_sec(now, spill->tv) <= retention) {
 			break;
 		}
+		event_spill_drop_oldest();
+	}
+	ast_mutex_unlock(&event_spill_lock);
+}
+
+/*!
+ * \internal
+ * \brief Move an event that is about to be overwritten to the retention list.
+ *
+ * \note Called by append_event() with the slot write locked, so this only
+ * costs a copy: the list being full, its oldest events go.
+ */
+static void event_spill_add(struct eventqent *slot)
+{
+	struct eventspill *spill;
+	size_t len;
 
-		/* 2.5 times whatever the HTTP timeout is (maximum 2.5 hours) is the maximum time that we will definitely cache an event */
-		if (ev->usecount == 0 && ast_tvdiff_sec(now, ev->tv) > (httptimeout > 3600 ? 3600 : httptimeout) * 2.5) {
-			AST_RWLIST_REMOVE_CURRENT(eq_next);
-			ast_free(ev);
+	len = strlen(slot->eventdata) + 1;
+	if (len > event_spill_max_bytes || !(spill = ast_malloc(sizeof(*spill) + len))) {
+		return;
+	}
+	spill->seq = slot->seq;
+	spill->category = slot->category;
+	spill->tv = slot->tv;
+	spill->len = len;
+	memcpy(spill->eventdata, slot->eventdata, len);
+
+	ast_mutex_lock(&event_spill_lock);
+	if (!event_spill_count) {
+		event_spill_floor = event_spill_next = spill->seq;
+	}
+	if ((int) (spill->seq - event_spill_floor) < 0) {
+		/* Overtaken by another producer and dropped already */
+		ast_mutex_unlock(&event_spill_lock);
+		ast_free(spill);
+		return;
+	}
+	if ((int) (spill->seq - event_spill_next) >= 0) {
+		event_spill_next = spill->seq + 1;
+	}
+	while ((int) (event_spill_next - event_spill_floor) > (int) event_spill_size
+		|| (event_spill_count && event_spill_bytes + len > event_spill_max_bytes
+			&& event_spill_floor != spill->seq)) {
+		event_spill_drop_oldest();
+	}
+	event_spill[spill->seq & (event_spill_size - 1)] = spill;
+	event_spill_bytes += len;
+	event_spill_count++;
+	ast_mutex_unlock(&event_spill_lock);
+}
+
+/*! \brief Drop every retained event, once there is no HTTP session left */
+static void event_spill_clear(void)
+{
+	ast_mutex_lock(&event_spill_lock);
+	while (event_spill_count) {
+		event_spill_drop_oldest();
+	}
+	ast_mutex_unlock(&event_spill_lock);
+}
+
+/*!
+ * \internal
+ * \brief Look for an event an HTTP session missed in the retention list.
+ *
+ * \retval 1 it is there, and wanted: it was copied to buf
+ * \retval 0 it is there, but not wanted
+ * \retval -1 it is not retained
+ */
+static int event_spill_get(struct mansession_session *session, unsigned int want, int mask,
+	struct ast_str **buf, int *category)
+{
+	struct eventspill *spill;
+	int res = -1;
+
+	ast_mutex_lock(&event_spill_lock);
+	spill = event_spill[want & (event_spill_size - 1)];
+	if (event_spill_count && spill && spill->seq == want) {
+		res = 0;
+		if (event_wanted(session, mask, spill->category, spill->eventdata)) {
+			ast_str_set(buf, 0, "%s", spill->eventdata);
+			*category = spill->category;
+			res = 1;
 		}
 	}
-	AST_RWLIST_TRAVERSE_SAFE_END;
-	AST_RWLIST_UNLOCK(&all_events);
+	ast_mutex_unlock(&event_spill_lock);
+
+	return res;
+}
+
+/*!
+ * \internal
+ * \brief Find how far an HTTP session has to skip when an event is gone.
+ *
+ * \param want The event that is neither in the ring nor retained.
+ * \param oldest The oldest event still in the ring.
+ *
+ * \return The number of events lost.
+ */
+static unsigned int event_spill_skip(unsigned int want, unsigned int oldest)
+{
+	unsigned int next;
+
+	ast_mutex_lock(&event_spill_lock);
+	if (!event_spill_count || (int) (event_spill_floor - oldest) >= 0) {
+		next = oldest;
+	} else if ((int) (event_spill_floor - want) > 0) {
+		next = event_spill_floor;
+	} else {
+		/* A hole in the list: only one event is missing. */
+		next = want + 1;
+	}
+	ast_mutex_unlock(&event_spill_lock);
+
+	return next - want;
 }
 
 /*!
@@ -1325,16 +1601,122 @@ static struct mansession_session *unref_mansession(struct mansession_session *s)
 	return s;
 }
 
+/*!
+ * \brief A compiled event filter.
+ *
+ * \note Most filters are plain strings such as "Event: Newchannel".  A
+ * regular expression without metacharacters matches exactly where the
+ * string occurs, so those are matched with strstr() instead of running
+ * the regex engine over every event.
+ */
+struct event_filter {
+	regex_t regex;
+	/*! The pattern, if it has no regex metacharacters */
+	char *literal;
+	/*! For "Event: Name" filters, the name (points into literal) */
+	const char *event;
+};
+
 static void event_filter_destructor(void *obj)
 {
-	regex_t *regex_filter = obj;
-	regfree(regex_filter);
+	struct event_filter *filter = obj;
+
+	regfree(&filter->regex);
+	ast_free(filter->literal);
+}
+
+/*! \brief Number of hash buckets in a session's event filter index */
+#define EVENT_INDEX_BUCKETS	17
+
+static int event_index_hash(const void *obj, const int flags)
+{
+	const struct event_filter *filter = obj;
+
+	return ast_str_hash(filter->event);
+}
+
+static int event_index_cmp(void *obj, void *arg, int flags)
+{
+	struct event_filter *filter = obj, *other = arg;
+
+	return !strcmp(filter->event, other->event) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+/*!
+ * \internal
+ * \brief Rebuild the index of a session's white filters by event name.
+ *
+ * \note The session must be locked.  When every white filter is of the
+ * form "Event: Name", events with any other name can never pass, so
+ * those sessions are neither woken for them nor copy them out.
+ */
+static void session_index_filters(struct mansession_session *session)
+{
+	struct event_filter *filter;
+	struct ao2_iterator i;
+
+	ao2_callback(session->eventindex, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, NULL, NULL);
+	session->eventindex_all = !ao2_container_count(session->whitefilters);
+
+	i = ao2_iterator_init(session->whitefilters, 0);
+	while ((filter = ao2_iterator_next(&i))) {
+		if (filter->event) {
+			ao2_link(session->eventindex, filter);
+		} else {
+			session->eventindex_all = 1;
+		}
+		ao2_ref(filter, -1);
+	}
+	ao2_iterator_destroy(&i);
+}
+
+/*!
+ * \internal
+ * \brief Check an event against a session's filter index.
+ *
+ * \note The session must be locked.  A non-zero return only means the
+ * filters may accept the event; match_filter() has the final say.
+ */
+static int session_may_want(struct mansession_session *session, const char *event)
+{
+	struct event_filter key = { .event = event, }, *filter;
+
+	if (session->eventindex_all) {
+		return 1;
+	}
+	if (!event || !(filter = ao2_find(session->eventindex, &key, OBJ_POINTER))) {
+		return 0;
+	}
+	ao2_ref(filter, -1);
+	return 1;
+}
+
+/*!
+ * \internal
+ * \brief Get the name from the "Event:" line that starts an event.
+ *
+ * \return buf holding the name, or NULL if the event has no name.
+ */
+static const char *event_name(const char *eventdata, char *buf, size_t len)
+{
+	size_t n;
+
+	if (strncmp(eventdata, "Event: ", 7)) {
+		return NULL;
+	}
+	eventdata += 7;
+	n = strcspn(eventdata, "\r\n");
+	if (n >= len) {
+		return NULL;
+	}
+	memcpy(buf, eventdata, n);
+	buf[n] = '\0';
+	return buf;
 }
 
 static void session_destructor(void *obj)
 {
 	struct mansession_session *session = obj;
-	struct eventqent *eqe = session->last_ev;
 	struct ast_datastore *datastore;
 
 	/* Get rid of each of the data stores on the session */
@@ -1346,10 +1728,10 @@ static void session_destructor(void *obj)
 	if (session->f != NULL) {
 		fclose(session->f);
 	}
-	if (eqe) {
-		ast_atomic_fetchadd_int(&eqe->usecount, -1);
+	if (session->http_counted && ast_atomic_dec_and_test(&http_sessions)) {
+		/* Nobody left to retain events for. */
+		event_spill_clear();
 	}
-
 	if (session->whitefilters) {
 		ao2_t_callback(session->whitefilters, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL, "unlink all white filters");
 		ao2_t_ref(session->whitefilters, -1 , "decrement ref for white container, should be last one");
@@ -1359,6 +1741,11 @@ static void session_destructor(void *obj)
 		ao2_t_callback(session->blackfilters, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL, "unlink all black filters");
 		ao2_t_ref(session->blackfilters, -1 , "decrement ref for black container, should be last one");
 	}
+
+	if (session->eventindex) {
+		ao2_callback(session->eventindex, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
+		ao2_ref(session->eventindex, -1);
+	}
 }
 
 /*! \brief Allocate manager session structure and add it to the list of sessions */
@@ -1380,6 +1767,12 @@ static struct mansession_session *build_mansession(struct sockaddr_in sin)
 		return NULL;
 	}
 
+	if (!(newsession->eventindex = ao2_container_alloc(EVENT_INDEX_BUCKETS, event_index_hash, event_index_cmp))) {
+		ao2_ref(newsession, -1);
+		return NULL;
+	}
+	newsession->eventindex_all = 1;
+
 	newsession->fd = -1;
 	newsession->waiting_thread = AST_PTHREADT_NULL;
 	newsession->writetimeout = 100;
@@ -1695,8 +2088,8 @@ static char *handle_showmanconn(struct ast_cli_entry *e, int cmd, struct ast_cli
 {
 	struct mansession_session *session;
 	time_t now = time(NULL);
-#define HSMCONN_FORMAT1 "  %-15.15s  %-15.15s  %-10.10s  %-10.10s  %-8.8s  %-8.8s  %-5.5s  %-5.5s\n"
-#define HSMCONN_FORMAT2 "  %-15.15s  %-15.15s  %-10d  %-10d  %-8d  %-8d  %-5.5d  %-5.5d\n"
+#define HSMCONN_FORMAT1 "  %-15.15s  %-15.15s  %-10.10s  %-10.10s  %-8.8s  %-8.8s  %-5.5s  %-5.5s  %-10.10s\n"
+#define HSMCONN_FORMAT2 "  %-15.15s  %-15.15s  %-10d  %-10d  %-8d  %-8d  %-5.5d  %-5.5d  %-10u\n"
 	int count = 0;
 	struct ao2_iterator i;
 
@@ -1706,18 +2099,19 @@ static char *handle_showmanconn(struct ast_cli_entry *e, int cmd, struct ast_cli
 		e->usage =
 			"Usage: manager show connected\n"
 			"	Prints a listing of the users that are currently connected to the\n"
-			"Asterisk manager interface.\n";
+			"Asterisk manager interface.  Dropped is the number of events the\n"
+			"session fell too far behind to receive.\n";
 		return NULL;
 	case CLI_GENERATE:
 		return NULL;
 	}
 
-	ast_cli(a->fd, HSMCONN_FORMAT1, "Username", "IP Address", "Start", "Elapsed", "FileDes", "HttpCnt", "Read", "Write");
+	ast_cli(a->fd, HSMCONN_FORMAT1, "Username", "IP Address", "Start", "Elapsed", "FileDes", "HttpCnt", "Read", "Write", "Dropped");
 
 	i = ao2_iterator_init(sessions, 0);
 	while ((session = ao2_iterator_next(&i))) {
 		ao2_lock(session);
-		ast_cli(a->fd, HSMCONN_FORMAT2, session->username, ast_inet_ntoa(session->sin.sin_addr), (int)(session->sessionstart), (int)(now - session->sessionstart), session->fd, session->inuse, session->readperm, session->writeperm);
+		ast_cli(a->fd, HSMCONN_FORMAT2, session->username, ast_inet_ntoa(session->sin.sin_addr), (int)(session->sessionstart), (int)(now - session->sessionstart), session->fd, session->inuse, session->readperm, session->writeperm, session->dropped_events);
 		count++;
 		ao2_unlock(session);
 		unref_mansession(session);
@@ -1733,6 +2127,7 @@ static char *handle_showmanconn(struct ast_cli_entry *e, int cmd, struct ast_cli
 static char *handle_showmaneventq(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	struct eventqent *s;
+	unsigned int seq, end;
 	switch (cmd) {
 	case CLI_INIT:
 		e->command = "manager show eventq";
@@ -1744,13 +2139,20 @@ static char *handle_showmaneventq(struct ast_cli_entry *e, int cmd, struct ast_c
 	case CLI_GENERATE:
 		return NULL;
 	}
-	AST_RWLIST_RDLOCK(&all_events);
-	AST_RWLIST_TRAVERSE(&all_events, s, eq_next) {
-		ast_cli(a->fd, "Usecount: %d\n", s->usecount);
-		ast_cli(a->fd, "Category: %d\n", s->category);
-		ast_cli(a->fd, "Event:\n%s", s->eventdata);
+	if (!event_ring) {
+		return CLI_SUCCESS;
+	}
+	end = grab_last();
+	for (seq = end - event_ring_size; seq != end; seq++) {
+		s = &event_ring[seq & (event_ring_size - 1)];
+		ast_rwlock_rdlock(&s->lock);
+		if (s->seq == seq) {
+			ast_cli(a->fd, "Sequence: %u\n", s->seq);
+			ast_cli(a->fd, "Category: %d\n", s->category);
+			ast_cli(a->fd, "Event:\n%s", s->eventdata);
+		}
+		ast_rwlock_unlock(&s->lock);
 	}
-	AST_RWLIST_UNLOCK(&all_events);
 
 	return CLI_SUCCESS;
 }
@@ -1775,23 +2177,226 @@ static char *handle_manager_reload(struct ast_cli_entry *e, int cmd, struct ast_
 	return CLI_SUCCESS;
 }
 
-static struct eventqent *advance_event(struct eventqent *e)
+/*! \brief holds a copy of the event being delivered by advance_event() */
+AST_THREADSTORAGE(manager_event_copy_buf);
+
+/*!
+ * \internal
+ * \brief Check whether an event in the ring is worth copying out.
+ *
+ * \note Only the category mask and the filter index are checked, both
+ * cheap enough for the slot lock; match_filter() runs later.
+ */
+static int event_wanted(struct mansession_session *session, int mask, int category, const char *eventdata)
 {
-	struct eventqent *next;
+	char name[80];
 
-	AST_RWLIST_RDLOCK(&all_events);
-	if ((next = AST_RWLIST_NEXT(e, eq_next))) {
-		ast_atomic_fetchadd_int(&next->usecount, 1);
-		ast_atomic_fetchadd_int(&e->usecount, -1);
+	if ((mask & category) != category) {
+		return 0;
 	}
-	AST_RWLIST_UNLOCK(&all_events);
-	return next;
+	return session_may_want(session, event_name(eventdata, name, sizeof(name)));
+}
+
+/*!
+ * \internal
+ * \brief Fetch the next event for a session.
+ *
+ * \param session Session whose read position is advanced.
+ * \param mask Categories wanted; other events are skipped.
+ * \param category Set to the category of the event returned.
+ * \param notice Set when the text returned is an EventsDropped notice.
+ *
+ * \note The session must be locked.  Events are checked in place in the
+ * ring, and only those the session may want are copied out.  The returned
+ * text is a per-thread copy, so it can be sent out without holding up
+ * the producers.  Unless it is a notice, the caller still has to run it
+ * through match_filter(), after unlocking the session.
+ *
+ * When the session fell behind and events were lost, an EventsDropped
+ * event saying how many is returned first.  HTTP sessions first look
+ * for the missed events in the retention list.
+ *
+ * \return The event text, or NULL if there is no new event.
+ */
+static const char *advance_event(struct mansession_session *session, int mask, int *category, int *notice)
+{
+	struct eventqent *slot;
+	struct ast_str *buf;
+	unsigned int want, oldest = 0, lost = 0;
+	const char *res = NULL;
+	int more, lapped, retained = -1;
+
+	*notice = 0;
+	if (!event_ring || !(buf = ast_str_thread_get(&manager_event_copy_buf, EVENT_SLOT_SIZE))) {
+		return NULL;
+	}
+
+	for (;;) {
+		want = session->last_ev;
+		slot = &event_ring[want & (event_ring_size - 1)];
+		lapped = 0;
+		ast_rwlock_rdlock(&slot->lock);
+		if (slot->seq == want) {
+			session->last_ev = want + 1;
+			if (event_wanted(session, mask, slot->category, slot->eventdata)) {
+				ast_str_set(&buf, 0, "%s", slot->eventdata);
+				*category = slot->category;
+				res = ast_str_buffer(buf);
+			}
+			more = !res;
+		} else if ((int) (slot->seq - want) > 0) {
+			/* Lapped: the event is no longer in the ring. */
+			oldest = slot->seq - event_ring_size + 1;
+			lapped = more = 1;
+		} else {
+			/* Not queued yet. */
+			more = 0;
+		}
+		ast_rwlock_unlock(&slot->lock);
+
+		if (lapped && session->managerid
+			&& (retained = event_spill_get(session, want, mask, &buf, category)) >= 0) {
+			session->last_ev = want + 1;
+			if (retained) {
+				res = ast_str_buffer(buf);
+				more = 0;
+			}
+		} else if (lapped) {
+			/* Resume from the oldest event still available. */
+			lost = session->managerid ? event_spill_skip(want, oldest) : oldest - want;
+			session->last_ev = want + lost;
+			session->dropped_events += lost;
+			ast_log(LOG_WARNING, "Manager session for '%s' from %s is too slow, %u events dropped\n",
+				session->username, ast_inet_ntoa(session->sin.sin_addr), lost);
+			if (mask) {
+				/* Tell the client before handing out the next event. */
+				ast_str_set(&buf, 0,
+					"Event: EventsDropped\r\n"
+					"Privilege: system,all\r\n"
+					"Count: %u\r\n"
+					"Total: %u\r\n"
+					"\r\n", lost, session->dropped_events);
+				*category = EVENT_FLAG_SYSTEM;
+				*notice = 1;
+				res = ast_str_buffer(buf);
+				more = 0;
+			}
+		}
+		if (!more) {
+			break;
+		}
+	}
+
+	return res;
+}
+
+/*! \brief Check whether an event is waiting for a session */
+static int event_pending(struct mansession_session *session)
+{
+	return grab_last() != session->last_ev;
 }
 
 #define	GET_HEADER_FIRST_MATCH	0
 #define	GET_HEADER_LAST_MATCH	1
 #define	GET_HEADER_SKIP_EMPTY	2
 
+/*! \brief Number of hash buckets in a message header index */
+#define MANAGER_HEADER_BUCKETS	64
+
+/*!
+ * \brief Hashed index of the headers of the message being processed.
+ *
+ * \details
+ * Built once by do_message() when a request has been read, so that the
+ * many astman_get_header() calls made by an action handler do not each
+ * rescan every header.  Chains are kept in message order, so first and
+ * last match work exactly as they do with the linear scan.
+ */
+struct manager_header_index {
+	/*! Message the index describes, NULL if none */
+	const struct message *m;
+	unsigned int hdrcount;
+	short buckets[MANAGER_HEADER_BUCKETS];
+	struct {
+		unsigned int hash;
+		unsigned short namelen;
+		short next;
+	} hdr[AST_MAX_MANHEADERS];
+};
+
+AST_THREADSTORAGE(manager_header_index_buf);
+
+static unsigned int manager_header_hash(const char *name, size_t len)
+{
+	unsigned int hash = 5381;
+
+	while (len--) {
+		hash = hash * 33 ^ tolower(*name++);
+	}
+
+	return hash;
+}
+
+/*!
+ * \internal
+ * \brief Index the headers of a message for __astman_get_header().
+ *
+ * \note The index stays valid until manager_header_index_forget() is
+ * called; the message headers must not change in between.
+ */
+static void manager_header_index_build(const struct message *m)
+{
+	struct manager_header_index *idx;
+	short *tail[MANAGER_HEADER_BUCKETS];
+	unsigned int hash;
+	const char *colon;
+	int x;
+
+	if (!(idx = ast_threadstorage_get(&manager_header_index_buf, sizeof(*idx)))) {
+		return;
+	}
+
+	for (x = 0; x < MANAGER_HEADER_BUCKETS; x++) {
+		idx->buckets[x] = -1;
+		tail[x] = &idx->buckets[x];
+	}
+	for (x = 0; x < m->hdrcount && x < AST_MAX_MANHEADERS; x++) {
+		if (!(colon = strchr(m->headers[x], ':'))) {
+			continue;
+		}
+		hash = manager_header_hash(m->headers[x], colon - m->headers[x]);
+		idx->hdr[x].hash = hash;
+		idx->hdr[x].namelen = colon - m->headers[x];
+		idx->hdr[x].next = -1;
+		*tail[hash % MANAGER_HEADER_BUCKETS] = x;
+		tail[hash % MANAGER_HEADER_BUCKETS] = &idx->hdr[x].next;
+	}
+	idx->hdrcount = m->hdrcount;
+	idx->m = m;
+}
+
+static void manager_header_index_forget(const struct message *m)
+{
+	struct manager_header_index *idx;
+
+	if ((idx = ast_threadstorage_get(&manager_header_index_buf, sizeof(*idx))) && idx->m == m) {
+		idx->m = NULL;
+	}
+}
+
+/*! \brief Return the header index for a message, or NULL if it has none */
+static const struct manager_header_index *manager_header_index_find(const struct message *m)
+{
+	struct manager_header_index *idx;
+
+	if (!(idx = ast_threadstorage_get(&manager_header_index_buf, sizeof(*idx)))
+		|| idx->m != m || idx->hdrcount != m->hdrcount) {
+		return NULL;
+	}
+
+	return idx;
+}
+
 /*!
  * \brief Return a matching header value.
  *
@@ -1809,9 +2414,22 @@ static const char *__astman_get_header(const struct message *m, char *var, int m
 {
 	int x, l = strlen(var);
 	const char *result = "";
+	const struct manager_header_index *idx = manager_header_index_find(m);
+	unsigned int hash = 0;
 
-	for (x = 0; x < m->hdrcount; x++) {
+	if (idx) {
+		/* Only walk the headers that hash like the one we want. */
+		hash = manager_header_hash(var, l);
+		x = idx->buckets[hash % MANAGER_HEADER_BUCKETS];
+	} else {
+		x = 0;
+	}
+
+	for (; x >= 0 && x < m->hdrcount; x = idx ? idx->hdr[x].next : x + 1) {
 		const char *h = m->headers[x];
+		if (idx && (idx->hdr[x].hash != hash || idx->hdr[x].namelen != l)) {
+			continue;
+		}
 		if (!strncasecmp(var, h, l) && h[l] == ':') {
 			const char *value = h + l + 1;
 			value = ast_skip_blanks(value); /* ignore leading spaces in the value */
@@ -2026,6 +2644,9 @@ AST_THREADSTORAGE(astman_append_buf);
 
 AST_THREADSTORAGE(userevent_buf);
 
+/*! \brief holds the lines of the AMI request being read by do_message() */
+AST_THREADSTORAGE(manager_message_buf);
+
 /*! \brief initial allocated size for the astman_append_buf */
 #define ASTMAN_APPEND_BUF_INITSIZE   256
 
@@ -2394,7 +3015,7 @@ static int authenticate(struct mansession *s, const struct message *m)
 	const char *password = astman_get_header(m, "Secret");
 	int error = -1;
 	struct ast_manager_user *user = NULL;
-	regex_t *regex_filter;
+	struct event_filter *regex_filter;
 	struct ao2_iterator filter_iter;
 	struct ast_sockaddr addr;
 
@@ -2475,6 +3096,10 @@ static int authenticate(struct mansession *s, const struct message *m)
 	}
 	ao2_iterator_destroy(&filter_iter);
 
+	ao2_lock(s->session);
+	session_index_filters(s->session);
+	ao2_unlock(s->session);
+
 	s->session->sessionstart = time(NULL);
 	s->session->sessionstart_tv = ast_tvnow();
 	set_eventmask(s, astman_get_header(m, "Events"));
@@ -2958,7 +3583,7 @@ static int action_waitevent(struct mansession *s, const struct message *m)
 
 	for (x = 0; x < timeout || timeout < 0; x++) {
 		ao2_lock(s->session);
-		if (AST_RWLIST_NEXT(s->session->last_ev, eq_next)) {
+		if (event_pending(s->session)) {
 			needexit = 1;
 		}
 		/* We can have multiple HTTP session point to the same mansession entry.
@@ -2987,14 +3612,20 @@ static int action_waitevent(struct mansession *s, const struct message *m)
 
 	ao2_lock(s->session);
 	if (s->session->waiting_thread == pthread_self()) {
-		struct eventqent *eqe = s->session->last_ev;
+		const char *eventdata;
+		int category, notice, match;
+
 		astman_send_response(s, m, "Success", "Waiting for Event completed.");
-		while ((eqe = advance_event(eqe))) {
-			if (((s->session->readperm & eqe->category) == eqe->category) &&
-			    ((s->session->send_events & eqe->category) == eqe->category)) {
-				astman_append(s, "%s", eqe->eventdata);
+		while ((eventdata = advance_event(s->session, s->session->readperm & s->session->send_events, &category, &notice))) {
+			if (!notice) {
+				ao2_unlock(s->session);
+				match = match_filter(s->session, eventdata);
+				ao2_lock(s->session);
+				if (!match) {
+					continue;
+				}
 			}
-			s->session->last_ev = eqe;
+			astman_append(s, "%s", eventdata);
 		}
 		astman_append(s,
 			"Event: WaitEventComplete\r\n"
@@ -4243,13 +4874,32 @@ static int action_timeout(struct mansession *s, const struct message *m)
 	return 0;
 }
 
+/*! \brief An event being checked by match_filter() */
+struct filter_event {
+	const char *eventdata;
+	const char *name;	/*!< from the Event: line, or NULL */
+};
+
+/*! \brief Check one compiled filter against an event */
+static int event_filter_match(const struct event_filter *filter, const struct filter_event *ev)
+{
+	if (filter->event) {
+		return ev->name && !strcmp(ev->name, filter->event);
+	}
+	if (filter->literal) {
+		return strstr(ev->eventdata, filter->literal) != NULL;
+	}
+
+	return !regexec(&filter->regex, ev->eventdata, 0, NULL, 0);
+}
+
 static int whitefilter_cmp_fn(void *obj, void *arg, void *data, int flags)
 {
-	regex_t *regex_filter = obj;
-	const char *eventdata = arg;
+	struct event_filter *filter = obj;
+	const struct filter_event *ev = arg;
 	int *result = data;
 
-	if (!regexec(regex_filter, eventdata, 0, NULL, 0)) {
+	if (event_filter_match(filter, ev)) {
 		*result = 1;
 		return (CMP_MATCH | CMP_STOP);
 	}
@@ -4259,11 +4909,11 @@ static int whitefilter_cmp_fn(void *obj, void *arg, void *data, int flags)
 
 static int blackfilter_cmp_fn(void *obj, void *arg, void *data, int flags)
 {
-	regex_t *regex_filter = obj;
-	const char *eventdata = arg;
+	struct event_filter *filter = obj;
+	const struct filter_event *ev = arg;
 	int *result = data;
 
-	if (!regexec(regex_filter, eventdata, 0, NULL, 0)) {
+	if (event_filter_match(filter, ev)) {
 		*result = 0;
 		return (CMP_MATCH | CMP_STOP);
 	}
@@ -4284,6 +4934,9 @@ static int action_filter(struct mansession *s, const struct message *m)
 
         if (!strcasecmp(operation, "Add")) {
 		res = manager_add_filter(filter, s->session->whitefilters, s->session->blackfilters);
+		ao2_lock(s->session);
+		session_index_filters(s->session);
+		ao2_unlock(s->session);
 
 	        if (res != FILTER_SUCCESS) {
 		        if (res == FILTER_ALLOC_FAILED) {
@@ -4326,12 +4979,14 @@ static int action_filter(struct mansession *s, const struct message *m)
  *
  */
 static enum add_filter_result manager_add_filter(const char *filter_pattern, struct ao2_container *whitefilters, struct ao2_container *blackfilters) {
-	regex_t *new_filter = ao2_t_alloc(sizeof(*new_filter), event_filter_destructor, "event_filter allocation");
+	struct event_filter *new_filter = ao2_t_alloc(sizeof(*new_filter), event_filter_destructor, "event_filter allocation");
 	int is_blackfilter;
 
 	if (!new_filter) {
 		return FILTER_ALLOC_FAILED;
 	}
+	new_filter->literal = NULL;
+	new_filter->event = NULL;
 
 	if (filter_pattern[0] == '!') {
 		is_blackfilter = 1;
@@ -4340,11 +4995,23 @@ static enum add_filter_result manager_add_filter(const char *filter_pattern, str
 		is_blackfilter = 0;
 	}
 
-	if (regcomp(new_filter, filter_pattern, 0)) {
+	if (regcomp(&new_filter->regex, filter_pattern, 0)) {
 		ao2_t_ref(new_filter, -1, "failed to make regx");
 		return FILTER_COMPILE_FAIL;
 	}
 
+	/* These are the only characters special to a basic regex. */
+	if (!filter_pattern[strcspn(filter_pattern, ".[\\*^$")]
+		&& !(new_filter->literal = ast_strdup(filter_pattern))) {
+		ao2_t_ref(new_filter, -1, "failed to copy filter");
+		return FILTER_ALLOC_FAILED;
+	}
+	/* "Event: Name" is compared against the event name, so it can be indexed. */
+	if (new_filter->literal && !strncmp(new_filter->literal, "Event: ", 7)
+		&& new_filter->literal[7] && !strpbrk(new_filter->literal + 7, " \t\r\n")) {
+		new_filter->event = new_filter->literal + 7;
+	}
+
 	if (is_blackfilter) {
 		ao2_t_link(blackfilters, new_filter, "link new filter into black user container");
 	} else {
@@ -4354,25 +5021,36 @@ static enum add_filter_result manager_add_filter(const char *filter_pattern, str
         return FILTER_SUCCESS;
 }
 
-static int match_filter(struct mansession *s, char *eventdata)
+/*!
+ * \brief Run an event through a session's filters.
+ *
+ * \note Called without the session locked; the filter containers have
+ * their own locks, and regexec() should not hold up producers waking
+ * the session.
+ */
+static int match_filter(struct mansession_session *session, const char *eventdata)
 {
 	int result = 0;
+	char name[80];
+	struct filter_event ev = { .eventdata = eventdata, };
 
 	ast_debug(3, "Examining event:\n%s\n", eventdata);
-	if (!ao2_container_count(s->session->whitefilters) && !ao2_container_count(s->session->blackfilters)) {
+	if (!ao2_container_count(session->whitefilters) && !ao2_container_count(session->blackfilters)) {
 		return 1; /* no filtering means match all */
-	} else if (ao2_container_count(s->session->whitefilters) && !ao2_container_count(s->session->blackfilters)) {
+	}
+	ev.name = event_name(eventdata, name, sizeof(name));
+	if (ao2_container_count(session->whitefilters) && !ao2_container_count(session->blackfilters)) {
 		/* white filters only: implied black all filter processed first, then white filters */
-		ao2_t_callback_data(s->session->whitefilters, OBJ_NODATA, whitefilter_cmp_fn, eventdata, &result, "find filter in session filter container"); 
-	} else if (!ao2_container_count(s->session->whitefilters) && ao2_container_count(s->session->blackfilters)) {
+		ao2_t_callback_data(session->whitefilters, OBJ_NODATA, whitefilter_cmp_fn, &ev, &result, "find filter in session filter container"); 
+	} else if (!ao2_container_count(session->whitefilters) && ao2_container_count(session->blackfilters)) {
 		/* black filters only: implied white all filter processed first, then black filters */
-		ao2_t_callback_data(s->session->blackfilters, OBJ_NODATA, blackfilter_cmp_fn, eventdata, &result, "find filter in session filter container"); 
+		ao2_t_callback_data(session->blackfilters, OBJ_NODATA, blackfilter_cmp_fn, &ev, &result, "find filter in session filter container"); 
 	} else {
 		/* white and black filters: implied black all filter processed first, then white filters, and lastly black filters */
-		ao2_t_callback_data(s->session->whitefilters, OBJ_NODATA, whitefilter_cmp_fn, eventdata, &result, "find filter in session filter container"); 
+		ao2_t_callback_data(session->whitefilters, OBJ_NODATA, whitefilter_cmp_fn, &ev, &result, "find filter in session filter container"); 
 		if (result) {
 			result = 0;
-			ao2_t_callback_data(s->session->blackfilters, OBJ_NODATA, blackfilter_cmp_fn, eventdata, &result, "find filter in session filter container"); 
+			ao2_t_callback_data(session->blackfilters, OBJ_NODATA, blackfilter_cmp_fn, &ev, &result, "find filter in session filter container"); 
 		}
 	}
 
@@ -4390,18 +5068,29 @@ static int process_events(struct mansession *s)
 
 	ao2_lock(s->session);
 	if (s->session->f != NULL) {
-		struct eventqent *eqe = s->session->last_ev;
-
-		while ((eqe = advance_event(eqe))) {
-			if (!ret && s->session->authenticated &&
-			    (s->session->readperm & eqe->category) == eqe->category &&
-			    (s->session->send_events & eqe->category) == eqe->category) {
-					if (match_filter(s, eqe->eventdata)) {
-						if (send_string(s, eqe->eventdata) < 0)
-							ret = -1;	/* don't send more */
+		const char *eventdata;
+		int category, notice, match;
+
+		if (s->session->authenticated) {
+			while ((eventdata = advance_event(s->session, s->session->readperm & s->session->send_events, &category, &notice))) {
+				if (!notice) {
+					/* eventdata is a per-thread copy, the session lock is not needed to check it */
+					ao2_unlock(s->session);
+					match = match_filter(s->session, eventdata);
+					ao2_lock(s->session);
+					if (!match) {
+						continue;
 					}
+				}
+				if (send_string(s, eventdata) < 0) {
+					ret = -1;	/* don't send more */
+					break;
+				}
 			}
-			s->session->last_ev = eqe;
+		}
+		if (ret || !s->session->authenticated) {
+			/* Whatever is left is dropped. */
+			s->session->last_ev = grab_last();
 		}
 	}
 	ao2_unlock(s->session);
@@ -4914,12 +5603,24 @@ static int get_input(struct mansession *s, char *output)
 static int do_message(struct mansession *s)
 {
 	struct message m = { 0 };
-	char header_buf[sizeof(s->session->inbuf)] = { '\0' };
+	struct ast_str *buf;
+	size_t hdr_off[AST_MAX_MANHEADERS];
+	size_t used = 0;
+	char *header_buf;
 	int res;
 	int idx;
 	int hdr_loss;
 	time_t now;
 
+	/*
+	 * Request lines are read straight into a per-thread buffer, one after
+	 * the other, and the headers point into it; nothing is allocated or
+	 * freed per header.
+	 */
+	if (!(buf = ast_str_thread_get(&manager_message_buf, sizeof(s->session->inbuf)))) {
+		return -1;
+	}
+
 	hdr_loss = 0;
 	for (;;) {
 		/* Check if any events are pending and do them if needed */
@@ -4927,6 +5628,14 @@ static int do_message(struct mansession *s)
 			res = -1;
 			break;
 		}
+		if (ast_str_make_space(&buf, used + sizeof(s->session->inbuf))) {
+			/* Allocation failure; drop what we have and keep reading. */
+			hdr_loss = 1;
+			m.hdrcount = 0;
+			used = 0;
+		}
+		header_buf = ast_str_buffer(buf) + used;
+		*header_buf = '\0';
 		res = get_input(s, header_buf);
 		if (res == 0) {
 			/* No input line received. */
@@ -4949,6 +5658,10 @@ static int do_message(struct mansession *s)
 		} else if (res > 0) {
 			/* Input line received. */
 			if (ast_strlen_zero(header_buf)) {
+				for (idx = 0; idx < m.hdrcount; ++idx) {
+					m.headers[idx] = ast_str_buffer(buf) + hdr_off[idx];
+				}
+				manager_header_index_build(&m);
 				if (hdr_loss) {
 					mansession_lock(s);
 					astman_send_error(s, &m, "Too many lines in message or allocation failure");
@@ -4958,14 +5671,9 @@ static int do_message(struct mansession *s)
 					res = process_message(s, &m) ? -1 : 0;
 				}
 				break;
-			} else if (m.hdrcount < ARRAY_LEN(m.headers)) {
-				m.headers[m.hdrcount] = ast_strdup(header_buf);
-				if (!m.headers[m.hdrcount]) {
-					/* Allocation failure. */
-					hdr_loss = 1;
-				} else {
-					++m.hdrcount;
-				}
+			} else if (m.hdrcount < ARRAY_LEN(m.headers) && !hdr_loss) {
+				hdr_off[m.hdrcount++] = used;
+				used += strlen(header_buf) + 1;
 			} else {
 				/* Too many lines in message. */
 				hdr_loss = 1;
@@ -4976,10 +5684,7 @@ static int do_message(struct mansession *s)
 		}
 	}
 
-	/* Free AMI request headers. */
-	for (idx = 0; idx < m.hdrcount; ++idx) {
-		ast_free((void *) m.headers[idx]);
-	}
+	manager_header_index_forget(&m);
 	return res;
 }
 
@@ -5095,10 +5800,17 @@ static void purge_sessions(int n_max)
 	struct mansession_session *session;
 	time_t now = time(NULL);
 	struct ao2_iterator i;
+	/* Oldest event an HTTP session still wants */
+	unsigned int cursor = 0;
+	int have_cursor = 0;
 
 	i = ao2_iterator_init(sessions, 0);
 	while ((session = ao2_iterator_next(&i)) && n_max > 0) {
 		ao2_lock(session);
+		if (session->managerid && (!have_cursor || (int) (session->last_ev - cursor) < 0)) {
+			cursor = session->last_ev;
+			have_cursor = 1;
+		}
 		if (session->sessiontimeout && (now > session->sessiontimeout) && !session->inuse) {
 			if (session->authenticated && (VERBOSITY_ATLEAST(2)) && manager_displayconnects(session)) {
 				ast_verb(2, "HTTP Manager '%s' timed out from %s\n",
@@ -5113,32 +5825,63 @@ static void purge_sessions(int n_max)
 		}
 	}
 	ao2_iterator_destroy(&i);
+
+	if (event_spill) {
+		/* The cursor only counts if every session was seen */
+		event_spill_purge(ast_tvnow(), !session && have_cursor ? &cursor : NULL);
+	}
 }
 
 /*! \brief
  * events are appended to a queue from where they
  * can be dispatched to clients.
+ *
+ * \param seqp If not NULL, set to the sequence number of the event.
  */
-static int append_event(const char *str, int category)
+static int append_event(const char *str, int category, unsigned int *seqp)
 {
-	struct eventqent *tmp = ast_malloc(sizeof(*tmp) + strlen(str));
-	static int seq;	/* sequence number */
+	struct eventqent *slot;
+	size_t len = strlen(str) + 1;
+	char *slab, *heap = NULL;
+	unsigned int seq;
+	struct timeval now;
 
-	if (!tmp) {
+	if (!event_ring) {
 		return -1;
 	}
+	if (len > EVENT_SLOT_SIZE && !(heap = ast_malloc(len))) {
+		return -1;
+	}
+
+	seq = ast_atomic_fetchadd_int(&event_seq, 1);
+	slot = &event_ring[seq & (event_ring_size - 1)];
+	slab = event_slab + (seq & (event_ring_size - 1)) * EVENT_SLOT_SIZE;
+	now = ast_tvnow();
 
-	/* need to init all fields, because ast_malloc() does not */
-	tmp->usecount = 0;
-	tmp->category = category;
-	tmp->seq = ast_atomic_fetchadd_int(&seq, 1);
-	tmp->tv = ast_tvnow();
-	AST_RWLIST_NEXT(tmp, eq_next) = NULL;
-	strcpy(tmp->eventdata, str);
+	ast_rwlock_wrlock(&slot->lock);
+	if ((int) (seq - slot->seq) <= 0) {
+		/* A whole lap overtook us while we were stalled; drop it. */
+		ast_rwlock_unlock(&slot->lock);
+		ast_free(heap);
+		return -1;
+	}
+	if (http_sessions && slot->seq == seq - event_ring_size) {
+		/* HTTP sessions may not have polled for it yet. */
+		event_spill_add(slot);
+	}
+	if (slot->eventdata != slab) {
+		ast_free(slot->eventdata);
+	}
+	slot->eventdata = heap ? heap : slab;
+	memcpy(slot->eventdata, str, len);
+	slot->category = category;
+	slot->tv = now;
+	slot->seq = seq;
+	ast_rwlock_unlock(&slot->lock);
 
-	AST_RWLIST_WRLOCK(&all_events);
-	AST_RWLIST_INSERT_TAIL(&all_events, tmp, eq_next);
-	AST_RWLIST_UNLOCK(&all_events);
+	if (seqp) {
+		*seqp = seq;
+	}
 
 	return 0;
 }
@@ -5183,6 +5926,7 @@ int __ast_manager_event_multichan(int category, const char *event, int chancount
 	va_list ap;
 	struct timeval now;
 	struct ast_str *buf;
+	unsigned int seq;
 	int i;
 
 	if (!(sessions && ao2_container_count(sessions)) && AST_RWLIST_EMPTY(&manager_hooks)) {
@@ -5222,15 +5966,19 @@ int __ast_manager_event_multichan(int category, const char *event, int chancount
 
 	ast_str_append(&buf, 0, "\r\n");
 
-	append_event(ast_str_buffer(buf), category);
-
 	/* Wake up any sleeping sessions */
-	if (sessions) {
+	if (!append_event(ast_str_buffer(buf), category, &seq) && sessions) {
 		struct ao2_iterator i;
 		i = ao2_iterator_init(sessions, 0);
 		while ((session = ao2_iterator_next(&i))) {
 			ao2_lock(session);
-			if (session->waiting_thread != AST_PTHREADT_NULL) {
+			if ((session->readperm & session->send_events & category) != category
+				|| !session_may_want(session, event)) {
+				/* Not for this session; if it is caught up, keep it that way. */
+				if (session->last_ev == seq) {
+					session->last_ev = seq + 1;
+				}
+			} else if (session->waiting_thread != AST_PTHREADT_NULL) {
 				pthread_kill(session->waiting_thread, SIGURG);
 			} else {
 				/* We have an event to process, but the mansession is
@@ -5268,6 +6016,7 @@ int ast_manager_unregister(char *action)
 	AST_RWLIST_TRAVERSE_SAFE_BEGIN(&actions, cur, list) {
 		if (!strcasecmp(action, cur->action)) {
 			AST_RWLIST_REMOVE_CURRENT(list);
+			ao2_t_unlink(action_hash, cur, "action object removed from hash");
 			break;
 		}
 	}
@@ -5305,6 +6054,11 @@ static int ast_manager_register_struct(struct manager_action *act)
 	struct manager_action *cur, *prev = NULL;
 
 	AST_RWLIST_WRLOCK(&actions);
+	if (!action_hash
+		&& !(action_hash = ao2_container_alloc(ACTION_BUCKETS, action_hash_fn, action_cmp_fn))) {
+		AST_RWLIST_UNLOCK(&actions);
+		return -1;
+	}
 	AST_RWLIST_TRAVERSE(&actions, cur, list) {
 		int ret;
 
@@ -5327,6 +6081,7 @@ static int ast_manager_register_struct(struct manager_action *act)
 	} else {
 		AST_RWLIST_INSERT_HEAD(&actions, act, list);
 	}
+	ao2_t_link(action_hash, act, "action object added to hash");
 
 	ast_verb(2, "Manager registered action %s\n", act->action);
 
@@ -5891,6 +6646,8 @@ static int generic_http_callback(struct ast_tcptls_session_instance *ser,
 		 * won't happen twice in a row.
 		 */
 		while ((session->managerid = ast_random() ^ (unsigned long) session) == 0);
+		session->http_counted = 1;
+		ast_atomic_fetchadd_int(&http_sessions, 1);
 		session->last_ev = grab_last();
 		AST_LIST_HEAD_INIT_NOLOCK(&session->datastores);
 	}
@@ -6185,6 +6942,8 @@ static int auth_http_callback(struct ast_tcptls_session_instance *ser,
 
 		ast_copy_string(session->username, u_username, sizeof(session->username));
 		session->managerid = nonce;
+		session->http_counted = 1;
+		ast_atomic_fetchadd_int(&http_sessions, 1);
 		session->last_ev = grab_last();
 		AST_LIST_HEAD_INIT_NOLOCK(&session->datastores);
 
@@ -6491,7 +7250,6 @@ static int webregged = 0;
 static void purge_old_stuff(void *data)
 {
 	purge_sessions(1);
-	purge_events();
 }
 
 static struct ast_tls_config ami_tls_cfg;
@@ -6551,6 +7309,10 @@ static char *handle_manager_show_settings(struct ast_cli_entry *e, int cmd, stru
 	ast_cli(a->fd, FORMAT, "Channel vars:", S_OR(manager_channelvars, ""));
 	ast_cli(a->fd, FORMAT, "Debug:", AST_CLI_YESNO(manager_debug));
 	ast_cli(a->fd, FORMAT, "Block sockets:", AST_CLI_YESNO(block_sockets));
+	ast_cli(a->fd, FORMAT2, "Event queue size:", (int) event_ring_size);
+	ast_mutex_lock(&event_spill_lock);
+	ast_cli(a->fd, FORMAT2, "Events retained for HTTP:", (int) event_spill_count);
+	ast_mutex_unlock(&event_spill_lock);
 #undef FORMAT
 #undef FORMAT2
 
@@ -6623,6 +7385,11 @@ static int __init_manager(int reload)
 	manager_enabled = 0;
 
 	if (!registered) {
+		if (event_ring_init()) {
+			ast_log(LOG_ERROR, "Unable to allocate the manager event queue\n");
+			return -1;
+		}
+
 		/* Register default actions */
 		ast_manager_register_xml("Ping", 0, action_ping);
 		ast_manager_register_xml("Events", 0, action_events);
@@ -6663,7 +7430,7 @@ static int __init_manager(int reload)
 		ast_extension_state_add(NULL, NULL, manager_state_cb, NULL);
 		registered = 1;
 		/* Append placeholder event so master_eventq never runs dry */
-		append_event("Event: Placeholder\r\n\r\n", 0);
+		append_event("Event: Placeholder\r\n\r\n", 0, NULL);
 	}
 	if ((cfg = ast_config_load2("manager.conf", "manager", config_flags)) == CONFIG_STATUS_FILEUNCHANGED) {
 		return 0;
@@ -6736,6 +7503,11 @@ static int __init_manager(int reload)
 			manager_debug = ast_true(val);
 		} else if (!strcasecmp(var->name, "httptimeout")) {
 			newhttptimeout = atoi(val);
+		} else if (!strcasecmp(var->name, "eventqueuesize")) {
+			/* Read by event_ring_init(); the ring is sized once. */
+			if (reload && event_ring_size_parse(val) != event_ring_size) {
+				ast_log(LOG_NOTICE, "eventqueuesize change takes effect after a restart\n");
+			}
 		} else if (!strcasecmp(var->name, "authtimeout")) {
 			int timeout = atoi(var->value);
 
@@ -72,6 +72,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 344845 $")
 
 static char base64[64];
 static char b2a[256];
+/*! Two base64 characters for each 12 bit value, so a 3 byte group takes two lookups */
+static char base64_pair[4096][2];
 
 AST_THREADSTORAGE(inet_ntoa_buf);
 
@@ -302,39 +304,32 @@ int ast_base64encode_full(char *dst, const unsigned char *src, int srclen, int m
 {
 	int cnt = 0;
 	int col = 0;
-	unsigned int byte = 0;
-	int bits = 0;
-	int cntin = 0;
+	unsigned int byte;
 	/* Reserve space for null byte at end of string */
 	max--;
-	while ((cntin < srclen) && (cnt < max)) {
-		byte <<= 8;
-		byte |= *(src++);
-		bits += 8;
-		cntin++;
-		if ((bits == 24) && (cnt + 4 <= max)) {
-			*dst++ = base64[(byte >> 18) & 0x3f];
-			*dst++ = base64[(byte >> 12) & 0x3f];
-			*dst++ = base64[(byte >> 6) & 0x3f];
-			*dst++ = base64[byte & 0x3f];
-			cnt += 4;
-			col += 4;
-			bits = 0;
-			byte = 0;
-		}
+	/* Whole 3 byte groups; the loop body has no data dependent branches */
+	while ((srclen >= 3) && (cnt + 4 <= max)) {
+		byte = (src[0] << 16) | (src[1] << 8) | src[2];
+		memcpy(dst, base64_pair[byte >> 12], 2);
+		memcpy(dst + 2, base64_pair[byte & 0xfff], 2);
+		dst += 4;
+		src += 3;
+		srclen -= 3;
+		cnt += 4;
+		col += 4;
 		if (linebreaks && (cnt < max) && (col == 64)) {
 			*dst++ = '\n';
 			cnt++;
 			col = 0;
 		}
 	}
-	if (bits && (cnt + 4 <= max)) {
+	if ((srclen > 0) && (srclen < 3) && (cnt + 4 <= max)) {
 		/* Add one last character for the remaining bits, 
 		   padding the rest with 0 */
-		byte <<= 24 - bits;
+		byte = (src[0] << 16) | (srclen == 2 ? src[1] << 8 : 0);
 		*dst++ = base64[(byte >> 18) & 0x3f];
 		*dst++ = base64[(byte >> 12) & 0x3f];
-		if (bits == 16)
+		if (srclen == 2)
 			*dst++ = base64[(byte >> 6) & 0x3f];
 		else
 			*dst++ = '=';
@@ -376,6 +371,10 @@ static void base64_init(void)
 	base64[63] = '/';
 	b2a[(int)'+'] = 62;
 	b2a[(int)'/'] = 63;
+	for (x = 0; x < ARRAY_LEN(base64_pair); x++) {
+		base64_pair[x][0] = base64[x >> 6];
+		base64_pair[x][1] = base64[x & 0x3f];
+	}
 }
 
 const struct ast_flags ast_uri_http = {AST_URI_UNRESERVED};
@@ -523,9 +522,16 @@ struct thr_lock_info {
 		enum ast_lock_type type;
 		/*! This thread is waiting on this lock */
 		int pending:2;
+		/*! Wait and hold times are being measured for this acquisition */
+		unsigned int sampled:1;
 #ifdef HAVE_BKTR
 		struct ast_bt *backtrace;
 #endif
+		/*! Where this acquisition is counted, if the profiler is on */
+		struct lockstat *stat;
+		/*! When we started waiting, and when we got the lock (ns) */
+		uint64_t wait_start;
+		uint64_t acquired_at;
 	} locks[AST_MAX_LOCKS];
 	/*! This is the number of locks currently held by this thread.
 	 *  The index (num_locks - 1) has the info on the last one in the
@@ -534,6 +540,10 @@ struct thr_lock_info {
 	/*! Protects the contents of the locks member 
 	 * Intentionally not ast_mutex_t */
 	pthread_mutex_t lock;
+	/*! Lock contention counters of this thread, protected by lock */
+	struct lockstat_table *stats;
+	/*! Acquisitions since the last sampled one */
+	unsigned int since_sample;
 	AST_LIST_ENTRY(thr_lock_info) entry;
 };
 
@@ -546,6 +556,251 @@ AST_MUTEX_DEFINE_STATIC(lock_infos_lock);
  */
 static AST_LIST_HEAD_NOLOCK_STATIC(lock_infos, thr_lock_info);
 
+/*!
+ * \brief Lock contention profiler
+ *
+ * While turned on, every acquisition of a tracked lock is counted per
+ * lock name and acquiring site in a table owned by the acquiring
+ * thread, so threads never touch each other's counters.  Every
+ * lockstats_rate'th acquisition also has its wait and hold times
+ * measured.  The lock functions do not say whether the lock was free,
+ * so an acquisition that had to wait LOCKSTATS_CONTENDED_NS or more is
+ * counted as contended.
+ *
+ * The tables are only merged when they are looked at, and into
+ * lockstats_retired when their thread exits.
+ *
+ * It only exists with DEBUG_THREADS: it is fed by ast_store_lock_info()
+ * and friends, and the lock wrappers only call those in such builds.
+ * Otherwise they are the bare pthread calls, inlined, and any hook there
+ * would be paid on every lock operation whether profiling or not.
+ */
+#define LOCKSTATS_SLOTS 512
+#define LOCKSTATS_RETIRED_SLOTS 4096
+/*! Give up looking for a free slot after this many probes */
+#define LOCKSTATS_PROBES 16
+#define LOCKSTATS_BUCKETS 16
+#define LOCKSTATS_CONTENDED_NS 1000
+
+struct lockstat {
+	const char *lock_name;
+	const char *file;
+	const char *func;
+	int line_num;
+	uint64_t acquired;
+	/*! Acquisitions that had their wait time measured */
+	uint64_t sampled;
+	uint64_t contended;
+	/*! Failed trylocks */
+	uint64_t failed;
+	uint64_t wait_total;
+	uint64_t wait_max;
+	/*! Sampled acquisitions that have been released again */
+	uint64_t held;
+	uint64_t hold_total;
+	uint64_t hold_max;
+	/*! Bucket 0 is under 1us, bucket n up to 2^n us, the last one is everything above */
+	unsigned int wait_hist[LOCKSTATS_BUCKETS];
+	unsigned int hold_hist[LOCKSTATS_BUCKETS];
+};
+
+struct lockstat_table {
+	/*! Results from an older run of the profiler if not lockstats_gen */
+	unsigned int gen;
+	unsigned int size;
+	/*! Sites that did not fit */
+	unsigned int dropped;
+	struct lockstat slots[0];
+};
+
+static int lockstats_enabled;
+static unsigned int lockstats_rate = 1;
+/*! Bumped every time the profiler is turned on, which discards older results */
+static unsigned int lockstats_gen;
+/*! Counters of exited threads, protected by lock_infos_lock */
+static struct lockstat_table *lockstats_retired;
+
+static uint64_t lockstats_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv = ast_tvnow();
+
+	return (uint64_t) tv.tv_sec * 1000000000 + (uint64_t) tv.tv_usec * 1000;
+#endif
+}
+
+static int lockstats_bucket(uint64_t ns)
+{
+	int bucket = 0;
+
+	for (ns /= 1000; ns && bucket < LOCKSTATS_BUCKETS - 1; ns >>= 1) {
+		bucket++;
+	}
+	return bucket;
+}
+
+/*!
+ * \brief Make sure a table is there and belongs to the current run of the profiler
+ *
+ * Plain calloc(), we may be in the middle of locking something.
+ */
+static struct lockstat_table *lockstats_table_get(struct lockstat_table **table, unsigned int size)
+{
+	if (!*table) {
+		if (!(*table = calloc(1, sizeof(**table) + size * sizeof((*table)->slots[0])))) {
+			return NULL;
+		}
+		(*table)->size = size;
+		(*table)->gen = lockstats_gen;
+	} else if ((*table)->gen != lockstats_gen) {
+		memset((*table)->slots, 0, size * sizeof((*table)->slots[0]));
+		(*table)->dropped = 0;
+		(*table)->gen = lockstats_gen;
+	}
+	return *table;
+}
+
+static struct lockstat *lockstats_find(struct lockstat_table *table, const char *lock_name, const char *file, int line_num, const char *func)
+{
+	unsigned long hash = (unsigned long) lock_name ^ ((unsigned long) file << 5) ^ (line_num * 2654435761UL);
+	struct lockstat *stat;
+	int i;
+
+	hash ^= hash >> 15;
+	for (i = 0; i < LOCKSTATS_PROBES; i++) {
+		stat = &table->slots[(hash + i) & (table->size - 1)];
+		if (!stat->lock_name) {
+			stat->lock_name = lock_name;
+			stat->file = file;
+			stat->line_num = line_num;
+			stat->func = func;
+			return stat;
+		}
+		if (stat->lock_name == lock_name && stat->file == file && stat->line_num == line_num) {
+			return stat;
+		}
+	}
+	table->dropped++;
+	return NULL;
+}
+
+static void lockstats_add(struct lockstat *dst, const struct lockstat *src)
+{
+	int i;
+
+	dst->acquired += src->acquired;
+	dst->sampled += src->sampled;
+	dst->contended += src->contended;
+	dst->failed += src->failed;
+	dst->wait_total += src->wait_total;
+	dst->wait_max = MAX(dst->wait_max, src->wait_max);
+	dst->held += src->held;
+	dst->hold_total += src->hold_total;
+	dst->hold_max = MAX(dst->hold_max, src->hold_max);
+	for (i = 0; i < LOCKSTATS_BUCKETS; i++) {
+		dst->wait_hist[i] += src->wait_hist[i];
+		dst->hold_hist[i] += src->hold_hist[i];
+	}
+}
+
+/*! \brief Start counting an attempt to get lock i, with lock_info->lock held */
+static void lockstats_attempt(struct thr_lock_info *lock_info, int i)
+{
+	int j;
+
+	if (!lock_info->stats || lock_info->stats->gen != lockstats_gen) {
+		/* Held locks may still point into the old results */
+		for (j = 0; j < lock_info->num_locks; j++) {
+			lock_info->locks[j].stat = NULL;
+		}
+		if (!lockstats_table_get(&lock_info->stats, LOCKSTATS_SLOTS)) {
+			return;
+		}
+	}
+
+	if (!(lock_info->locks[i].stat = lockstats_find(lock_info->stats, lock_info->locks[i].lock_name,
+		lock_info->locks[i].file, lock_info->locks[i].line_num, lock_info->locks[i].func))) {
+		return;
+	}
+
+	if (++lock_info->since_sample >= lockstats_rate) {
+		lock_info->since_sample = 0;
+		lock_info->locks[i].sampled = 1;
+		lock_info->locks[i].wait_start = lockstats_now();
+	}
+}
+
+static void lockstats_acquired(struct thr_lock_info *lock_info, int i)
+{
+	struct lockstat *stat = lock_info->locks[i].stat;
+	uint64_t wait;
+
+	stat->acquired++;
+	if (!lock_info->locks[i].sampled) {
+		return;
+	}
+
+	lock_info->locks[i].acquired_at = lockstats_now();
+	wait = lock_info->locks[i].acquired_at - lock_info->locks[i].wait_start;
+	stat->sampled++;
+	stat->wait_total += wait;
+	stat->wait_max = MAX(stat->wait_max, wait);
+	stat->wait_hist[lockstats_bucket(wait)]++;
+	if (wait >= LOCKSTATS_CONTENDED_NS) {
+		stat->contended++;
+	}
+}
+
+static void lockstats_released(struct thr_lock_info *lock_info, int i)
+{
+	struct lockstat *stat = lock_info->locks[i].stat;
+	uint64_t hold;
+
+	if (!lock_info->locks[i].sampled || !lock_info->locks[i].acquired_at) {
+		return;
+	}
+
+	hold = lockstats_now() - lock_info->locks[i].acquired_at;
+	stat->held++;
+	stat->hold_total += hold;
+	stat->hold_max = MAX(stat->hold_max, hold);
+	stat->hold_hist[lockstats_bucket(hold)]++;
+}
+
+/*! \brief Keep the counters of an exiting thread, with lock_infos_lock held */
+static void lockstats_retire(struct thr_lock_info *lock_info)
+{
+	struct lockstat *stat;
+	int i;
+
+	if (!lock_info->stats) {
+		return;
+	}
+
+	if (lock_info->stats->gen == lockstats_gen
+		&& lockstats_table_get(&lockstats_retired, LOCKSTATS_RETIRED_SLOTS)) {
+		for (i = 0; i < lock_info->stats->size; i++) {
+			if (!lock_info->stats->slots[i].lock_name) {
+				continue;
+			}
+			if ((stat = lockstats_find(lockstats_retired, lock_info->stats->slots[i].lock_name,
+				lock_info->stats->slots[i].file, lock_info->stats->slots[i].line_num,
+				lock_info->stats->slots[i].func))) {
+				lockstats_add(stat, &lock_info->stats->slots[i]);
+			}
+		}
+		lockstats_retired->dropped += lock_info->stats->dropped;
+	}
+
+	free(lock_info->stats);
+	lock_info->stats = NULL;
+}
+
 /*!
  * \brief Destroy a thread's lock info
  *
@@ -558,6 +813,7 @@ static void lock_info_destroy(void *data)
 
 	pthread_mutex_lock(&lock_infos_lock.mutex);
 	AST_LIST_REMOVE(&lock_infos, lock_info, entry);
+	lockstats_retire(lock_info);
 	pthread_mutex_unlock(&lock_infos_lock.mutex);
 
 
@@ -644,8 +900,15 @@ void ast_store_lock_info(enum ast_lock_type type, const char *filename,
 #ifdef HAVE_BKTR
 	lock_info->locks[i].backtrace = bt;
 #endif
+	lock_info->locks[i].stat = NULL;
+	lock_info->locks[i].sampled = 0;
+	lock_info->locks[i].acquired_at = 0;
 	lock_info->num_locks++;
 
+	if (lockstats_enabled) {
+		lockstats_attempt(lock_info, i);
+	}
+
 	pthread_mutex_unlock(&lock_info->lock);
 }
 
@@ -659,6 +922,9 @@ void ast_mark_lock_acquired(void *lock_addr)
 	pthread_mutex_lock(&lock_info->lock);
 	if (lock_info->locks[lock_info->num_locks - 1].lock_addr == lock_addr) {
 		lock_info->locks[lock_info->num_locks - 1].pending = 0;
+		if (lock_info->locks[lock_info->num_locks - 1].stat) {
+			lockstats_acquired(lock_info, lock_info->num_locks - 1);
+		}
 	}
 	pthread_mutex_unlock(&lock_info->lock);
 }
@@ -674,6 +940,10 @@ void ast_mark_lock_failed(void *lock_addr)
 	if (lock_info->locks[lock_info->num_locks - 1].lock_addr == lock_addr) {
 		lock_info->locks[lock_info->num_locks - 1].pending = -1;
 		lock_info->locks[lock_info->num_locks - 1].times_locked--;
+		if (lock_info->locks[lock_info->num_locks - 1].stat) {
+			lock_info->locks[lock_info->num_locks - 1].stat->failed++;
+			lock_info->locks[lock_info->num_locks - 1].stat = NULL;
+		}
 	}
 	pthread_mutex_unlock(&lock_info->lock);
 }
@@ -743,6 +1013,10 @@ void ast_remove_lock_info(void *lock_addr)
 		return;
 	}
 
+	if (lock_info->locks[i].stat) {
+		lockstats_released(lock_info, i);
+	}
+
 	if (i < lock_info->num_locks - 1) {
 		/* Not the last one ... *should* be rare! */
 		memmove(&lock_info->locks[i], &lock_info->locks[i + 1], 
@@ -948,8 +1222,340 @@ static char *handle_show_locks(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	return CLI_SUCCESS;
 }
 
+static int lockstats_cmp_site(const void *a, const void *b)
+{
+	const struct lockstat *sa = a, *sb = b;
+	int res;
+
+	if ((res = strcmp(sa->lock_name, sb->lock_name))) {
+		return res;
+	}
+	if ((res = strcmp(sa->file, sb->file))) {
+		return res;
+	}
+	return sa->line_num - sb->line_num;
+}
+
+static int lockstats_cmp_wait(const void *a, const void *b)
+{
+	const struct lockstat *sa = a, *sb = b;
+
+	if (sa->wait_total != sb->wait_total) {
+		return sa->wait_total < sb->wait_total ? 1 : -1;
+	}
+	return lockstats_cmp_site(a, b);
+}
+
+/*!
+ * \brief Merge the counters of all threads, busiest lock site first
+ *
+ * \return an array the caller has to free(), NULL and a count of 0 if there is nothing
+ */
+static struct lockstat *lockstats_collect(int *count, unsigned int *dropped)
+{
+	struct thr_lock_info *lock_info;
+	struct lockstat *stats = NULL, *tmp;
+	int i, j, num = 0, max = 0;
+
+	*count = 0;
+	*dropped = 0;
+
+	pthread_mutex_lock(&lock_infos_lock.mutex);
+	if (lockstats_retired && lockstats_retired->gen == lockstats_gen) {
+		if (!(stats = malloc(lockstats_retired->size * sizeof(*stats)))) {
+			pthread_mutex_unlock(&lock_infos_lock.mutex);
+			return NULL;
+		}
+		max = lockstats_retired->size;
+		for (i = 0; i < lockstats_retired->size; i++) {
+			if (lockstats_retired->slots[i].lock_name) {
+				stats[num++] = lockstats_retired->slots[i];
+			}
+		}
+		*dropped += lockstats_retired->dropped;
+	}
+	AST_LIST_TRAVERSE(&lock_infos, lock_info, entry) {
+		/* Grow first, no allocating with somebody's lock info locked */
+		if (num + LOCKSTATS_SLOTS > max) {
+			if (!(tmp = realloc(stats, (num + LOCKSTATS_SLOTS) * sizeof(*stats)))) {
+				break;
+			}
+			stats = tmp;
+			max = num + LOCKSTATS_SLOTS;
+		}
+		pthread_mutex_lock(&lock_info->lock);
+		if (lock_info->stats && lock_info->stats->gen == lockstats_gen) {
+			for (i = 0; i < lock_info->stats->size; i++) {
+				if (lock_info->stats->slots[i].lock_name) {
+					stats[num++] = lock_info->stats->slots[i];
+				}
+			}
+			*dropped += lock_info->stats->dropped;
+		}
+		pthread_mutex_unlock(&lock_info->lock);
+	}
+	pthread_mutex_unlock(&lock_infos_lock.mutex);
+
+	if (!num) {
+		free(stats);
+		return NULL;
+	}
+
+	/* The same site in several threads */
+	qsort(stats, num, sizeof(*stats), lockstats_cmp_site);
+	for (i = 1, j = 0; i < num; i++) {
+		if (!lockstats_cmp_site(&stats[j], &stats[i])) {
+			lockstats_add(&stats[j], &stats[i]);
+		} else {
+			stats[++j] = stats[i];
+		}
+	}
+	num = j + 1;
+
+	qsort(stats, num, sizeof(*stats), lockstats_cmp_wait);
+	*count = num;
+
+	return stats;
+}
+
+static const char *lockstats_bucket2str(int bucket, char *buf, size_t len)
+{
+	if (!bucket) {
+		return "<1us";
+	}
+	if (bucket == LOCKSTATS_BUCKETS - 1) {
+		snprintf(buf, len, ">=%dus", 1 << (bucket - 1));
+	} else {
+		snprintf(buf, len, "<%dus", 1 << bucket);
+	}
+	return buf;
+}
+
+static void lockstats_show_hist(int fd, const char *what, const unsigned int *hist)
+{
+	char buf[16];
+	int i;
+
+	ast_cli(fd, "    %s:", what);
+	for (i = 0; i < LOCKSTATS_BUCKETS; i++) {
+		if (hist[i]) {
+			ast_cli(fd, " %s %u", lockstats_bucket2str(i, buf, sizeof(buf)), hist[i]);
+		}
+	}
+	ast_cli(fd, "\n");
+}
+
+static char *handle_set_lockstats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int rate = 1;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core set lockstats {on|off}";
+		e->usage =
+			"Usage: core set lockstats {on|off} [<rate>]\n"
+			"       Turn the lock contention profiler on or off.  Turning it on\n"
+			"discards the previous results.  With a rate, only every <rate>th\n"
+			"acquisition has its wait and hold times measured.\n"
+			"       The profiler uses the lock tracking of DEBUG_THREADS builds.\n"
+			"When off it costs one test per lock operation on top of that\n"
+			"tracking; when on, mostly two clock reads per timed acquisition.\n";
+		return NULL;
+
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args && a->argc != e->args + 1) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!strcasecmp(a->argv[e->args - 1], "off")) {
+		lockstats_enabled = 0;
+		ast_cli(a->fd, "Lock contention profiler disabled\n");
+		return CLI_SUCCESS;
+	}
+
+	if (a->argc == e->args + 1 && (sscanf(a->argv[e->args], "%30d", &rate) != 1 || rate < 1)) {
+		return CLI_SHOWUSAGE;
+	}
+
+	lockstats_enabled = 0;
+	lockstats_rate = rate;
+	lockstats_gen++;
+	lockstats_enabled = 1;
+	ast_cli(a->fd, "Lock contention profiler enabled, sampling 1 in %d acquisitions\n", rate);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_show_lockstats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+#define FORMAT "%-32.32s %-30.30s %10s %10s %8s %10s %10s %10s %10s\n"
+#define FORMAT2 "%-32.32s %-30.30s %10llu %10llu %8llu %10llu %10llu %10llu %10llu\n"
+	struct lockstat *stats;
+	unsigned int dropped;
+	char site[64];
+	int i, count, shown = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core show lockstats";
+		e->usage =
+			"Usage: core show lockstats [<lock name>]\n"
+			"       Show what the lock contention profiler found, per lock and\n"
+			"acquiring site, most waited for first.  Times are in microseconds.\n"
+			"Given part of a lock name, only matching locks are shown, along with\n"
+			"their wait and hold time histograms.\n";
+		return NULL;
+
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args && a->argc != e->args + 1) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(stats = lockstats_collect(&count, &dropped))) {
+		ast_cli(a->fd, "No lock statistics%s\n", lockstats_enabled ? " yet" : ", see 'core set lockstats on'");
+		return CLI_SUCCESS;
+	}
+
+	ast_cli(a->fd, FORMAT, "Lock", "Site", "Acquired", "Contended", "Failed", "Wait avg", "Wait max", "Hold avg", "Hold max");
+	for (i = 0; i < count; i++) {
+		if (a->argc == e->args + 1 && !strstr(stats[i].lock_name, a->argv[e->args])) {
+			continue;
+		}
+		snprintf(site, sizeof(site), "%s:%d", stats[i].file, stats[i].line_num);
+		ast_cli(a->fd, FORMAT2, stats[i].lock_name, site,
+			(unsigned long long) stats[i].acquired,
+			(unsigned long long) stats[i].contended,
+			(unsigned long long) stats[i].failed,
+			(unsigned long long) (stats[i].sampled ? stats[i].wait_total / stats[i].sampled / 1000 : 0),
+			(unsigned long long) (stats[i].wait_max / 1000),
+			(unsigned long long) (stats[i].held ? stats[i].hold_total / stats[i].held / 1000 : 0),
+			(unsigned long long) (stats[i].hold_max / 1000));
+		if (a->argc == e->args + 1) {
+			lockstats_show_hist(a->fd, "wait", stats[i].wait_hist);
+			lockstats_show_hist(a->fd, "hold", stats[i].hold_hist);
+		}
+		shown++;
+	}
+	ast_cli(a->fd, "%d lock sites, 1 in %u acquisitions timed%s\n", shown, lockstats_rate,
+		lockstats_enabled ? "" : ", profiler off");
+	if (dropped) {
+		ast_cli(a->fd, "%u acquisitions at sites that did not fit the tables were not counted\n", dropped);
+	}
+
+	free(stats);
+
+	return CLI_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+
+static char *handle_dump_lockstats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct lockstat *stats;
+	unsigned int dropped;
+	FILE *f;
+	int i, j, count;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core dump lockstats";
+		e->usage =
+			"Usage: core dump lockstats <filename>\n"
+			"       Write everything the lock contention profiler found to a file,\n"
+			"one tab separated line per lock and acquiring site.  Times are in\n"
+			"nanoseconds.\n";
+		return NULL;
+
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args + 1) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(f = fopen(a->argv[e->args], "w"))) {
+		ast_cli(a->fd, "Unable to open '%s' for writing: %s\n", a->argv[e->args], strerror(errno));
+		return CLI_FAILURE;
+	}
+
+	stats = lockstats_collect(&count, &dropped);
+
+	fprintf(f, "# lock\tfile\tline\tfunction\tacquired\tsampled\tcontended\tfailed"
+		"\twait total\twait max\theld\thold total\thold max\twait histogram\thold histogram\n");
+	fprintf(f, "# histogram buckets: <1us, then <2^n us, the last one everything above; %u not counted\n", dropped);
+	for (i = 0; i < count; i++) {
+		fprintf(f, "%s\t%s\t%d\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t",
+			stats[i].lock_name, stats[i].file, stats[i].line_num, stats[i].func,
+			(unsigned long long) stats[i].acquired,
+			(unsigned long long) stats[i].sampled,
+			(unsigned long long) stats[i].contended,
+			(unsigned long long) stats[i].failed,
+			(unsigned long long) stats[i].wait_total,
+			(unsigned long long) stats[i].wait_max,
+			(unsigned long long) stats[i].held,
+			(unsigned long long) stats[i].hold_total,
+			(unsigned long long) stats[i].hold_max);
+		for (j = 0; j < LOCKSTATS_BUCKETS; j++) {
+			fprintf(f, "%s%u", j ? "," : "", stats[i].wait_hist[j]);
+		}
+		fprintf(f, "\t");
+		for (j = 0; j < LOCKSTATS_BUCKETS; j++) {
+			fprintf(f, "%s%u", j ? "," : "", stats[i].hold_hist[j]);
+		}
+		fprintf(f, "\n");
+	}
+
+	free(stats);
+
+	if (fclose(f)) {
+		ast_cli(a->fd, "Error writing '%s': %s\n", a->argv[e->args], strerror(errno));
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "Wrote %d lock sites to '%s'\n", count, a->argv[e->args]);
+
+	return CLI_SUCCESS;
+}
+
 static struct ast_cli_entry utils_cli[] = {
 	AST_CLI_DEFINE(handle_show_locks, "Show which locks are held by which thread"),
+	AST_CLI_DEFINE(handle_set_lockstats, "Turn the lock contention profiler on or off"),
+	AST_CLI_DEFINE(handle_show_lockstats, "Show lock contention statistics"),
+	AST_CLI_DEFINE(handle_dump_lockstats, "Write lock contention statistics to a file"),
+};
+
+#else /* !DEBUG_THREADS */
+
+static char *handle_lockstats_unavailable(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core {set|show|dump} lockstats";
+		e->usage =
+			"Usage: core {set|show|dump} lockstats ...\n"
+			"       The lock contention profiler needs Asterisk built with\n"
+			"DEBUG_THREADS (menuselect, Compiler Flags).  Without it locks are\n"
+			"plain pthread calls with nowhere to count from, and adding a hook\n"
+			"would slow down every lock operation even with the profiler off.\n";
+		return NULL;
+
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	ast_cli(a->fd, "Lock statistics are not available, Asterisk was built without DEBUG_THREADS\n");
+
+	return CLI_FAILURE;
+}
+
+static struct ast_cli_entry utils_cli[] = {
+	AST_CLI_DEFINE(handle_lockstats_unavailable, "Lock contention profiler (needs DEBUG_THREADS)"),
 };
 
 #endif /* DEBUG_THREADS */
@@ -1972,10 +2578,8 @@ int ast_utils_init(void)
 	dev_urandom_fd = open("/dev/urandom", O_RDONLY);
 #endif
 	base64_init();
-#ifdef DEBUG_THREADS
 #if !defined(LOW_MEMORY)
 	ast_cli_register_multiple(utils_cli, ARRAY_LEN(utils_cli));
-#endif
 #endif
 	return 0;
 }
@@ -0,0 +1,271 @@
+/* dissector_prof.c
+ * Per-dissector time and allocation profiler
+ *
+ * $Id$
+ *
+ * Wireshark - Network traffic analyzer
+ * By Gerald Combs <gerald@wireshark.org>
+ * Copyright 1998 Gerald Combs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>	/* QueryPerformanceCounter */
+#endif
+
+#include <glib.h>
+
+#include "emem.h"
+#include "dissector_prof.h"
+
+gboolean dissector_prof_enabled = FALSE;
+
+/*
+ * One entry per active dissector invocation.  The "child_" members
+ * accumulate the inclusive figures of the dissectors this one called,
+ * so that they can be subtracted to get the self figures.
+ */
+typedef struct {
+	dissector_prof_entry_t *entry;
+	guint64	start_ns;
+	guint64	child_ns;
+	guint64	start_ep;
+	guint64	start_se;
+	guint64	child_ep;
+	guint64	child_se;
+	gsize	path_len;	/* length of stack_path before we were pushed */
+} prof_frame_t;
+
+static GHashTable *prof_entries = NULL;	/* name -> dissector_prof_entry_t */
+static GHashTable *prof_stacks = NULL;	/* folded stack -> guint64 self ns */
+static GArray *prof_stack = NULL;	/* of prof_frame_t */
+static GString *stack_path = NULL;	/* "frame;eth;ip" for the current stack */
+
+static guint64
+prof_now(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (guint64) ((double) now.QuadPart * 1000000000.0 / (double) freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return (guint64) tv.tv_sec * 1000000000 + (guint64) tv.tv_usec * 1000;
+#endif
+}
+
+static void
+free_stack_count(gpointer data)
+{
+	g_free(data);
+}
+
+void
+dissector_prof_reset(void)
+{
+	if (prof_entries != NULL)
+		g_hash_table_destroy(prof_entries);
+	if (prof_stacks != NULL)
+		g_hash_table_destroy(prof_stacks);
+
+	prof_entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    NULL, g_free);
+	prof_stacks = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, free_stack_count);
+
+	if (prof_stack == NULL)
+		prof_stack = g_array_new(FALSE, FALSE, sizeof (prof_frame_t));
+	else
+		g_array_set_size(prof_stack, 0);
+
+	if (stack_path == NULL)
+		stack_path = g_string_new("");
+	else
+		g_string_truncate(stack_path, 0);
+}
+
+void
+dissector_prof_enable(gboolean enable)
+{
+	if (enable)
+		dissector_prof_reset();
+	dissector_prof_enabled = enable;
+}
+
+void
+dissector_prof_enter(const char *name)
+{
+	prof_frame_t frame;
+	dissector_prof_entry_t *entry;
+
+	if (name == NULL)
+		name = "<unknown>";
+
+	entry = g_hash_table_lookup(prof_entries, name);
+	if (entry == NULL) {
+		entry = g_malloc0(sizeof (dissector_prof_entry_t));
+		entry->name = name;
+		g_hash_table_insert(prof_entries, (gpointer) name, entry);
+	}
+	entry->calls++;
+	entry->depth++;
+
+	frame.entry = entry;
+	frame.path_len = stack_path->len;
+	frame.child_ns = 0;
+	frame.child_ep = 0;
+	frame.child_se = 0;
+
+	if (stack_path->len > 0)
+		g_string_append_c(stack_path, ';');
+	g_string_append(stack_path, name);
+
+	/* Take the timestamps last so that our own overhead isn't counted */
+	emem_get_allocated_bytes(&frame.start_ep, &frame.start_se);
+	frame.start_ns = prof_now();
+
+	g_array_append_val(prof_stack, frame);
+}
+
+void
+dissector_prof_exit(gboolean exception)
+{
+	guint64 now, incl_ns, self_ns, ep, se, incl_ep, incl_se;
+	prof_frame_t *frame;
+	dissector_prof_entry_t *entry;
+	guint64 *stack_ns;
+
+	now = prof_now();
+	emem_get_allocated_bytes(&ep, &se);
+
+	/* Enabled part-way through a dissection; nothing to pop */
+	if (prof_stack->len == 0)
+		return;
+
+	frame = &g_array_index(prof_stack, prof_frame_t, prof_stack->len - 1);
+	entry = frame->entry;
+
+	incl_ns = now - frame->start_ns;
+	self_ns = incl_ns > frame->child_ns ? incl_ns - frame->child_ns : 0;
+	incl_ep = ep - frame->start_ep;
+	incl_se = se - frame->start_se;
+
+	entry->self_ns += self_ns;
+	entry->ep_bytes += incl_ep - frame->child_ep;
+	entry->se_bytes += incl_se - frame->child_se;
+	if (exception)
+		entry->exceptions++;
+
+	/*
+	 * Only count inclusive time at the outermost invocation of a
+	 * protocol, so that protocols which call themselves (tunnels,
+	 * stacked headers) aren't charged twice for the same time.
+	 */
+	entry->depth--;
+	if (entry->depth == 0)
+		entry->incl_ns += incl_ns;
+
+	stack_ns = g_hash_table_lookup(prof_stacks, stack_path->str);
+	if (stack_ns == NULL) {
+		stack_ns = g_malloc0(sizeof (guint64));
+		g_hash_table_insert(prof_stacks, g_strdup(stack_path->str),
+		    stack_ns);
+	}
+	*stack_ns += self_ns;
+
+	g_string_truncate(stack_path, frame->path_len);
+	g_array_set_size(prof_stack, prof_stack->len - 1);
+
+	if (prof_stack->len > 0) {
+		frame = &g_array_index(prof_stack, prof_frame_t,
+		    prof_stack->len - 1);
+		frame->child_ns += incl_ns;
+		frame->child_ep += incl_ep;
+		frame->child_se += incl_se;
+	}
+}
+
+typedef struct {
+	dissector_prof_func func;
+	gpointer user_data;
+} prof_foreach_info_t;
+
+static void
+prof_foreach_func(gpointer key _U_, gpointer value, gpointer user_data)
+{
+	prof_foreach_info_t *info = user_data;
+
+	(*info->func)((dissector_prof_entry_t *) value, info->user_data);
+}
+
+void
+dissector_prof_foreach(dissector_prof_func func, gpointer user_data)
+{
+	prof_foreach_info_t info;
+
+	if (prof_entries == NULL)
+		return;
+
+	info.func = func;
+	info.user_data = user_data;
+	g_hash_table_foreach(prof_entries, prof_foreach_func, &info);
+}
+
+static void
+write_folded_func(gpointer key, gpointer value, gpointer user_data)
+{
+	FILE *fh = user_data;
+	guint64 self_ns = *(guint64 *) value;
+
+	if (self_ns != 0)
+		fprintf(fh, "%s %" G_GINT64_MODIFIER "u\n", (const char *) key,
+		    self_ns);
+}
+
+int
+dissector_prof_write_folded(FILE *fh)
+{
+	if (prof_stacks != NULL)
+		g_hash_table_foreach(prof_stacks, write_folded_func, fh);
+
+	if (ferror(fh))
+		return errno;
+	return 0;
+}
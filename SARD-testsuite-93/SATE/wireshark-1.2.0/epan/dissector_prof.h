@@ -0,0 +1,86 @@
+/* dissector_prof.h
+ * Definitions for the per-dissector profiler
+ *
+ * $Id$
+ *
+ * Wireshark - Network traffic analyzer
+ * By Gerald Combs <gerald@wireshark.org>
+ * Copyright 1998 Gerald Combs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __DISSECTOR_PROF_H__
+#define __DISSECTOR_PROF_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+/*
+ * Per-protocol counters collected while profiling is enabled.
+ *
+ * "self" figures only cover the time (or allocations) spent in the
+ * dissector itself; "incl" figures also include everything it called.
+ * Times are in nanoseconds.
+ */
+typedef struct _dissector_prof_entry_t {
+	const char	*name;		/* protocol filter name or dissector name */
+	guint64		calls;		/* number of invocations */
+	guint64		exceptions;	/* invocations that left via an exception */
+	guint64		self_ns;
+	guint64		incl_ns;
+	guint64		ep_bytes;	/* self ep_ allocations */
+	guint64		se_bytes;	/* self se_ allocations */
+	guint		depth;		/* current recursion depth */
+} dissector_prof_entry_t;
+
+/*
+ * TRUE while profiling is turned on.  Checked by the dissector call
+ * paths in packet.c before doing anything else, so that profiling
+ * costs a single test when it's off.
+ */
+extern gboolean dissector_prof_enabled;
+
+/*
+ * Running totals of the bytes handed out by ep_alloc() and se_alloc(),
+ * used to charge allocations to the dissector that made them.  Defined
+ * in emem.c, next to the allocators.
+ */
+extern void emem_get_allocated_bytes(guint64 *ep_bytes, guint64 *se_bytes);
+
+/* Turn profiling on or off; turning it on discards previous results. */
+extern void dissector_prof_enable(gboolean enable);
+
+/* Discard all collected results. */
+extern void dissector_prof_reset(void);
+
+/* Called around every dissector invocation by packet.c. */
+extern void dissector_prof_enter(const char *name);
+extern void dissector_prof_exit(gboolean exception);
+
+/* Iterate over the collected per-protocol entries, unordered. */
+typedef void (*dissector_prof_func)(dissector_prof_entry_t *entry,
+    gpointer user_data);
+extern void dissector_prof_foreach(dissector_prof_func func,
+    gpointer user_data);
+
+/*
+ * Write the collected call stacks in "folded stacks" format, i.e. one
+ * "frame;eth;ip;tcp;http <self-ns>" line per distinct stack, as
+ * consumed by flamegraph.pl.  Returns 0 on success or an errno value.
+ */
+extern int dissector_prof_write_folded(FILE *fh);
+
+#endif /* __DISSECTOR_PROF_H__ */
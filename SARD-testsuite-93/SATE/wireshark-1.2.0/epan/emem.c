@@ -45,6 +45,7 @@
 
 #include <proto.h>
 #include "emem.h"
+#include "dissector_prof.h"
 
 #ifdef _WIN32
 #include <windows.h>	/* VirtualAlloc, VirtualProtect */
@@ -130,6 +131,13 @@ typedef struct _emem_header_t {
 static emem_header_t ep_packet_mem;
 static emem_header_t se_packet_mem;
 
+/* Running totals of the bytes handed out by ep_alloc() and se_alloc(),
+ * including padding; read by the dissector profiler to attribute
+ * allocations to the dissector that made them.
+ */
+static guint64 ep_bytes_allocated;
+static guint64 se_bytes_allocated;
+
 #if !defined(SE_DEBUG_FREE)
 #if defined (_WIN32)
 static SYSTEM_INFO sysinfo;
@@ -414,6 +422,8 @@ ep_alloc(size_t size)
 
 	emem_create_chunk(&ep_packet_mem.free_list);
 
+	ep_bytes_allocated += size;
+
 	free_list = ep_packet_mem.free_list;
 
 	buf = free_list->buf + free_list->free_offset;
@@ -439,6 +449,7 @@ ep_alloc(size_t size)
 	npc->buf=g_malloc(size);
 	buf = npc->buf;
 	ep_packet_mem.used_list=npc;
+	ep_bytes_allocated += size;
 #endif /* EP_DEBUG_FREE */
 
 	return buf;
@@ -488,6 +499,8 @@ se_alloc(size_t size)
 
 	emem_create_chunk(&se_packet_mem.free_list);
 
+	se_bytes_allocated += size;
+
 	free_list = se_packet_mem.free_list;
 
 	buf = free_list->buf + free_list->free_offset;
@@ -513,12 +526,21 @@ se_alloc(size_t size)
 	npc->buf=g_malloc(size);
 	buf = npc->buf;
 	se_packet_mem.used_list=npc;
+	se_bytes_allocated += size;
 #endif /* SE_DEBUG_FREE */
 
 	return buf;
 }
 
 
+/* Return the number of bytes allocated so far from the ep_ and se_ pools. */
+void
+emem_get_allocated_bytes(guint64 *ep_bytes, guint64 *se_bytes)
+{
+	*ep_bytes = ep_bytes_allocated;
+	*se_bytes = se_bytes_allocated;
+}
+
 void* ep_alloc0(size_t size) {
 	return memset(ep_alloc(size),'\0',size);
 }
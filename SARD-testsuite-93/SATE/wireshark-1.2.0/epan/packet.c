@@ -53,6 +53,7 @@
 #include "epan_dissect.h"
 
 #include "emem.h"
+#include "dissector_prof.h"
 
 #include <epan/reassemble.h>
 #include <epan/stream.h>
@@ -384,19 +385,11 @@ struct dissector_handle {
  * and if the dissector rejected the packet.
  */
 static int
-call_dissector_through_handle(dissector_handle_t handle, tvbuff_t *tvb,
+call_dissector_handle(dissector_handle_t handle, tvbuff_t *tvb,
     packet_info *pinfo, proto_tree *tree)
 {
-	const char *saved_proto;
 	int ret;
 
-	saved_proto = pinfo->current_proto;
-
-	if (handle->protocol != NULL) {
-		pinfo->current_proto =
-		    proto_get_protocol_short_name(handle->protocol);
-	}
-
 	if (handle->is_new) {
         EP_CHECK_CANARY(("before calling handle->dissector.new for %s",handle->name));
 		ret = (*handle->dissector.new)(tvb, pinfo, tree);
@@ -416,6 +409,56 @@ call_dissector_through_handle(dissector_handle_t handle, tvbuff_t *tvb,
 		}
 	}
 
+	return ret;
+}
+
+/*
+ * Same as call_dissector_handle(), but charges the time spent and the
+ * memory allocated to the handle's protocol in the dissector profiler.
+ * Exceptions are caught only to close the profiler's frame, and are
+ * then rethrown.
+ */
+static int
+call_dissector_handle_profiled(dissector_handle_t handle, tvbuff_t *tvb,
+    packet_info *pinfo, proto_tree *tree)
+{
+	volatile int ret = 0;
+
+	dissector_prof_enter(handle->protocol != NULL ?
+	    proto_get_protocol_filter_name(proto_get_id(handle->protocol)) :
+	    handle->name);
+	TRY {
+		ret = call_dissector_handle(handle, tvb, pinfo, tree);
+	}
+	CATCH_ALL {
+		dissector_prof_exit(TRUE);
+		RETHROW;
+	}
+	ENDTRY;
+	dissector_prof_exit(FALSE);
+
+	return ret;
+}
+
+static int
+call_dissector_through_handle(dissector_handle_t handle, tvbuff_t *tvb,
+    packet_info *pinfo, proto_tree *tree)
+{
+	const char *saved_proto;
+	int ret;
+
+	saved_proto = pinfo->current_proto;
+
+	if (handle->protocol != NULL) {
+		pinfo->current_proto =
+		    proto_get_protocol_short_name(handle->protocol);
+	}
+
+	if (G_UNLIKELY(dissector_prof_enabled))
+		ret = call_dissector_handle_profiled(handle, tvb, pinfo, tree);
+	else
+		ret = call_dissector_handle(handle, tvb, pinfo, tree);
+
 	pinfo->current_proto = saved_proto;
 
 	return ret;
@@ -1524,6 +1567,32 @@ heur_dissector_add(const char *name, heur_dissector_t dissector, int proto)
 
 
 
+/* Call a heuristic dissector, charging it in the profiler if enabled. */
+static gboolean
+call_heur_dissector(heur_dtbl_entry_t *dtbl_entry, tvbuff_t *tvb,
+    packet_info *pinfo, proto_tree *tree)
+{
+	volatile gboolean ret = FALSE;
+
+	if (G_LIKELY(!dissector_prof_enabled))
+		return (*dtbl_entry->dissector)(tvb, pinfo, tree);
+
+	dissector_prof_enter(dtbl_entry->protocol != NULL ?
+	    proto_get_protocol_filter_name(proto_get_id(dtbl_entry->protocol)) :
+	    NULL);
+	TRY {
+		ret = (*dtbl_entry->dissector)(tvb, pinfo, tree);
+	}
+	CATCH_ALL {
+		dissector_prof_exit(TRUE);
+		RETHROW;
+	}
+	ENDTRY;
+	dissector_prof_exit(FALSE);
+
+	return ret;
+}
+
 static int find_matching_heur_dissector( gconstpointer a, gconstpointer b) {
     const heur_dtbl_entry_t *dtbl_entry_a = (const heur_dtbl_entry_t *) a;
     const heur_dtbl_entry_t *dtbl_entry_b = (const heur_dtbl_entry_t *) b;
@@ -1613,7 +1682,7 @@ dissector_try_heuristic(heur_dissector_list_t sub_dissectors,
 		}
         EP_CHECK_CANARY(("before calling heuristic dissector for protocol: %s",
                          proto_get_protocol_filter_name(proto_get_id(dtbl_entry->protocol))));
-		if ((*dtbl_entry->dissector)(tvb, pinfo, tree)) {
+		if (call_heur_dissector(dtbl_entry, tvb, pinfo, tree)) {
             EP_CHECK_CANARY(("after heuristic dissector for protocol: %s has accepted and dissected packet",
                              proto_get_protocol_filter_name(proto_get_id(dtbl_entry->protocol))));
 			status = TRUE;
@@ -0,0 +1,554 @@
+/* print_columnar.c
+ * Columnar field output for TShark ("-T columnar")
+ *
+ * $Id$
+ *
+ * Wireshark - Network traffic analyzer
+ * By Gerald Combs <gerald@wireshark.org>
+ * Copyright 1998 Gerald Combs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include <glib.h>
+
+#include <epan/epan_dissect.h>
+#include <epan/proto.h>
+#include <epan/guid-utils.h>
+#include <epan/ipv4.h>
+#include <epan/ftypes/ftypes.h>
+
+#include "print_columnar.h"
+
+#define COLUMNAR_MAGIC		"TSCOLv1"	/* plus the terminating NUL */
+#define COLUMNAR_CODEC_NONE	0
+#define COLUMNAR_CODEC_DEFLATE	1
+
+/* A dictionary entry for string and bytes columns. */
+typedef struct {
+	guint32 len;
+	guint32 index;
+	guint8 data[1];
+} columnar_blob_t;
+
+typedef struct {
+	header_field_info *hfinfo;
+	columnar_type_e type;
+	GByteArray *validity;	/* one bit per row in the current group */
+	GByteArray *values;	/* present values, or dictionary indexes */
+	GHashTable *dict;	/* columnar_blob_t -> columnar_blob_t */
+	GPtrArray *dict_entries;	/* of columnar_blob_t, in index order */
+} columnar_column_t;
+
+struct _columnar_writer_t {
+	FILE *fh;
+	gboolean compress;
+	guint ncols;
+	columnar_column_t *cols;
+	guint32 group_rows;	/* rows in the current row group */
+	guint64 total_rows;
+	GByteArray *chunk;	/* scratch buffer for building a chunk */
+};
+
+static void
+put_u8(GByteArray *ba, guint8 v)
+{
+	g_byte_array_append(ba, &v, 1);
+}
+
+static void
+put_u16(GByteArray *ba, guint16 v)
+{
+	guint8 b[2];
+
+	b[0] = (guint8) v;
+	b[1] = (guint8) (v >> 8);
+	g_byte_array_append(ba, b, 2);
+}
+
+static void
+put_u32(GByteArray *ba, guint32 v)
+{
+	guint8 b[4];
+
+	b[0] = (guint8) v;
+	b[1] = (guint8) (v >> 8);
+	b[2] = (guint8) (v >> 16);
+	b[3] = (guint8) (v >> 24);
+	g_byte_array_append(ba, b, 4);
+}
+
+static void
+put_u64(GByteArray *ba, guint64 v)
+{
+	put_u32(ba, (guint32) v);
+	put_u32(ba, (guint32) (v >> 32));
+}
+
+static guint
+blob_hash(gconstpointer key)
+{
+	const columnar_blob_t *blob = key;
+	guint h = 5381;
+	guint32 i;
+
+	for (i = 0; i < blob->len; i++)
+		h = (h << 5) + h + blob->data[i];
+	return h;
+}
+
+static gboolean
+blob_equal(gconstpointer a, gconstpointer b)
+{
+	const columnar_blob_t *ba = a;
+	const columnar_blob_t *bb = b;
+
+	return ba->len == bb->len && memcmp(ba->data, bb->data, ba->len) == 0;
+}
+
+static columnar_type_e
+columnar_type_for_field(header_field_info *hfinfo)
+{
+	switch (hfinfo->type) {
+
+	case FT_BOOLEAN:
+	case FT_UINT8:
+	case FT_UINT16:
+	case FT_UINT24:
+	case FT_UINT32:
+	case FT_FRAMENUM:
+		return COLUMNAR_UINT32;
+
+	case FT_INT8:
+	case FT_INT16:
+	case FT_INT24:
+	case FT_INT32:
+		return COLUMNAR_INT32;
+
+	case FT_UINT64:
+		return COLUMNAR_UINT64;
+
+	case FT_INT64:
+		return COLUMNAR_INT64;
+
+	case FT_FLOAT:
+	case FT_DOUBLE:
+		return COLUMNAR_DOUBLE;
+
+	case FT_ABSOLUTE_TIME:
+	case FT_RELATIVE_TIME:
+		return COLUMNAR_TIME;
+
+	case FT_IPv4:
+		return COLUMNAR_IPV4;
+
+	case FT_STRING:
+	case FT_STRINGZ:
+	case FT_UINT_STRING:
+		return COLUMNAR_STRING;
+
+	default:
+		/* Addresses, GUIDs, OIDs, byte arrays...: the value's bytes */
+		return COLUMNAR_BYTES;
+	}
+}
+
+static gboolean
+remove_all_func(gpointer key _U_, gpointer value _U_, gpointer user_data _U_)
+{
+	return TRUE;
+}
+
+static void
+column_reset(columnar_column_t *col)
+{
+	guint i;
+
+	g_byte_array_set_size(col->validity, 0);
+	g_byte_array_set_size(col->values, 0);
+	if (col->dict != NULL) {
+		g_hash_table_foreach_remove(col->dict, remove_all_func, NULL);
+		for (i = 0; i < col->dict_entries->len; i++)
+			g_free(g_ptr_array_index(col->dict_entries, i));
+		g_ptr_array_set_size(col->dict_entries, 0);
+	}
+}
+
+columnar_writer_t *
+columnar_writer_new(FILE *fh, GPtrArray *fields, gboolean compress,
+    const gchar **err_field)
+{
+	columnar_writer_t *cw;
+	columnar_column_t *col;
+	header_field_info *hfinfo;
+	guint i;
+
+	for (i = 0; i < fields->len; i++) {
+		if (proto_registrar_get_byname(g_ptr_array_index(fields, i)) == NULL) {
+			*err_field = g_ptr_array_index(fields, i);
+			return NULL;
+		}
+	}
+
+	cw = g_malloc0(sizeof (columnar_writer_t));
+	cw->fh = fh;
+#ifdef HAVE_LIBZ
+	cw->compress = compress;
+#else
+	cw->compress = FALSE;
+	(void) compress;
+#endif
+	cw->ncols = fields->len;
+	cw->cols = g_malloc0(cw->ncols * sizeof (columnar_column_t));
+	cw->chunk = g_byte_array_new();
+
+	for (i = 0; i < cw->ncols; i++) {
+		hfinfo = proto_registrar_get_byname(g_ptr_array_index(fields, i));
+		col = &cw->cols[i];
+		col->hfinfo = hfinfo;
+		col->type = columnar_type_for_field(hfinfo);
+		col->validity = g_byte_array_new();
+		col->values = g_byte_array_new();
+		if (col->type == COLUMNAR_STRING || col->type == COLUMNAR_BYTES) {
+			col->dict = g_hash_table_new(blob_hash, blob_equal);
+			col->dict_entries = g_ptr_array_new();
+		}
+	}
+
+	return cw;
+}
+
+void
+columnar_writer_prime_edt(columnar_writer_t *cw, epan_dissect_t *edt)
+{
+	guint i;
+
+	for (i = 0; i < cw->ncols; i++)
+		proto_tree_prime_hfid(edt->tree, cw->cols[i].hfinfo->id);
+}
+
+gboolean
+columnar_writer_write_preamble(columnar_writer_t *cw)
+{
+	GByteArray *hdr = cw->chunk;
+	const char *name;
+	guint16 name_len;
+	guint i;
+
+	g_byte_array_set_size(hdr, 0);
+	g_byte_array_append(hdr, (const guint8 *) COLUMNAR_MAGIC,
+	    sizeof COLUMNAR_MAGIC);
+	put_u32(hdr, cw->ncols);
+	for (i = 0; i < cw->ncols; i++) {
+		name = cw->cols[i].hfinfo->abbrev;
+		name_len = (guint16) strlen(name);
+		put_u8(hdr, (guint8) cw->cols[i].type);
+		put_u16(hdr, name_len);
+		g_byte_array_append(hdr, (const guint8 *) name, name_len);
+	}
+
+	return fwrite(hdr->data, 1, hdr->len, cw->fh) == hdr->len;
+}
+
+static void
+column_add_blob(columnar_column_t *col, const guint8 *data, guint32 len)
+{
+	columnar_blob_t *blob, *found;
+
+	blob = g_malloc(sizeof (columnar_blob_t) + len);
+	blob->len = len;
+	memcpy(blob->data, data, len);
+
+	found = g_hash_table_lookup(col->dict, blob);
+	if (found != NULL) {
+		g_free(blob);
+		put_u32(col->values, found->index);
+		return;
+	}
+	blob->index = col->dict_entries->len;
+	g_ptr_array_add(col->dict_entries, blob);
+	g_hash_table_insert(col->dict, blob, blob);
+	put_u32(col->values, blob->index);
+}
+
+/*
+ * Append the value of a field to its column.  Returns FALSE if the
+ * field has no value we can store, in which case it's recorded as
+ * absent.
+ */
+static gboolean
+column_add_value(columnar_column_t *col, field_info *fi)
+{
+	nstime_t *ts;
+	const char *str;
+	const guint8 *raw;
+	const e_guid_t *guid;
+	guint8 buf[16];
+	guint32 len;
+	gdouble d;
+	guint64 u64;
+
+	switch (col->type) {
+
+	case COLUMNAR_UINT32:
+		put_u32(col->values, fvalue_get_uinteger(&fi->value));
+		return TRUE;
+
+	case COLUMNAR_INT32:
+		put_u32(col->values, (guint32) fvalue_get_sinteger(&fi->value));
+		return TRUE;
+
+	case COLUMNAR_UINT64:
+	case COLUMNAR_INT64:
+		put_u64(col->values, fvalue_get_integer64(&fi->value));
+		return TRUE;
+
+	case COLUMNAR_DOUBLE:
+		d = fvalue_get_floating(&fi->value);
+		memcpy(&u64, &d, sizeof u64);
+		put_u64(col->values, u64);
+		return TRUE;
+
+	case COLUMNAR_TIME:
+		ts = fvalue_get(&fi->value);
+		put_u64(col->values,
+		    (guint64) ((gint64) ts->secs * 1000000000 + ts->nsecs));
+		return TRUE;
+
+	case COLUMNAR_IPV4:
+		/* FT_IPv4 has no integer getter; the fvalue holds an
+		 * ipv4_addr, whose address we get in network byte order
+		 * and write as a number, so 10.0.0.1 is 0x0a000001 */
+		put_u32(col->values, g_ntohl(ipv4_get_net_order_addr(
+		    (ipv4_addr *) fvalue_get(&fi->value))));
+		return TRUE;
+
+	case COLUMNAR_STRING:
+		str = fvalue_get(&fi->value);
+		if (str == NULL)
+			return FALSE;
+		column_add_blob(col, (const guint8 *) str, (guint32) strlen(str));
+		return TRUE;
+
+	case COLUMNAR_BYTES:
+		switch (fi->hfinfo->type) {
+
+		case FT_BYTES:
+		case FT_UINT_BYTES:
+		case FT_ETHER:
+		case FT_IPv6:
+		case FT_OID:
+			raw = fvalue_get(&fi->value);
+			len = fvalue_length(&fi->value);
+			break;
+
+		case FT_IPXNET:
+			/* In network byte order, like the other addresses */
+			u64 = fvalue_get_uinteger(&fi->value);
+			buf[0] = (guint8) (u64 >> 24);
+			buf[1] = (guint8) (u64 >> 16);
+			buf[2] = (guint8) (u64 >> 8);
+			buf[3] = (guint8) u64;
+			raw = buf;
+			len = 4;
+			break;
+
+		case FT_GUID:
+			/* Little-endian fields, as GUIDs are stored on Windows */
+			guid = fvalue_get(&fi->value);
+			buf[0] = (guint8) guid->data1;
+			buf[1] = (guint8) (guid->data1 >> 8);
+			buf[2] = (guint8) (guid->data1 >> 16);
+			buf[3] = (guint8) (guid->data1 >> 24);
+			buf[4] = (guint8) guid->data2;
+			buf[5] = (guint8) (guid->data2 >> 8);
+			buf[6] = (guint8) guid->data3;
+			buf[7] = (guint8) (guid->data3 >> 8);
+			memcpy(&buf[8], guid->data4, 8);
+			raw = buf;
+			len = 16;
+			break;
+
+		default:
+			/* FT_NONE, FT_PROTOCOL...: no value of their own */
+			return FALSE;
+		}
+		if (raw == NULL)
+			return FALSE;
+		column_add_blob(col, raw, len);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+write_column_chunk(columnar_writer_t *cw, columnar_column_t *col)
+{
+	GByteArray *raw = cw->chunk;
+	columnar_blob_t *blob;
+	guint8 hdr[9];
+	const guint8 *data;
+	guint32 stored_len;
+	guint8 codec = COLUMNAR_CODEC_NONE;
+	gboolean ok;
+	guint i;
+#ifdef HAVE_LIBZ
+	Bytef *zbuf = NULL;
+	uLongf zlen;
+#endif
+
+	g_byte_array_set_size(raw, 0);
+	g_byte_array_append(raw, col->validity->data, col->validity->len);
+	if (col->dict != NULL) {
+		put_u32(raw, col->dict_entries->len);
+		for (i = 0; i < col->dict_entries->len; i++) {
+			blob = g_ptr_array_index(col->dict_entries, i);
+			put_u32(raw, blob->len);
+			g_byte_array_append(raw, blob->data, blob->len);
+		}
+	}
+	g_byte_array_append(raw, col->values->data, col->values->len);
+
+	data = raw->data;
+	stored_len = raw->len;
+#ifdef HAVE_LIBZ
+	if (cw->compress && raw->len != 0) {
+		zlen = compressBound(raw->len);
+		zbuf = g_malloc(zlen);
+		if (compress2(zbuf, &zlen, raw->data, raw->len, Z_DEFAULT_COMPRESSION) == Z_OK &&
+		    zlen < raw->len) {
+			codec = COLUMNAR_CODEC_DEFLATE;
+			data = zbuf;
+			stored_len = (guint32) zlen;
+		}
+	}
+#endif
+
+	hdr[0] = codec;
+	hdr[1] = (guint8) raw->len;
+	hdr[2] = (guint8) (raw->len >> 8);
+	hdr[3] = (guint8) (raw->len >> 16);
+	hdr[4] = (guint8) (raw->len >> 24);
+	hdr[5] = (guint8) stored_len;
+	hdr[6] = (guint8) (stored_len >> 8);
+	hdr[7] = (guint8) (stored_len >> 16);
+	hdr[8] = (guint8) (stored_len >> 24);
+
+	ok = fwrite(hdr, 1, sizeof hdr, cw->fh) == sizeof hdr &&
+	    fwrite(data, 1, stored_len, cw->fh) == stored_len;
+
+#ifdef HAVE_LIBZ
+	g_free(zbuf);
+#endif
+	return ok;
+}
+
+static gboolean
+flush_row_group(columnar_writer_t *cw)
+{
+	guint8 hdr[8];
+	guint i;
+
+	if (cw->group_rows == 0)
+		return TRUE;
+
+	memcpy(hdr, "RGRP", 4);
+	hdr[4] = (guint8) cw->group_rows;
+	hdr[5] = (guint8) (cw->group_rows >> 8);
+	hdr[6] = (guint8) (cw->group_rows >> 16);
+	hdr[7] = (guint8) (cw->group_rows >> 24);
+	if (fwrite(hdr, 1, sizeof hdr, cw->fh) != sizeof hdr)
+		return FALSE;
+
+	for (i = 0; i < cw->ncols; i++) {
+		if (!write_column_chunk(cw, &cw->cols[i]))
+			return FALSE;
+		column_reset(&cw->cols[i]);
+	}
+	cw->group_rows = 0;
+
+	return TRUE;
+}
+
+gboolean
+columnar_writer_add_packet(columnar_writer_t *cw, epan_dissect_t *edt)
+{
+	columnar_column_t *col;
+	GPtrArray *finfos;
+	guint8 bit;
+	guint i;
+
+	bit = 1 << (cw->group_rows % 8);
+	for (i = 0; i < cw->ncols; i++) {
+		col = &cw->cols[i];
+		if (cw->group_rows % 8 == 0)
+			put_u8(col->validity, 0);
+
+		finfos = proto_get_finfo_ptr_array(edt->tree, col->hfinfo->id);
+		if (finfos != NULL && finfos->len != 0 &&
+		    column_add_value(col, g_ptr_array_index(finfos, 0)))
+			col->validity->data[col->validity->len - 1] |= bit;
+	}
+
+	cw->group_rows++;
+	cw->total_rows++;
+	if (cw->group_rows == COLUMNAR_ROWS_PER_GROUP)
+		return flush_row_group(cw);
+
+	return TRUE;
+}
+
+gboolean
+columnar_writer_finish(columnar_writer_t *cw)
+{
+	GByteArray *trailer = cw->chunk;
+	gboolean ok;
+	guint i;
+
+	ok = flush_row_group(cw);
+	if (ok) {
+		g_byte_array_set_size(trailer, 0);
+		g_byte_array_append(trailer, (const guint8 *) "TEND", 4);
+		put_u64(trailer, cw->total_rows);
+		ok = fwrite(trailer->data, 1, trailer->len, cw->fh) == trailer->len;
+	}
+
+	for (i = 0; i < cw->ncols; i++) {
+		column_reset(&cw->cols[i]);
+		g_byte_array_free(cw->cols[i].validity, TRUE);
+		g_byte_array_free(cw->cols[i].values, TRUE);
+		if (cw->cols[i].dict != NULL) {
+			g_hash_table_destroy(cw->cols[i].dict);
+			g_ptr_array_free(cw->cols[i].dict_entries, TRUE);
+		}
+	}
+	g_free(cw->cols);
+	g_byte_array_free(cw->chunk, TRUE);
+	g_free(cw);
+
+	return ok;
+}
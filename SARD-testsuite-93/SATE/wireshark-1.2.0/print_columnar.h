@@ -0,0 +1,109 @@
+/* print_columnar.h
+ * Definitions for the columnar field output format
+ *
+ * $Id$
+ *
+ * Wireshark - Network traffic analyzer
+ * By Gerald Combs <gerald@wireshark.org>
+ * Copyright 1998 Gerald Combs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __PRINT_COLUMNAR_H__
+#define __PRINT_COLUMNAR_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+#include <epan/epan_dissect.h>
+
+/*
+ * Columnar output ("-T columnar").
+ *
+ * Instead of a line of text per packet, the first occurrence of each
+ * requested field is stored in a typed column; every
+ * COLUMNAR_ROWS_PER_GROUP packets the columns are written out as a
+ * row group, each column chunk optionally deflated on its own.
+ *
+ * All integers are little-endian.  The layout is:
+ *
+ *   file         = "TSCOLv1\0" ncols:u32 column_desc* row_group* trailer
+ *   column_desc  = type:u8 name_len:u16 name
+ *   row_group    = "RGRP" nrows:u32 column_chunk*
+ *   column_chunk = codec:u8 raw_len:u32 stored_len:u32 data[stored_len]
+ *   trailer      = "TEND" total_rows:u64
+ *
+ * Once inflated (codec 1) a chunk holds a validity bitmap of
+ * (nrows + 7) / 8 bytes, bit set = value present, followed by the
+ * present values only:
+ *
+ *   COLUMNAR_UINT32, COLUMNAR_INT32, COLUMNAR_IPV4  u32 / i32 each,
+ *                                                  addresses as numbers
+ *   COLUMNAR_UINT64, COLUMNAR_INT64, COLUMNAR_TIME  u64 / i64 each,
+ *                                                  times in ns
+ *   COLUMNAR_DOUBLE                                IEEE 754 double
+ *   COLUMNAR_STRING, COLUMNAR_BYTES                ndict:u32
+ *                                                  (len:u32 bytes)*ndict
+ *                                                  then an u32 dictionary
+ *                                                  index per value
+ *
+ * Dictionaries are per row group.  Values are taken from the fields'
+ * values, not from the packet bytes; a field without a value of its
+ * own (FT_NONE, FT_PROTOCOL) is never present.  FT_BYTES, FT_ETHER,
+ * FT_IPv6 and FT_OID values are their bytes as dissected, FT_IPXNET
+ * is 4 bytes in network byte order and FT_GUID 16 bytes with
+ * little-endian fields.
+ */
+
+#define COLUMNAR_ROWS_PER_GROUP	65536
+
+typedef enum {
+	COLUMNAR_UINT32 = 1,
+	COLUMNAR_INT32,
+	COLUMNAR_UINT64,
+	COLUMNAR_INT64,
+	COLUMNAR_DOUBLE,
+	COLUMNAR_TIME,
+	COLUMNAR_IPV4,
+	COLUMNAR_STRING,
+	COLUMNAR_BYTES
+} columnar_type_e;
+
+typedef struct _columnar_writer_t columnar_writer_t;
+
+/*
+ * Create a writer for the given field abbreviations.  Returns NULL,
+ * with *err_field set to the first unknown field, if a field doesn't
+ * exist.
+ */
+extern columnar_writer_t *columnar_writer_new(FILE *fh, GPtrArray *fields,
+    gboolean compress, const gchar **err_field);
+
+/*
+ * Make sure the fields we want are kept in the protocol tree even when
+ * it isn't visible; call before epan_dissect_run().
+ */
+extern void columnar_writer_prime_edt(columnar_writer_t *cw,
+    epan_dissect_t *edt);
+
+extern gboolean columnar_writer_write_preamble(columnar_writer_t *cw);
+extern gboolean columnar_writer_add_packet(columnar_writer_t *cw,
+    epan_dissect_t *edt);
+
+/* Flush the last row group, write the trailer and free the writer. */
+extern gboolean columnar_writer_finish(columnar_writer_t *cw);
+
+#endif /* __PRINT_COLUMNAR_H__ */
@@ -0,0 +1,163 @@
+/* tap-dissectorprof.c
+ * dissector,prof   2009
+ *
+ * Reports where dissection time and ep_/se_ memory go, per protocol.
+ *
+ * $Id$
+ *
+ * Wireshark - Network traffic analyzer
+ * By Gerald Combs <gerald@wireshark.org>
+ * Copyright 1998 Gerald Combs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include <epan/packet_info.h>
+#include <epan/tap.h>
+#include <epan/stat_cmd_args.h>
+#include <epan/dissector_prof.h>
+#include "register.h"
+
+typedef struct _dissectorprof_t {
+	char *folded_file;	/* where to write folded stacks, or NULL */
+	guint32 frames;
+} dissectorprof_t;
+
+static int
+dissectorprof_packet(void *prs, packet_info *pinfo _U_, epan_dissect_t *edt _U_, const void *dummy _U_)
+{
+	dissectorprof_t *rs = prs;
+
+	rs->frames++;
+	return 0;
+}
+
+static void
+dissectorprof_add_entry(dissector_prof_entry_t *entry, gpointer user_data)
+{
+	g_ptr_array_add((GPtrArray *) user_data, entry);
+}
+
+static gint
+dissectorprof_sort_by_self(gconstpointer a, gconstpointer b)
+{
+	const dissector_prof_entry_t *ea = *(const dissector_prof_entry_t * const *) a;
+	const dissector_prof_entry_t *eb = *(const dissector_prof_entry_t * const *) b;
+
+	if (ea->self_ns < eb->self_ns)
+		return 1;
+	if (ea->self_ns > eb->self_ns)
+		return -1;
+	return strcmp(ea->name, eb->name);
+}
+
+static void
+dissectorprof_draw(void *prs)
+{
+	dissectorprof_t *rs = prs;
+	GPtrArray *entries;
+	dissector_prof_entry_t *entry;
+	guint64 total_ns = 0;
+	guint i;
+	FILE *fh;
+	int err;
+
+	entries = g_ptr_array_new();
+	dissector_prof_foreach(dissectorprof_add_entry, entries);
+	g_ptr_array_sort(entries, dissectorprof_sort_by_self);
+
+	for (i = 0; i < entries->len; i++) {
+		entry = g_ptr_array_index(entries, i);
+		total_ns += entry->self_ns;
+	}
+
+	printf("\n");
+	printf("===================================================================================================\n");
+	printf("Dissector Profile        Frames: %u\n", rs->frames);
+	printf("Protocol                  Calls  Exceptions   Self(ms)  Self%%   Incl(ms)      ep bytes      se bytes\n");
+	for (i = 0; i < entries->len; i++) {
+		entry = g_ptr_array_index(entries, i);
+		printf("%-20s %10" G_GINT64_MODIFIER "u %11" G_GINT64_MODIFIER "u %10.3f %5.1f%% %10.3f %13" G_GINT64_MODIFIER "u %13" G_GINT64_MODIFIER "u\n",
+		    entry->name, entry->calls, entry->exceptions,
+		    entry->self_ns / 1000000.0,
+		    total_ns ? 100.0 * entry->self_ns / total_ns : 0.0,
+		    entry->incl_ns / 1000000.0,
+		    entry->ep_bytes, entry->se_bytes);
+	}
+	printf("===================================================================================================\n");
+
+	g_ptr_array_free(entries, TRUE);
+
+	if (rs->folded_file != NULL) {
+		fh = fopen(rs->folded_file, "w");
+		if (fh == NULL) {
+			fprintf(stderr, "tshark: Couldn't open %s for writing: %s\n",
+			    rs->folded_file, strerror(errno));
+			return;
+		}
+		err = dissector_prof_write_folded(fh);
+		if (fclose(fh) == EOF && err == 0)
+			err = errno;
+		if (err != 0)
+			fprintf(stderr, "tshark: Couldn't write %s: %s\n",
+			    rs->folded_file, strerror(err));
+	}
+}
+
+static void
+dissectorprof_init(const char *optarg, void* userdata _U_)
+{
+	dissectorprof_t *rs;
+	GString *error_string;
+
+	rs = g_malloc0(sizeof(dissectorprof_t));
+	if (strncmp(optarg, "dissector,prof,", 15) == 0 && optarg[15] != '\0') {
+		rs->folded_file = g_strdup(optarg + 15);
+	} else if (strcmp(optarg, "dissector,prof") != 0) {
+		fprintf(stderr, "tshark: invalid \"-z dissector,prof[,<folded-stacks-file>]\" argument\n");
+		exit(1);
+	}
+
+	error_string = register_tap_listener("frame", rs, NULL, NULL, dissectorprof_packet, dissectorprof_draw);
+	if (error_string) {
+		/* error, we failed to attach to the tap. clean up */
+		g_free(rs->folded_file);
+		g_free(rs);
+
+		fprintf(stderr, "tshark: Couldn't register dissector,prof tap: %s\n",
+		    error_string->str);
+		g_string_free(error_string, TRUE);
+		exit(1);
+	}
+
+	dissector_prof_enable(TRUE);
+}
+
+void
+register_tap_listener_dissectorprof(void)
+{
+	register_stat_cmd_arg("dissector,prof", dissectorprof_init, NULL);
+}
@@ -45,6 +45,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef _WIN32
+#include <io.h>		/* _setmode */
+#endif
+
 #include <signal.h>
 
 #ifdef HAVE_SYS_STAT_H
@@ -72,6 +76,7 @@
 #include <epan/prefs.h>
 #include <epan/column.h>
 #include "print.h"
+#include "print_columnar.h"
 #include <epan/addr_resolv.h>
 #include "util.h"
 #include "clopts_common.h"
@@ -117,7 +122,8 @@ static gboolean print_packet_info;	/* TRUE if we're to print packet information
 typedef enum {
 	WRITE_TEXT,	/* summary or detail text */
 	WRITE_XML,	/* PDML or PSML */
-	WRITE_FIELDS	/* User defined list of fields */
+	WRITE_FIELDS,	/* User defined list of fields */
+	WRITE_COLUMNAR	/* User defined list of fields, binary columns */
 	/* Add CSV and the like here */
 } output_action_e;
 static output_action_e output_action;
@@ -130,6 +136,8 @@ static print_format_e print_format = PR_FMT_TEXT;
 static print_stream_t *print_stream;
 
 static output_fields_t* output_fields  = NULL;
+static GPtrArray *columnar_fields = NULL;	/* "-e" fields, for -Tcolumnar */
+static columnar_writer_t *columnar_writer = NULL;
 
 /*
  * Standard secondary message for unexpected errors.
@@ -291,9 +299,10 @@ print_usage(gboolean print_ver)
   fprintf(output, "  -V                       add output of packet tree        (Packet Details)\n");
   fprintf(output, "  -S                       display packets even when writing to a file\n");
   fprintf(output, "  -x                       add output of hex and ASCII dump (Packet Bytes)\n");
-  fprintf(output, "  -T pdml|ps|psml|text|fields\n");
+  fprintf(output, "  -T pdml|ps|psml|text|fields|columnar\n");
   fprintf(output, "                           format of text output (def: text)\n");
-  fprintf(output, "  -e <field>               field to print if -Tfields selected (e.g. tcp.port);\n");
+  fprintf(output, "  -e <field>               field to print if -Tfields or -Tcolumnar selected\n");
+  fprintf(output, "                           (e.g. tcp.port);\n");
   fprintf(output, "                           this option can be repeated to print multiple fields\n");
   fprintf(output, "  -E<fieldsoption>=<value> set options for output when -Tfields selected:\n");
   fprintf(output, "     header=y|n            switch headers on and off\n");
@@ -968,6 +977,7 @@ main(int argc, char *argv[])
   print_format = PR_FMT_TEXT;
 
   output_fields = output_fields_new();
+  columnar_fields = g_ptr_array_new();
 
   /* Now get our args */
   while ((opt = getopt(argc, argv, optstring)) != -1) {
@@ -1018,6 +1028,7 @@ main(int argc, char *argv[])
       case 'e':
         /* Field entry */
         output_fields_add(output_fields, optarg);
+        g_ptr_array_add(columnar_fields, optarg);
         break;
       case 'E':
         /* Field option */
@@ -1143,9 +1154,13 @@ main(int argc, char *argv[])
         } else if(strcmp(optarg, "fields") == 0) {
           output_action = WRITE_FIELDS;
           verbose = TRUE; /* Need full tree info */
+        } else if(strcmp(optarg, "columnar") == 0) {
+          /* Fields are primed, so the tree needn't be visible */
+          output_action = WRITE_COLUMNAR;
+          verbose = FALSE;
         } else {
           cmdarg_err("Invalid -T parameter.");
-          cmdarg_err_cont("It must be \"ps\", \"text\", \"pdml\", \"psml\" or \"fields\".");
+          cmdarg_err_cont("It must be \"ps\", \"text\", \"pdml\", \"psml\", \"fields\" or \"columnar\".");
           exit(1);
         }
         break;
@@ -1197,14 +1212,20 @@ main(int argc, char *argv[])
   }
 
   /* If we specified output fields, but not the output field type... */
-  if(WRITE_FIELDS != output_action && 0 != output_fields_num_fields(output_fields)) {
+  if(WRITE_FIELDS != output_action && WRITE_COLUMNAR != output_action &&
+     0 != output_fields_num_fields(output_fields)) {
         cmdarg_err("Output fields were specified with \"-e\", "
-            "but \"-Tfields\" was not specified.");
+            "but \"-Tfields\" or \"-Tcolumnar\" was not specified.");
         exit(1);
   } else if(WRITE_FIELDS == output_action && 0 == output_fields_num_fields(output_fields)) {
         cmdarg_err("\"-Tfields\" was specified, but no fields were "
                     "specified with \"-e\".");
 
+        exit(1);
+  } else if(WRITE_COLUMNAR == output_action && 0 == columnar_fields->len) {
+        cmdarg_err("\"-Tcolumnar\" was specified, but no fields were "
+                    "specified with \"-e\".");
+
         exit(1);
   }
 
@@ -1495,6 +1516,20 @@ main(int argc, char *argv[])
       default:
         g_assert_not_reached();
       }
+    } else if (output_action == WRITE_COLUMNAR) {
+      const gchar *bad_field = NULL;
+
+      /* The field registrations are complete by now, so the "-e"
+         fields can be looked up. */
+      columnar_writer = columnar_writer_new(stdout, columnar_fields, TRUE,
+                                            &bad_field);
+      if (columnar_writer == NULL) {
+        cmdarg_err("\"%s\" isn't a valid field name.", bad_field);
+        exit(1);
+      }
+#ifdef _WIN32
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
     }
   }
 
@@ -1637,6 +1672,8 @@ main(int argc, char *argv[])
 
   output_fields_free(output_fields);
   output_fields = NULL;
+  g_ptr_array_free(columnar_fields, TRUE);
+  columnar_fields = NULL;
 
   return 0;
 }
@@ -2419,7 +2456,8 @@ process_packet(capture_file *cf, gint64 offset, const struct wtap_pkthdr *whdr,
     }
 
     passed = TRUE;
-    if (cf->rfcode || verbose || num_tap_filters!=0 || have_custom_cols(&cf->cinfo))
+    if (cf->rfcode || verbose || num_tap_filters!=0 || have_custom_cols(&cf->cinfo) ||
+        columnar_writer != NULL)
       create_proto_tree = TRUE;
     else
       create_proto_tree = FALSE;
@@ -2436,13 +2474,18 @@ process_packet(capture_file *cf, gint64 offset, const struct wtap_pkthdr *whdr,
 
     col_custom_prime_edt(edt, &cf->cinfo);
 
+    if (columnar_writer != NULL)
+      columnar_writer_prime_edt(columnar_writer, edt);
+
     tap_queue_init(edt);
 
     /* We only need the columns if we're printing packet info but we're
        *not* verbose; in verbose mode, we print the protocol tree, not
-       the protocol summary. */
+       the protocol summary.  Columnar output takes its values from the
+       protocol tree, so it doesn't need them either. */
     epan_dissect_run(edt, pseudo_header, pd, &fdata,
-                     (print_packet_info && !verbose) ? &cf->cinfo : NULL);
+                     (print_packet_info && !verbose &&
+                      output_action != WRITE_COLUMNAR) ? &cf->cinfo : NULL);
 
     tap_push_tapped_queue(edt);
 
@@ -2573,6 +2616,9 @@ write_preamble(capture_file *cf)
     write_fields_preamble(output_fields, stdout);
     return !ferror(stdout);
 
+  case WRITE_COLUMNAR:
+    return columnar_writer_write_preamble(columnar_writer);
+
   default:
     g_assert_not_reached();
     return FALSE;
@@ -2834,6 +2880,11 @@ print_packet(capture_file *cf, epan_dissect_t *edt)
 {
   print_args_t  print_args;
 
+  if (output_action == WRITE_COLUMNAR) {
+    /* The values come straight from the primed fields in the tree. */
+    return columnar_writer_add_packet(columnar_writer, edt);
+  }
+
   if (verbose) {
     /* Print the information in the protocol tree. */
     switch (output_action) {
@@ -2868,6 +2919,9 @@ print_packet(capture_file *cf, epan_dissect_t *edt)
       proto_tree_write_fields(output_fields, edt, stdout);
       printf("\n");
       return !ferror(stdout);
+    case WRITE_COLUMNAR: /* Handled above */
+      g_assert_not_reached();
+      break;
     }
   } else {
     /* Just fill in the columns. */
@@ -2885,6 +2939,7 @@ print_packet(capture_file *cf, epan_dissect_t *edt)
         proto_tree_write_psml(edt, stdout);
         return !ferror(stdout);
     case WRITE_FIELDS: /*No non-verbose "fields" format */
+    case WRITE_COLUMNAR: /* Handled above */
         g_assert_not_reached();
         break;
     }
@@ -2901,6 +2956,8 @@ print_packet(capture_file *cf, epan_dissect_t *edt)
 static gboolean
 write_finale(void)
 {
+  gboolean ok;
+
   switch (output_action) {
 
   case WRITE_TEXT:
@@ -2917,6 +2974,12 @@ write_finale(void)
     write_fields_finale(output_fields, stdout);
     return !ferror(stdout);
 
+  case WRITE_COLUMNAR:
+    /* Flushes the last row group and frees the writer */
+    ok = columnar_writer_finish(columnar_writer);
+    columnar_writer = NULL;
+    return ok && !ferror(stdout);
+
   default:
     g_assert_not_reached();
     return FALSE;
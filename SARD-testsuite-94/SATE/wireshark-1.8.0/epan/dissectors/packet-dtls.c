@@ -586,10 +586,13 @@ dissect_dtls_heur(tvbuff_t *tvb, packet_info *pinfo, proto_tree *tree)
   return FALSE;
 }
 
+/* "from_server" is the direction of the record, as already determined
+ * by dissect_dtls_record(), so the association tree isn't searched again
+ * for every record. */
 static gint
 decrypt_dtls_record(tvbuff_t *tvb, packet_info *pinfo, guint32 offset,
                     guint32 record_length, guint8 content_type, SslDecryptSession* ssl,
-                    gboolean save_plaintext)
+                    gboolean save_plaintext, gboolean from_server)
 {
   gint        ret;
   SslDecoder *decoder;
@@ -598,15 +601,15 @@ decrypt_dtls_record(tvbuff_t *tvb, packet_info *pinfo, guint32 offset,
 
   /* if we can decrypt and decryption have success
    * add decrypted data to this packet info */
-  ssl_debug_printf("decrypt_dtls_record: app_data len %d, ssl state %X\n",
-                   record_length, ssl->state);
   if (!ssl || (!save_plaintext && !(ssl->state & SSL_HAVE_SESSION_KEY))) {
     ssl_debug_printf("decrypt_dtls_record: no session key\n");
     return ret;
   }
+  ssl_debug_printf("decrypt_dtls_record: app_data len %d, ssl state %X\n",
+                   record_length, ssl->state);
 
   /* retrieve decoder for this packet direction */
-  if (ssl_packet_from_server(ssl, dtls_associations, pinfo) != 0) {
+  if (from_server) {
     ssl_debug_printf("decrypt_dtls_record: using server decoder\n");
     decoder = ssl->server;
   }
@@ -706,9 +709,11 @@ dissect_dtls_record(tvbuff_t *tvb, packet_info *pinfo,
   proto_tree     *dtls_record_tree;
   SslAssociation *association;
   SslDataInfo    *appl_data;
+  gboolean        from_server;
 
   ti               = NULL;
   dtls_record_tree = NULL;
+  from_server      = FALSE;
 
   /*
    * Get the record layer fields of interest
@@ -723,7 +728,9 @@ dissect_dtls_record(tvbuff_t *tvb, packet_info *pinfo,
   record_length         = tvb_get_ntohs(tvb, offset + 11);
 
   if(ssl){
-    if(ssl_packet_from_server(ssl, dtls_associations, pinfo)){
+    /* Look up the direction once; the decryption below needs it too */
+    from_server = ssl_packet_from_server(ssl, dtls_associations, pinfo) != 0;
+    if(from_server){
      if (ssl->server) {
       ssl->server->seq=(guint32)sequence_number;
       ssl->server->epoch=epoch;
@@ -861,14 +868,14 @@ dissect_dtls_record(tvbuff_t *tvb, packet_info *pinfo,
     col_append_str(pinfo->cinfo, COL_INFO, "Change Cipher Spec");
     dissect_dtls_change_cipher_spec(tvb, dtls_record_tree,
                                     offset, conv_version, content_type);
-    if (ssl) ssl_change_cipher(ssl, ssl_packet_from_server(ssl, dtls_associations, pinfo));
+    if (ssl) ssl_change_cipher(ssl, from_server);
     break;
   case SSL_ID_ALERT:
     {
       tvbuff_t* decrypted;
       decrypted = 0;
       if (ssl&&decrypt_dtls_record(tvb, pinfo, offset,
-                                   record_length, content_type, ssl, FALSE))
+                                   record_length, content_type, ssl, FALSE, from_server))
         ssl_add_record_info(proto_dtls, pinfo, dtls_decrypted_data.data,
                             dtls_decrypted_data_avail, offset);
 
@@ -893,7 +900,7 @@ dissect_dtls_record(tvbuff_t *tvb, packet_info *pinfo,
        * this record into the packet (we can have multiple handshake records
        * in the same frame) */
       if (ssl && decrypt_dtls_record(tvb, pinfo, offset,
-                                     record_length, content_type, ssl, FALSE))
+                                     record_length, content_type, ssl, FALSE, from_server))
         ssl_add_record_info(proto_dtls, pinfo, dtls_decrypted_data.data,
                             dtls_decrypted_data_avail, offset);
 
@@ -912,7 +919,7 @@ dissect_dtls_record(tvbuff_t *tvb, packet_info *pinfo,
   case SSL_ID_APP_DATA:
     if (ssl)
       decrypt_dtls_record(tvb, pinfo, offset,
-                          record_length, content_type, ssl, TRUE);
+                          record_length, content_type, ssl, TRUE, from_server);
 
     /* show on info colum what we are decoding */
     col_append_str(pinfo->cinfo, COL_INFO, "Application Data");
@@ -973,7 +980,7 @@ dissect_dtls_record(tvbuff_t *tvb, packet_info *pinfo,
     tvbuff_t* decrypted;
 
     if (ssl && decrypt_dtls_record(tvb, pinfo, offset,
-                                   record_length, content_type, ssl, FALSE))
+                                   record_length, content_type, ssl, FALSE, from_server))
       ssl_add_record_info(proto_dtls, pinfo, dtls_decrypted_data.data,
                           dtls_decrypted_data_avail, offset);
 
@@ -1307,10 +1307,20 @@ static wtap_dumper* wtap_dump_alloc_wdh(int filetype, int encap, int snaplen,
 	return wdh;
 }
 
+/*
+ * Size of the stdio buffer used for uncompressed output files.
+ * Dump routines write a block header, data, padding and so on per
+ * packet; with the default BUFSIZ buffer that still means a write()
+ * every few packets at high packet rates, so give the stream a
+ * buffer big enough to coalesce many packets into each write().
+ */
+#define WTAP_DUMP_BUFFER_SIZE	(1024 * 1024)
+
 static gboolean wtap_dump_open_finish(wtap_dumper *wdh, int filetype, gboolean compressed, int *err)
 {
 	int fd;
 	gboolean cant_seek;
+	ws_statb64 statb;
 
 	/* Can we do a seek on the file descriptor?
 	   If not, note that fact. */
@@ -1333,6 +1343,16 @@ static gboolean wtap_dump_open_finish(wtap_dumper *wdh, int filetype, gboolean c
 		return FALSE;
 	}
 
+	/* Nothing has been written yet, so we can still change the
+	   buffering; failing to do so isn't fatal.  Only do it for
+	   regular files; whoever reads a pipe or stdout wants the
+	   packets as they come, not a megabyte at a time. */
+	if (!compressed) {
+		fd = fileno((FILE *)wdh->fh);
+		if (ws_fstat64(fd, &statb) == 0 && S_ISREG(statb.st_mode))
+			setvbuf((FILE *)wdh->fh, NULL, _IOFBF, WTAP_DUMP_BUFFER_SIZE);
+	}
+
 	/* Now try to open the file for writing. */
 	if (!(*dump_open_table[filetype].dump_open)(wdh, err)) {
 		return FALSE;
@@ -1347,6 +1367,30 @@ gboolean wtap_dump(wtap_dumper *wdh, const struct wtap_pkthdr *phdr,
 	return (wdh->subtype_write)(wdh, phdr, pseudo_header, pd, err);
 }
 
+/*
+ * Write "count" packets in one call.  "pseudo_headers" may be NULL if
+ * none of the packets have one.  Stops at the first failure; the
+ * number of packets actually written is returned in "*written".
+ */
+gboolean wtap_dump_many(wtap_dumper *wdh, guint count,
+		   const struct wtap_pkthdr *phdrs,
+		   const union wtap_pseudo_header *pseudo_headers,
+		   const guint8 * const *pds, guint *written, int *err)
+{
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		if (!(wdh->subtype_write)(wdh, &phdrs[i],
+		    pseudo_headers != NULL ? &pseudo_headers[i] : NULL,
+		    pds[i], err)) {
+			*written = i;
+			return FALSE;
+		}
+	}
+	*written = count;
+	return TRUE;
+}
+
 void wtap_dump_flush(wtap_dumper *wdh)
 {
 #ifdef HAVE_LIBZ
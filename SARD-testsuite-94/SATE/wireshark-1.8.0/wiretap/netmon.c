@@ -31,6 +31,7 @@
 #include "atm.h"
 #include "pcap-encap.h"
 #include "netmon.h"
+#include "wtap-batch.h"
 
 /* The file at
  *
@@ -469,9 +470,13 @@ netmon_set_pseudo_header_info(int pkt_encap,
 	}
 }
 
-/* Read the next packet */
-static gboolean netmon_read(wtap *wth, int *err, gchar **err_info,
-    gint64 *data_offset)
+/*
+ * Read the next packet into the given header and pseudo-header, and
+ * its data into "pd" or, if that's NULL, into the frame buffer.
+ */
+static gboolean netmon_read_packet(wtap *wth, struct wtap_pkthdr *phdr,
+    union wtap_pseudo_header *pseudo_header, guint8 *pd,
+    int *err, gchar **err_info, gint64 *data_offset)
 {
 	netmon_t *netmon = (netmon_t *)wth->priv;
 	guint32	packet_size = 0;
@@ -585,7 +590,7 @@ again:
 			    packet_size);
 			return FALSE;
 		}
-		if (!netmon_read_atm_pseudoheader(wth->fh, &wth->pseudo_header,
+		if (!netmon_read_atm_pseudoheader(wth->fh, pseudo_header,
 		    err, err_info))
 			return FALSE;	/* Read error */
 
@@ -600,8 +605,12 @@ again:
 		break;
 	}
 
-	buffer_assure_space(wth->frame_buffer, packet_size);
-	data_ptr = buffer_start_ptr(wth->frame_buffer);
+	if (pd != NULL)
+		data_ptr = pd;
+	else {
+		buffer_assure_space(wth->frame_buffer, packet_size);
+		data_ptr = buffer_start_ptr(wth->frame_buffer);
+	}
 	if (!netmon_read_rec_data(wth->fh, data_ptr, packet_size, err,
 	    err_info))
 		return FALSE;	/* Read error */
@@ -673,11 +682,11 @@ again:
 	}
 	secs += (time_t)(t/1000000000);
 	nsecs = (guint32)(t%1000000000);
-	wth->phdr.presence_flags = WTAP_HAS_TS|WTAP_HAS_CAP_LEN;
-	wth->phdr.ts.secs = netmon->start_secs + secs;
-	wth->phdr.ts.nsecs = nsecs;
-	wth->phdr.caplen = packet_size;
-	wth->phdr.len = orig_size;
+	phdr->presence_flags = WTAP_HAS_TS|WTAP_HAS_CAP_LEN;
+	phdr->ts.secs = netmon->start_secs + secs;
+	phdr->ts.nsecs = nsecs;
+	phdr->caplen = packet_size;
+	phdr->len = orig_size;
 
 	/*
 	 * For version 2.1 and later, there's additional information
@@ -688,22 +697,57 @@ again:
 		/*
 		 * I haz a trailer.
 		 */
-		wth->phdr.pkt_encap = netmon_read_rec_trailer(wth->fh,
+		phdr->pkt_encap = netmon_read_rec_trailer(wth->fh,
 		    trlr_size, err, err_info);
-		if (wth->phdr.pkt_encap == -1)
+		if (phdr->pkt_encap == -1)
 			return FALSE;	/* error */
-		if (wth->phdr.pkt_encap == 0)
+		if (phdr->pkt_encap == 0)
 			goto again;
-		netmon_set_pseudo_header_info(wth->phdr.pkt_encap,
-		    &wth->pseudo_header, data_ptr, packet_size);
+		netmon_set_pseudo_header_info(phdr->pkt_encap,
+		    pseudo_header, data_ptr, packet_size);
 	} else {
 		netmon_set_pseudo_header_info(wth->file_encap,
-		    &wth->pseudo_header, data_ptr, packet_size);
+		    pseudo_header, data_ptr, packet_size);
 	}
 
 	return TRUE;
 }
 
+/* Read the next packet */
+static gboolean netmon_read(wtap *wth, int *err, gchar **err_info,
+    gint64 *data_offset)
+{
+	return netmon_read_packet(wth, &wth->phdr, &wth->pseudo_header,
+	    NULL, err, err_info, data_offset);
+}
+
+/*
+ * Batch read: the records are read straight into the caller's buffer,
+ * rather than into the frame buffer and then copied.
+ */
+guint netmon_read_many(wtap *wth, wtap_frame_t *frames, guint max_frames,
+    guint8 *buf, gsize buf_len, int *err, gchar **err_info)
+{
+	wtap_frame_t *frame;
+	gsize used = 0;
+	guint count = 0;
+
+	while (count < max_frames && buf_len - used >= WTAP_READ_MANY_MIN_BUF) {
+		frame = &frames[count];
+		frame->phdr.pkt_encap = wth->file_encap;
+		frame->data = buf + used;
+		if (!netmon_read_packet(wth, &frame->phdr,
+		    &frame->pseudo_header, frame->data, err, err_info,
+		    &frame->data_offset))
+			break;	/* EOF, or error in *err */
+
+		used += WTAP_READ_MANY_ALIGN(frame->phdr.caplen);
+		count++;
+	}
+
+	return count;
+}
+
 static gboolean
 netmon_seek_read(wtap *wth, gint64 seek_off,
     union wtap_pseudo_header *pseudo_header, guint8 *pd, int length,
@@ -69,6 +69,7 @@
 #include "pcap-common.h"
 #include "pcap-encap.h"
 #include "pcapng.h"
+#include "wtap-batch.h"
 
 #if 0
 #define pcapng_debug0(str) g_warning(str)
@@ -2142,9 +2143,16 @@ pcapng_open(wtap *wth, int *err, gchar **err_info)
 }
 
 
-/* classic wtap: read packet */
+/*
+ * Read the next packet into the given header, pseudo-header and data
+ * buffer, which must have room for WTAP_MAX_PACKET_SIZE bytes (or the
+ * snapshot length, if there is one); shared by the one-at-a-time and
+ * the batch read routines.
+ */
 static gboolean
-pcapng_read(wtap *wth, int *err, gchar **err_info, gint64 *data_offset)
+pcapng_read_packet(wtap *wth, struct wtap_pkthdr *phdr,
+    union wtap_pseudo_header *pseudo_header, guint8 *pd,
+    int *err, gchar **err_info, gint64 *data_offset)
 {
         pcapng_t *pcapng = (pcapng_t *)wth->priv;
         int bytes_read;
@@ -2155,18 +2163,9 @@ pcapng_read(wtap *wth, int *err, gchar **err_info, gint64 *data_offset)
         *data_offset = file_tell(wth->fh);
         pcapng_debug1("pcapng_read: data_offset is initially %" G_GINT64_MODIFIER "d", *data_offset);
 
-        /* XXX - This should be done in the packet block reading function and
-         * should make use of the caplen of the packet.
-         */
-        if (wth->snapshot_length > 0) {
-                buffer_assure_space(wth->frame_buffer, wth->snapshot_length);
-        } else {
-                buffer_assure_space(wth->frame_buffer, WTAP_MAX_PACKET_SIZE);
-        }
-
-        wblock.frame_buffer  = buffer_start_ptr(wth->frame_buffer);
-        wblock.pseudo_header = &wth->pseudo_header;
-        wblock.packet_header = &wth->phdr;
+        wblock.frame_buffer  = pd;
+        wblock.pseudo_header = pseudo_header;
+        wblock.packet_header = phdr;
         wblock.file_encap    = &wth->file_encap;
 
         pcapng->add_new_ipv4 = wth->add_new_ipv4;
@@ -2226,7 +2225,7 @@ pcapng_read(wtap *wth, int *err, gchar **err_info, gint64 *data_offset)
 
         if (wblock.data.packet.interface_id < pcapng->number_of_interfaces) {
         } else {
-                wth->phdr.pkt_encap = WTAP_ENCAP_UNKNOWN;
+                phdr->pkt_encap = WTAP_ENCAP_UNKNOWN;
                 *err = WTAP_ERR_BAD_FILE;
                 *err_info = g_strdup_printf("pcapng: interface index %u is not less than interface count %u.",
                     wblock.data.packet.interface_id, pcapng->number_of_interfaces);
@@ -2234,13 +2233,59 @@ pcapng_read(wtap *wth, int *err, gchar **err_info, gint64 *data_offset)
                 return FALSE;
         }
 
-        /*pcapng_debug2("Read length: %u Packet length: %u", bytes_read, wth->phdr.caplen);*/
+        /*pcapng_debug2("Read length: %u Packet length: %u", bytes_read, phdr->caplen);*/
         pcapng_debug1("pcapng_read: data_offset is finally %" G_GINT64_MODIFIER "d", *data_offset + bytes_read);
 
         return TRUE;
 }
 
 
+/* classic wtap: read packet */
+static gboolean
+pcapng_read(wtap *wth, int *err, gchar **err_info, gint64 *data_offset)
+{
+        /* XXX - This should be done in the packet block reading function and
+         * should make use of the caplen of the packet.
+         */
+        if (wth->snapshot_length > 0) {
+                buffer_assure_space(wth->frame_buffer, wth->snapshot_length);
+        } else {
+                buffer_assure_space(wth->frame_buffer, WTAP_MAX_PACKET_SIZE);
+        }
+
+        return pcapng_read_packet(wth, &wth->phdr, &wth->pseudo_header,
+            buffer_start_ptr(wth->frame_buffer), err, err_info, data_offset);
+}
+
+
+/*
+ * Batch read: the packet blocks are read straight into the caller's
+ * buffer, rather than into the frame buffer and then copied.
+ */
+guint
+pcapng_read_many(wtap *wth, wtap_frame_t *frames, guint max_frames,
+    guint8 *buf, gsize buf_len, int *err, gchar **err_info)
+{
+        wtap_frame_t *frame;
+        gsize used = 0;
+        guint count = 0;
+
+        while (count < max_frames && buf_len - used >= WTAP_READ_MANY_MIN_BUF) {
+                frame = &frames[count];
+                frame->phdr.pkt_encap = wth->file_encap;
+                frame->data = buf + used;
+                if (!pcapng_read_packet(wth, &frame->phdr, &frame->pseudo_header,
+                    frame->data, err, err_info, &frame->data_offset))
+                        break;  /* EOF, or error in *err */
+
+                used += WTAP_READ_MANY_ALIGN(frame->phdr.caplen);
+                count++;
+        }
+
+        return count;
+}
+
+
 /* classic wtap: seek to file position and read packet */
 static gboolean
 pcapng_seek_read(wtap *wth, gint64 seek_off,
@@ -2302,8 +2347,26 @@ typedef struct {
         GArray *interface_data;
         guint number_of_interfaces;
         struct addrinfo *addrinfo_list_last;
+        guint8 *block_buf;       /* scratch buffer for assembling a block */
+        guint32 block_buf_len;
 } pcapng_dump_t;
 
+/*
+ * Return a buffer at least "len" bytes long in which a block can be
+ * assembled, so that it can be handed to wtap_dump_file_write() in
+ * one piece rather than one call per header, field and pad.
+ */
+static guint8 *
+pcapng_get_block_buf(pcapng_dump_t *pcapng, guint32 len)
+{
+        if (len > pcapng->block_buf_len) {
+                /* Grow in page multiples to avoid reallocating for every larger packet */
+                pcapng->block_buf_len = (len + 4095) & ~4095U;
+                pcapng->block_buf = (guint8 *)g_realloc(pcapng->block_buf, pcapng->block_buf_len);
+        }
+        return pcapng->block_buf;
+}
+
 static gboolean
 pcapng_write_section_header_block(wtap_dumper *wdh, int *err)
 {
@@ -3099,8 +3162,11 @@ pcapng_write_enhanced_packet_block(wtap_dumper *wdh,
     const struct wtap_pkthdr *phdr,
     const union wtap_pseudo_header *pseudo_header, const guint8 *pd, int *err)
 {
+        pcapng_dump_t *pcapng = (pcapng_dump_t *)wdh->priv;
         pcapng_block_header_t bh;
         pcapng_enhanced_packet_block_t epb;
+        guint8 *buf;
+        guint32 off;
         guint64 ts;
         const guint32 zero_pad = 0;
         guint32 pad_len;
@@ -3134,15 +3200,21 @@ pcapng_write_enhanced_packet_block(wtap_dumper *wdh,
                 options_total_length += 4;
         }
 
-        /* write (enhanced) packet block header */
+        /*
+         * The whole block is assembled in pcapng->block_buf and written
+         * with a single call, instead of one wtap_dump_file_write() per
+         * header, data, padding, option and trailer.
+         */
+
+        /* (enhanced) packet block header */
         bh.block_type = BLOCK_TYPE_EPB;
         bh.block_total_length = (guint32)sizeof(bh) + (guint32)sizeof(epb) + phdr_len + phdr->caplen + pad_len + options_total_length + 4;
 
-        if (!wtap_dump_file_write(wdh, &bh, sizeof bh, err))
-                return FALSE;
-        wdh->bytes_dumped += sizeof bh;
+        buf = pcapng_get_block_buf(pcapng, bh.block_total_length);
+        memcpy(buf, &bh, sizeof bh);
+        off = (guint32)sizeof bh;
 
-        /* write block fixed content */
+        /* block fixed content */
         if (phdr->presence_flags & WTAP_HAS_INTERFACE_ID)
                 epb.interface_id        = phdr->interface_id;
         else {
@@ -3160,26 +3232,33 @@ pcapng_write_enhanced_packet_block(wtap_dumper *wdh,
         epb.captured_len        = phdr->caplen + phdr_len;
         epb.packet_len          = phdr->len + phdr_len;
 
-        if (!wtap_dump_file_write(wdh, &epb, sizeof epb, err))
-                return FALSE;
-        wdh->bytes_dumped += sizeof epb;
+        memcpy(buf + off, &epb, sizeof epb);
+        off += (guint32)sizeof epb;
 
-        /* write pseudo header */
-        if (!pcap_write_phdr(wdh, phdr->pkt_encap, pseudo_header, err)) {
-                return FALSE;
+        /*
+         * pcap_write_phdr() writes straight to the file, so if there is
+         * a pseudo header, write out what we have so far before it.
+         */
+        if (phdr_len != 0) {
+                if (!wtap_dump_file_write(wdh, buf, off, err))
+                        return FALSE;
+                wdh->bytes_dumped += off;
+                off = 0;
+
+                if (!pcap_write_phdr(wdh, phdr->pkt_encap, pseudo_header, err)) {
+                        return FALSE;
+                }
+                wdh->bytes_dumped += phdr_len;
         }
-        wdh->bytes_dumped += phdr_len;
 
-        /* write packet data */
-        if (!wtap_dump_file_write(wdh, pd, phdr->caplen, err))
-                return FALSE;
-        wdh->bytes_dumped += phdr->caplen;
+        /* packet data */
+        memcpy(buf + off, pd, phdr->caplen);
+        off += phdr->caplen;
 
-        /* write padding (if any) */
+        /* padding (if any) */
         if (pad_len != 0) {
-                if (!wtap_dump_file_write(wdh, &zero_pad, pad_len, err))
-                        return FALSE;
-                wdh->bytes_dumped += pad_len;
+                memcpy(buf + off, &zero_pad, pad_len);
+                off += pad_len;
         }
 
         /* XXX - write (optional) block options */
@@ -3208,21 +3287,18 @@ pcapng_write_enhanced_packet_block(wtap_dumper *wdh,
                 options_hdr = options_hdr << 16;
                 /* Option 1  */
                 options_hdr += 1;
-                if (!wtap_dump_file_write(wdh, &options_hdr, 4, err))
-                        return FALSE;
-                wdh->bytes_dumped += 4;
+                memcpy(buf + off, &options_hdr, 4);
+                off += 4;
 
-                /* Write the comments string */
+                /* The comments string */
                 pcapng_debug3("pcapng_write_enhanced_packet_block, comment:'%s' comment_len %u comment_pad_len %u" , phdr->opt_comment, comment_len, comment_pad_len);
-                if (!wtap_dump_file_write(wdh, phdr->opt_comment, comment_len, err))
-                        return FALSE;
-                wdh->bytes_dumped += comment_len;
+                memcpy(buf + off, phdr->opt_comment, comment_len);
+                off += comment_len;
 
-                /* write padding (if any) */
+                /* padding (if any) */
                 if (comment_pad_len != 0) {
-                        if (!wtap_dump_file_write(wdh, &zero_pad, comment_pad_len, err))
-                                return FALSE;
-                        wdh->bytes_dumped += comment_pad_len;
+                        memcpy(buf + off, &zero_pad, comment_pad_len);
+                        off += comment_pad_len;
                 }
 
                 pcapng_debug2("pcapng_write_enhanced_packet_block: Wrote Options comments: comment_len %u, comment_pad_len %u",
@@ -3230,18 +3306,20 @@ pcapng_write_enhanced_packet_block(wtap_dumper *wdh,
                         comment_pad_len);
         }
 
-        /* Write end of options if we have otions */
+        /* End of options if we have otions */
         if (have_options) {
-                if (!wtap_dump_file_write(wdh, &zero_pad, 4, err))
-                        return FALSE;
-                wdh->bytes_dumped += 4;
+                memcpy(buf + off, &zero_pad, 4);
+                off += 4;
         }
 
-        /* write block footer */
-        if (!wtap_dump_file_write(wdh, &bh.block_total_length,
-            sizeof bh.block_total_length, err))
+        /* block footer */
+        memcpy(buf + off, &bh.block_total_length, sizeof bh.block_total_length);
+        off += (guint32)sizeof bh.block_total_length;
+
+        /* ...and write it all in one go. */
+        if (!wtap_dump_file_write(wdh, buf, off, err))
                 return FALSE;
-        wdh->bytes_dumped += sizeof bh.block_total_length;
+        wdh->bytes_dumped += off;
 
         return TRUE;
 }
@@ -3423,6 +3501,9 @@ static gboolean pcapng_dump_close(wtap_dumper *wdh, int *err _U_)
         pcapng_debug0("pcapng_dump_close");
         g_array_free(pcapng->interface_data, TRUE);
         pcapng->number_of_interfaces = 0;
+        g_free(pcapng->block_buf);
+        pcapng->block_buf = NULL;
+        pcapng->block_buf_len = 0;
         return TRUE;
 }
 
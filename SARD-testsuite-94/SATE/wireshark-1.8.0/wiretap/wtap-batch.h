@@ -0,0 +1,84 @@
+/* wtap-batch.h
+ *
+ * $Id$
+ *
+ * Wiretap Library
+ * Copyright (c) 1998 by Gilbert Ramirez <gram@alumni.rice.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __WTAP_BATCH_H__
+#define __WTAP_BATCH_H__
+
+#include <glib.h>
+#include "wtap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * One frame returned by wtap_read_many().  "data" points into the
+ * buffer passed to wtap_read_many(), and stays valid until the caller
+ * reuses that buffer; unlike wtap_phdr()/wtap_buf_ptr(), the frames
+ * aren't overwritten by the next read, so a whole batch can be handed
+ * to another thread.
+ */
+typedef struct wtap_frame_s {
+	struct wtap_pkthdr phdr;
+	union wtap_pseudo_header pseudo_header;
+	gint64 data_offset;	/* as returned by wtap_read() */
+	guint8 *data;		/* phdr.caplen bytes */
+} wtap_frame_t;
+
+/* Frame data in the batch buffer is kept 8-byte aligned. */
+#define WTAP_READ_MANY_ALIGN(n)	(((n) + 7) & ~((gsize)7))
+
+/*
+ * Minimum size of the buffer passed to wtap_read_many(); frames are
+ * read only while at least this much room is left in it, so that no
+ * frame ever has to be dropped or split.
+ */
+#define WTAP_READ_MANY_MIN_BUF	WTAP_READ_MANY_ALIGN(WTAP_MAX_PACKET_SIZE)
+
+/*
+ * Read up to "max_frames" frames sequentially, storing their data in
+ * "buf" (of "buf_len" bytes, at least WTAP_READ_MANY_MIN_BUF).
+ *
+ * Returns the number of frames read.  0 with *err == 0 means end of
+ * file.  If an error occurs after some frames have been read, those
+ * frames are returned and *err is set; the caller should process them
+ * before reporting the error.
+ */
+int wtap_read_many(wtap *wth, wtap_frame_t *frames, guint max_frames,
+    guint8 *buf, gsize buf_len, int *err, gchar **err_info);
+
+/*
+ * Native batch readers, used by wtap_read_many() for their file
+ * types; they read straight into "buf" instead of going through the
+ * frame buffer.  Same arguments, and they return the number of frames
+ * read; wtap_read_many() does the checks wtap_read() would do.
+ */
+guint pcapng_read_many(wtap *wth, wtap_frame_t *frames, guint max_frames,
+    guint8 *buf, gsize buf_len, int *err, gchar **err_info);
+guint netmon_read_many(wtap *wth, wtap_frame_t *frames, guint max_frames,
+    guint8 *buf, gsize buf_len, int *err, gchar **err_info);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __WTAP_BATCH_H__ */
@@ -40,6 +40,7 @@
 #endif
 
 #include "wtap-int.h"
+#include "wtap-batch.h"
 
 #include "file_wrappers.h"
 #include <wsutil/file_util.h>
@@ -874,6 +875,77 @@ wtap_read(wtap *wth, int *err, gchar **err_info, gint64 *data_offset)
 	return TRUE;	/* success */
 }
 
+/*
+ * Generic batch read, for file types without a batch read routine of
+ * their own: read frames one at a time with wtap_read(), and copy them
+ * out of the reused frame buffer.
+ */
+static guint
+wtap_read_many_generic(wtap *wth, wtap_frame_t *frames, guint max_frames,
+	guint8 *buf, gsize buf_len, int *err, gchar **err_info)
+{
+	wtap_frame_t *frame;
+	gsize used = 0;
+	guint count = 0;
+
+	while (count < max_frames && buf_len - used >= WTAP_READ_MANY_MIN_BUF) {
+		frame = &frames[count];
+		if (!wtap_read(wth, err, err_info, &frame->data_offset))
+			break;	/* EOF, or error in *err */
+
+		frame->phdr = wth->phdr;
+		frame->pseudo_header = wth->pseudo_header;
+		frame->data = buf + used;
+		memcpy(frame->data, buffer_start_ptr(wth->frame_buffer),
+		    wth->phdr.caplen);
+
+		used += WTAP_READ_MANY_ALIGN(wth->phdr.caplen);
+		count++;
+	}
+
+	return count;
+}
+
+int
+wtap_read_many(wtap *wth, wtap_frame_t *frames, guint max_frames,
+	guint8 *buf, gsize buf_len, int *err, gchar **err_info)
+{
+	guint count, i;
+
+	*err = 0;
+
+	switch (wth->file_type) {
+
+	case WTAP_FILE_PCAPNG:
+		count = pcapng_read_many(wth, frames, max_frames, buf,
+		    buf_len, err, err_info);
+		break;
+
+	case WTAP_FILE_NETMON_1_x:
+	case WTAP_FILE_NETMON_2_x:
+		count = netmon_read_many(wth, frames, max_frames, buf,
+		    buf_len, err, err_info);
+		break;
+
+	default:
+		/* wtap_read() has already done the checks below */
+		return (int)wtap_read_many_generic(wth, frames, max_frames,
+		    buf, buf_len, err, err_info);
+	}
+
+	/* Pick up any deferred error, as wtap_read() does. */
+	if (*err == 0)
+		*err = file_error(wth->fh, err_info);
+
+	for (i = 0; i < count; i++) {
+		if (frames[i].phdr.caplen > frames[i].phdr.len)
+			frames[i].phdr.caplen = frames[i].phdr.len;
+		g_assert(frames[i].phdr.pkt_encap != WTAP_ENCAP_PER_PACKET);
+	}
+
+	return (int)count;
+}
+
 /*
  * Return an approximation of the amount of data we've read sequentially
  * from the file so far.  (gint64, in case that's 64 bits.)